@@ -0,0 +1,736 @@
+//
+//  Benchmark.c
+//  Hash Table
+//
+//  Standalone benchmark of the htbl_ API. Builds with `make bench`, no Xcode needed.
+//
+//  Every (table size, key length, distribution) combination runs these phases:
+//  insert (into a presized table), resize (insert into a table growing from
+//  the smallest size), lookup hit, lookup miss, iterate and delete.
+//  Throughput is measured over the whole phase, latency percentiles over
+//  every LATENCY_SAMPLE_EVERY'th operation.
+//
+//  Baseline comparison: build the bench against the baseline revision's
+//  sources and run it with --save, then run the bench of the revision under
+//  test with --compare, every row gets a speedup column:
+//
+//    git worktree add /tmp/baseline <revision>
+//    make bench-baseline BASELINE=/tmp/baseline
+//    Build/bench-baseline --save baseline.csv
+//    make bench && Build/bench --compare baseline.csv
+//
+//  Use the same options for both runs. --filter and --log need a tree that
+//  has them (HTBL_HAS_FILTER, HTBL_HAS_LOG), an older one exits with an error.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include "HashTable.h"
+
+#pragma mark Private Header
+#define MAX_KEY_LEN 256
+#define BATCH_SIZE 4096 /* Keys are generated per batch, outside of the timed region */
+#define LATENCY_SAMPLE_EVERY 8
+#define ZIPF_THETA 0.99
+#define MAX_RESULTS 4096
+
+enum Distribution
+{
+	kUniform = 0, kZipf, kSequential, kColliding, kDistributionCount
+};
+static const char *distributionNames[kDistributionCount] = {"uniform", "zipf", "sequential", "colliding"};
+
+enum Operation
+{
+	kInsert = 0, kResize, kLookupHit, kLookupMiss, kIterate, kDelete, kOperationCount
+};
+static const char *operationNames[kOperationCount] = {"insert", "resize", "lookup-hit", "lookup-miss", "iterate", "delete"};
+
+struct Options
+{
+	size_t sizes[32];
+	int sizesCount;
+	int keyLengths[32];
+	int keyLengthsCount;
+	int distributions[kDistributionCount];
+	int distributionsCount;
+	size_t operations; /* Lookups per lookup phase, 0 - table size */
+	double budget; /* Seconds per phase, a phase stops early when exceeded */
+	uint64_t seed;
+	const char *savePath;
+	const char *comparePath;
+	int filter; /* htbl_EnableFilter on every table */
+	const char *logDirectory; /* htbl_EnableLog on every table, NULL - none */
+};
+
+struct Result
+{
+	size_t size;
+	int keyLength;
+	int distribution;
+	int operation;
+
+	size_t operations;
+	double opsPerSecond;
+	double nsPerOp;
+	double p50, p99, p999;
+};
+
+struct Samples
+{
+	uint64_t *values;
+	size_t count;
+	size_t capacity;
+};
+
+struct Zipf
+{
+	size_t n;
+	double theta, alpha, zetan, eta;
+};
+
+static struct Result results[MAX_RESULTS];
+static int resultsCount;
+static struct Result baseline[MAX_RESULTS];
+static int baselineCount;
+
+static void _ParseOptions(struct Options *options, int argc, const char *argv[]);
+static void _MakeCollidingKey(char *key, uint64_t index, int keyLength);
+static void _PrintUsage(const char *name);
+static void _RunCombination(struct Options *options, size_t size, int keyLength, int distribution);
+static void _Report(struct Result *result);
+static void _Save(const char *path);
+static void _LoadBaseline(const char *path);
+static struct Result *_BaselineFor(struct Result *result);
+static struct HashTable *_CreateTable(struct Options *options, size_t capacity);
+static void _FreeTable(struct Options *options, struct HashTable *table);
+
+#pragma mark Time
+static inline uint64_t _Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+#pragma mark Random
+static uint64_t _SplitMix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+static uint64_t _Random(uint64_t *state)
+{
+	*state = _SplitMix(*state);
+	return *state;
+}
+
+static void _InitZipf(struct Zipf *zipf, size_t n, double theta)
+{
+	/* Gray et al., "Quickly generating billion-record synthetic databases" */
+	zipf->n = n;
+	zipf->theta = theta;
+	zipf->zetan = 0;
+	for (size_t i = 1; i <= n; ++i)
+		zipf->zetan += 1.0 / pow((double) i, theta);
+	double zeta2 = 1.0 + 1.0 / pow(2.0, theta);
+	zipf->alpha = 1.0 / (1.0 - theta);
+	zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+}
+
+static size_t _NextZipf(struct Zipf *zipf, uint64_t *state)
+{
+	double u = (double) (_Random(state) >> 11) / (double) (1ull << 53);
+	double uz = u * zipf->zetan;
+	if (uz < 1.0)
+		return 0;
+	if (uz < 1.0 + pow(0.5, zipf->theta))
+		return 1 < zipf->n ? 1 : 0;
+	size_t value = (size_t) (zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha));
+	return value < zipf->n ? value : zipf->n - 1;
+}
+
+#pragma mark Keys
+static void _MakeKey(char *key, uint64_t index, int keyLength, int distribution)
+{
+	/* Unique for every index: the last four bytes are the index in base 255,
+	 * everything before them is either random looking or a constant prefix. */
+	if (distribution == kColliding)
+	{
+		_MakeCollidingKey(key, index, keyLength);
+		return;
+	}
+	uint64_t noise = _SplitMix(index);
+	int prefixLength = keyLength - 4;
+	for (int i = 0; i < prefixLength; ++i)
+	{
+		if (distribution == kSequential)
+		{
+			key[i] = 'k';
+			continue;
+		}
+		if ((i & 7) == 0 && i != 0)
+			noise = _SplitMix(noise);
+		key[i] = (char) (1 + ((noise >> ((i & 7) * 8)) & 0xFF) % 255);
+	}
+	uint64_t value = index;
+	for (int i = keyLength - 1; i >= prefixLength; --i)
+	{
+		key[i] = (char) (1 + value % 255);
+		value /= 255;
+	}
+	key[keyLength] = '\0';
+}
+
+static void _MakeCollidingKey(char *key, uint64_t index, int keyLength)
+{
+	/* Flooding: every pair of bytes sums up to 128, so the character sum
+	 * of all keys is the same. Unique up to 127^(keyLength / 2) keys. */
+	uint64_t value = index;
+	for (int i = 0; i + 1 < keyLength; i += 2)
+	{
+		int digit = (int) (value % 127);
+		value /= 127;
+		key[i] = (char) (1 + digit);
+		key[i + 1] = (char) (127 - digit);
+	}
+	if (keyLength % 2 != 0)
+		key[keyLength - 1] = 'k';
+	key[keyLength] = '\0';
+}
+
+#pragma mark Samples
+static void _AddSample(struct Samples *samples, uint64_t value)
+{
+	if (samples->count == samples->capacity)
+	{
+		size_t capacity = samples->capacity ? samples->capacity * 2 : 1024;
+		uint64_t *values = realloc(samples->values, capacity * sizeof(uint64_t));
+		if (values == NULL)
+			return;
+		samples->values = values;
+		samples->capacity = capacity;
+	}
+	samples->values[samples->count++] = value;
+}
+
+static int _CompareSamples(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double _Percentile(struct Samples *samples, double percentile)
+{
+	if (samples->count == 0)
+		return 0;
+	size_t index = (size_t) (percentile * (samples->count - 1));
+	return (double) samples->values[index];
+}
+
+static void _FinishResult(struct Result *result, struct Samples *samples, size_t operations, uint64_t elapsed)
+{
+	qsort(samples->values, samples->count, sizeof(uint64_t), _CompareSamples);
+	result->operations = operations;
+	result->nsPerOp = operations ? (double) elapsed / operations : 0;
+	result->opsPerSecond = elapsed ? operations * 1e9 / elapsed : 0;
+	result->p50 = _Percentile(samples, 0.5);
+	result->p99 = _Percentile(samples, 0.99);
+	result->p999 = _Percentile(samples, 0.999);
+	samples->count = 0;
+}
+
+#pragma mark Phases
+struct Phase
+{
+	struct Options *options;
+	size_t size;
+	int keyLength;
+	int distribution;
+	struct Zipf *zipf;
+	uint64_t random;
+	char *keys; /* BATCH_SIZE keys, MAX_KEY_LEN + 1 apart */
+};
+
+static uint64_t _PickIndex(struct Phase *phase, size_t counter, size_t count)
+{
+	switch (phase->distribution)
+	{
+		case kZipf:
+			/* Scatter the hot ranks over the key space */
+			return _SplitMix(_NextZipf(phase->zipf, &phase->random)) % count;
+		case kSequential:
+			return counter % count;
+		default:
+			return _Random(&phase->random) % count;
+	}
+}
+
+typedef void (*OperationFunction)(struct HashTable *table, char *key);
+
+static void _Insert(struct HashTable *table, char *key)
+{
+	htbl_SetValueForKey(table, key, key);
+}
+
+static void _Lookup(struct HashTable *table, char *key)
+{
+	void *volatile value = htbl_ValueForKey(table, key);
+	(void) value;
+}
+
+static void _Delete(struct HashTable *table, char *key)
+{
+	htbl_RemoveKey(table, key);
+}
+
+/* Runs count operations on keys from indexOf, returns how many were done in budget */
+static size_t _RunPhase(struct Phase *phase, struct HashTable *table, OperationFunction function, size_t count, uint64_t (*indexOf)(struct Phase *, size_t, size_t), size_t indexLimit, uint64_t keyOffset, struct Samples *samples, uint64_t *elapsedOut)
+{
+	uint64_t budget = (uint64_t) (phase->options->budget * 1e9);
+	uint64_t elapsed = 0;
+	size_t done = 0;
+	while (done < count && elapsed < budget)
+	{
+		size_t batch = count - done < BATCH_SIZE ? count - done : BATCH_SIZE;
+		for (size_t i = 0; i < batch; ++i)
+		{
+			uint64_t index = indexOf(phase, done + i, indexLimit);
+			_MakeKey(phase->keys + i * (MAX_KEY_LEN + 1), index + keyOffset, phase->keyLength, phase->distribution);
+		}
+
+		uint64_t start = _Now();
+		for (size_t i = 0; i < batch; ++i)
+		{
+			char *key = phase->keys + i * (MAX_KEY_LEN + 1);
+			if ((i % LATENCY_SAMPLE_EVERY) == 0)
+			{
+				uint64_t opStart = _Now();
+				function(table, key);
+				_AddSample(samples, _Now() - opStart);
+			} else
+			{
+				function(table, key);
+			}
+		}
+		elapsed += _Now() - start;
+		done += batch;
+	}
+
+	*elapsedOut = elapsed;
+	return done;
+}
+
+static uint64_t _InOrder(struct Phase *phase, size_t counter, size_t count)
+{
+	/* Every key exactly once: sequential in order, the rest scattered by
+	 * an affine permutation (the multiplier is a prime not dividing count) */
+	if (phase->distribution == kSequential)
+		return counter;
+
+	uint64_t multiplier = 2654435761u;
+	if (count % multiplier == 0)
+		multiplier = 4294967291u;
+	return (uint64_t) (((unsigned __int128) counter * multiplier + 12345) % count);
+}
+
+static uint64_t _Anywhere(struct Phase *phase, size_t counter, size_t count)
+{
+	return _PickIndex(phase, counter, count);
+}
+
+static void _RecordResult(struct Phase *phase, int operation, struct Samples *samples, size_t operations, uint64_t elapsed)
+{
+	if (resultsCount == MAX_RESULTS)
+		return;
+
+	struct Result *result = &results[resultsCount++];
+	result->size = phase->size;
+	result->keyLength = phase->keyLength;
+	result->distribution = phase->distribution;
+	result->operation = operation;
+	_FinishResult(result, samples, operations, elapsed);
+	_Report(result);
+}
+
+static void _RunCombination(struct Options *options, size_t size, int keyLength, int distribution)
+{
+	struct Phase phase = {0};
+	phase.options = options;
+	phase.size = size;
+	phase.keyLength = keyLength;
+	phase.distribution = distribution;
+	phase.random = options->seed ^ _SplitMix(size * 31 + keyLength * 7 + distribution);
+	phase.keys = malloc(BATCH_SIZE * (MAX_KEY_LEN + 1));
+
+	struct Zipf zipf;
+	if (distribution == kZipf)
+	{
+		_InitZipf(&zipf, size, ZIPF_THETA);
+		phase.zipf = &zipf;
+	}
+
+	struct Samples samples = {0};
+	uint64_t elapsed = 0;
+	size_t lookups = options->operations ? options->operations : size;
+
+	// Resize: grow from the smallest table
+	struct HashTable *table = _CreateTable(options, 1);
+	size_t done = _RunPhase(&phase, table, _Insert, size, _InOrder, size, 0, &samples, &elapsed);
+	_RecordResult(&phase, kResize, &samples, done, elapsed);
+	_FreeTable(options, table);
+
+	// Insert: presized, so no resize happens
+	table = _CreateTable(options, size * 4 / 3 + 1);
+	size_t inserted = _RunPhase(&phase, table, _Insert, size, _InOrder, size, 0, &samples, &elapsed);
+	_RecordResult(&phase, kInsert, &samples, inserted, elapsed);
+
+	if (inserted != 0)
+	{
+		// Lookups over what made it in within the budget
+		done = _RunPhase(&phase, table, _Lookup, lookups, _Anywhere, inserted, 0, &samples, &elapsed);
+		_RecordResult(&phase, kLookupHit, &samples, done, elapsed);
+
+		// Misses use indexes past everything inserted
+		done = _RunPhase(&phase, table, _Lookup, lookups, _Anywhere, inserted, size, &samples, &elapsed);
+		_RecordResult(&phase, kLookupMiss, &samples, done, elapsed);
+
+		// Iterate
+		uint64_t start = _Now();
+		size_t iterated = 0;
+		struct HashTableIterator *iterator = htbl_IteratorForTable(table);
+		while (htbl_IsValidIterator(iterator))
+		{
+			if ((iterated % LATENCY_SAMPLE_EVERY) == 0)
+			{
+				uint64_t stepStart = _Now();
+				iterator->next(iterator);
+				_AddSample(&samples, _Now() - stepStart);
+			} else
+			{
+				iterator->next(iterator);
+			}
+			++iterated;
+		}
+		htbl_FreeIterator(iterator);
+		_RecordResult(&phase, kIterate, &samples, iterated, _Now() - start);
+
+		// Delete
+		done = _RunPhase(&phase, table, _Delete, inserted, _InOrder, inserted, 0, &samples, &elapsed);
+		_RecordResult(&phase, kDelete, &samples, done, elapsed);
+	}
+
+	_FreeTable(options, table);
+	free(samples.values);
+	free(phase.keys);
+}
+
+static struct HashTable *_CreateTable(struct Options *options, size_t capacity)
+{
+	struct HashTable *table = htbl_Create(capacity);
+#ifdef HTBL_HAS_FILTER
+	if (options->filter)
+		htbl_EnableFilter(table);
+#endif
+#ifdef HTBL_HAS_LOG
+	if (options->logDirectory != NULL)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/bench.log", options->logDirectory);
+		if (htbl_EnableLog(table, path, NULL) == 0)
+		{
+			fprintf(stderr, "Can't open a log in %s\n", options->logDirectory);
+			exit(1);
+		}
+	}
+#endif
+	return table;
+}
+
+static void _FreeTable(struct Options *options, struct HashTable *table)
+{
+	/* Every table starts with an empty log */
+	htbl_Free(table);
+	if (options->logDirectory == NULL)
+		return;
+
+	const char *suffixes[] = {"", ".snapshot", ".next"};
+	for (int i = 0; i < 3; ++i)
+	{
+		char path[1024];
+		snprintf(path, sizeof(path), "%s/bench.log%s", options->logDirectory, suffixes[i]);
+		unlink(path);
+	}
+}
+
+#pragma mark Reporting
+static void _PrintHeader(int comparing)
+{
+	printf("%-10s %-6s %-10s %-12s %12s %14s %10s %10s %10s %10s%s\n",
+			"size", "keylen", "dist", "op", "ops", "ops/sec", "ns/op", "p50", "p99", "p99.9",
+			comparing ? "   vs base" : "");
+}
+
+static void _Report(struct Result *result)
+{
+	printf("%-10zu %-6d %-10s %-12s %12zu %14.0f %10.1f %10.0f %10.0f %10.0f",
+			result->size, result->keyLength, distributionNames[result->distribution], operationNames[result->operation],
+			result->operations, result->opsPerSecond, result->nsPerOp, result->p50, result->p99, result->p999);
+
+	struct Result *base = _BaselineFor(result);
+	if (base != NULL && base->opsPerSecond > 0)
+		printf("   %6.2fx", result->opsPerSecond / base->opsPerSecond);
+	printf("\n");
+	fflush(stdout);
+}
+
+static void _Save(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+	{
+		perror(path);
+		return;
+	}
+
+	fprintf(file, "size,keylen,dist,op,ops,ops_per_sec,ns_per_op,p50,p99,p999\n");
+	for (int i = 0; i < resultsCount; ++i)
+	{
+		struct Result *r = &results[i];
+		fprintf(file, "%zu,%d,%s,%s,%zu,%.1f,%.2f,%.0f,%.0f,%.0f\n", r->size, r->keyLength,
+				distributionNames[r->distribution], operationNames[r->operation],
+				r->operations, r->opsPerSecond, r->nsPerOp, r->p50, r->p99, r->p999);
+	}
+	fclose(file);
+}
+
+static int _IndexOfName(const char **names, int count, const char *name)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static void _LoadBaseline(const char *path)
+{
+	FILE *file = fopen(path, "r");
+	if (file == NULL)
+	{
+		perror(path);
+		exit(1);
+	}
+
+	char line[512];
+	if (fgets(line, sizeof(line), file) == NULL) /* Header */
+	{
+		fclose(file);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), file) != NULL && baselineCount < MAX_RESULTS)
+	{
+		struct Result *r = &baseline[baselineCount];
+		char distribution[32], operation[32];
+		int fields = sscanf(line, "%zu,%d,%31[^,],%31[^,],%zu,%lf,%lf,%lf,%lf,%lf", &r->size, &r->keyLength,
+				distribution, operation, &r->operations, &r->opsPerSecond, &r->nsPerOp, &r->p50, &r->p99, &r->p999);
+		if (fields != 10)
+			continue;
+
+		r->distribution = _IndexOfName(distributionNames, kDistributionCount, distribution);
+		r->operation = _IndexOfName(operationNames, kOperationCount, operation);
+		if (r->distribution != -1 && r->operation != -1)
+			++baselineCount;
+	}
+	fclose(file);
+}
+
+static struct Result *_BaselineFor(struct Result *result)
+{
+	for (int i = 0; i < baselineCount; ++i)
+	{
+		struct Result *r = &baseline[i];
+		if (r->size == result->size && r->keyLength == result->keyLength
+				&& r->distribution == result->distribution && r->operation == result->operation)
+			return r;
+	}
+	return NULL;
+}
+
+#pragma mark Options
+static int _ParseList(const char *string, size_t *output, int capacity)
+{
+	int count = 0;
+	const char *cursor = string;
+	while (*cursor != '\0' && count < capacity)
+	{
+		char *end;
+		double value = strtod(cursor, &end); /* Accepts 1e6 */
+		if (end == cursor)
+			break;
+		if (*end == 'K' || *end == 'k')
+			value *= 1e3, ++end;
+		else if (*end == 'M' || *end == 'm')
+			value *= 1e6, ++end;
+		output[count++] = (size_t) value;
+		cursor = (*end == ',') ? end + 1 : end;
+	}
+	return count;
+}
+
+static void _ParseOptions(struct Options *options, int argc, const char *argv[])
+{
+	memset(options, 0, sizeof(struct Options));
+	options->sizesCount = _ParseList("1K,10K,100K,1M", options->sizes, 32);
+	int defaultKeyLengths[] = {4, 16, 64, 256};
+	memcpy(options->keyLengths, defaultKeyLengths, sizeof(defaultKeyLengths));
+	options->keyLengthsCount = 4;
+	for (int i = 0; i < kColliding; ++i) /* Colliding keys only on request */
+		options->distributions[i] = i;
+	options->distributionsCount = kColliding;
+	options->budget = 5.0;
+	options->seed = 42;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *argument = argv[i];
+		const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (strcmp(argument, "--large") == 0)
+		{
+			options->sizesCount = _ParseList("1K,10K,100K,1M,10M,100M", options->sizes, 32);
+			continue;
+		}
+		if (strcmp(argument, "--filter") == 0)
+		{
+#ifndef HTBL_HAS_FILTER
+			fprintf(stderr, "This tree has no htbl_EnableFilter\n");
+			exit(1);
+#endif
+			options->filter = 1;
+			continue;
+		}
+		if (value == NULL)
+		{
+			_PrintUsage(argv[0]);
+			exit(1);
+		}
+		++i;
+
+		if (strcmp(argument, "--log") == 0)
+		{
+#ifndef HTBL_HAS_LOG
+			fprintf(stderr, "This tree has no htbl_EnableLog\n");
+			exit(1);
+#endif
+			options->logDirectory = value;
+		}
+		else if (strcmp(argument, "--sizes") == 0)
+			options->sizesCount = _ParseList(value, options->sizes, 32);
+		else if (strcmp(argument, "--key-lengths") == 0)
+		{
+			size_t lengths[32];
+			options->keyLengthsCount = _ParseList(value, lengths, 32);
+			for (int j = 0; j < options->keyLengthsCount; ++j)
+			{
+				if (lengths[j] < 4 || lengths[j] > MAX_KEY_LEN)
+				{
+					fprintf(stderr, "Key lengths must be within 4...%d\n", MAX_KEY_LEN);
+					exit(1);
+				}
+				options->keyLengths[j] = (int) lengths[j];
+			}
+		}
+		else if (strcmp(argument, "--dist") == 0)
+		{
+			options->distributionsCount = 0;
+			char names[256];
+			strncpy(names, value, sizeof(names) - 1);
+			names[sizeof(names) - 1] = '\0';
+			for (char *name = strtok(names, ","); name != NULL; name = strtok(NULL, ","))
+			{
+				int distribution = _IndexOfName(distributionNames, kDistributionCount, name);
+				if (distribution == -1)
+				{
+					fprintf(stderr, "Unknown distribution %s\n", name);
+					exit(1);
+				}
+				if (options->distributionsCount == kDistributionCount)
+				{
+					fprintf(stderr, "At most %d distributions\n", kDistributionCount);
+					exit(1);
+				}
+				options->distributions[options->distributionsCount++] = distribution;
+			}
+		}
+		else if (strcmp(argument, "--ops") == 0)
+			options->operations = (size_t) strtod(value, NULL);
+		else if (strcmp(argument, "--budget") == 0)
+			options->budget = strtod(value, NULL);
+		else if (strcmp(argument, "--seed") == 0)
+			options->seed = strtoull(value, NULL, 10);
+		else if (strcmp(argument, "--save") == 0)
+			options->savePath = value;
+		else if (strcmp(argument, "--compare") == 0)
+			options->comparePath = value;
+		else
+		{
+			_PrintUsage(argv[0]);
+			exit(1);
+		}
+	}
+}
+
+static void _PrintUsage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s [options]\n"
+			"  --sizes 1K,10K,100K,1M   table sizes (K and M suffixes allowed)\n"
+			"  --large                  sizes 1K...100M\n"
+			"  --filter                 check lookups against a Bloom filter first\n"
+			"  --log DIRECTORY          keep a write-ahead log of every table there\n"
+			"  --key-lengths 4,16,64,256\n"
+			"  --dist uniform,zipf,sequential,colliding\n"
+			"  --ops N                  lookups per lookup phase (default: table size)\n"
+			"  --budget SECONDS         time limit per phase (default 5)\n"
+			"  --seed N\n"
+			"  --save results.csv       keep results to compare against later\n"
+			"  --compare baseline.csv   add a speedup column against saved results\n", name);
+}
+
+#pragma mark Main
+int main(int argc, const char *argv[])
+{
+	struct Options options;
+	_ParseOptions(&options, argc, argv);
+
+	if (options.comparePath != NULL)
+		_LoadBaseline(options.comparePath);
+
+	_PrintHeader(options.comparePath != NULL);
+	for (int s = 0; s < options.sizesCount; ++s)
+	{
+		for (int k = 0; k < options.keyLengthsCount; ++k)
+		{
+			for (int d = 0; d < options.distributionsCount; ++d)
+				_RunCombination(&options, options.sizes[s], options.keyLengths[k], options.distributions[d]);
+		}
+	}
+
+	if (options.savePath != NULL)
+		_Save(options.savePath);
+
+	return 0;
+}
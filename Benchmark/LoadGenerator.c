@@ -0,0 +1,480 @@
+//
+//  LoadGenerator.c
+//  Hash Table
+//
+//  Load generator for the key-value server in main.c. Builds with
+//  `make loadgen`, start the server with `make server && Build/server`.
+//
+//  Every connection runs on a thread of its own and keeps --pipeline
+//  requests in flight: it tops the pipeline up and polls the non-blocking
+//  socket, writing what the server takes and reading whatever replies have
+//  arrived, so neither side waits for the other to drain first. Keys are picked uniformly from --keys,
+//  which are all set once before the measured run. Latency is the time
+//  from a request's write to its reply, sampled every LATENCY_SAMPLE_EVERY'th.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "ServerProtocol.h"
+
+#pragma mark Private Header
+#define MAX_KEY_LEN 256
+#define MAX_PIPELINE 4096
+#define LATENCY_SAMPLE_EVERY 8
+#define MAX_SAMPLES (1 << 20) /* Per connection */
+#define READ_SIZE (256 * 1024)
+#define POLL_TIMEOUT 100 /* Milliseconds, to notice the deadline */
+
+struct Options
+{
+	const char *unixPath; /* NULL - TCP */
+	int port;
+	int connections;
+	int pipeline;
+	size_t keys;
+	int keyLength;
+	int valueLength;
+	double getRatio; /* The rest are SETs */
+	int mget; /* Keys per MGET instead of single GETs, 0 or 1 - GET */
+	double duration; /* Seconds */
+};
+
+struct InFlight
+{
+	uint64_t sentAt;
+	int repliesLeft;
+};
+
+struct Client
+{
+	struct Options *options;
+	int fd;
+	uint64_t random;
+	pthread_t thread;
+
+	// Pipeline, replies come in the order of the requests
+	struct InFlight inFlight[MAX_PIPELINE];
+	int inFlightHead;
+	int inFlightCount;
+	char *output;
+	size_t outputUsed;
+	size_t outputSent; /* Of outputUsed, written already */
+	char *input;
+	size_t inputUsed;
+
+	size_t prefillNext; /* Keys set so far, or the last one set */
+	size_t prefillEnd;
+
+	size_t requests;
+	size_t replies;
+	size_t misses;
+	size_t errors;
+	uint64_t *samples;
+	size_t samplesCount;
+};
+
+enum Phase
+{
+	kPrefill = 0, kMeasure
+};
+
+static void _ParseOptions(struct Options *options, int argc, const char *argv[]);
+static void _PrintUsage(const char *name);
+static int _Connect(struct Options *options);
+static int _SetNonBlocking(int fd);
+static void *_RunClient(void *argument);
+static int _RunPhase(struct Client *client, enum Phase phase, uint64_t deadline);
+static void _AddRequest(struct Client *client, enum Phase phase);
+static void _AppendRequest(struct Client *client, uint8_t operation, uint64_t keyIndex);
+static int _ReadReplies(struct Client *client, int collect);
+static void _MakeKey(char *key, uint64_t index, int keyLength);
+static int _CompareSamples(const void *a, const void *b);
+
+#pragma mark Time
+static inline uint64_t _Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+#pragma mark Random
+static uint64_t _Random(uint64_t *state)
+{
+	/* SplitMix64 */
+	uint64_t x = (*state += 0x9E3779B97F4A7C15ull);
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+#pragma mark Keys
+static void _MakeKey(char *key, uint64_t index, int keyLength)
+{
+	/* Fixed length: a prefix padded with zeros, then the index */
+	char digits[24];
+	int length = snprintf(digits, sizeof(digits), "%llu", (unsigned long long) index);
+	int padding = keyLength > length + 1 ? keyLength - length - 1 : 0;
+	key[0] = 'k';
+	memset(key + 1, '0', (size_t) padding);
+	memcpy(key + 1 + padding, digits, (size_t) length + 1);
+}
+
+#pragma mark Connections
+static int _Connect(struct Options *options)
+{
+	int fd;
+	if (options->unixPath != NULL)
+	{
+		struct sockaddr_un address = {0};
+		address.sun_family = AF_UNIX;
+		strncpy(address.sun_path, options->unixPath, sizeof(address.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd != -1 && connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	struct sockaddr_in address = {0};
+	address.sin_family = AF_INET;
+	address.sin_port = htons((uint16_t) options->port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (fd != -1 && connect(fd, (struct sockaddr *) &address, sizeof(address)) != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	int noDelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+	return fd;
+}
+
+static int _SetNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+#pragma mark Clients
+static pthread_barrier_t prefilled;
+static uint64_t measureDeadline;
+
+static void *_RunClient(void *argument)
+{
+	struct Client *client = argument;
+	if (_RunPhase(client, kPrefill, UINT64_MAX) == 0)
+		fprintf(stderr, "Prefill failed: %s\n", strerror(errno));
+
+	/* Everybody measures the same stretch of time */
+	if (pthread_barrier_wait(&prefilled) == PTHREAD_BARRIER_SERIAL_THREAD)
+		__atomic_store_n(&measureDeadline, _Now() + (uint64_t) (client->options->duration * 1e9), __ATOMIC_RELEASE);
+	pthread_barrier_wait(&prefilled);
+
+	if (_RunPhase(client, kMeasure, __atomic_load_n(&measureDeadline, __ATOMIC_ACQUIRE)) == 0)
+		fprintf(stderr, "Connection failed: %s\n", strerror(errno));
+	return NULL;
+}
+
+static int _RunPhase(struct Client *client, enum Phase phase, uint64_t deadline)
+{
+	/* Stops sending at the deadline or when the prefill is done, then drains */
+	for (;;)
+	{
+		int sending = (phase == kPrefill) ? client->prefillNext < client->prefillEnd : _Now() < deadline;
+
+		/* Unsent bytes belong to requests in flight, so a full pipeline still fits */
+		memmove(client->output, client->output + client->outputSent, client->outputUsed - client->outputSent);
+		client->outputUsed -= client->outputSent;
+		client->outputSent = 0;
+		while (sending && client->inFlightCount < client->options->pipeline)
+		{
+			_AddRequest(client, phase);
+			if (phase == kPrefill && client->prefillNext == client->prefillEnd)
+				break;
+		}
+		if (!sending && client->inFlightCount == 0)
+			return 1;
+
+		struct pollfd poller = {client->fd, POLLIN | (client->outputUsed > 0 ? POLLOUT : 0), 0};
+		if (poll(&poller, 1, POLL_TIMEOUT) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if (poller.revents & POLLOUT)
+		{
+			ssize_t bytes = write(client->fd, client->output, client->outputUsed);
+			if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return 0;
+			client->outputSent = bytes > 0 ? (size_t) bytes : 0;
+		}
+		if ((poller.revents & (POLLIN | POLLERR | POLLHUP)) && _ReadReplies(client, phase == kMeasure) == 0)
+			return 0;
+	}
+}
+
+static void _AddRequest(struct Client *client, enum Phase phase)
+{
+	struct Options *options = client->options;
+	struct InFlight *slot = &client->inFlight[(client->inFlightHead + client->inFlightCount) % MAX_PIPELINE];
+	slot->sentAt = _Now();
+	slot->repliesLeft = 1;
+	client->inFlightCount++;
+	client->requests += (phase == kMeasure);
+
+	if (phase == kPrefill)
+	{
+		_AppendRequest(client, SRV_SET, client->prefillNext++);
+		return;
+	}
+	double dice = (double) (_Random(&client->random) >> 11) / (double) (1ull << 53);
+	if (dice >= options->getRatio)
+	{
+		_AppendRequest(client, SRV_SET, _Random(&client->random) % options->keys);
+		return;
+	}
+	if (options->mget <= 1)
+	{
+		_AppendRequest(client, SRV_GET, _Random(&client->random) % options->keys);
+		return;
+	}
+
+	/* One header, then every key with its length */
+	struct ServerRequest request = {SRV_MGET, 0, (uint16_t) options->mget, 0};
+	size_t headerOffset = client->outputUsed;
+	client->outputUsed += sizeof(request);
+	for (int i = 0; i < options->mget; ++i)
+	{
+		char key[MAX_KEY_LEN + 1];
+		_MakeKey(key, _Random(&client->random) % options->keys, options->keyLength);
+		uint16_t keyLength = (uint16_t) strlen(key);
+		memcpy(client->output + client->outputUsed, &keyLength, sizeof(keyLength));
+		memcpy(client->output + client->outputUsed + sizeof(keyLength), key, keyLength);
+		client->outputUsed += sizeof(keyLength) + keyLength;
+	}
+	request.valueLength = (uint32_t) (client->outputUsed - headerOffset - sizeof(request));
+	memcpy(client->output + headerOffset, &request, sizeof(request));
+	slot->repliesLeft = options->mget;
+}
+
+static void _AppendRequest(struct Client *client, uint8_t operation, uint64_t keyIndex)
+{
+	char key[MAX_KEY_LEN + 1];
+	_MakeKey(key, keyIndex, client->options->keyLength);
+	size_t keyLength = strlen(key);
+	size_t valueLength = (operation == SRV_SET) ? (size_t) client->options->valueLength : 0;
+
+	struct ServerRequest request = {operation, 0, (uint16_t) keyLength, (uint32_t) valueLength};
+	char *output = client->output + client->outputUsed;
+	memcpy(output, &request, sizeof(request));
+	memcpy(output + sizeof(request), key, keyLength);
+	memset(output + sizeof(request) + keyLength, 'v', valueLength);
+	client->outputUsed += sizeof(request) + keyLength + valueLength;
+}
+
+static int _ReadReplies(struct Client *client, int collect)
+{
+	/* Takes every whole reply that came, 0 - the connection is gone */
+	ssize_t bytes = read(client->fd, client->input + client->inputUsed, READ_SIZE - client->inputUsed);
+	if (bytes <= 0)
+		return bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR);
+	client->inputUsed += (size_t) bytes;
+
+	size_t offset = 0;
+	uint64_t now = _Now();
+	while (client->inputUsed - offset >= sizeof(struct ServerReply))
+	{
+		struct ServerReply reply;
+		memcpy(&reply, client->input + offset, sizeof(reply));
+		if (client->inputUsed - offset - sizeof(reply) < reply.valueLength)
+			break;
+		offset += sizeof(reply) + reply.valueLength;
+
+		struct InFlight *slot = &client->inFlight[client->inFlightHead];
+		if (collect)
+		{
+			client->replies++;
+			client->misses += (reply.status == SRV_NOT_FOUND);
+			client->errors += (reply.status == SRV_ERROR);
+		}
+		if (--slot->repliesLeft != 0)
+			continue;
+		if (collect && client->replies % LATENCY_SAMPLE_EVERY == 0 && client->samplesCount < MAX_SAMPLES)
+			client->samples[client->samplesCount++] = now - slot->sentAt;
+		client->inFlightHead = (client->inFlightHead + 1) % MAX_PIPELINE;
+		client->inFlightCount--;
+	}
+
+	memmove(client->input, client->input + offset, client->inputUsed - offset);
+	client->inputUsed -= offset;
+	return 1;
+}
+
+#pragma mark Reporting
+static int _CompareSamples(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double _Percentile(uint64_t *samples, size_t count, double percentile)
+{
+	if (count == 0)
+		return 0;
+	size_t index = (size_t) (percentile / 100.0 * (double) (count - 1));
+	return (double) samples[index];
+}
+
+#pragma mark Options
+static void _ParseOptions(struct Options *options, int argc, const char *argv[])
+{
+	memset(options, 0, sizeof(struct Options));
+	options->port = 7379;
+	options->connections = 4;
+	options->pipeline = 32;
+	options->keys = 100000;
+	options->keyLength = 16;
+	options->valueLength = 64;
+	options->getRatio = 0.9;
+	options->duration = 5.0;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *argument = argv[i];
+		const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+		if (value == NULL)
+		{
+			_PrintUsage(argv[0]);
+			exit(1);
+		}
+		++i;
+
+		if (strcmp(argument, "--unix") == 0)
+			options->unixPath = value;
+		else if (strcmp(argument, "--tcp") == 0)
+			options->port = atoi(value);
+		else if (strcmp(argument, "--connections") == 0)
+			options->connections = atoi(value);
+		else if (strcmp(argument, "--pipeline") == 0)
+			options->pipeline = atoi(value);
+		else if (strcmp(argument, "--keys") == 0)
+			options->keys = (size_t) strtod(value, NULL);
+		else if (strcmp(argument, "--key-length") == 0)
+			options->keyLength = atoi(value);
+		else if (strcmp(argument, "--value-length") == 0)
+			options->valueLength = atoi(value);
+		else if (strcmp(argument, "--get-ratio") == 0)
+			options->getRatio = strtod(value, NULL);
+		else if (strcmp(argument, "--mget") == 0)
+			options->mget = atoi(value);
+		else if (strcmp(argument, "--duration") == 0)
+			options->duration = strtod(value, NULL);
+		else
+		{
+			_PrintUsage(argv[0]);
+			exit(1);
+		}
+	}
+
+	/* A full pipeline of requests has to fit the output buffer */
+	if (options->connections < 1 || options->pipeline < 1 || options->pipeline > MAX_PIPELINE || options->keys == 0
+		|| options->keyLength < 2 || options->keyLength > MAX_KEY_LEN || options->valueLength < 0 || options->valueLength > 64 * 1024
+		|| options->mget < 0 || options->mget > 256)
+	{
+		_PrintUsage(argv[0]);
+		exit(1);
+	}
+}
+
+static void _PrintUsage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+			"  --unix PATH              connect to a Unix domain socket\n"
+			"  --tcp PORT               connect to 127.0.0.1 (default 7379)\n"
+			"  --connections N          each on a thread of its own (default 4)\n"
+			"  --pipeline N             requests in flight per connection, up to %d (default 32)\n"
+			"  --keys N                 key space, set once before measuring (default 100K)\n"
+			"  --key-length N           2 to %d (default 16)\n"
+			"  --value-length N         up to 64K (default 64)\n"
+			"  --get-ratio R            the rest are SETs (default 0.9)\n"
+			"  --mget N                 read N keys per request, up to 256\n"
+			"  --duration SECONDS       measured time (default 5)\n", name, MAX_PIPELINE, MAX_KEY_LEN);
+}
+
+#pragma mark Main
+int main(int argc, const char *argv[])
+{
+	struct Options options;
+	_ParseOptions(&options, argc, argv);
+
+	size_t largestRequest = sizeof(struct ServerRequest) + (size_t) MAX_KEY_LEN + (size_t) options.valueLength
+		+ (size_t) options.mget * (sizeof(uint16_t) + MAX_KEY_LEN);
+	struct Client *clients = calloc((size_t) options.connections, sizeof(struct Client));
+	pthread_barrier_init(&prefilled, NULL, (unsigned) options.connections);
+	for (int i = 0; i < options.connections; ++i)
+	{
+		struct Client *client = &clients[i];
+		client->options = &options;
+		client->random = 42 + (uint64_t) i;
+		client->prefillNext = options.keys * (size_t) i / (size_t) options.connections;
+		client->prefillEnd = options.keys * (size_t) (i + 1) / (size_t) options.connections;
+		client->output = malloc(largestRequest * (size_t) options.pipeline);
+		client->input = malloc(READ_SIZE);
+		client->samples = malloc(MAX_SAMPLES * sizeof(uint64_t));
+		client->fd = _Connect(&options);
+		if (client->fd == -1 || _SetNonBlocking(client->fd) == 0 || client->output == NULL || client->input == NULL || client->samples == NULL)
+		{
+			perror("Can't connect");
+			return 1;
+		}
+	}
+	for (int i = 0; i < options.connections; ++i)
+		pthread_create(&clients[i].thread, NULL, _RunClient, &clients[i]);
+
+	size_t requests = 0, replies = 0, misses = 0, errors = 0, samplesCount = 0;
+	for (int i = 0; i < options.connections; ++i)
+	{
+		pthread_join(clients[i].thread, NULL);
+		requests += clients[i].requests;
+		replies += clients[i].replies;
+		misses += clients[i].misses;
+		errors += clients[i].errors;
+		samplesCount += clients[i].samplesCount;
+	}
+
+	uint64_t *samples = malloc((samplesCount ? samplesCount : 1) * sizeof(uint64_t));
+	size_t merged = 0;
+	for (int i = 0; i < options.connections; ++i)
+	{
+		memcpy(samples + merged, clients[i].samples, clients[i].samplesCount * sizeof(uint64_t));
+		merged += clients[i].samplesCount;
+	}
+	qsort(samples, samplesCount, sizeof(uint64_t), _CompareSamples);
+
+	printf("%-12s %-10s %14s %14s %10s %10s %10s %8s %8s\n", "connections", "pipeline", "requests/sec", "replies/sec",
+		   "p50 us", "p99 us", "p99.9 us", "misses", "errors");
+	printf("%-12d %-10d %14.0f %14.0f %10.1f %10.1f %10.1f %8zu %8zu\n", options.connections, options.pipeline,
+		   (double) requests / options.duration, (double) replies / options.duration,
+		   _Percentile(samples, samplesCount, 50) / 1e3, _Percentile(samples, samplesCount, 99) / 1e3,
+		   _Percentile(samples, samplesCount, 99.9) / 1e3, misses, errors);
+	return errors != 0;
+}
@@ -0,0 +1,481 @@
+//
+//  Replay.c
+//  Hash Table
+//
+//  Replays a trace recorded with htbl_StartRecording against different table
+//  configurations. Builds with `make replay`.
+//
+//  A trace keeps the hash and length of every key, not the key, so replay
+//  makes up a key of the same length for every hash: equal hashes get equal
+//  keys, so repeats, removals and key sizes follow the recording. It is an
+//  approximation, not the recorded workload:
+//  - Keys under 11 characters have fewer spellings than hashes, so several
+//    recorded keys can become one made-up key and hit where they missed.
+//    Replay counts these before it starts, a high count means the hit
+//    rates and sizes below don't match the recording.
+//  - Made-up keys are random, so the default table's character sum hash
+//    spreads them better than it may have spread the real ones, which can
+//    hide probe lengths and the switch to SipHash that real keys caused.
+//  Every configuration starts from an empty table and runs the whole trace,
+//  as fast as it can or, with --paced, at the recorded pace. Throughput is
+//  measured over the whole run, latency percentiles over every
+//  LATENCY_SAMPLE_EVERY'th operation.
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "HashTable.h"
+#include "WorkloadTrace.h"
+
+#pragma mark Private Header
+#define LATENCY_SAMPLE_EVERY 8
+#define MAX_CONFIGURATIONS 64
+
+enum Mode
+{
+	kLinear = 0, kCuckoo, kPool, kModeCount
+};
+static const char *modeNames[kModeCount] = {"linear", "cuckoo", "pool"};
+
+static const char *pagesNames[] = {"default", "transparent", "explicit"};
+
+struct Configuration
+{
+	int mode;
+	double maxLoadFactor; /* Linear only, 0 - the default */
+	enum HashTablePages pages; /* Linear only */
+};
+
+struct Options
+{
+	const char *tracePath;
+	struct Configuration configurations[MAX_CONFIGURATIONS];
+	int configurationsCount;
+	size_t capacity; /* Initial, 0 - grow from the smallest table like the recorded one did */
+	double growthFactor; /* Linear only, 0 - the default */
+	int filter; /* htbl_EnableFilter on every table */
+	int paced; /* Wait out the recorded delays */
+};
+
+struct Trace
+{
+	struct WorkloadTraceRecord *records;
+	size_t count;
+	char **keys; /* One per record, NULL for clears */
+	char *keyBytes;
+	size_t distinctHashes; /* Of keys, with their length */
+	size_t collapsedHashes; /* Distinct hashes that made up the same key as another one */
+};
+
+static void _ParseOptions(struct Options *options, int argc, const char *argv[]);
+static void _PrintUsage(const char *name);
+static int _LoadTrace(const char *path, struct Trace *trace);
+static void _MakeKey(char *key, uint64_t hash, size_t keyLength);
+static void _CountCollapsedHashes(struct Trace *trace);
+static struct HashTable *_CreateTable(struct Options *options, struct Configuration *configuration, struct KeyPool **pool);
+static void _Replay(struct Options *options, struct Trace *trace, struct Configuration *configuration);
+
+#pragma mark Time
+static inline uint64_t _Now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
+
+#pragma mark Random
+static uint64_t _SplitMix(uint64_t x)
+{
+	x += 0x9E3779B97F4A7C15ull;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+	return x ^ (x >> 31);
+}
+
+#pragma mark Trace
+static int _LoadTrace(const char *path, struct Trace *trace)
+{
+	/* Keys are made up front, outside of the timed region */
+	trace->records = wtrc_Load(path, &trace->count);
+	if (trace->records == NULL)
+		return 0;
+
+	size_t keyBytes = 0;
+	for (size_t i = 0; i < trace->count; ++i)
+		keyBytes += trace->records[i].keyLength + 1;
+	trace->keys = malloc((trace->count ? trace->count : 1) * sizeof(char *));
+	trace->keyBytes = malloc(keyBytes ? keyBytes : 1);
+	if (trace->keys == NULL || trace->keyBytes == NULL)
+		return 0;
+
+	char *key = trace->keyBytes;
+	for (size_t i = 0; i < trace->count; ++i)
+	{
+		struct WorkloadTraceRecord *record = &trace->records[i];
+		if (record->operation == WTRC_CLEAR || record->keyLength == 0)
+		{
+			trace->keys[i] = NULL;
+			continue;
+		}
+		_MakeKey(key, record->keyHash, record->keyLength);
+		trace->keys[i] = key;
+		key += record->keyLength + 1;
+	}
+	_CountCollapsedHashes(trace);
+	return 1;
+}
+
+static int _CompareRecordKeys(const void *a, const void *b)
+{
+	const struct WorkloadTraceRecord *x = *(struct WorkloadTraceRecord *const *) a;
+	const struct WorkloadTraceRecord *y = *(struct WorkloadTraceRecord *const *) b;
+	if (x->keyLength != y->keyLength)
+		return (x->keyLength > y->keyLength) - (x->keyLength < y->keyLength);
+	return (x->keyHash > y->keyHash) - (x->keyHash < y->keyHash);
+}
+
+static int _CompareKeys(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+static void _CountCollapsedHashes(struct Trace *trace)
+{
+	/* Distinct (length, hash) pairs against distinct made-up keys */
+	struct WorkloadTraceRecord **records = malloc((trace->count ? trace->count : 1) * sizeof(struct WorkloadTraceRecord *));
+	char **keys = malloc((trace->count ? trace->count : 1) * sizeof(char *));
+	if (records == NULL || keys == NULL)
+	{
+		free(records);
+		free(keys);
+		return;
+	}
+
+	size_t keyed = 0;
+	for (size_t i = 0; i < trace->count; ++i)
+	{
+		if (trace->keys[i] != NULL)
+			records[keyed++] = &trace->records[i];
+	}
+	qsort(records, keyed, sizeof(struct WorkloadTraceRecord *), _CompareRecordKeys);
+
+	size_t distinct = 0;
+	for (size_t i = 0; i < keyed; ++i)
+	{
+		if (i > 0 && _CompareRecordKeys(&records[i - 1], &records[i]) == 0)
+			continue;
+		keys[distinct++] = trace->keys[records[i] - trace->records];
+	}
+	qsort(keys, distinct, sizeof(char *), _CompareKeys);
+
+	size_t distinctKeys = 0;
+	for (size_t i = 0; i < distinct; ++i)
+		distinctKeys += (i == 0 || strcmp(keys[i - 1], keys[i]) != 0);
+
+	trace->distinctHashes = distinct;
+	trace->collapsedHashes = distinct - distinctKeys;
+	free(records);
+	free(keys);
+}
+
+static void _MakeKey(char *key, uint64_t hash, size_t keyLength)
+{
+	/* Six bits of a stream seeded by the hash per character. From 11
+	 * characters on every hash gets a key of its own. */
+	static const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789-_";
+	uint64_t bits = 0;
+	int bitsLeft = 0;
+	for (size_t i = 0; i < keyLength; ++i)
+	{
+		if (bitsLeft < 6)
+		{
+			hash = _SplitMix(hash);
+			bits = hash;
+			bitsLeft = 64;
+		}
+		key[i] = alphabet[bits & 63];
+		bits >>= 6;
+		bitsLeft -= 6;
+	}
+	key[keyLength] = '\0';
+}
+
+#pragma mark Samples
+static int _CompareSamples(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+static double _Percentile(uint64_t *samples, size_t count, double percentile)
+{
+	if (count == 0)
+		return 0;
+	size_t index = (size_t) (percentile * (count - 1));
+	return (double) samples[index];
+}
+
+#pragma mark Replaying
+static struct HashTable *_CreateTable(struct Options *options, struct Configuration *configuration, struct KeyPool **pool)
+{
+	struct HashTable *table = NULL;
+	*pool = NULL;
+	switch (configuration->mode)
+	{
+		case kCuckoo:
+			table = htbl_CreateCuckoo(options->capacity);
+			break;
+		case kPool:
+			*pool = kpool_Create();
+			table = htbl_CreateWithKeyPool(options->capacity, *pool);
+			break;
+		default:
+		{
+			struct HashTableOptions tableOptions = {0};
+			tableOptions.initialCapacity = options->capacity;
+			tableOptions.maxLoadFactor = configuration->maxLoadFactor;
+			tableOptions.growthFactor = options->growthFactor;
+			tableOptions.pages = configuration->pages;
+			table = htbl_CreateWithOptions(&tableOptions);
+			break;
+		}
+	}
+	if (table != NULL && options->filter)
+		htbl_EnableFilter(table);
+	return table;
+}
+
+static void _Replay(struct Options *options, struct Trace *trace, struct Configuration *configuration)
+{
+	struct KeyPool *pool;
+	struct HashTable *table = _CreateTable(options, configuration, &pool);
+	uint64_t *samples = malloc((trace->count / LATENCY_SAMPLE_EVERY + 1) * sizeof(uint64_t));
+	if (table == NULL || samples == NULL)
+	{
+		fprintf(stderr, "Can't create a %s table\n", modeNames[configuration->mode]);
+		exit(1);
+	}
+
+	size_t samplesCount = 0, lookups = 0, hits = 0;
+	uint64_t start = _Now();
+	uint64_t due = start;
+	for (size_t i = 0; i < trace->count; ++i)
+	{
+		struct WorkloadTraceRecord *record = &trace->records[i];
+		char *key = trace->keys[i];
+		if (options->paced)
+		{
+			due += record->delay;
+			while (_Now() < due)
+				;
+		}
+
+		uint64_t operationStart = (i % LATENCY_SAMPLE_EVERY) == 0 ? _Now() : 0;
+		switch (record->operation)
+		{
+			case WTRC_SET:
+				htbl_SetValueForKey(table, key, key);
+				break;
+			case WTRC_GET:
+				lookups++;
+				hits += htbl_ValueForKey(table, key) != NULL;
+				break;
+			case WTRC_REMOVE:
+				htbl_RemoveKey(table, key);
+				break;
+			case WTRC_CLEAR:
+				htbl_Clear(table, NULL, NULL);
+				break;
+		}
+		if (operationStart != 0)
+			samples[samplesCount++] = _Now() - operationStart;
+	}
+	uint64_t elapsed = _Now() - start;
+
+	struct HashTableStats stats;
+	htbl_GetStats(table, &stats);
+	qsort(samples, samplesCount, sizeof(uint64_t), _CompareSamples);
+
+	char loadFactor[16] = "-";
+	if (configuration->mode == kLinear)
+		snprintf(loadFactor, sizeof(loadFactor), "%.2f", configuration->maxLoadFactor ? configuration->maxLoadFactor : 0.75);
+	printf("%-8s %-6s %-12s %14.0f %10.1f %10.0f %10.0f %10.0f %8.1f%% %10zu %12.1f\n",
+			modeNames[configuration->mode], loadFactor, configuration->mode == kLinear ? pagesNames[configuration->pages] : "-",
+			elapsed ? trace->count * 1e9 / elapsed : 0, trace->count ? (double) elapsed / trace->count : 0,
+			_Percentile(samples, samplesCount, 0.5), _Percentile(samples, samplesCount, 0.99), _Percentile(samples, samplesCount, 0.999),
+			lookups ? 100.0 * hits / lookups : 0, htbl_Count(table), stats.totalBytes / 1048576.0);
+	fflush(stdout);
+
+	free(samples);
+	htbl_Free(table);
+	kpool_Release(pool);
+}
+
+#pragma mark Options
+static int _IndexOfName(const char **names, int count, const char *name)
+{
+	for (int i = 0; i < count; ++i)
+	{
+		if (strcmp(names[i], name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int _ParseNames(const char *string, const char **names, int namesCount, int *output, int capacity)
+{
+	int count = 0;
+	char list[256];
+	strncpy(list, string, sizeof(list) - 1);
+	list[sizeof(list) - 1] = '\0';
+	for (char *name = strtok(list, ","); name != NULL && count < capacity; name = strtok(NULL, ","))
+	{
+		int index = _IndexOfName(names, namesCount, name);
+		if (index == -1)
+		{
+			fprintf(stderr, "Unknown name %s\n", name);
+			exit(1);
+		}
+		output[count++] = index;
+	}
+	return count;
+}
+
+static void _ParseOptions(struct Options *options, int argc, const char *argv[])
+{
+	memset(options, 0, sizeof(struct Options));
+	int modes[kModeCount] = {kLinear, kCuckoo, kPool};
+	int modesCount = kModeCount;
+	double loadFactors[16] = {0};
+	int loadFactorsCount = 1;
+	int pages[3] = {HTBL_PAGES_DEFAULT};
+	int pagesCount = 1;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		const char *argument = argv[i];
+		const char *value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (argument[0] != '-' && options->tracePath == NULL)
+		{
+			options->tracePath = argument;
+			continue;
+		}
+		if (strcmp(argument, "--filter") == 0)
+		{
+			options->filter = 1;
+			continue;
+		}
+		if (strcmp(argument, "--paced") == 0)
+		{
+			options->paced = 1;
+			continue;
+		}
+		if (value == NULL)
+		{
+			_PrintUsage(argv[0]);
+			exit(1);
+		}
+		++i;
+
+		if (strcmp(argument, "--modes") == 0)
+			modesCount = _ParseNames(value, modeNames, kModeCount, modes, kModeCount);
+		else if (strcmp(argument, "--load-factors") == 0)
+		{
+			loadFactorsCount = 0;
+			for (const char *cursor = value; *cursor != '\0' && loadFactorsCount < 16;)
+			{
+				char *end;
+				double loadFactor = strtod(cursor, &end);
+				if (end == cursor || loadFactor <= 0 || loadFactor >= 1)
+				{
+					fprintf(stderr, "Load factors must be within (0, 1)\n");
+					exit(1);
+				}
+				loadFactors[loadFactorsCount++] = loadFactor;
+				cursor = (*end == ',') ? end + 1 : end;
+			}
+		}
+		else if (strcmp(argument, "--pages") == 0)
+			pagesCount = _ParseNames(value, pagesNames, 3, pages, 3);
+		else if (strcmp(argument, "--growth") == 0)
+			options->growthFactor = strtod(value, NULL);
+		else if (strcmp(argument, "--capacity") == 0)
+			options->capacity = (size_t) strtod(value, NULL);
+		else
+		{
+			_PrintUsage(argv[0]);
+			exit(1);
+		}
+	}
+	if (options->tracePath == NULL)
+	{
+		_PrintUsage(argv[0]);
+		exit(1);
+	}
+
+	/* Load factors and pages only vary the linear table */
+	for (int m = 0; m < modesCount; ++m)
+	{
+		for (int l = 0; l < (modes[m] == kLinear ? loadFactorsCount : 1); ++l)
+		{
+			for (int p = 0; p < (modes[m] == kLinear ? pagesCount : 1); ++p)
+			{
+				if (options->configurationsCount == MAX_CONFIGURATIONS)
+					return;
+				struct Configuration *configuration = &options->configurations[options->configurationsCount++];
+				configuration->mode = modes[m];
+				configuration->maxLoadFactor = loadFactors[l];
+				configuration->pages = (enum HashTablePages) pages[p];
+			}
+		}
+	}
+}
+
+static void _PrintUsage(const char *name)
+{
+	fprintf(stderr,
+			"usage: %s TRACE [options]\n"
+			"  --modes linear,cuckoo,pool       tables to replay against (default: all)\n"
+			"  --load-factors 0.5,0.75,0.9      linear tables only\n"
+			"  --pages default,transparent,explicit\n"
+			"                                   slot memory of linear tables\n"
+			"  --growth FACTOR                  linear tables only (default 2)\n"
+			"  --capacity N                     presize every table\n"
+			"  --filter                         check lookups against a Bloom filter first\n"
+			"  --paced                          keep the recorded time between operations\n", name);
+}
+
+#pragma mark Main
+int main(int argc, const char *argv[])
+{
+	struct Options options;
+	_ParseOptions(&options, argc, argv);
+
+	struct Trace trace;
+	if (_LoadTrace(options.tracePath, &trace) == 0)
+	{
+		fprintf(stderr, "Can't read a trace from %s\n", options.tracePath);
+		return 1;
+	}
+
+	printf("%zu operations, %zu distinct keys", trace.count, trace.distinctHashes);
+	if (trace.collapsedHashes != 0)
+		printf(", %zu of them (%.2f%%) made up as a key already in use - short keys, expect more hits than recorded",
+				trace.collapsedHashes, 100.0 * trace.collapsedHashes / trace.distinctHashes);
+	printf("\n");
+	printf("%-8s %-6s %-12s %14s %10s %10s %10s %10s %9s %10s %12s\n",
+			"mode", "load", "pages", "ops/sec", "ns/op", "p50", "p99", "p99.9", "hits", "count", "MB");
+	for (int i = 0; i < options.configurationsCount; ++i)
+		_Replay(&options, &trace, &options.configurations[i]);
+
+	free(trace.records);
+	free(trace.keys);
+	free(trace.keyBytes);
+	return 0;
+}
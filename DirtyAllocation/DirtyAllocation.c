@@ -1,12 +1,29 @@
+#define _GNU_SOURCE /* RTLD_NEXT */
 #include "DirtyAllocation.h"
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdatomic.h>
 #include <dlfcn.h>
-#import <mm_malloc.h>
-#import <stdio.h>
+#include <stdio.h>
 #include <execinfo.h>
-#import <string.h>
-#import <assert.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
 
+/* Initial-exec TLS never allocates on first access, the general dynamic one may */
+#define DA_THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+
+/* What the symbol at a return address starts with */
+enum DA_Flags
+{
+	kMonsterKill = 1 << 0,
+	kDirty = 1 << 1,
+	kBlackListed = 1 << 2,
+	kTrace = 1 << 3,
+	kInterposer = 1 << 4, /* Our own frames, not a part of the caller's stack */
+	kVerdictReady = 1 << 7 /* Cache only: the flags next to the address are written */
+};
 
 struct DA_Symbols
 {
@@ -29,229 +46,755 @@ static struct DA_Symbols smbls = {
 		{BLACKLISTED_PREFIXES}, BLACKLISTED_PREFIXES_COUNT,
 		{LEAK_PREFIXES}, LEAK_PREFIXES_COUNT};
 
-void **traceListArray = NULL;
-size_t traceListArrayLen = 0;
+/* dladdr and strncmp are only paid once per return address. Open addressing,
+ * never deleted from; when the probe runs out the verdict just isn't cached.
+ * A slot is claimed by CAS on the address, the flags are published after. */
+#define ADDRESS_CACHE_MAX_PROBE 16
 
-static void *(*r_calloc)(size_t, size_t) = NULL;
-static void *(*r_malloc)(size_t) = NULL;
-static void *(*r_free)(void *) = NULL;
+struct DA_AddressVerdict
+{
+	_Atomic(void *) address;
+	_Atomic uint8_t flags;
+};
+
+static struct DA_AddressVerdict addressCache[ADDRESS_CACHE_SIZE];
+
+/* Live traced allocations: a fixed open-addressed set, so registration is a
+ * single CAS and nothing ever moves. Freed slots become tombstones, which
+ * inserts reuse - a pointer can't be live twice. */
+#define TOMBSTONE ((void *) 1)
+
+struct DA_LiveAllocation
+{
+	_Atomic(void *) ptr;
+	size_t size;
+	uint64_t birth; /* Profiling only */
+	struct DA_Site *site;
+};
+
+/* Start and stop are expected to be called while other threads are quiet */
+static _Atomic(struct DA_LiveAllocation *) liveAllocations = NULL;
+static atomic_size_t untracedAllocations = 0;
+
+/* Profile tables are allocated once per StartTracing and never grow,
+ * so live allocations can point right into them */
+#define PROFILE_MAX_PROBE 32
+
+/* Shared by all threads: peak live bytes can't be told from per-thread logs,
+ * memory is often freed by another thread than the one allocated it */
+struct DA_Site
+{
+	_Atomic(void *) address; /* Return address into the allocating function, NULL - (other) */
+	atomic_size_t count;
+	atomic_size_t bytes;
+	atomic_size_t liveBytes;
+	atomic_size_t peakLiveBytes;
+	atomic_size_t freedCount;
+	_Atomic uint64_t lifetimeNanoseconds; /* Sum over the freed ones */
+};
+
+struct DA_Stack
+{
+	uint64_t hash;
+	int depth; /* 0 - free slot, the (other) stack has no frames either */
+	void *frames[BACKTRACE_DEPTH]; /* Callee first */
+	size_t count;
+	size_t bytes;
+};
+
+/* Every thread counts its stacks on its own, merged at StopTracing */
+struct DA_ThreadLog
+{
+	struct DA_ThreadLog *next;
+	struct DA_Stack stacks[PROFILE_MAX_STACKS + 1]; /* + (other) */
+};
 
-static bool _shouldReturnNull();
-static bool _shouldTraceAllocation();
-static int getBacktrace(Dl_info *output, size_t len);
-static bool backtraceContainsMonsterKillSymbol(Dl_info *backtrace, int backtraceSize);
-static bool backtraceContainsBlackListedSymbol(Dl_info *backtrace, int backtraceSize);
-static bool backtraceContainsDirtyPrefixes(Dl_info *backtrace, int backtraceSize);
-static bool backtraceContainsPrefixesFromArray(Dl_info *backtrace, int backtraceSize, char **prefixArray, int count);
-static bool backtraceContainsSymbolStartingWith(Dl_info *backtrace, int backtraceSize, char *string);
-static bool backtraceContainsTracePrefixes(Dl_info *backtrace, int backtraceSize);
+struct DA_Profile
+{
+	struct DA_Site *sites; /* PROFILE_MAX_SITES + (other) */
+	_Atomic(struct DA_ThreadLog *) threadLogs;
+	atomic_uint generation; /* Tells a thread its log belongs to a stopped profile */
+};
+
+static bool profiling = PROFILE_ALLOCATIONS;
+static struct DA_Profile profile = {NULL, NULL, 0};
+static DA_THREAD_LOCAL struct DA_ThreadLog *threadLog = NULL;
+static DA_THREAD_LOCAL unsigned threadLogGeneration = 0;
+static void *ownBase = NULL;
 
-static void print_trace(void);
+/* Every thread has its own generator, seeded by the order threads come in,
+ * so a single threaded run replays exactly */
+static uint64_t seed = DIRTY_DEFAULT_SEED;
+static atomic_uint_fast64_t seededThreads = 0;
+static DA_THREAD_LOCAL uint64_t randomState = 0;
+
+static void *(*r_calloc)(size_t, size_t) = NULL;
+static void *(*r_malloc)(size_t) = NULL;
+static void (*r_free)(void *) = NULL;
 
-void addAllocationToTrace(void *ptr);
-void removeAllocationFromTrace(void *ptr);
+/* dlsym and backtrace allocate themselves. Those allocations go straight
+ * to the real functions, or to the arena while they aren't resolved yet. */
+enum
+{
+	kUnresolved = 0, kResolving, kResolved
+};
+static atomic_int resolveState = kUnresolved;
+static DA_THREAD_LOCAL bool resolvingHere = false;
+static DA_THREAD_LOCAL bool insideInterposer = false;
+static char bootstrapArena[4096];
+static atomic_size_t bootstrapArenaUsed = 0;
+
+static void _resolveRealFunctions();
+static void *_bootstrapAllocation(size_t size);
+static bool _isBootstrapAllocation(void *ptr);
+
+static uint8_t _backtraceFlags(void **frames, int *depth);
+static uint8_t _flagsForAddress(void *address);
+static uint8_t _flagsForSymbolAt(void *address);
+static bool _symbolStartsWithPrefixFromArray(const char *symbol, char **prefixArray, int count);
+static size_t _hashPointer(void *ptr);
+
+static bool _shouldReturnNull(uint8_t flags);
+static bool _shouldTraceAllocation(uint8_t flags);
+static uint64_t _nextRandom();
+
+void print_trace(void); /* For the debugger */
+
+static void addAllocationToTrace(void *ptr, size_t size, void **frames, int depth);
+static void removeAllocationFromTrace(void *ptr);
+
+static bool _startProfiling();
+static void _stopProfiling();
+static struct DA_ThreadLog *_currentThreadLog();
+static void _chargeSite(struct DA_Site *site, size_t size);
+static struct DA_Site *_siteForAddress(void *address);
+static struct DA_Stack *_stackForFrames(struct DA_Stack *stacks, void **frames, int depth);
+static void _writeReport(const char *path);
+static void _writeCollapsedStacks(const char *path, struct DA_Stack *stacks);
+static int _compareSitesByBytes(const void *a, const void *b);
+static void _describeAddress(void *address, bool withOffset, char *buffer, size_t length);
+static uint64_t _monotonicNanoseconds();
 
 void *malloc(size_t size)
 {
-	if (r_malloc == NULL)
-		r_malloc = dlsym(RTLD_NEXT, "malloc");
+	if (atomic_load_explicit(&resolveState, memory_order_acquire) != kResolved)
+	{
+		if (resolvingHere)
+			return _bootstrapAllocation(size);
+		_resolveRealFunctions();
+	}
+	if (insideInterposer)
+		return r_malloc(size);
 
-	if (_shouldReturnNull())
-		return NULL;
+	insideInterposer = true;
+	void *frames[BACKTRACE_DEPTH];
+	int depth = 0;
+	uint8_t flags = _backtraceFlags(frames, &depth);
 
-	void *memporyPtr = r_malloc(size);
+	void *memporyPtr = NULL;
+	if (_shouldReturnNull(flags) == false)
+		memporyPtr = r_malloc(size);
 
-	if (_shouldTraceAllocation() && memporyPtr != NULL)
-		addAllocationToTrace(memporyPtr);
+	if (_shouldTraceAllocation(flags) && memporyPtr != NULL)
+		addAllocationToTrace(memporyPtr, size, frames, depth);
+	insideInterposer = false;
 
 	return memporyPtr;
 }
 
 void *calloc(size_t nmemb, size_t size)
 {
-	if (r_calloc == NULL)
-		r_calloc = dlsym(RTLD_NEXT, "calloc");
+	if (atomic_load_explicit(&resolveState, memory_order_acquire) != kResolved)
+	{
+		if (resolvingHere)
+			return _bootstrapAllocation(nmemb * size); /* Static, already zeroed */
+		_resolveRealFunctions();
+	}
+	if (insideInterposer)
+		return r_calloc(nmemb, size);
 
-	if (_shouldReturnNull())
-		return NULL;
+	insideInterposer = true;
+	void *frames[BACKTRACE_DEPTH];
+	int depth = 0;
+	uint8_t flags = _backtraceFlags(frames, &depth);
 
-	void *memporyPtr = r_calloc(nmemb, size);
+	void *memporyPtr = NULL;
+	if (_shouldReturnNull(flags) == false)
+		memporyPtr = r_calloc(nmemb, size);
 
-	if (_shouldTraceAllocation() && memporyPtr != NULL)
-		addAllocationToTrace(memporyPtr);
+	if (_shouldTraceAllocation(flags) && memporyPtr != NULL)
+		addAllocationToTrace(memporyPtr, nmemb * size, frames, depth);
+	insideInterposer = false;
 
 	return memporyPtr;
 }
 
 void free(void *ptr)
 {
-	if (r_free == NULL)
-		r_free = dlsym(RTLD_NEXT, "free");
+	if (ptr == NULL || _isBootstrapAllocation(ptr))
+		return;
+	if (atomic_load_explicit(&resolveState, memory_order_acquire) != kResolved)
+		_resolveRealFunctions();
 
-	if (_shouldTraceAllocation())
+	/* Whoever frees it, it's not leaked anymore - no backtrace needed */
+	if (insideInterposer == false)
 		removeAllocationFromTrace(ptr);
 	r_free(ptr);
 }
-#pragma mark Rutines
 
-static bool _shouldReturnNull()
+#pragma mark Bootstrap
+static void _resolveRealFunctions()
 {
-	Dl_info backtrace[10] = {0};
-	int backtraceLen = getBacktrace(backtrace, 10);
+	int expected = kUnresolved;
+	if (atomic_compare_exchange_strong(&resolveState, &expected, kResolving) == false)
+	{
+		/* Somebody else is on it */
+		while (atomic_load_explicit(&resolveState, memory_order_acquire) != kResolved)
+			;
+		return;
+	}
+
+	resolvingHere = true;
+	r_malloc = dlsym(RTLD_NEXT, "malloc");
+	r_calloc = dlsym(RTLD_NEXT, "calloc");
+	r_free = dlsym(RTLD_NEXT, "free");
 
-	bool containsMonsterKill = backtraceContainsMonsterKillSymbol(backtrace, backtraceLen);
-	bool containsBlackListed = backtraceContainsBlackListedSymbol(backtrace, backtraceLen);
-	bool containsDirty = backtraceContainsDirtyPrefixes(backtrace, backtraceLen);
+	const char *seedString = getenv("DIRTY_SEED");
+	if (seedString != NULL)
+		seed = strtoull(seedString, NULL, 0);
 
-	if (containsBlackListed == true)
+	const char *profileString = getenv("DIRTY_PROFILE");
+	if (profileString != NULL)
+		profiling = (atoi(profileString) != 0);
+
+	Dl_info info;
+	if (dladdr((void *) StartTracing, &info) != 0)
+		ownBase = info.dli_fbase;
+	resolvingHere = false;
+
+	atomic_store_explicit(&resolveState, kResolved, memory_order_release);
+}
+
+static void *_bootstrapAllocation(size_t size)
+{
+	size = (size + 15) & ~(size_t) 15;
+	size_t offset = atomic_fetch_add(&bootstrapArenaUsed, size);
+	if (offset + size > sizeof(bootstrapArena))
+		return NULL;
+
+	return &bootstrapArena[offset];
+}
+
+static bool _isBootstrapAllocation(void *ptr)
+{
+	return (char *) ptr >= bootstrapArena && (char *) ptr < bootstrapArena + sizeof(bootstrapArena);
+}
+
+#pragma mark Rutines
+
+static bool _shouldReturnNull(uint8_t flags)
+{
+	if (profiling)
+		return false; /* Measure what really happens */
+	if (flags & kBlackListed)
 		return false;
-	if (containsMonsterKill == true)
+	if (flags & kMonsterKill)
 		return true;
-	if (containsDirty == true)
-		return (arc4random() % AGGRESSIVENESS) ? false : true;
+	if (flags & kDirty)
+		return (_nextRandom() % AGGRESSIVENESS) ? false : true;
 
 	return false;
 }
 
-static bool _shouldTraceAllocation()
+static bool _shouldTraceAllocation(uint8_t flags)
 {
-	if (traceListArray == NULL)
+	if (atomic_load_explicit(&liveAllocations, memory_order_acquire) == NULL)
 		return false;
 
-	Dl_info backtrace[10] = {0};
-	int backtraceLen = getBacktrace(backtrace, 10);
+	return (flags & kTrace) ? true : false;
+}
 
-	bool containsTraceSymbol = backtraceContainsTracePrefixes(backtrace, backtraceLen);
+static uint64_t _nextRandom()
+{
+	if (randomState == 0)
+	{
+		uint64_t thread = atomic_fetch_add(&seededThreads, 1);
+		randomState = seed + thread * 0x9E3779B97F4A7C15ull;
+		if (randomState == 0)
+			randomState = 0x9E3779B97F4A7C15ull;
+	}
 
-	if (containsTraceSymbol)
-		return true;
-	return false;
+	/* xorshift64* - small, fast and the same everywhere */
+	randomState ^= randomState >> 12;
+	randomState ^= randomState << 25;
+	randomState ^= randomState >> 27;
+	return (randomState * 0x2545F4914F6CDD1Dull) >> 32;
 }
 
-static int getBacktrace(Dl_info *output, size_t len)
+#pragma mark Backtrace
+/* Frames get the caller's stack, our own frames skipped */
+static uint8_t _backtraceFlags(void **frames, int *depth)
 {
-	void *returnAddresses[len];
-	int size = backtrace(returnAddresses, (int) len);
+	*depth = 0;
+	if (MONSTERKILL_PREFIXES_COUNT + DIRTY_PREFIXES_COUNT == 0 && atomic_load(&liveAllocations) == NULL)
+		return 0;
 
-	int finalSize = 0;
-	for (int i = 0; i < size; ++i, ++finalSize)
-	{
-		void *addr = returnAddresses[i];
+	void *returnAddresses[BACKTRACE_DEPTH];
+	int size = backtrace(returnAddresses, BACKTRACE_DEPTH);
 
-		Dl_info info;
-		int foundInfo = dladdr(addr, &info);
-		if (foundInfo == 0)
-		{
-			--finalSize;
+	uint8_t flags = 0;
+	for (int i = 0; i < size; ++i)
+	{
+		uint8_t addressFlags = _flagsForAddress(returnAddresses[i]);
+		if (addressFlags & kInterposer)
 			continue;
-		}
 
-		output[finalSize] = info;
+		flags |= addressFlags;
+		frames[(*depth)++] = returnAddresses[i];
 	}
 
-	return finalSize;
+	return flags;
 }
 
-static bool backtraceContainsMonsterKillSymbol(Dl_info *backtrace, int backtraceSize)
+static uint8_t _flagsForAddress(void *address)
 {
-	return backtraceContainsPrefixesFromArray(backtrace, backtraceSize, smbls.monsterKill, smbls.monsterKillCount);
-}
+	size_t mask = ADDRESS_CACHE_SIZE - 1;
+	size_t index = _hashPointer(address) & mask;
+	for (int probe = 0; probe < ADDRESS_CACHE_MAX_PROBE; ++probe, index = (index + 1) & mask)
+	{
+		struct DA_AddressVerdict *verdict = &addressCache[index];
+		void *cachedAddress = atomic_load_explicit(&verdict->address, memory_order_acquire);
+		if (cachedAddress == NULL)
+		{
+			if (atomic_compare_exchange_strong(&verdict->address, &cachedAddress, address))
+			{
+				uint8_t flags = _flagsForSymbolAt(address);
+				atomic_store_explicit(&verdict->flags, flags | kVerdictReady, memory_order_release);
+				return flags;
+			}
+			/* Lost the slot, cachedAddress has the winner now */
+		}
+		if (cachedAddress != address)
+			continue;
 
-static bool backtraceContainsBlackListedSymbol(Dl_info *backtrace, int backtraceSize)
-{
-	return backtraceContainsPrefixesFromArray(backtrace, backtraceSize, smbls.blackList, smbls.blackListCount);
-}
+		uint8_t flags = atomic_load_explicit(&verdict->flags, memory_order_acquire);
+		if (flags & kVerdictReady)
+			return flags & ~kVerdictReady;
+		break; /* Being resolved by another thread right now */
+	}
 
-static bool backtraceContainsDirtyPrefixes(Dl_info *backtrace, int backtraceSize)
-{
-	return backtraceContainsPrefixesFromArray(backtrace, backtraceSize, smbls.dirty, smbls.dirtyCount);
+	return _flagsForSymbolAt(address);
 }
 
-static bool backtraceContainsTracePrefixes(Dl_info *backtrace, int backtraceSize)
+static uint8_t _flagsForSymbolAt(void *address)
 {
-	return backtraceContainsPrefixesFromArray(backtrace, backtraceSize, smbls.traceList, smbls.traceListCount);
+	Dl_info info;
+	int foundInfo = dladdr(address, &info);
+	if (foundInfo == 0)
+		return 0;
+	if (info.dli_fbase == ownBase)
+		return kInterposer;
+	if (info.dli_sname == NULL)
+		return 0;
+
+	const char *symbol = info.dli_sname;
+	uint8_t flags = 0;
+	if (_symbolStartsWithPrefixFromArray(symbol, smbls.monsterKill, smbls.monsterKillCount))
+		flags |= kMonsterKill;
+	if (_symbolStartsWithPrefixFromArray(symbol, smbls.dirty, smbls.dirtyCount))
+		flags |= kDirty;
+	if (_symbolStartsWithPrefixFromArray(symbol, smbls.blackList, smbls.blackListCount))
+		flags |= kBlackListed;
+	if (_symbolStartsWithPrefixFromArray(symbol, smbls.traceList, smbls.traceListCount))
+		flags |= kTrace;
+
+	return flags;
 }
 
-static bool backtraceContainsPrefixesFromArray(Dl_info *backtrace, int backtraceSize, char **prefixArray, int count)
+static bool _symbolStartsWithPrefixFromArray(const char *symbol, char **prefixArray, int count)
 {
 	for (int i = 0; i < count; ++i)
 	{
 		char *symbolPrefix = prefixArray[i];
-		bool contains = backtraceContainsSymbolStartingWith(backtrace, backtraceSize, symbolPrefix);
-		if (contains == true)
-			return 1;
+		int cmp = strncmp(symbolPrefix, symbol, strlen(symbolPrefix));
+		if (cmp == 0)
+			return true;
 	}
-	return 0;
+	return false;
 }
 
-static bool backtraceContainsSymbolStartingWith(Dl_info *backtrace, int backtraceSize, char *string)
+static size_t _hashPointer(void *ptr)
 {
-	for (int i = 0; i < backtraceSize; ++i)
-	{
-		Dl_info info = backtrace[i];
-		if (info.dli_sname == NULL)
-			continue;
-
-		size_t len = strlen(string);
-		int cmp = strncmp(string, info.dli_sname, len);
-		if (cmp == 0)
-			return 1;
-	}
-	return 0;
+	uint64_t x = (uint64_t) (uintptr_t) ptr;
+	x ^= x >> 33;
+	x *= 0xFF51AFD7ED558CCDull;
+	x ^= x >> 33;
+	return (size_t) x;
 }
 
 void print_trace(void)
 {
 	void *array[10];
 	char **strings;
-	size_t i;
+	int i;
 
 	int size = backtrace(array, 10);
 	strings = backtrace_symbols(array, size);
 
-	printf("Obtained %zd stack frames.\n", size);
+	printf("Obtained %d stack frames.\n", size);
 
 	for (i = 0; i < size; i++)
 		printf("%s\n", strings[i]);
-	fpurge(stdout);
+	fflush(stdout);
 	free(strings);
 }
 
-#pragma mark TraceListArray
+#pragma mark Live Allocations
 void StartTracing()
 {
-	traceListArray = r_calloc(0, sizeof(void *));
+	if (atomic_load_explicit(&resolveState, memory_order_acquire) != kResolved)
+		_resolveRealFunctions();
+	if (atomic_load(&liveAllocations) != NULL)
+		return;
+
+	bool wasInside = insideInterposer;
+	insideInterposer = true;
+	if (profiling == false || _startProfiling())
+	{
+		struct DA_LiveAllocation *slots = r_calloc(LIVE_ALLOCATIONS_CAPACITY, sizeof(struct DA_LiveAllocation));
+		atomic_store(&untracedAllocations, 0);
+		atomic_store_explicit(&liveAllocations, slots, memory_order_release);
+	}
+	insideInterposer = wasInside;
 }
 
-void addAllocationToTrace(void *ptr)
+static void addAllocationToTrace(void *ptr, size_t size, void **frames, int depth)
 {
-	traceListArray = realloc(traceListArray, sizeof(void *) * (traceListArrayLen + 1));
-	traceListArray[traceListArrayLen] = ptr;
-	traceListArrayLen += 1;
+	struct DA_LiveAllocation *slots = atomic_load_explicit(&liveAllocations, memory_order_acquire);
+	if (slots == NULL)
+		return;
+
+	size_t mask = LIVE_ALLOCATIONS_CAPACITY - 1;
+	size_t index = _hashPointer(ptr) & mask;
+	for (size_t probe = 0; probe < LIVE_ALLOCATIONS_CAPACITY; ++probe, index = (index + 1) & mask)
+	{
+		struct DA_LiveAllocation *slot = &slots[index];
+		void *slotPtr = atomic_load_explicit(&slot->ptr, memory_order_relaxed);
+		if (slotPtr != NULL && slotPtr != TOMBSTONE)
+			continue;
+		if (atomic_compare_exchange_strong(&slot->ptr, &slotPtr, ptr) == false)
+			continue;
+
+		/* Nobody but us knows ptr yet, so there's no hurry filling the rest */
+		slot->size = size;
+		slot->site = NULL;
+		if (profile.sites != NULL)
+		{
+			struct DA_Site *site = _siteForAddress(depth ? frames[0] : NULL);
+			_chargeSite(site, size);
+
+			struct DA_ThreadLog *log = _currentThreadLog();
+			if (log != NULL)
+			{
+				struct DA_Stack *stack = _stackForFrames(log->stacks, frames, depth);
+				stack->count++;
+				stack->bytes += size;
+			}
+
+			slot->site = site;
+			slot->birth = _monotonicNanoseconds();
+		}
+		return;
+	}
+
+	atomic_fetch_add_explicit(&untracedAllocations, 1, memory_order_relaxed);
 }
 
-void removeAllocationFromTrace(void *ptr)
+static void removeAllocationFromTrace(void *ptr)
 {
-	for (size_t i = 0; i < traceListArrayLen; ++i)
+	struct DA_LiveAllocation *slots = atomic_load_explicit(&liveAllocations, memory_order_acquire);
+	if (slots == NULL)
+		return;
+
+	size_t mask = LIVE_ALLOCATIONS_CAPACITY - 1;
+	size_t index = _hashPointer(ptr) & mask;
+	for (size_t probe = 0; probe < LIVE_ALLOCATIONS_CAPACITY; ++probe, index = (index + 1) & mask)
 	{
-		if (traceListArray[i] == ptr)
-		{
-			traceListArray[i] = NULL;
+		struct DA_LiveAllocation *slot = &slots[index];
+		void *slotPtr = atomic_load_explicit(&slot->ptr, memory_order_acquire);
+		if (slotPtr == NULL)
 			return;
+		if (slotPtr != ptr)
+			continue;
+
+		struct DA_Site *site = slot->site;
+		if (site != NULL)
+		{
+			atomic_fetch_sub_explicit(&site->liveBytes, slot->size, memory_order_relaxed);
+			atomic_fetch_add_explicit(&site->freedCount, 1, memory_order_relaxed);
+			atomic_fetch_add_explicit(&site->lifetimeNanoseconds, _monotonicNanoseconds() - slot->birth, memory_order_relaxed);
 		}
+		atomic_store_explicit(&slot->ptr, TOMBSTONE, memory_order_release);
+		return;
 	}
 }
 
 void StopTracing()
 {
-	for (int i = 0; i < traceListArrayLen; ++i)
+	struct DA_LiveAllocation *slots = atomic_exchange(&liveAllocations, NULL);
+	if (slots == NULL)
+		return;
+
+	/* Nothing below is to be traced or failed */
+	bool wasInside = insideInterposer;
+	insideInterposer = true;
+
+	if (profile.sites != NULL)
+		_stopProfiling();
+
+	size_t leaks = 0;
+	for (size_t i = 0; i < LIVE_ALLOCATIONS_CAPACITY; ++i)
+	{
+		void *ptr = atomic_load(&slots[i].ptr);
+		if (ptr == NULL || ptr == TOMBSTONE)
+			continue;
+		printf("Leaked %p!\n", ptr);
+		++leaks;
+	}
+	size_t untraced = atomic_load(&untracedAllocations);
+	if (untraced != 0)
+		printf("%zu allocations weren't traced, raise LIVE_ALLOCATIONS_CAPACITY\n", untraced);
+	fflush(stdout);
+	r_free(slots);
+	insideInterposer = wasInside;
+
+	assert(leaks == 0 || LEAK_ASSERT == false);
+}
+
+#pragma mark Profiling
+static bool _startProfiling()
+{
+	profile.sites = r_calloc(PROFILE_MAX_SITES + 1, sizeof(struct DA_Site));
+	if (profile.sites == NULL)
+		return false;
+
+	atomic_store(&profile.threadLogs, NULL);
+	atomic_fetch_add(&profile.generation, 1);
+	return true;
+}
+
+static void _stopProfiling()
+{
+	_writeReport(PROFILE_REPORT_PATH);
+
+	/* Every stack goes into the first log, the rest are just freed */
+	struct DA_ThreadLog *log = atomic_exchange(&profile.threadLogs, NULL);
+	struct DA_ThreadLog *merged = log;
+	while (log != NULL)
+	{
+		struct DA_ThreadLog *nextLog = log->next;
+		if (log != merged)
+		{
+			for (size_t i = 0; i <= PROFILE_MAX_STACKS; ++i)
+			{
+				struct DA_Stack *stack = &log->stacks[i];
+				if (stack->count == 0)
+					continue;
+
+				struct DA_Stack *mergedStack = _stackForFrames(merged->stacks, stack->frames, stack->depth);
+				mergedStack->count += stack->count;
+				mergedStack->bytes += stack->bytes;
+			}
+			r_free(log);
+		}
+		log = nextLog;
+	}
+	if (merged != NULL)
+	{
+		_writeCollapsedStacks(PROFILE_STACKS_PATH, merged->stacks);
+		r_free(merged);
+	}
+
+	r_free(profile.sites);
+	profile.sites = NULL;
+}
+
+static struct DA_ThreadLog *_currentThreadLog()
+{
+	unsigned generation = atomic_load_explicit(&profile.generation, memory_order_relaxed);
+	if (threadLog != NULL && threadLogGeneration == generation)
+		return threadLog;
+
+	/* The old one, if any, was freed by StopTracing */
+	threadLog = r_calloc(1, sizeof(struct DA_ThreadLog));
+	threadLogGeneration = generation;
+	if (threadLog == NULL)
+		return NULL;
+
+	struct DA_ThreadLog *head = atomic_load(&profile.threadLogs);
+	do
+		threadLog->next = head;
+	while (atomic_compare_exchange_weak(&profile.threadLogs, &head, threadLog) == false);
+
+	return threadLog;
+}
+
+static void _chargeSite(struct DA_Site *site, size_t size)
+{
+	atomic_fetch_add_explicit(&site->count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&site->bytes, size, memory_order_relaxed);
+
+	size_t liveBytes = atomic_fetch_add_explicit(&site->liveBytes, size, memory_order_relaxed) + size;
+	size_t peak = atomic_load_explicit(&site->peakLiveBytes, memory_order_relaxed);
+	while (liveBytes > peak && atomic_compare_exchange_weak(&site->peakLiveBytes, &peak, liveBytes) == false)
+		;
+}
+
+static struct DA_Site *_siteForAddress(void *address)
+{
+	struct DA_Site *other = &profile.sites[PROFILE_MAX_SITES];
+	if (address == NULL)
+		return other;
+
+	size_t index = _hashPointer(address) % PROFILE_MAX_SITES;
+	for (int probe = 0; probe < PROFILE_MAX_PROBE; ++probe, index = (index + 1) % PROFILE_MAX_SITES)
+	{
+		struct DA_Site *site = &profile.sites[index];
+		void *siteAddress = atomic_load_explicit(&site->address, memory_order_relaxed);
+		if (siteAddress == NULL && atomic_compare_exchange_strong(&site->address, &siteAddress, address))
+			return site;
+		if (siteAddress == address)
+			return site;
+	}
+	return other;
+}
+
+static struct DA_Stack *_stackForFrames(struct DA_Stack *stacks, void **frames, int depth)
+{
+	struct DA_Stack *other = &stacks[PROFILE_MAX_STACKS];
+	if (depth == 0)
+		return other;
+
+	uint64_t hash = 0;
+	for (int i = 0; i < depth; ++i)
+		hash = hash * 31 + _hashPointer(frames[i]);
+
+	size_t index = hash % PROFILE_MAX_STACKS;
+	for (int probe = 0; probe < PROFILE_MAX_PROBE; ++probe, index = (index + 1) % PROFILE_MAX_STACKS)
+	{
+		struct DA_Stack *stack = &stacks[index];
+		if (stack->depth == 0)
+		{
+			stack->hash = hash;
+			stack->depth = depth;
+			memcpy(stack->frames, frames, depth * sizeof(void *));
+			return stack;
+		}
+		if (stack->hash == hash && stack->depth == depth && memcmp(stack->frames, frames, depth * sizeof(void *)) == 0)
+			return stack;
+	}
+	return other;
+}
+
+static void _writeReport(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+		return;
+
+	struct DA_Site *sites[PROFILE_MAX_SITES + 1];
+	size_t count = 0;
+	for (size_t i = 0; i <= PROFILE_MAX_SITES; ++i)
+	{
+		if (profile.sites[i].count != 0)
+			sites[count++] = &profile.sites[i];
+	}
+	qsort(sites, count, sizeof(struct DA_Site *), _compareSitesByBytes);
+
+	fprintf(file, "%-48s %10s %14s %14s %16s %10s\n", "Call site", "Count", "Bytes", "Peak live", "Avg lifetime ns", "Live");
+	for (size_t i = 0; i < count; ++i)
+	{
+		struct DA_Site *site = sites[i];
+		char name[256];
+		_describeAddress(site->address, true, name, sizeof(name));
+
+		size_t freedCount = site->freedCount;
+		uint64_t averageLifetime = freedCount ? site->lifetimeNanoseconds / freedCount : 0;
+		fprintf(file, "%-48s %10zu %14zu %14zu %16llu %10zu\n", name, (size_t) site->count, (size_t) site->bytes,
+				(size_t) site->peakLiveBytes, (unsigned long long) averageLifetime, site->count - freedCount);
+	}
+
+	fclose(file);
+}
+
+static void _writeCollapsedStacks(const char *path, struct DA_Stack *stacks)
+{
+	FILE *file = fopen(path, "w");
+	if (file == NULL)
+		return;
+
+	/* Root first, semicolon separated, then the weight - bytes here */
+	for (size_t i = 0; i <= PROFILE_MAX_STACKS; ++i)
 	{
-		if (traceListArray[i] == NULL)
+		struct DA_Stack *stack = &stacks[i];
+		if (stack->count == 0)
 			continue;
-		printf("Leaked!\n");
-		assert(LEAK_ASSERT == false);
+
+		if (stack->depth == 0)
+			fprintf(file, "(other)");
+		for (int frame = stack->depth - 1; frame >= 0; --frame)
+		{
+			char name[256];
+			_describeAddress(stack->frames[frame], false, name, sizeof(name));
+			fprintf(file, "%s%s", name, frame ? ";" : "");
+		}
+		fprintf(file, " %zu\n", stack->bytes);
+	}
+
+	fclose(file);
+}
+
+static int _compareSitesByBytes(const void *a, const void *b)
+{
+	size_t bytesA = (*(struct DA_Site **) a)->bytes;
+	size_t bytesB = (*(struct DA_Site **) b)->bytes;
+	if (bytesA == bytesB)
+		return 0;
+	return bytesA > bytesB ? -1 : 1;
+}
+
+/* Exported symbols by name. Static functions only have module+offset, which addr2line turns into a name */
+static void _describeAddress(void *address, bool withOffset, char *buffer, size_t length)
+{
+	Dl_info info;
+	if (address == NULL || dladdr(address, &info) == 0)
+	{
+		snprintf(buffer, length, address ? "%p" : "(other)", address);
+		return;
+	}
+
+	if (info.dli_sname != NULL && withOffset)
+		snprintf(buffer, length, "%s+0x%zx", info.dli_sname, (size_t) ((char *) address - (char *) info.dli_saddr));
+	else if (info.dli_sname != NULL)
+		snprintf(buffer, length, "%s", info.dli_sname);
+	else
+	{
+		const char *module = info.dli_fname ? strrchr(info.dli_fname, '/') : NULL;
+		module = module ? module + 1 : (info.dli_fname ? info.dli_fname : "?");
+		snprintf(buffer, length, "%s+0x%zx", module, (size_t) ((char *) address - (char *) info.dli_fbase));
 	}
-	free(traceListArray);
-	traceListArray = NULL;
-	traceListArrayLen = 0;
-}
\ No newline at end of file
+
+	/* Collapsed stacks are split by spaces */
+	for (char *c = buffer; *c != '\0'; ++c)
+	{
+		if (*c == ' ' || *c == ';')
+			*c = '_';
+	}
+}
+
+static uint64_t _monotonicNanoseconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+}
@@ -33,4 +33,30 @@
 #define LEAK_PREFIXES_COUNT 2
 #define LEAK_ASSERT true
 
-#endif
\ No newline at end of file
+/* Dirty NULLs come from a seeded generator, so the very same allocations fail
+ * again on the next run. DIRTY_SEED environment variable overrides the default. */
+#define DIRTY_DEFAULT_SEED 1
+
+/* How deep to look for the prefixes */
+#define BACKTRACE_DEPTH 10
+/* Return addresses with their prefix verdicts remembered, power of two */
+#define ADDRESS_CACHE_SIZE 4096
+/* Allocations traced at once, power of two. The set never grows so threads
+ * can register allocations without locks; the overflow is reported. */
+#define LIVE_ALLOCATIONS_CAPACITY (1 << 20)
+
+/* Profiling mode: nothing fails, instead allocations made under LEAK_PREFIXES
+ * are counted per call site. StopTracing writes PROFILE_REPORT_PATH, sorted by
+ * bytes, and PROFILE_STACKS_PATH in the collapsed format flame graph tools read.
+ * DIRTY_PROFILE environment variable (0 or 1) overrides the default. */
+#define PROFILE_ALLOCATIONS false
+#define PROFILE_REPORT_PATH "DirtyAllocation.report"
+#define PROFILE_STACKS_PATH "DirtyAllocation.folded"
+/* Beyond these everything is counted as "(other)" */
+#define PROFILE_MAX_SITES 1024
+#define PROFILE_MAX_STACKS 8192
+
+void StartTracing();
+void StopTracing();
+
+#endif
@@ -0,0 +1,172 @@
+#import <stdlib.h>
+#import <string.h>
+#import "BloomFilter.h"
+#include "Utilities.h"
+
+#pragma mark Private Header
+#define BLOOM_BLOCK_BYTES 64 /* One cache line */
+#define BLOOM_BLOCK_COUNTERS (BLOOM_BLOCK_BYTES * 2)
+#define BLOOM_KEYS_PER_BLOCK 16 /* 8 counters per key */
+#define BLOOM_PROBES 5 /* Counters per key, 7 bits of the hash each */
+#define BLOOM_COUNTER_MAX 15
+
+struct BloomBlock
+{
+	uint8_t counters[BLOOM_BLOCK_BYTES]; /* Two per byte, the low nibble first */
+};
+
+struct BloomFilter
+{
+	struct BloomBlock *blocks;
+	size_t blockMask; /* Block count is a power of two */
+	size_t capacity;
+	size_t count;
+};
+
+// Counters
+static struct BloomBlock *_BlockForHash(struct BloomFilter *filter, uint64_t hash);
+static unsigned _CounterAt(struct BloomBlock *block, unsigned counter);
+static void _SetCounterAt(struct BloomBlock *block, unsigned counter, unsigned value);
+static unsigned _CounterForProbe(uint64_t hash, int probe);
+
+#pragma mark Creation
+struct BloomFilter *blm_Create(size_t capacity)
+{
+	size_t blockCount = 1;
+	while (blockCount * BLOOM_KEYS_PER_BLOCK < capacity)
+		blockCount *= 2;
+
+	struct BloomFilter *filter = calloc(1, sizeof(struct BloomFilter));
+	if (filter == NULL)
+		return NULL;
+
+	void *blocks = NULL;
+	if (posix_memalign(&blocks, BLOOM_BLOCK_BYTES, blockCount * sizeof(struct BloomBlock)) != 0)
+	{
+		free(filter);
+		return NULL;
+	}
+	memset(blocks, 0, blockCount * sizeof(struct BloomBlock));
+
+	filter->blocks = blocks;
+	filter->blockMask = blockCount - 1;
+	filter->capacity = capacity;
+	return filter;
+}
+
+void blm_Free(struct BloomFilter *filter)
+{
+	if (filter == NULL)
+		return;
+
+	free(filter->blocks);
+	free(filter);
+}
+
+#pragma mark Changing
+void blm_Add(struct BloomFilter *filter, uint64_t hash)
+{
+	if (filter == NULL)
+		return;
+
+	hash = util_MixHash(hash);
+	struct BloomBlock *block = _BlockForHash(filter, hash);
+	for (int probe = 0; probe < BLOOM_PROBES; ++probe)
+	{
+		unsigned counter = _CounterForProbe(hash, probe);
+		unsigned value = _CounterAt(block, counter);
+		if (value < BLOOM_COUNTER_MAX)
+			_SetCounterAt(block, counter, value + 1);
+	}
+	filter->count++;
+}
+
+void blm_Remove(struct BloomFilter *filter, uint64_t hash)
+{
+	if (filter == NULL)
+		return;
+
+	hash = util_MixHash(hash);
+	struct BloomBlock *block = _BlockForHash(filter, hash);
+	for (int probe = 0; probe < BLOOM_PROBES; ++probe)
+	{
+		/* A saturated counter lost track of how many keys it counts */
+		unsigned counter = _CounterForProbe(hash, probe);
+		unsigned value = _CounterAt(block, counter);
+		if (value != 0 && value < BLOOM_COUNTER_MAX)
+			_SetCounterAt(block, counter, value - 1);
+	}
+	if (filter->count != 0)
+		filter->count--;
+}
+
+void blm_RemoveAll(struct BloomFilter *filter)
+{
+	if (filter == NULL)
+		return;
+
+	memset(filter->blocks, 0, (filter->blockMask + 1) * sizeof(struct BloomBlock));
+	filter->count = 0;
+}
+
+#pragma mark Searching
+int blm_MayContain(struct BloomFilter *filter, uint64_t hash)
+{
+	if (filter == NULL)
+		return 1;
+
+	hash = util_MixHash(hash);
+	struct BloomBlock *block = _BlockForHash(filter, hash);
+	for (int probe = 0; probe < BLOOM_PROBES; ++probe)
+	{
+		if (_CounterAt(block, _CounterForProbe(hash, probe)) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+#pragma mark Counters
+static inline struct BloomBlock *_BlockForHash(struct BloomFilter *filter, uint64_t hash)
+{
+	return &filter->blocks[hash & filter->blockMask];
+}
+
+static inline unsigned _CounterAt(struct BloomBlock *block, unsigned counter)
+{
+	return (block->counters[counter / 2] >> ((counter % 2) * 4)) & 0xF;
+}
+
+static inline void _SetCounterAt(struct BloomBlock *block, unsigned counter, unsigned value)
+{
+	unsigned shift = (counter % 2) * 4;
+	uint8_t *byte = &block->counters[counter / 2];
+	*byte = (uint8_t) ((*byte & ~(0xF << shift)) | (value << shift));
+}
+
+static inline unsigned _CounterForProbe(uint64_t hash, int probe)
+{
+	/* The block takes the low bits, probes the high ones */
+	return (unsigned) (hash >> (64 - 7 * (probe + 1))) & (BLOOM_BLOCK_COUNTERS - 1);
+}
+
+#pragma mark Stuff
+size_t blm_Count(struct BloomFilter *filter)
+{
+	if (filter == NULL)
+		return 0;
+	return filter->count;
+}
+
+size_t blm_Capacity(struct BloomFilter *filter)
+{
+	if (filter == NULL)
+		return 0;
+	return filter->capacity;
+}
+
+size_t blm_BytesUsed(struct BloomFilter *filter)
+{
+	if (filter == NULL)
+		return 0;
+	return sizeof(struct BloomFilter) + (filter->blockMask + 1) * sizeof(struct BloomBlock);
+}
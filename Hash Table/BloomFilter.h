@@ -0,0 +1,26 @@
+#ifndef BloomFilter_h
+#define BloomFilter_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Counting Bloom filter split into blocks of one cache line: all counters
+ * of a key are in the one block its hash picks, so a check costs a single
+ * cache miss. Counters are 4 bits wide, which makes removal possible; one
+ * that reaches 15 stays there, costing false positives but never a false
+ * negative. The caller hashes the keys, with a 64-bit hash. */
+struct BloomFilter;
+
+struct BloomFilter *blm_Create(size_t capacity); /* Expected number of keys, ~3% false positives at it */
+
+void blm_Add(struct BloomFilter *filter, uint64_t hash);
+void blm_Remove(struct BloomFilter *filter, uint64_t hash); /* Only of hashes added before */
+int blm_MayContain(struct BloomFilter *filter, uint64_t hash); /* 0 - certainly never added */
+void blm_RemoveAll(struct BloomFilter *filter);
+
+size_t blm_Count(struct BloomFilter *filter);
+size_t blm_Capacity(struct BloomFilter *filter);
+size_t blm_BytesUsed(struct BloomFilter *filter);
+void blm_Free(struct BloomFilter *filter);
+
+#endif
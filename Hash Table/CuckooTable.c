@@ -0,0 +1,662 @@
+#import <stdlib.h>
+#import <string.h>
+#import <assert.h>
+#import "CuckooTable.h"
+#include "Utilities.h"
+
+#pragma mark Private Header
+#define CUCKOO_WAYS 4
+#define CUCKOO_STASH_SIZE 8
+#define CUCKOO_MIN_BUCKETS 2
+#define CUCKOO_CACHE_LINE 64
+/* Breadth-first search for a free slot gives up after visiting that many buckets */
+#define CUCKOO_MAX_SEARCH 256
+/* Buckets are allocated and shared between clones in chunks of that many (4 KB) */
+#define CUCKOO_CHUNK_BUCKETS 64
+
+struct CuckooBucket
+{
+	uint64_t hashes[CUCKOO_WAYS];
+	void *items[CUCKOO_WAYS]; /* NULL - free way */
+};
+
+/* A chunk is a cache line aligned array of buckets followed by its
+ * reference count. A chunk referenced by several clones is never written
+ * to, the writer copies it first. Every chunk holds a reference to each
+ * of its items, so copying a chunk retains them. */
+struct CuckooTable
+{
+	struct CuckooBucket **chunks;
+	size_t chunkCount;
+	unsigned chunkShift; /* Buckets per chunk is a power of two too */
+	size_t bucketMask; /* Bucket count is a power of two */
+	size_t count;
+
+	uint64_t stashHashes[CUCKOO_STASH_SIZE];
+	void *stash[CUCKOO_STASH_SIZE]; /* With holes, so indices of the rest stay put */
+	size_t stashCount;
+
+	unsigned long version;
+
+	cuck_ItemFunction retainItem;
+	cuck_ItemFunction releaseItem;
+	void *itemContext;
+};
+
+struct CuckooSearchNode
+{
+	size_t bucket;
+	int parent; /* -1 - one of the two starting buckets */
+	int way; /* The way of the parent bucket whose item would come here */
+};
+
+// Chunks
+static int _AllocateStorage(struct CuckooTable *table, size_t bucketCount);
+static struct CuckooBucket *_AllocateChunk(size_t bucketsPerChunk);
+static unsigned long *_ChunkReferences(struct CuckooTable *table, struct CuckooBucket *chunk);
+static void _ReleaseChunk(struct CuckooTable *table, struct CuckooBucket *chunk);
+static void _DiscardStorage(struct CuckooTable *table);
+static struct CuckooBucket *_Bucket(struct CuckooTable *table, size_t bucket);
+static struct CuckooBucket *_WritableBucket(struct CuckooTable *table, size_t bucket);
+static void _RetainItem(struct CuckooTable *table, void *item);
+static void _ReleaseItem(struct CuckooTable *table, void *item);
+// Buckets
+static size_t _FirstBucket(struct CuckooTable *table, uint64_t hash);
+static size_t _SecondBucket(struct CuckooTable *table, uint64_t hash);
+static size_t _OtherBucket(struct CuckooTable *table, size_t bucket, uint64_t hash);
+// Adding
+static long _Insert(struct CuckooTable *table, uint64_t hash, void *item);
+static long _InsertIntoFreeWay(struct CuckooTable *table, size_t bucket, uint64_t hash, void *item);
+static long _InsertByDisplacement(struct CuckooTable *table, uint64_t hash, void *item);
+static int _MoveAlongPath(struct CuckooTable *table, struct CuckooSearchNode *nodes, int node, int freeWay);
+static long _InsertIntoStash(struct CuckooTable *table, uint64_t hash, void *item);
+// Growing
+static int _RebuildWithBucketCount(struct CuckooTable *table, size_t bucketCount);
+// Scanning
+static size_t _NextScanCursor(size_t cursor, size_t mask);
+
+#pragma mark Creation
+struct CuckooTable *cuck_Create(size_t capacity)
+{
+	size_t bucketCount = CUCKOO_MIN_BUCKETS;
+	while (bucketCount * CUCKOO_WAYS < capacity)
+		bucketCount *= 2;
+
+	struct CuckooTable *table = calloc(1, sizeof(struct CuckooTable));
+	if (table == NULL)
+		return NULL;
+
+	if (_AllocateStorage(table, bucketCount) == 0)
+	{
+		free(table);
+		return NULL;
+	}
+
+	return table;
+}
+
+void cuck_SetItemFunctions(struct CuckooTable *table, cuck_ItemFunction retain, cuck_ItemFunction release, void *context)
+{
+	if (table == NULL)
+		return;
+
+	table->retainItem = retain;
+	table->releaseItem = release;
+	table->itemContext = context;
+}
+
+struct CuckooTable *cuck_Clone(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return NULL;
+
+	struct CuckooTable *clone = malloc(sizeof(struct CuckooTable));
+	if (clone == NULL)
+		return NULL;
+	*clone = *table;
+
+	clone->chunks = malloc(table->chunkCount * sizeof(struct CuckooBucket *));
+	if (clone->chunks == NULL)
+	{
+		free(clone);
+		return NULL;
+	}
+	memcpy(clone->chunks, table->chunks, table->chunkCount * sizeof(struct CuckooBucket *));
+
+	for (size_t i = 0; i < table->chunkCount; ++i)
+		__atomic_add_fetch(_ChunkReferences(table, table->chunks[i]), 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < CUCKOO_STASH_SIZE; ++i)
+	{
+		if (clone->stash[i] != NULL)
+			_RetainItem(clone, clone->stash[i]);
+	}
+
+	return clone;
+}
+
+void cuck_Free(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return;
+
+	for (size_t i = 0; i < table->chunkCount; ++i)
+		_ReleaseChunk(table, table->chunks[i]);
+	for (int i = 0; i < CUCKOO_STASH_SIZE; ++i)
+	{
+		if (table->stash[i] != NULL)
+			_ReleaseItem(table, table->stash[i]);
+	}
+	free(table->chunks);
+	free(table);
+}
+
+#pragma mark Chunks
+static int _AllocateStorage(struct CuckooTable *table, size_t bucketCount)
+{
+	size_t bucketsPerChunk = bucketCount < CUCKOO_CHUNK_BUCKETS ? bucketCount : CUCKOO_CHUNK_BUCKETS;
+	unsigned chunkShift = 0;
+	while (((size_t) 1 << chunkShift) < bucketsPerChunk)
+		chunkShift++;
+
+	table->chunkCount = bucketCount >> chunkShift;
+	table->chunkShift = chunkShift;
+	table->bucketMask = bucketCount - 1;
+	table->chunks = calloc(table->chunkCount, sizeof(struct CuckooBucket *));
+	if (table->chunks == NULL)
+		return 0;
+
+	for (size_t i = 0; i < table->chunkCount; ++i)
+	{
+		table->chunks[i] = _AllocateChunk(bucketsPerChunk);
+		if (table->chunks[i] == NULL)
+		{
+			_DiscardStorage(table);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static struct CuckooBucket *_AllocateChunk(size_t bucketsPerChunk)
+{
+	size_t bucketBytes = bucketsPerChunk * sizeof(struct CuckooBucket);
+	void *chunk = NULL;
+	if (posix_memalign(&chunk, CUCKOO_CACHE_LINE, bucketBytes + sizeof(unsigned long)) != 0)
+		return NULL;
+
+	memset(chunk, 0, bucketBytes);
+	*(unsigned long *) ((char *) chunk + bucketBytes) = 1;
+	return chunk;
+}
+
+static unsigned long *_ChunkReferences(struct CuckooTable *table, struct CuckooBucket *chunk)
+{
+	return (unsigned long *) (chunk + ((size_t) 1 << table->chunkShift));
+}
+
+static void _ReleaseChunk(struct CuckooTable *table, struct CuckooBucket *chunk)
+{
+	if (__atomic_sub_fetch(_ChunkReferences(table, chunk), 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	size_t bucketsPerChunk = (size_t) 1 << table->chunkShift;
+	for (size_t i = 0; i < bucketsPerChunk; ++i)
+	{
+		for (int way = 0; way < CUCKOO_WAYS; ++way)
+		{
+			if (chunk[i].items[way] != NULL)
+				_ReleaseItem(table, chunk[i].items[way]);
+		}
+	}
+	free(chunk);
+}
+
+static void _DiscardStorage(struct CuckooTable *table)
+{
+	/* Only for private chunks whose items were never retained */
+	for (size_t i = 0; i < table->chunkCount; ++i)
+		free(table->chunks[i]);
+	free(table->chunks);
+	table->chunks = NULL;
+}
+
+static inline struct CuckooBucket *_Bucket(struct CuckooTable *table, size_t bucket)
+{
+	return &table->chunks[bucket >> table->chunkShift][bucket & (((size_t) 1 << table->chunkShift) - 1)];
+}
+
+static struct CuckooBucket *_WritableBucket(struct CuckooTable *table, size_t bucket)
+{
+	size_t chunkIndex = bucket >> table->chunkShift;
+	struct CuckooBucket *chunk = table->chunks[chunkIndex];
+	if (__atomic_load_n(_ChunkReferences(table, chunk), __ATOMIC_ACQUIRE) != 1)
+	{
+		size_t bucketsPerChunk = (size_t) 1 << table->chunkShift;
+		struct CuckooBucket *copy = _AllocateChunk(bucketsPerChunk);
+		if (copy == NULL)
+			return NULL;
+
+		memcpy(copy, chunk, bucketsPerChunk * sizeof(struct CuckooBucket));
+		for (size_t i = 0; i < bucketsPerChunk; ++i)
+		{
+			for (int way = 0; way < CUCKOO_WAYS; ++way)
+			{
+				if (copy[i].items[way] != NULL)
+					_RetainItem(table, copy[i].items[way]);
+			}
+		}
+		_ReleaseChunk(table, chunk);
+		table->chunks[chunkIndex] = copy;
+		chunk = copy;
+	}
+	return &chunk[bucket & (((size_t) 1 << table->chunkShift) - 1)];
+}
+
+static void _RetainItem(struct CuckooTable *table, void *item)
+{
+	if (table->retainItem != NULL)
+		table->retainItem(item, table->itemContext);
+}
+
+static void _ReleaseItem(struct CuckooTable *table, void *item)
+{
+	if (table->releaseItem != NULL)
+		table->releaseItem(item, table->itemContext);
+}
+
+#pragma mark Buckets
+static size_t _FirstBucket(struct CuckooTable *table, uint64_t hash)
+{
+	return (size_t) hash & table->bucketMask;
+}
+
+static size_t _SecondBucket(struct CuckooTable *table, uint64_t hash)
+{
+	/* The upper half, scrambled, so keys sharing the first bucket spread out */
+	size_t bucket = (size_t) (((hash >> 32) * 0x9E3779B97F4A7C15ull) >> 17) & table->bucketMask;
+	if (bucket == _FirstBucket(table, hash))
+		bucket ^= 1;
+	return bucket;
+}
+
+static size_t _OtherBucket(struct CuckooTable *table, size_t bucket, uint64_t hash)
+{
+	size_t firstBucket = _FirstBucket(table, hash);
+	return (bucket == firstBucket) ? _SecondBucket(table, hash) : firstBucket;
+}
+
+#pragma mark Searching
+long cuck_FindIndex(struct CuckooTable *table, uint64_t hash, cuck_MatchFunction match, void *context)
+{
+	if (table == NULL)
+		return -1;
+
+	size_t candidates[2] = {_FirstBucket(table, hash), _SecondBucket(table, hash)};
+	for (int i = 0; i < 2; ++i)
+	{
+		struct CuckooBucket *bucket = _Bucket(table, candidates[i]);
+		for (int way = 0; way < CUCKOO_WAYS; ++way)
+		{
+			if (bucket->items[way] == NULL || bucket->hashes[way] != hash)
+				continue;
+			if (match(bucket->items[way], context))
+				return (long) (candidates[i] * CUCKOO_WAYS + way);
+		}
+	}
+
+	if (table->stashCount == 0)
+		return -1;
+
+	for (int i = 0; i < CUCKOO_STASH_SIZE; ++i)
+	{
+		if (table->stash[i] == NULL || table->stashHashes[i] != hash)
+			continue;
+		if (match(table->stash[i], context))
+			return (long) ((table->bucketMask + 1) * CUCKOO_WAYS + i);
+	}
+
+	return -1;
+}
+
+void *cuck_ItemAtIndex(struct CuckooTable *table, long index)
+{
+	size_t bucketSlots = (table->bucketMask + 1) * CUCKOO_WAYS;
+	if ((size_t) index < bucketSlots)
+		return _Bucket(table, index / CUCKOO_WAYS)->items[index % CUCKOO_WAYS];
+
+	return table->stash[(size_t) index - bucketSlots];
+}
+
+void **cuck_WritableSlotAtIndex(struct CuckooTable *table, long index)
+{
+	if (table == NULL || index < 0 || (size_t) index >= cuck_SlotCount(table))
+		return NULL;
+
+	size_t bucketSlots = (table->bucketMask + 1) * CUCKOO_WAYS;
+	if ((size_t) index >= bucketSlots)
+		return &table->stash[(size_t) index - bucketSlots];
+
+	struct CuckooBucket *bucket = _WritableBucket(table, index / CUCKOO_WAYS);
+	if (bucket == NULL)
+		return NULL;
+	return &bucket->items[index % CUCKOO_WAYS];
+}
+
+#pragma mark Adding
+long cuck_Insert(struct CuckooTable *table, uint64_t hash, void *item)
+{
+	if (table == NULL || item == NULL)
+		return -1;
+
+	return _Insert(table, hash, item);
+}
+
+static long _Insert(struct CuckooTable *table, uint64_t hash, void *item)
+{
+	long index = _InsertIntoFreeWay(table, _FirstBucket(table, hash), hash, item);
+	if (index != -1)
+		return index;
+
+	index = _InsertIntoFreeWay(table, _SecondBucket(table, hash), hash, item);
+	if (index != -1)
+		return index;
+
+	index = _InsertByDisplacement(table, hash, item);
+	if (index != -1)
+		return index;
+
+	return _InsertIntoStash(table, hash, item);
+}
+
+static long _InsertIntoFreeWay(struct CuckooTable *table, size_t bucketIndex, uint64_t hash, void *item)
+{
+	struct CuckooBucket *bucket = _Bucket(table, bucketIndex);
+	for (int way = 0; way < CUCKOO_WAYS; ++way)
+	{
+		if (bucket->items[way] != NULL)
+			continue;
+
+		bucket = _WritableBucket(table, bucketIndex); /* Only once there is room */
+		if (bucket == NULL)
+			return -1;
+		bucket->hashes[way] = hash;
+		bucket->items[way] = item;
+		table->count++;
+		return (long) (bucketIndex * CUCKOO_WAYS + way);
+	}
+	return -1;
+}
+
+static long _InsertByDisplacement(struct CuckooTable *table, uint64_t hash, void *item)
+{
+	/* Breadth first, so the chain of moves found is the shortest one */
+	struct CuckooSearchNode nodes[CUCKOO_MAX_SEARCH];
+	int head = 0;
+	int tail = 0;
+	nodes[tail++] = (struct CuckooSearchNode) {_FirstBucket(table, hash), -1, -1};
+	nodes[tail++] = (struct CuckooSearchNode) {_SecondBucket(table, hash), -1, -1};
+
+	for (; head < tail; ++head)
+	{
+		struct CuckooBucket *bucket = _Bucket(table, nodes[head].bucket);
+		for (int way = 0; way < CUCKOO_WAYS; ++way)
+		{
+			if (bucket->items[way] == NULL)
+			{
+				table->version++;
+				if (_MoveAlongPath(table, nodes, head, way) == 0)
+					return -1;
+
+				int root = head;
+				while (nodes[root].parent != -1)
+					root = nodes[root].parent;
+				return _InsertIntoFreeWay(table, nodes[root].bucket, hash, item);
+			}
+		}
+
+		for (int way = 0; way < CUCKOO_WAYS && tail < CUCKOO_MAX_SEARCH; ++way)
+		{
+			size_t otherBucket = _OtherBucket(table, nodes[head].bucket, bucket->hashes[way]);
+			nodes[tail++] = (struct CuckooSearchNode) {otherBucket, head, way};
+		}
+	}
+
+	return -1;
+}
+
+static int _MoveAlongPath(struct CuckooTable *table, struct CuckooSearchNode *nodes, int node, int freeWay)
+{
+	/* From the free slot back to the start, every move fills the hole the
+	 * previous one left. Each move is checked, a bucket may be on the path
+	 * twice; stopping halfway still leaves every item in one of its buckets. */
+	while (nodes[node].parent != -1)
+	{
+		struct CuckooSearchNode *parent = &nodes[nodes[node].parent];
+		/* Copying the chunk of from can't move to, it's private by then */
+		struct CuckooBucket *to = _WritableBucket(table, nodes[node].bucket);
+		struct CuckooBucket *from = _WritableBucket(table, parent->bucket);
+		if (to == NULL || from == NULL)
+			return 0;
+		int way = nodes[node].way;
+
+		if (from->items[way] == NULL || to->items[freeWay] != NULL)
+			return 0;
+		if (_OtherBucket(table, parent->bucket, from->hashes[way]) != nodes[node].bucket)
+			return 0;
+
+		to->hashes[freeWay] = from->hashes[way];
+		to->items[freeWay] = from->items[way];
+		from->items[way] = NULL;
+
+		freeWay = way;
+		node = nodes[node].parent;
+	}
+	return 1;
+}
+
+static long _InsertIntoStash(struct CuckooTable *table, uint64_t hash, void *item)
+{
+	for (int i = 0; i < CUCKOO_STASH_SIZE; ++i)
+	{
+		if (table->stash[i] != NULL)
+			continue;
+
+		table->stashHashes[i] = hash;
+		table->stash[i] = item;
+		table->stashCount++;
+		table->count++;
+		return (long) ((table->bucketMask + 1) * CUCKOO_WAYS + i);
+	}
+	return -1;
+}
+
+#pragma mark Removing
+int cuck_RemoveAtIndex(struct CuckooTable *table, long index)
+{
+	void **item = cuck_WritableSlotAtIndex(table, index);
+	if (item == NULL)
+		return 0;
+	if (*item == NULL)
+		return 1;
+
+	if ((size_t) index >= (table->bucketMask + 1) * CUCKOO_WAYS)
+		table->stashCount--;
+	*item = NULL;
+	table->count--;
+	return 1;
+}
+
+int cuck_RemoveAll(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return 0;
+
+	size_t bucketsPerChunk = (size_t) 1 << table->chunkShift;
+	for (size_t i = 0; i < table->chunkCount; ++i)
+	{
+		/* Shared chunks are swapped for empty ones instead of being copied */
+		struct CuckooBucket *chunk = _AllocateChunk(bucketsPerChunk);
+		if (chunk == NULL)
+			return 0;
+
+		struct CuckooBucket *oldChunk = table->chunks[i];
+		for (size_t bucket = 0; bucket < bucketsPerChunk; ++bucket)
+		{
+			for (int way = 0; way < CUCKOO_WAYS; ++way)
+				table->count -= (oldChunk[bucket].items[way] != NULL);
+		}
+		table->chunks[i] = chunk;
+		_ReleaseChunk(table, oldChunk);
+	}
+	for (int i = 0; i < CUCKOO_STASH_SIZE; ++i)
+	{
+		if (table->stash[i] == NULL)
+			continue;
+		_ReleaseItem(table, table->stash[i]);
+		table->stash[i] = NULL;
+		table->count--;
+	}
+	table->stashCount = 0;
+	table->version++;
+
+	assert(table->count == 0);
+	return 1;
+}
+
+#pragma mark Growing
+int cuck_Grow(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return 0;
+
+	return _RebuildWithBucketCount(table, (table->bucketMask + 1) * 2);
+}
+
+static int _RebuildWithBucketCount(struct CuckooTable *table, size_t bucketCount)
+{
+	size_t oldBucketCount = table->bucketMask + 1;
+	struct CuckooTable newTable = {0};
+
+	/* Doubling once is all but certain to be enough, but keep going if not */
+	for (; bucketCount > oldBucketCount && bucketCount <= oldBucketCount * 64; bucketCount *= 2)
+	{
+		memset(&newTable, 0, sizeof(newTable));
+		if (_AllocateStorage(&newTable, bucketCount) == 0)
+			return 0;
+
+		int succeed = 1;
+		for (size_t i = 0; i < oldBucketCount * CUCKOO_WAYS && succeed; ++i)
+		{
+			struct CuckooBucket *bucket = _Bucket(table, i / CUCKOO_WAYS);
+			if (bucket->items[i % CUCKOO_WAYS] != NULL)
+				succeed = (_Insert(&newTable, bucket->hashes[i % CUCKOO_WAYS], bucket->items[i % CUCKOO_WAYS]) != -1);
+		}
+		for (int i = 0; i < CUCKOO_STASH_SIZE && succeed; ++i)
+		{
+			if (table->stash[i] != NULL)
+				succeed = (_Insert(&newTable, table->stashHashes[i], table->stash[i]) != -1);
+		}
+
+		if (succeed)
+			break;
+		_DiscardStorage(&newTable);
+	}
+	if (newTable.chunks == NULL)
+		return 0;
+	assert(newTable.count == table->count);
+
+	/* The new chunks hold their own references, the old ones (maybe
+	 * still shared with clones) drop theirs; the stash hands its over */
+	for (size_t i = 0; i < oldBucketCount * CUCKOO_WAYS; ++i)
+	{
+		void *item = _Bucket(table, i / CUCKOO_WAYS)->items[i % CUCKOO_WAYS];
+		if (item != NULL)
+			_RetainItem(table, item);
+	}
+	for (size_t i = 0; i < table->chunkCount; ++i)
+		_ReleaseChunk(table, table->chunks[i]);
+	free(table->chunks);
+
+	newTable.version = table->version + 1;
+	newTable.retainItem = table->retainItem;
+	newTable.releaseItem = table->releaseItem;
+	newTable.itemContext = table->itemContext;
+	*table = newTable;
+	return 1;
+}
+
+#pragma mark Scanning
+size_t cuck_Scan(struct CuckooTable *table, size_t cursor, size_t count, cuck_ItemFunction visit, void *context)
+{
+	if (table == NULL)
+		return 0;
+	if (visit == NULL)
+		return 0;
+
+	if ((cursor & table->bucketMask) == 0)
+	{
+		for (int i = 0; i < CUCKOO_STASH_SIZE; ++i)
+		{
+			if (table->stash[i] != NULL)
+				visit(table->stash[i], context);
+		}
+	}
+
+	do
+	{
+		struct CuckooBucket *bucket = _Bucket(table, cursor & table->bucketMask);
+		for (int way = 0; way < CUCKOO_WAYS; ++way)
+		{
+			if (bucket->items[way] != NULL)
+				visit(bucket->items[way], context);
+		}
+		cursor = _NextScanCursor(cursor, table->bucketMask);
+	} while (cursor != 0 && count-- > 1);
+
+	return cursor;
+}
+
+static size_t _NextScanCursor(size_t cursor, size_t mask)
+{
+	/* Adds one to the reversed bucket index, so the high bits change
+	 * fastest and a bucket split by growing is never skipped */
+	uint64_t reversed = util_ReverseBits((uint64_t) cursor | ~(uint64_t) mask);
+	return (size_t) util_ReverseBits(reversed + 1);
+}
+
+#pragma mark Stuff
+size_t cuck_SlotCount(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return 0;
+	return (table->bucketMask + 1) * CUCKOO_WAYS + CUCKOO_STASH_SIZE;
+}
+
+size_t cuck_Count(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return 0;
+	return table->count;
+}
+
+size_t cuck_StashCount(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return 0;
+	return table->stashCount;
+}
+
+size_t cuck_BytesUsed(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return 0;
+	size_t chunkBytes = ((size_t) 1 << table->chunkShift) * sizeof(struct CuckooBucket) + sizeof(unsigned long);
+	return sizeof(struct CuckooTable) + table->chunkCount * (sizeof(struct CuckooBucket *) + chunkBytes);
+}
+
+unsigned long cuck_Version(struct CuckooTable *table)
+{
+	if (table == NULL)
+		return 0;
+	return table->version;
+}
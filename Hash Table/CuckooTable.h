@@ -0,0 +1,56 @@
+#ifndef CuckooTable_h
+#define CuckooTable_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Bucketized cuckoo hashing: every item may live in one of two 4-way buckets
+ * (each exactly one cache line) or in a small stash. Lookups never look
+ * anywhere else. The table stores items and their 64-bit hashes, the caller
+ * owns both and tells items apart with a match function. */
+struct CuckooTable;
+
+typedef int (*cuck_MatchFunction)(void *item, void *context);
+typedef void (*cuck_ItemFunction)(void *item, void *context);
+
+struct CuckooTable *cuck_Create(size_t capacity);
+/* Without these the table never touches the items. With them, the table
+ * holds one reference per item: cuck_Insert takes over the caller's one,
+ * cuck_RemoveAtIndex hands it back, and cloned storage retains its items. */
+void cuck_SetItemFunctions(struct CuckooTable *table, cuck_ItemFunction retain, cuck_ItemFunction release, void *context);
+/* Shares the buckets with the original in 4 KB chunks, copy-on-write.
+ * Clones may be used and freed from different threads. */
+struct CuckooTable *cuck_Clone(struct CuckooTable *table);
+
+/* Indices are bucket slots first, then the stash, all below cuck_SlotCount.
+ * An insert may move other items around, so indices are only good until the
+ * next insert; cuck_Version changes whenever that happens. */
+long cuck_FindIndex(struct CuckooTable *table, uint64_t hash, cuck_MatchFunction match, void *context);
+/* The item must not be in the table yet. -1 - no room, grow and try again */
+long cuck_Insert(struct CuckooTable *table, uint64_t hash, void *item);
+void *cuck_ItemAtIndex(struct CuckooTable *table, long index);
+/* The slot in storage of this table alone, so it can be overwritten with
+ * an item of the same hash. NULL - out of memory copying a shared chunk */
+void **cuck_WritableSlotAtIndex(struct CuckooTable *table, long index);
+/* 0 - out of memory copying a shared chunk, nothing is removed then */
+int cuck_RemoveAtIndex(struct CuckooTable *table, long index);
+int cuck_RemoveAll(struct CuckooTable *table);
+/* Doubles the buckets, 0 - out of memory, the table is left as it was */
+int cuck_Grow(struct CuckooTable *table);
+
+/* Calls visit for the items of count buckets (at least one) in the
+ * reverse-binary order of their indices, the stash along with bucket 0.
+ * Start with cursor 0 and go on with the returned one, until it is 0.
+ * Inserts move items to their other bucket, which may have been visited
+ * already - only items left alone by inserts are sure to be visited. */
+size_t cuck_Scan(struct CuckooTable *table, size_t cursor, size_t count, cuck_ItemFunction visit, void *context);
+
+size_t cuck_SlotCount(struct CuckooTable *table);
+size_t cuck_Count(struct CuckooTable *table);
+size_t cuck_StashCount(struct CuckooTable *table);
+size_t cuck_BytesUsed(struct CuckooTable *table);
+unsigned long cuck_Version(struct CuckooTable *table);
+
+void cuck_Free(struct CuckooTable *table); /* Releases the items, if there is a release function */
+
+#endif
@@ -0,0 +1,749 @@
+#define _GNU_SOURCE /* mremap */
+#import <stdlib.h>
+#import <string.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import <pthread.h>
+#import "FileTable.h"
+#include "Utilities.h"
+
+#pragma mark Private Header
+#define FTBL_MAGIC "HTBLFILE"
+#define FTBL_VERSION 1
+#define FTBL_HEADER_SIZE 4096 /* The header has a page of its own */
+#define FTBL_MIN_SLOTS 128 /* One page of them */
+#define FTBL_PAGE_SIZE 4096 /* Heap growth is rounded up to it */
+
+struct FileTableHeader
+{
+	char magic[8];
+	uint64_t version;
+	uint64_t slotCount; /* A power of two, at most 3/4 of them used */
+	uint64_t count;
+	uint64_t heapCapacity; /* Bytes between the header and the slots */
+	uint64_t heapUsed; /* Records are appended right after the header */
+	uint64_t deadBytes; /* Records of removed keys, until the heap is compacted */
+	pthread_rwlock_t lock; /* Shared tables only, process-shared */
+};
+
+struct FileTableSlot
+{
+	uint64_t hash;
+	uint64_t keyOffset; /* Of the record, from the start of the file, 0 - empty */
+	uint64_t keyLength;
+	uint64_t value;
+};
+
+struct FileTableRecord
+{
+	uint64_t hash; /* To find the slot again when the record moves */
+	uint32_t keyLength;
+	uint32_t live;
+	char key[]; /* Zero terminated, padded to 8 bytes */
+};
+
+struct FileTableScanEntry /* A key copied out of a shared table, see ftbl_Scan */
+{
+	uint64_t value;
+	uint64_t size; /* Of the entry, padded to 8 bytes */
+	char key[];
+};
+
+struct FileTableScanBatch
+{
+	char *bytes;
+	size_t used;
+	size_t capacity;
+};
+
+struct FileTable
+{
+	int fd;
+	char *base;
+	size_t mappedSize;
+	int isShared; /* Every call takes the lock in the header */
+};
+
+// Mapping
+static int _Format(struct FileTable *table, size_t capacity);
+static int _Map(struct FileTable *table, size_t size);
+static int _Remap(struct FileTable *table, size_t size);
+static int _MapAgain(struct FileTable *table, size_t size);
+static int _IsValid(struct FileTable *table);
+static void _Discard(struct FileTable *table);
+// Locking
+static int _LockForReading(struct FileTable *table);
+static int _LockForWriting(struct FileTable *table);
+static void _Unlock(struct FileTable *table);
+static int _FollowSize(struct FileTable *table);
+// Layout
+static struct FileTableHeader *_Header(struct FileTable *table);
+static struct FileTableSlot *_Slots(struct FileTable *table);
+static struct FileTableRecord *_RecordAt(struct FileTable *table, uint64_t offset);
+static size_t _RecordSize(size_t keyLength);
+static uint64_t _HashKey(char *key, size_t keyLength);
+// Adding
+static int _StoreValueForKey(struct FileTable *table, uint64_t value, char *key, size_t keyLength);
+// Slots
+static long _FindSlotIndex(struct FileTable *table, char *key, size_t keyLength, uint64_t hash);
+static struct FileTableSlot *_EmptySlotForHash(struct FileTableSlot *slots, size_t mask, uint64_t hash);
+static void _RemoveSlotAtIndex(struct FileTable *table, size_t index);
+static int _GrowSlots(struct FileTable *table);
+// Heap
+static int _ReserveHeap(struct FileTable *table, size_t bytes);
+static void _CompactHeap(struct FileTable *table);
+static struct FileTableSlot *_SlotForRecord(struct FileTable *table, uint64_t offset);
+// Scanning
+static size_t _ScanShared(struct FileTable *table, size_t cursor, size_t count, ftbl_ScanFunction scan, void *context);
+static int _CopyHomeSlot(struct FileTable *table, size_t home, struct FileTableScanBatch *batch);
+static size_t _NextScanCursor(size_t cursor, size_t mask);
+
+#pragma mark Creation
+struct FileTable *ftbl_Open(const char *path, size_t capacity)
+{
+	if (path == NULL)
+		return NULL;
+
+	struct FileTable *table = calloc(1, sizeof(struct FileTable));
+	if (table == NULL)
+		return NULL;
+
+	table->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (table->fd == -1)
+	{
+		free(table);
+		return NULL;
+	}
+
+	struct stat status;
+	int opened = 0;
+	if (fstat(table->fd, &status) == 0)
+	{
+		if (status.st_size == 0)
+			opened = _Format(table, capacity);
+		else
+			opened = _Map(table, (size_t) status.st_size) && _IsValid(table);
+	}
+	if (!opened)
+	{
+		_Discard(table);
+		return NULL;
+	}
+	return table;
+}
+
+struct FileTable *ftbl_OpenShared(const char *name, size_t capacity, int create)
+{
+	if (name == NULL)
+		return NULL;
+
+	struct FileTable *table = calloc(1, sizeof(struct FileTable));
+	if (table == NULL)
+		return NULL;
+
+	/* Only the creator formats, so nobody attaches to half a table */
+	table->isShared = 1;
+	table->fd = shm_open(name, create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR, 0600);
+	if (table->fd == -1)
+	{
+		free(table);
+		return NULL;
+	}
+
+	struct stat status;
+	int opened = 0;
+	if (create)
+		opened = _Format(table, capacity);
+	else if (fstat(table->fd, &status) == 0)
+		opened = _Map(table, (size_t) status.st_size) && _IsValid(table);
+	if (!opened)
+	{
+		if (create)
+			shm_unlink(name);
+		_Discard(table);
+		return NULL;
+	}
+	return table;
+}
+
+int ftbl_UnlinkShared(const char *name)
+{
+	if (name == NULL)
+		return 0;
+	return shm_unlink(name) == 0;
+}
+
+void ftbl_Close(struct FileTable *table)
+{
+	if (table == NULL)
+		return;
+
+	_Discard(table);
+}
+
+int ftbl_Sync(struct FileTable *table)
+{
+	if (table == NULL)
+		return 0;
+	return msync(table->base, table->mappedSize, MS_SYNC) == 0;
+}
+
+#pragma mark Mapping
+static int _Format(struct FileTable *table, size_t capacity)
+{
+	size_t slotCount = FTBL_MIN_SLOTS;
+	while (slotCount * 3 / 4 < capacity)
+		slotCount *= 2;
+	size_t heapCapacity = (capacity * 32 + FTBL_PAGE_SIZE - 1) & ~(size_t) (FTBL_PAGE_SIZE - 1);
+	if (heapCapacity == 0)
+		heapCapacity = FTBL_PAGE_SIZE;
+
+	size_t size = FTBL_HEADER_SIZE + heapCapacity + slotCount * sizeof(struct FileTableSlot);
+	if (ftruncate(table->fd, (off_t) size) != 0)
+		return 0;
+	if (_Map(table, size) == 0)
+		return 0;
+
+	/* The file is all zeros: no records, every slot empty */
+	struct FileTableHeader *header = _Header(table);
+	header->version = FTBL_VERSION;
+	header->slotCount = slotCount;
+	header->heapCapacity = heapCapacity;
+	if (table->isShared)
+	{
+		pthread_rwlockattr_t attributes;
+		pthread_rwlockattr_init(&attributes);
+		int initialized = pthread_rwlockattr_setpshared(&attributes, PTHREAD_PROCESS_SHARED) == 0
+			&& pthread_rwlock_init(&header->lock, &attributes) == 0;
+		pthread_rwlockattr_destroy(&attributes);
+		if (!initialized)
+			return 0;
+	}
+
+	/* The magic goes last: a table attached before it is there is invalid */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(header->magic, FTBL_MAGIC, sizeof(header->magic));
+	return 1;
+}
+
+static int _Map(struct FileTable *table, size_t size)
+{
+	if (size < FTBL_HEADER_SIZE)
+		return 0;
+
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, table->fd, 0);
+	if (base == MAP_FAILED)
+		return 0;
+
+	table->base = base;
+	table->mappedSize = size;
+	return 1;
+}
+
+static int _Remap(struct FileTable *table, size_t size)
+{
+	if (ftruncate(table->fd, (off_t) size) != 0)
+		return 0;
+	return _MapAgain(table, size);
+}
+
+static int _MapAgain(struct FileTable *table, size_t size)
+{
+	/* The old mapping stays valid until the new one is there */
+#ifdef __linux__
+	void *base = mremap(table->base, table->mappedSize, size, MREMAP_MAYMOVE);
+	if (base == MAP_FAILED)
+		return 0;
+#else
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, table->fd, 0);
+	if (base == MAP_FAILED)
+		return 0;
+	munmap(table->base, table->mappedSize);
+#endif
+
+	table->base = base;
+	table->mappedSize = size;
+	return 1;
+}
+
+static int _IsValid(struct FileTable *table)
+{
+	struct FileTableHeader *header = _Header(table);
+	if (memcmp(header->magic, FTBL_MAGIC, sizeof(header->magic)) != 0)
+		return 0;
+	if (header->version != FTBL_VERSION)
+		return 0;
+	if (header->slotCount < FTBL_MIN_SLOTS || (header->slotCount & (header->slotCount - 1)) != 0)
+		return 0;
+	if (header->count * 4 > header->slotCount * 3 || header->heapUsed > header->heapCapacity)
+		return 0;
+
+	/* A failed remap may have left the file longer than it has to be */
+	size_t size = FTBL_HEADER_SIZE + header->heapCapacity + header->slotCount * sizeof(struct FileTableSlot);
+	return (header->heapCapacity < table->mappedSize && size <= table->mappedSize);
+}
+
+static void _Discard(struct FileTable *table)
+{
+	if (table->base != NULL)
+		munmap(table->base, table->mappedSize);
+	close(table->fd);
+	free(table);
+}
+
+#pragma mark Locking
+static int _LockForReading(struct FileTable *table)
+{
+	if (!table->isShared)
+		return 1;
+	if (pthread_rwlock_rdlock(&_Header(table)->lock) != 0)
+		return 0;
+	if (_FollowSize(table) == 0)
+	{
+		_Unlock(table);
+		return 0;
+	}
+	return 1;
+}
+
+static int _LockForWriting(struct FileTable *table)
+{
+	if (!table->isShared)
+		return 1;
+	if (pthread_rwlock_wrlock(&_Header(table)->lock) != 0)
+		return 0;
+	if (_FollowSize(table) == 0)
+	{
+		_Unlock(table);
+		return 0;
+	}
+	return 1;
+}
+
+static void _Unlock(struct FileTable *table)
+{
+	if (table->isShared)
+		pthread_rwlock_unlock(&_Header(table)->lock);
+}
+
+static int _FollowSize(struct FileTable *table)
+{
+	/* Another process may have grown the table since this one last looked.
+	 * The header page is always mapped and nobody resizes while we hold
+	 * the lock, so the mapping can follow. */
+	struct FileTableHeader *header = _Header(table);
+	size_t size = FTBL_HEADER_SIZE + header->heapCapacity + header->slotCount * sizeof(struct FileTableSlot);
+	if (size <= table->mappedSize)
+		return 1;
+	return _MapAgain(table, size);
+}
+
+#pragma mark Layout
+static inline struct FileTableHeader *_Header(struct FileTable *table)
+{
+	return (struct FileTableHeader *) table->base;
+}
+
+static inline struct FileTableSlot *_Slots(struct FileTable *table)
+{
+	return (struct FileTableSlot *) (table->base + FTBL_HEADER_SIZE + _Header(table)->heapCapacity);
+}
+
+static inline struct FileTableRecord *_RecordAt(struct FileTable *table, uint64_t offset)
+{
+	return (struct FileTableRecord *) (table->base + offset);
+}
+
+static inline size_t _RecordSize(size_t keyLength)
+{
+	return (sizeof(struct FileTableRecord) + keyLength + 1 + 7) & ~(size_t) 7;
+}
+
+static uint64_t _HashKey(char *key, size_t keyLength)
+{
+	/* FNV-1a and the MurmurHash3 finalizer. Part of the file format,
+	 * changing it needs a new FTBL_VERSION. */
+	return util_MixHash(util_HashBytes(key, keyLength));
+}
+
+#pragma mark Adding
+int ftbl_SetValueForKey(struct FileTable *table, uint64_t value, char *key)
+{
+	if (table == NULL)
+		return 0;
+	if (key == NULL)
+		return 0;
+	size_t keyLength = strlen(key);
+	if (keyLength > UINT32_MAX)
+		return 0;
+	if (_LockForWriting(table) == 0)
+		return 0;
+
+	int stored = _StoreValueForKey(table, value, key, keyLength);
+	_Unlock(table);
+	return stored;
+}
+
+static int _StoreValueForKey(struct FileTable *table, uint64_t value, char *key, size_t keyLength)
+{
+	uint64_t hash = _HashKey(key, keyLength);
+	long index = _FindSlotIndex(table, key, keyLength, hash);
+	if (index != -1)
+	{
+		_Slots(table)[index].value = value;
+		return 1;
+	}
+
+	struct FileTableHeader *header = _Header(table);
+	if ((header->count + 1) * 4 > header->slotCount * 3 && _GrowSlots(table) == 0)
+		return 0;
+	size_t recordSize = _RecordSize(keyLength);
+	if (_ReserveHeap(table, recordSize) == 0)
+		return 0;
+
+	header = _Header(table); /* Remapping moves everything */
+	uint64_t offset = FTBL_HEADER_SIZE + header->heapUsed;
+	struct FileTableRecord *record = _RecordAt(table, offset);
+	record->hash = hash;
+	record->keyLength = (uint32_t) keyLength;
+	record->live = 1;
+	memcpy(record->key, key, keyLength + 1);
+	header->heapUsed += recordSize;
+
+	struct FileTableSlot *slot = _EmptySlotForHash(_Slots(table), header->slotCount - 1, hash);
+	slot->hash = hash;
+	slot->keyOffset = offset;
+	slot->keyLength = keyLength;
+	slot->value = value;
+	header->count++;
+	return 1;
+}
+
+#pragma mark Searching
+int ftbl_ValueForKey(struct FileTable *table, char *key, uint64_t *value)
+{
+	if (table == NULL)
+		return 0;
+	if (key == NULL)
+		return 0;
+
+	size_t keyLength = strlen(key);
+	if (_LockForReading(table) == 0)
+		return 0;
+	long index = _FindSlotIndex(table, key, keyLength, _HashKey(key, keyLength));
+	if (index != -1 && value != NULL)
+		*value = _Slots(table)[index].value;
+	_Unlock(table);
+	return index != -1;
+}
+
+#pragma mark Removing
+int ftbl_RemoveKey(struct FileTable *table, char *key)
+{
+	if (table == NULL)
+		return 0;
+	if (key == NULL)
+		return 0;
+
+	size_t keyLength = strlen(key);
+	if (_LockForWriting(table) == 0)
+		return 0;
+	long index = _FindSlotIndex(table, key, keyLength, _HashKey(key, keyLength));
+	if (index == -1)
+	{
+		_Unlock(table);
+		return 0;
+	}
+
+	struct FileTableHeader *header = _Header(table);
+	uint64_t offset = _Slots(table)[index].keyOffset;
+	size_t recordSize = _RecordSize(keyLength);
+	_RecordAt(table, offset)->live = 0;
+	if (offset + recordSize == FTBL_HEADER_SIZE + header->heapUsed)
+		header->heapUsed -= recordSize; /* The last record, reused right away */
+	else
+		header->deadBytes += recordSize;
+
+	_RemoveSlotAtIndex(table, (size_t) index);
+	header->count--;
+	_Unlock(table);
+	return 1;
+}
+
+void ftbl_RemoveAll(struct FileTable *table)
+{
+	if (table == NULL)
+		return;
+	if (_LockForWriting(table) == 0)
+		return;
+
+	struct FileTableHeader *header = _Header(table);
+	memset(_Slots(table), 0, header->slotCount * sizeof(struct FileTableSlot));
+	header->count = 0;
+	header->heapUsed = 0;
+	header->deadBytes = 0;
+	_Unlock(table);
+}
+
+#pragma mark Slots
+static long _FindSlotIndex(struct FileTable *table, char *key, size_t keyLength, uint64_t hash)
+{
+	/* Keys are only read on a full hash match */
+	struct FileTableSlot *slots = _Slots(table);
+	size_t mask = _Header(table)->slotCount - 1;
+	for (size_t i = hash & mask; slots[i].keyOffset != 0; i = (i + 1) & mask)
+	{
+		struct FileTableSlot *slot = &slots[i];
+		if (slot->hash == hash && slot->keyLength == keyLength && memcmp(_RecordAt(table, slot->keyOffset)->key, key, keyLength) == 0)
+			return (long) i;
+	}
+	return -1;
+}
+
+static struct FileTableSlot *_EmptySlotForHash(struct FileTableSlot *slots, size_t mask, uint64_t hash)
+{
+	size_t i = hash & mask;
+	while (slots[i].keyOffset != 0)
+		i = (i + 1) & mask;
+	return &slots[i];
+}
+
+static void _RemoveSlotAtIndex(struct FileTable *table, size_t index)
+{
+	/* Backward shift: every following slot of the cluster that may live
+	 * closer to its home moves into the hole, so no probe chain breaks */
+	struct FileTableSlot *slots = _Slots(table);
+	size_t mask = _Header(table)->slotCount - 1;
+	size_t hole = index;
+	for (size_t next = (hole + 1) & mask; slots[next].keyOffset != 0; next = (next + 1) & mask)
+	{
+		size_t home = slots[next].hash & mask;
+		if (((next - home) & mask) >= ((next - hole) & mask))
+		{
+			slots[hole] = slots[next];
+			hole = next;
+		}
+	}
+	memset(&slots[hole], 0, sizeof(struct FileTableSlot));
+}
+
+static int _GrowSlots(struct FileTable *table)
+{
+	/* The doubled slots go after the old ones, which then become heap */
+	struct FileTableHeader *header = _Header(table);
+	size_t oldCount = header->slotCount;
+	size_t oldBytes = oldCount * sizeof(struct FileTableSlot);
+	size_t oldOffset = FTBL_HEADER_SIZE + header->heapCapacity;
+	if (_Remap(table, oldOffset + oldBytes * 3) == 0)
+		return 0;
+
+	header = _Header(table);
+	struct FileTableSlot *oldSlots = (struct FileTableSlot *) (table->base + oldOffset);
+	struct FileTableSlot *newSlots = oldSlots + oldCount;
+	size_t newMask = oldCount * 2 - 1;
+	memset(newSlots, 0, oldBytes * 2);
+	for (size_t i = 0; i < oldCount; ++i)
+	{
+		if (oldSlots[i].keyOffset != 0)
+			*_EmptySlotForHash(newSlots, newMask, oldSlots[i].hash) = oldSlots[i];
+	}
+
+	header->heapCapacity += oldBytes;
+	header->slotCount = oldCount * 2;
+	return 1;
+}
+
+#pragma mark Heap
+static int _ReserveHeap(struct FileTable *table, size_t bytes)
+{
+	struct FileTableHeader *header = _Header(table);
+	if (header->heapUsed + bytes <= header->heapCapacity)
+		return 1;
+	if (header->deadBytes >= header->heapUsed / 2)
+	{
+		_CompactHeap(table);
+		if (header->heapUsed + bytes <= header->heapCapacity)
+			return 1;
+	}
+
+	/* Doubles the heap, moving the slots up */
+	size_t growth = header->heapCapacity > bytes ? header->heapCapacity : bytes;
+	growth = (growth + FTBL_PAGE_SIZE - 1) & ~(size_t) (FTBL_PAGE_SIZE - 1);
+	size_t slotsOffset = FTBL_HEADER_SIZE + header->heapCapacity;
+	size_t slotBytes = header->slotCount * sizeof(struct FileTableSlot);
+	if (_Remap(table, slotsOffset + growth + slotBytes) == 0)
+		return 0;
+
+	header = _Header(table);
+	memmove(table->base + slotsOffset + growth, table->base + slotsOffset, slotBytes);
+	header->heapCapacity += growth;
+	return 1;
+}
+
+static void _CompactHeap(struct FileTable *table)
+{
+	/* Slides the live records down over the dead ones, in file order */
+	struct FileTableHeader *header = _Header(table);
+	uint64_t end = FTBL_HEADER_SIZE + header->heapUsed;
+	uint64_t write = FTBL_HEADER_SIZE;
+	for (uint64_t read = FTBL_HEADER_SIZE; read < end;)
+	{
+		struct FileTableRecord *record = _RecordAt(table, read);
+		size_t recordSize = _RecordSize(record->keyLength);
+		if (record->live)
+		{
+			if (write != read)
+			{
+				_SlotForRecord(table, read)->keyOffset = write;
+				memmove(table->base + write, record, recordSize);
+			}
+			write += recordSize;
+		}
+		read += recordSize;
+	}
+
+	header->heapUsed = write - FTBL_HEADER_SIZE;
+	header->deadBytes = 0;
+}
+
+static struct FileTableSlot *_SlotForRecord(struct FileTable *table, uint64_t offset)
+{
+	struct FileTableSlot *slots = _Slots(table);
+	size_t mask = _Header(table)->slotCount - 1;
+	size_t i = _RecordAt(table, offset)->hash & mask;
+	while (slots[i].keyOffset != offset)
+		i = (i + 1) & mask;
+	return &slots[i];
+}
+
+#pragma mark Scanning
+size_t ftbl_Scan(struct FileTable *table, size_t cursor, size_t count, ftbl_ScanFunction scan, void *context)
+{
+	if (table == NULL)
+		return 0;
+	if (scan == NULL)
+		return 0;
+	if (table->isShared)
+		return _ScanShared(table, cursor, count, scan, context);
+
+	/* Keys of a home slot are all in the cluster starting there, since
+	 * removal leaves no holes. Home slots go in reverse-binary order. */
+	struct FileTableSlot *slots = _Slots(table);
+	size_t mask = _Header(table)->slotCount - 1;
+	cursor &= mask;
+	do
+	{
+		for (size_t i = cursor; slots[i].keyOffset != 0; i = (i + 1) & mask)
+		{
+			if ((slots[i].hash & mask) == cursor)
+				scan(_RecordAt(table, slots[i].keyOffset)->key, slots[i].value, context);
+		}
+		cursor = _NextScanCursor(cursor, mask);
+	} while (cursor != 0 && count-- > 1);
+
+	return cursor;
+}
+
+static size_t _ScanShared(struct FileTable *table, size_t cursor, size_t count, ftbl_ScanFunction scan, void *context)
+{
+	/* One home slot at a time: its keys are copied out under the lock and
+	 * scan is called after unlocking, so other processes never wait on
+	 * it. The table may grow in between, like between two calls. */
+	struct FileTableScanBatch batch = {NULL, 0, 0};
+	do
+	{
+		if (_LockForReading(table) == 0)
+		{
+			cursor = 0; /* Like any other failed call */
+			break;
+		}
+		size_t mask = _Header(table)->slotCount - 1;
+		cursor &= mask;
+		int copied = _CopyHomeSlot(table, cursor, &batch);
+		_Unlock(table);
+		if (copied == 0)
+		{
+			cursor = 0; /* Out of memory */
+			break;
+		}
+
+		for (size_t offset = 0; offset < batch.used;)
+		{
+			struct FileTableScanEntry *entry = (struct FileTableScanEntry *) (batch.bytes + offset);
+			scan(entry->key, entry->value, context);
+			offset += entry->size;
+		}
+		cursor = _NextScanCursor(cursor, mask);
+	} while (cursor != 0 && count-- > 1);
+
+	free(batch.bytes);
+	return cursor;
+}
+
+static int _CopyHomeSlot(struct FileTable *table, size_t home, struct FileTableScanBatch *batch)
+{
+	struct FileTableSlot *slots = _Slots(table);
+	size_t mask = _Header(table)->slotCount - 1;
+	batch->used = 0;
+	for (size_t i = home; slots[i].keyOffset != 0; i = (i + 1) & mask)
+	{
+		if ((slots[i].hash & mask) != home)
+			continue;
+
+		size_t size = (sizeof(struct FileTableScanEntry) + slots[i].keyLength + 1 + 7) & ~(size_t) 7;
+		if (batch->used + size > batch->capacity)
+		{
+			size_t capacity = (batch->used + size) * 2;
+			char *bytes = realloc(batch->bytes, capacity);
+			if (bytes == NULL)
+				return 0;
+			batch->bytes = bytes;
+			batch->capacity = capacity;
+		}
+
+		struct FileTableScanEntry *entry = (struct FileTableScanEntry *) (batch->bytes + batch->used);
+		entry->value = slots[i].value;
+		entry->size = size;
+		memcpy(entry->key, _RecordAt(table, slots[i].keyOffset)->key, slots[i].keyLength + 1);
+		batch->used += size;
+	}
+	return 1;
+}
+
+static size_t _NextScanCursor(size_t cursor, size_t mask)
+{
+	uint64_t reversed = util_ReverseBits((uint64_t) cursor | ~(uint64_t) mask);
+	return (size_t) util_ReverseBits(reversed + 1);
+}
+
+#pragma mark Stuff
+size_t ftbl_Count(struct FileTable *table)
+{
+	if (table == NULL)
+		return 0;
+	/* A single aligned word, no lock needed */
+	return (size_t) __atomic_load_n(&_Header(table)->count, __ATOMIC_RELAXED);
+}
+
+size_t ftbl_SlotCount(struct FileTable *table)
+{
+	if (table == NULL)
+		return 0;
+	return (size_t) __atomic_load_n(&_Header(table)->slotCount, __ATOMIC_RELAXED);
+}
+
+size_t ftbl_FileSize(struct FileTable *table)
+{
+	if (table == NULL)
+		return 0;
+	return table->mappedSize;
+}
+
+int ftbl_IsShared(struct FileTable *table)
+{
+	if (table == NULL)
+		return 0;
+	return table->isShared;
+}
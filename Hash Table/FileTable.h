@@ -0,0 +1,56 @@
+#ifndef FileTable_h
+#define FileTable_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Linear probing table living in a memory-mapped file: a header page,
+ * the key records and then the slots. Slots are 32 bytes, 128 to a page,
+ * and keep the full hash and length of their key, so a miss reads one
+ * page of slots and a hit one more with the key. Removal shifts the rest
+ * of the cluster back instead of leaving tombstones. The file grows with
+ * ftruncate and is remapped; only the pages in use stay in memory.
+ * A shared table lives in a POSIX shared memory object instead and is
+ * mapped by several processes at once: every call takes a process-shared
+ * read-write lock in the header, and a process remaps when it finds that
+ * another one grew the table. */
+struct FileTable;
+
+typedef void (*ftbl_ScanFunction)(char *key, uint64_t value, void *context);
+
+/* Opens the table in path or creates it, room for capacity keys to begin
+ * with. NULL - it can't be created or mapped, or it isn't a table file */
+struct FileTable *ftbl_Open(const char *path, size_t capacity);
+/* Creates the shared memory object name (create, fails if it exists) or
+ * attaches to one made by another process. A handle is used by one thread
+ * at a time; threads attach handles of their own. A process that dies in
+ * the middle of a call leaves the table locked: read-write locks have no
+ * robust variant, and the table could be left half changed anyway. No
+ * call holds the lock for longer than one operation. NULL - can't be
+ * created, opened or mapped, or it isn't (yet) a table */
+struct FileTable *ftbl_OpenShared(const char *name, size_t capacity, int create);
+/* Removes the name, the memory goes once every process has closed it */
+int ftbl_UnlinkShared(const char *name);
+/* Unmaps the file. Changes not synced yet are written back by the
+ * system eventually, but are lost if it crashes first */
+void ftbl_Close(struct FileTable *table);
+int ftbl_Sync(struct FileTable *table); /* msync, 0 - failed */
+
+int ftbl_SetValueForKey(struct FileTable *table, uint64_t value, char *key); /* 0 - the file can't grow */
+int ftbl_ValueForKey(struct FileTable *table, char *key, uint64_t *value); /* 0 - no such key */
+int ftbl_RemoveKey(struct FileTable *table, char *key); /* 0 - no such key */
+void ftbl_RemoveAll(struct FileTable *table);
+/* Same contract as htbl_Scan: start with 0, go on with the returned
+ * cursor until it is 0 again. Every key present throughout is visited
+ * at least once, even if the table grows. Keys point into the mapping
+ * and the table must not be changed from inside scan. A shared table
+ * copies the keys of a home slot out and calls scan without the lock
+ * held, so scan may change it; its keys last until scan returns. */
+size_t ftbl_Scan(struct FileTable *table, size_t cursor, size_t count, ftbl_ScanFunction scan, void *context);
+
+size_t ftbl_Count(struct FileTable *table);
+size_t ftbl_SlotCount(struct FileTable *table);
+size_t ftbl_FileSize(struct FileTable *table);
+int ftbl_IsShared(struct FileTable *table); /* 1 - other processes may change it too */
+
+#endif
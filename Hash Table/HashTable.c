@@ -1,28 +1,88 @@
 #import <stdlib.h>
 #import <string.h>
 #import <assert.h>
+#include <stddef.h>
 #include "HashTable.h"
+#include "TimerWheel.h"
+#include "CuckooTable.h"
+#include "RadixTree.h"
+#include "BloomFilter.h"
+#include "FileTable.h"
+#include "WriteLog.h"
+#include "WorkloadTrace.h"
+#include "Utilities.h"
+#include <time.h>
+#ifndef __APPLE__
+#include <sys/random.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
 
 #pragma mark PrivateHeader
 #define STRING_MAX_LEN 1024
+#define HTBL_DEFAULT_CACHE_CAPACITY 64
+#define HTBL_MIN_CAPACITY 8
+#define HTBL_DEFAULT_MAX_LOAD 0.75
+#define HTBL_DEFAULT_GROWTH 2.0
+#define HTBL_TICK_BUDGET 1024 /* Timer wheel work done by one htbl_Tick */
+#define HTBL_CUCKOO_MAX_LOAD 0.9 /* 4-way buckets fill up to ~95%, grow before inserts get slow */
+#define HTBL_FLOOD_PROBE_LENGTH 64 /* Inserts probing further are suspicious, */
+#define HTBL_FLOOD_LONG_PROBES 16 /* that many of them between two resizes mean flooding, unless seeded */
+#define HTBL_FLOOD_CHAIN_LENGTH 1024 /* So do this many elements displaced, most of the table */
+#define HTBL_REHASH_STEP 16 /* Elements moved to the re-seeded storage per operation */
+#define HTBL_HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024) /* Mapped slot arrays are rounded up to it */
+#define HTBL_PAGE_SLOTS 512 /* Slots are allocated and shared with clones 4 KB at a time, unless mapped */
+#define HTBL_MPOL_BIND 2 /* From <numaif.h>, which comes with libnuma */
+#define HTBL_MPOL_INTERLEAVE 3
+#define HTBL_SNAPSHOT_SLICE 64 /* Home slots written to a log snapshot per write */
 typedef long tindex_t; // Must be signed for error codes
 typedef int8_t bool; // Why not?
 
+/* Build with -DHTBL_STATS=1 to collect the counters of htbl_GetStats,
+ * otherwise STAT() compiles to nothing and they stay 0 */
+#ifndef HTBL_STATS
+#define HTBL_STATS 0
+#endif
+#if HTBL_STATS
+#define STAT(statement) do { statement; } while (0)
+#else
+#define STAT(statement) do { } while (0)
+#endif
+
 #pragma mark Table Element Private Header
 struct HashTableElement
 {
 	char *key;
 	void *value;
+	bool referenced; /* CLOCK bit, set on every hit of a cache table */
+	bool borrowedKey; /* The caller owns the key and keeps it alive */
+	uint32_t references; /* Clones share it until either side writes to it */
+	struct HashTableTimer *timer; /* Only for elements that expire */
+};
+
+struct HashTableTimer /* Allocated with the first ttl, freed with the element */
+{
+	struct TimerWheelEntry entry;
+	struct HashTableElement *element;
 };
 
-static struct HashTableElement *_MakeElement(char *key, void *value);
+static struct HashTableElement *_MakeElement(struct KeyPool *pool, char *key, void *value, bool borrowKey);
+static struct HashTableElement *_CopyElement(struct KeyPool *pool, struct HashTableElement *element);
 static void _SetValueInElement(struct HashTableElement *element, void *value);
-static void _SetKeyInElement(struct HashTableElement *element, char *key);
-static void _FreeElement(struct HashTableElement *element);
+static void _SetKeyInElement(struct KeyPool *pool, struct HashTableElement *element, char *key);
+static void _FreeElement(struct KeyPool *pool, struct HashTableElement *element);
+static void _RetainElement(struct HashTableElement *element);
+static void _ReleaseElement(struct KeyPool *pool, struct HashTableElement *element);
+static size_t _BytesForKey(char *key);
+static uint32_t *_KeyReferences(char *key);
+static void _ReleaseKey(struct KeyPool *pool, char *key);
 
 #pragma mark Table Element Implementation
 
-static struct HashTableElement *_MakeElement(char *key, void *value)
+static struct HashTableElement *_MakeElement(struct KeyPool *pool, char *key, void *value, bool borrowKey)
 {
 	struct HashTableElement *element = calloc(1, sizeof(struct HashTableElement));
 	if (element == NULL)
@@ -30,7 +90,14 @@ static struct HashTableElement *_MakeElement(char *key, void *value)
 		return NULL;
 	}
 
-	_SetKeyInElement(element, key);
+	if (borrowKey)
+	{
+		element->key = key;
+		element->borrowedKey = 1;
+	} else
+	{
+		_SetKeyInElement(pool, element, key);
+	}
 	if (element->key == NULL)
 	{
 		free(element);
@@ -38,22 +105,53 @@ static struct HashTableElement *_MakeElement(char *key, void *value)
 	}
 
 	_SetValueInElement(element, value); /* Value is not being copied */
+	element->references = 1;
 
 	return element;
 }
 
-static void _SetKeyInElement(struct HashTableElement *element, char *key)
+static struct HashTableElement *_CopyElement(struct KeyPool *pool, struct HashTableElement *element)
+{
+	/* For copy-on-write: the copy shares the key, which is reference
+	 * counted like the element (or borrowed), so nothing pointing at
+	 * the key needs to follow */
+	struct HashTableElement *copy = calloc(1, sizeof(struct HashTableElement));
+	if (copy == NULL)
+		return NULL;
+
+	copy->key = element->key;
+	copy->borrowedKey = element->borrowedKey;
+	if (copy->borrowedKey == 0 && pool != NULL)
+		kpool_RetainKey(pool, copy->key);
+	else if (copy->borrowedKey == 0)
+		__atomic_add_fetch(_KeyReferences(copy->key), 1, __ATOMIC_RELAXED);
+	copy->value = element->value;
+	copy->referenced = element->referenced;
+	copy->references = 1;
+	return copy;
+}
+
+static void _SetKeyInElement(struct KeyPool *pool, struct HashTableElement *element, char *key)
 {
 	/* Does not frees the previous element key,
 	 * because it's not intended to be used on already
 	  * initialized element */
 	assert(element->key == NULL);
 
+	if (pool != NULL) /* The key is interned already */
+	{
+		element->key = kpool_RetainKey(pool, key);
+		return;
+	}
+
+	/* Prefixed with its reference count, element copies share it */
 	size_t keyLen = strnlen(key, STRING_MAX_LEN);
 	assert(keyLen != 0);
-	element->key = malloc((keyLen + 1) * sizeof(char));
-	if (element->key == NULL)
+	uint32_t *references = malloc(sizeof(uint32_t) + (keyLen + 1) * sizeof(char));
+	if (references == NULL)
 		return;
+	*references = 1;
+	element->key = (char *) (references + 1);
 	memcpy(element->key, key, keyLen + 1);
 	assert(strncmp(element->key, key, keyLen) == 0);
 }
@@ -63,43 +161,192 @@ static void _SetValueInElement(struct HashTableElement *element, void *value)
 	element->value = value;
 }
 
-static void _FreeElement(struct HashTableElement *element)
+static void _FreeElement(struct KeyPool *pool, struct HashTableElement *element)
 {
-	free(element->key);
+	if (element->borrowedKey == 0) /* Otherwise the key is not ours */
+		_ReleaseKey(pool, element->key);
+	free(element->timer); /* Cancelled already, or the wheel goes too */
 	free(element);
 }
 
+static void _RetainElement(struct HashTableElement *element)
+{
+	__atomic_add_fetch(&element->references, 1, __ATOMIC_RELAXED);
+}
+
+static void _ReleaseElement(struct KeyPool *pool, struct HashTableElement *element)
+{
+	if (__atomic_sub_fetch(&element->references, 1, __ATOMIC_ACQ_REL) == 0)
+		_FreeElement(pool, element);
+}
+
+static size_t _BytesForKey(char *key)
+{
+	return sizeof(struct HashTableElement) + strnlen(key, STRING_MAX_LEN) + 1;
+}
+
+static inline uint32_t *_KeyReferences(char *key)
+{
+	return (uint32_t *) key - 1;
+}
+
+static void _ReleaseKey(struct KeyPool *pool, char *key)
+{
+	if (pool != NULL)
+		kpool_ReleaseKey(pool, key);
+	else if (__atomic_sub_fetch(_KeyReferences(key), 1, __ATOMIC_ACQ_REL) == 0)
+		free(_KeyReferences(key));
+}
+
+#pragma mark Slot Page Private Header
+/* The slots are allocated in pages and shared with clones the way the
+ * chunks of a cuckoo table are: a page referenced by several tables is
+ * never written to, the writer copies it first. Every page holds a
+ * reference to each of its elements, so copying a page retains them. */
+struct HashTableSlotPage
+{
+	struct HashTableElement **slots; /* The same array the table reads through */
+	uint32_t *displacedCounts; /* Per home slot of the page, its elements placed past it. NULL - none yet */
+	unsigned long references;
+};
+
 #pragma mark Hash Table
 struct HashTable
 {
-	struct HashTableElement **array;
-	struct KeyValueList *iteratorKVList;
-	struct KeyValueList *collisionsList;
-	tindex_t size;
+	struct HashTableElement ***slots; /* size >> pageShift arrays, one per page */
+	struct HashTableSlotPage **pages; /* Holding each of them */
+	unsigned pageShift; /* Slots per page is a power of two too */
+	struct KeyValueList *iteratorKVList; /* NULL in clones, those iterate in slot order */
+	size_t displacedCount; /* All elements outside of their home slot */
+	unsigned long version; /* Changes whenever the elements move to other slots */
+	tindex_t size; /* A power of two, except in cuckoo mode */
 	tindex_t count;
-	tindex_t hashLimit;
+	tindex_t hashMask; /* size - 1 */
+	tindex_t growAt; /* Grows when an insert finds more elements than that */
+	struct HashTableOptions options; /* With the defaults filled in */
+	size_t usedBytes; /* Elements and their keys */
+
+	struct CuckooTable *cuckoo; /* Cuckoo mode: replaces the pages and the list */
+	struct FileTable *file; /* File-backed mode: replaces everything but the counters */
+	struct KeyPool *keyPool; /* Element keys are interned there, if set. Borrowed by storages being built or drained */
+	struct RadixTree *prefixIndex; /* Element keys in order, if enabled */
+	struct BloomFilter *filter; /* Rules out missing keys before any slot is read, if enabled */
+
+	// Cache mode
+	tindex_t maxCount; /* 0 - unlimited */
+	size_t maxBytes; /* 0 - unlimited */
+	tindex_t clockHand;
+	htbl_EvictFunction evictFunction;
+	void *evictContext;
+
+	// Expiration
+	struct TimerWheel *wheel; /* Created with the first expiring element */
+	uint64_t now;
+
+	// Write-ahead log
+	struct WriteLog *log;
+	struct HashTable *snapshotSource; /* Scanned into the log snapshot: the table, or a clone of a cuckoo one */
+	size_t snapshotCursor;
+	uint64_t snapshotSeed[2]; /* A re-seed reorders every key, the snapshot starts over */
+
+	struct WorkloadRecorder *recorder; /* Every public operation goes to the trace, if recording */
+
+	// Flooding defence
+	bool seeded; /* Keyed SipHash instead of _HashFunction */
+	uint64_t hashSeed[2];
+	size_t longProbes; /* Since the last resize or re-seed */
+	struct HashTable *draining; /* The storage before re-seeding, emptied a few elements per operation */
+	tindex_t drainIndex; /* Slots of draining before it are empty */
+
+	// Statistics, see HTBL_STATS
+	struct HashTableCounters
+	{
+		size_t probeHistogram[HTBL_PROBE_HISTOGRAM_SIZE];
+		size_t longestProbe;
+		size_t collisionsListWalks;
+		size_t resizeCount;
+		uint64_t resizeNanoseconds;
+		size_t reseedCount;
+		size_t hits;
+		size_t misses;
+		size_t filteredMisses;
+	} counters;
+
+	struct HashTableTrace *trace; /* NULL unless hooks are set */
+};
+
+struct HashTableTrace
+{
+	struct HashTableTraceHooks hooks;
+	enum HashTableOperation operation; /* The public call in progress */
+	unsigned sampleCounter;
 
+	struct HashTableTraceEvent *events; /* Ring buffer of hooks.ringCapacity */
+	size_t eventsHead;
+	size_t eventsCount;
+};
+
+struct HashTableScan /* Passes elements found elsewhere on to a htbl_ScanFunction */
+{
+	struct HashTable *table;
+	htbl_ScanFunction scan;
+	void *context;
+	char *prefix; /* File-backed tables: only keys starting with it, NULL - every key */
 };
 
 // Creation
-static struct HashTable *_AllocateTable(size_t size);
+static struct HashTable *_AllocateTable(struct HashTableOptions *options, size_t size);
 static struct HashTable *_InitTable(struct HashTable *table, size_t size);
+static struct HashTable *_CreateStorageLike(struct HashTable *table, size_t size);
+static struct HashTable *_CreateForFile(struct FileTable *file);
+static void _SetSize(struct HashTable *table, tindex_t size);
+static size_t _RoundUpToPowerOfTwo(size_t size);
+// Slot memory
+static struct HashTableElement **_AllocateSlots(struct HashTableOptions *options, size_t size);
+static void _FreeSlots(struct HashTableOptions *options, struct HashTableElement **slots, size_t size);
+static bool _AreSlotsMapped(struct HashTableOptions *options);
+static size_t _MappedSlotBytes(size_t size);
+static struct HashTableElement **_MapSlots(struct HashTableOptions *options, size_t size);
+static bool _BindSlotsToNodes(struct HashTableOptions *options, void *slots, size_t bytes);
+
+static unsigned _PageShiftForSize(struct HashTableOptions *options, size_t size);
+static bool _AllocatePages(struct HashTable *storage, size_t size, unsigned pageShift);
+static struct HashTableSlotPage *_AllocatePage(struct HashTableOptions *options, size_t slotsPerPage);
+static void _FreePage(struct HashTableOptions *options, struct HashTableSlotPage *page, size_t slotsPerPage);
+static void _ReleasePage(struct HashTable *storage, struct HashTableSlotPage *page);
+static void _ReleasePages(struct HashTable *storage);
+static bool _SharePagesWithTable(struct HashTable *storage, struct HashTable *clone);
+static struct HashTableSlotPage *_WritablePage(struct HashTable *storage, tindex_t index);
+static uint32_t *_WritableDisplacedCount(struct HashTable *storage, tindex_t home);
+static uint32_t _DisplacedCount(struct HashTable *storage, tindex_t home);
+static size_t _SlotsPerPage(struct HashTable *storage);
+static size_t _PageCount(struct HashTable *storage);
+static size_t _SlotBytes(struct HashTable *storage);
+static size_t _DisplacedCountBytes(struct HashTable *storage);
 // Destruction
 static void _FreeTableContentsButLeaveStruct(struct HashTable *table);
 static void _FreeTableStructButLeakContents(struct HashTable *table);
+static void _ReleaseTableStorage(struct HashTable *storage);
+static void _AdoptStorageOfTable(struct HashTable *table, struct HashTable *donorTable);
 // Add
-static void _AddKeyValuePair(struct HashTable *table, char *key, void *value);
+static struct HashTableElement *_AddKeyValuePair(struct HashTable *table, char *key, void *value, bool borrowKey);
+static tindex_t _PlaceElement(struct HashTable *table, struct HashTableElement *element);
+static bool _PlaceSharedElement(struct HashTable *storage, struct HashTableElement *element);
 // Remove
 static void _RemoveKeyValuePair(struct HashTable *table, char *key);
+static void *_ValueForKey(struct HashTable *table, char *key);
 static void _RemoveKeyValuePairAtIndex(struct HashTable *table, tindex_t index);
-bool _RemoveAllElementsUsingIterator(struct HashTable *table);
-void _RemoveAllElementsByHand(struct HashTable *table);
+static void _RemoveAllElements(struct HashTable *table, htbl_DestroyFunction destroy, void *context);
+static bool _DetachElementAtIndex(struct HashTable *storage, tindex_t index);
+static void _DiscardElement(struct HashTable *table, struct HashTableElement *element);
 // Setters
-static void _SetValueForKey(struct HashTable *table, void *value, char *key);
-static void _SetKeyValuePairAtIndex(struct HashTable *table, char *key, void *value, tindex_t index);
-static void _SetCollisionKeyValuePairAtIndex(struct HashTable *table, char *key, void *value, tindex_t index);
+static struct HashTableElement *_SetValueForKey(struct HashTable *table, void *value, char *key, bool borrowKey);
+static struct HashTableElement *_StoreValueForKey(struct HashTable *table, void *value, char *key, bool borrowKey);
 // Getters
 static struct HashTableElement *_ElementAtIndex(struct HashTable *table, tindex_t index);
+static struct HashTableElement *_WritableElementAtIndex(struct HashTable *table, tindex_t index);
+static struct HashTableElement *_UnshareElementInStorage(struct HashTable *table, struct HashTable *storage, tindex_t index);
+static struct HashTableElement **_WritableSlotAtIndex(struct HashTable *storage, tindex_t index);
 // Checkers
 static bool _IsElementForKey(struct HashTableElement *element, char *key);
 static bool _IsElementAtIndexEmpty(struct HashTable *table, tindex_t index);
@@ -107,17 +354,120 @@ static bool _IsElementAtIndexForKey(struct HashTable *table, tindex_t index, cha
 // Searching
 static tindex_t _FindEmptyIndexAfterIndex(struct HashTable *table, tindex_t startIndex);
 static tindex_t _FindExistingIndexForKey(struct HashTable *table, char *key);
+static tindex_t _FindDisplacedIndexForKey(struct HashTable *table, tindex_t home, char *key);
+static tindex_t _FindLiveIndexForKey(struct HashTable *table, char *key);
 // Optimization
 static void _OptimizeTable(struct HashTable *table);
+static size_t _GrownSize(struct HashTable *table);
 static void _ResizeTable(struct HashTable *table, size_t newSize);
+static bool _MoveElementsToNewStorage(struct HashTable *table, size_t newSize);
+// Cache
+static bool _IsCacheTable(struct HashTable *table);
+static bool _IsCacheFullForKey(struct HashTable *table, char *key);
+static void _EvictForKey(struct HashTable *table, char *key);
+static tindex_t _FindClockVictim(struct HashTable *table);
+// Expiration
+static void _SetElementTTL(struct HashTable *table, struct HashTableElement *element, uint64_t ttl);
+static void _CancelElementTimer(struct HashTable *table, struct HashTableElement *element);
+static bool _IsElementExpired(struct HashTable *table, struct HashTableElement *element);
+static void _ExpireTimerEntry(struct TimerWheelEntry *entry, void *context);
+// Flooding defence
+static tindex_t _HomeIndexForKey(struct HashTable *table, char *key);
+static bool _IsTableFlooded(struct HashTable *table);
+static void _Reseed(struct HashTable *table);
+static void _SwapStorage(struct HashTable *table, struct HashTable *otherTable);
+static bool _RehashStep(struct HashTable *table);
+static bool _FinishRehash(struct HashTable *table);
+static tindex_t _FindDrainingIndexForKey(struct HashTable *table, char *key);
+static tindex_t _FindLiveDrainingIndexForKey(struct HashTable *table, char *key);
+static struct HashTableElement *_FindLiveDrainingElementForKey(struct HashTable *table, char *key);
+static void _RemoveDrainingElementAtIndex(struct HashTable *table, tindex_t index);
+static void _RemoveDrainingElements(struct HashTable *table, htbl_DestroyFunction destroy, void *context);
+static tindex_t _ElementCount(struct HashTable *table);
+static size_t _UsedBytes(struct HashTable *table);
+static void _RandomSeed(uint64_t seed[2]);
+static uint64_t _SipHash(uint64_t seed[2], char *key);
+// Cuckoo
+static tindex_t _PlaceElementInCuckoo(struct HashTable *table, struct HashTableElement *element);
+static int _CuckooMatch(void *item, void *key);
+static uint64_t _CuckooHash(char *key);
+static void _RetainCuckooElement(void *item, void *context);
+static void _ReleaseCuckooElement(void *item, void *context);
+// Cloning
+static struct HashTable *_CloneCuckooTable(struct HashTable *table);
+static struct HashTable *_CopyTable(struct HashTable *table);
+// Prefix index
+static void _ScanIndexedElement(char *key, void *item, void *context);
+static void _ScanPrefixInSlots(struct HashTable *table, struct HashTable *storage, tindex_t from, char *prefix, htbl_ScanFunction scan, void *context);
+// Cursor scan
+static size_t _ScanSlots(struct HashTable *table, size_t cursor, size_t count, htbl_ScanFunction scan, void *context);
+static void _ScanDisplacedElements(struct HashTable *table, tindex_t home, htbl_ScanFunction scan, void *context);
+static void _ScanCuckooElement(void *item, void *context);
+static size_t _NextScanCursor(size_t cursor, size_t mask);
+// Filter
+static bool _RebuildFilter(struct HashTable *table);
+static void _FillFilter(struct BloomFilter *filter, struct HashTable *storage, tindex_t from);
+static void _AddFileKeyToFilter(char *key, void *value, void *context);
+// File-backed tables
+static void _SetValueInFile(struct HashTable *table, char *key, void *value);
+static void *_ValueInFile(struct HashTable *table, char *key);
+static void _ScanFileEntry(char *key, uint64_t value, void *context);
+static void _ScanWholeFile(struct HashTable *table, htbl_ScanFunction scan, void *context, char *prefix);
+static void _GetFileTableStats(struct HashTable *table, struct HashTableStats *stats);
+// Write-ahead log
+static void _ReplayLogRecord(enum WriteLogOperation operation, char *key, uint64_t value, void *context);
+static void _LoadSnapshotRecord(enum WriteLogOperation operation, char *key, uint64_t value, void *context);
+static void _ReserveForReplay(struct HashTable *table, size_t count);
+static void _LogChange(struct HashTable *table, enum WriteLogOperation operation, char *key, void *value);
+static void _CompactLog(struct HashTable *table);
+static void _BeginLogSnapshot(struct HashTable *table);
+static void _ContinueLogSnapshot(struct HashTable *table);
+static void _SnapshotElement(char *key, void *value, void *context);
+static void _EndLogSnapshot(struct HashTable *table);
+// Key pool
+static char *_PinKey(struct HashTable *table, char *key);
+static void _UnpinKey(struct HashTable *table, char *pinnedKey);
 // Stuff
-static void _loopIncrement(tindex_t *variable, tindex_t increment, tindex_t maxValueExclusive);
+static tindex_t _ProbeLength(struct HashTable *table, tindex_t fromIndex, tindex_t toIndex);
+#if HTBL_STATS
+static void _CountProbe(struct HashTable *table, tindex_t fromIndex, tindex_t toIndex);
+#endif
+// Tracing
+static uint64_t _BeginTracedOperation(struct HashTable *table, enum HashTableOperation operation);
+static void _EndTracedOperation(struct HashTable *table, uint64_t startTime);
+static void _TraceProbe(struct HashTable *table, size_t probeLength);
+static void _RecordTraceEvent(struct HashTableTrace *trace, struct HashTableTraceEvent *event);
+static size_t _OldestTraceEventIndex(struct HashTableTrace *trace);
 tindex_t _HashFunction(char *key, tindex_t limit);
 
 #pragma mark Creation
 struct HashTable *htbl_Create(size_t capacity)
 {
-	struct HashTable *hashTable = _AllocateTable(capacity);
+	struct HashTableOptions options = {.initialCapacity = capacity};
+	return htbl_CreateWithOptions(&options);
+}
+
+struct HashTable *htbl_CreateWithOptions(struct HashTableOptions *options)
+{
+	struct HashTableOptions filled = {0};
+	if (options != NULL)
+		filled = *options;
+	if (filled.minCapacity == 0)
+		filled.minCapacity = HTBL_MIN_CAPACITY;
+	if (filled.maxLoadFactor == 0)
+		filled.maxLoadFactor = HTBL_DEFAULT_MAX_LOAD;
+	if (filled.growthFactor == 0)
+		filled.growthFactor = HTBL_DEFAULT_GROWTH;
+	if (!(filled.maxLoadFactor > 0 && filled.maxLoadFactor < 1))
+		return NULL;
+	if (!(filled.growthFactor >= 2)) /* Sizes stay powers of two, anything less would still double */
+		return NULL;
+	if (filled.numaPolicy != HTBL_NUMA_DEFAULT && filled.numaNodes == 0)
+		return NULL;
+
+	filled.minCapacity = _RoundUpToPowerOfTwo(filled.minCapacity);
+	size_t capacity = _RoundUpToPowerOfTwo(filled.initialCapacity > filled.minCapacity ? filled.initialCapacity : filled.minCapacity);
+	struct HashTable *hashTable = _AllocateTable(&filled, capacity);
 	if (hashTable == NULL)
 		return NULL;
 
@@ -125,349 +475,2355 @@ struct HashTable *htbl_Create(size_t capacity)
 	return hashTable;
 }
 
-static struct HashTable *_AllocateTable(size_t size)
+struct HashTable *htbl_CreateCache(size_t maxEntries, size_t maxBytes, htbl_EvictFunction evict, void *context)
+{
+	if (maxEntries == 0 && maxBytes == 0)
+		return NULL;
+
+	/* Big enough to never grow while holding maxEntries elements */
+	size_t capacity = maxEntries ? maxEntries * 4 / 3 + 1 : HTBL_DEFAULT_CACHE_CAPACITY;
+	struct HashTable *hashTable = htbl_Create(capacity);
+	if (hashTable == NULL)
+		return NULL;
+
+	hashTable->maxCount = maxEntries;
+	hashTable->maxBytes = maxBytes;
+	hashTable->evictFunction = evict;
+	hashTable->evictContext = context;
+
+	return hashTable;
+}
+
+struct HashTable *htbl_CreateCuckoo(size_t capacity)
+{
+	struct HashTable *hashTable = calloc(1, sizeof(struct HashTable));
+	if (hashTable == NULL)
+		return NULL;
+
+	hashTable->cuckoo = cuck_Create(capacity);
+	if (hashTable->cuckoo == NULL)
+	{
+		free(hashTable);
+		return NULL;
+	}
+	cuck_SetItemFunctions(hashTable->cuckoo, _RetainCuckooElement, _ReleaseCuckooElement, NULL);
+	hashTable->options.maxLoadFactor = HTBL_CUCKOO_MAX_LOAD;
+	hashTable->options.growthFactor = 2; /* Always doubles */
+	_SetSize(hashTable, (tindex_t) cuck_SlotCount(hashTable->cuckoo));
+
+	return hashTable;
+}
+
+struct HashTable *htbl_CreateFileBacked(const char *path, size_t capacity)
+{
+	return _CreateForFile(ftbl_Open(path, capacity));
+}
+
+struct HashTable *htbl_CreateShared(const char *name, size_t capacity)
+{
+	return _CreateForFile(ftbl_OpenShared(name, capacity, 1));
+}
+
+struct HashTable *htbl_AttachShared(const char *name)
+{
+	return _CreateForFile(ftbl_OpenShared(name, 0, 0));
+}
+
+int htbl_UnlinkShared(const char *name)
+{
+	return ftbl_UnlinkShared(name);
+}
+
+static struct HashTable *_CreateForFile(struct FileTable *file)
+{
+	/* Shared tables are file tables too, just not on disk */
+	if (file == NULL)
+		return NULL;
+
+	struct HashTable *hashTable = calloc(1, sizeof(struct HashTable));
+	if (hashTable == NULL)
+	{
+		ftbl_Close(file);
+		return NULL;
+	}
+
+	hashTable->file = file;
+	return hashTable;
+}
+
+struct HashTable *htbl_CreateWithKeyPool(size_t capacity, struct KeyPool *pool)
+{
+	if (pool == NULL)
+		return NULL;
+
+	struct HashTable *hashTable = htbl_Create(capacity);
+	if (hashTable == NULL)
+		return NULL;
+
+	hashTable->keyPool = kpool_Retain(pool);
+	return hashTable;
+}
+
+static struct HashTable *_AllocateTable(struct HashTableOptions *options, size_t size)
 {
 	struct HashTable *hashTablePointer = calloc(1, sizeof(struct HashTable));
 	if (hashTablePointer == NULL)
 		return NULL;
 
-	hashTablePointer->array = calloc(size, sizeof(struct HashTableElement *));
-	if (hashTablePointer->array == NULL)
+	hashTablePointer->options = *options;
+	if (_AllocatePages(hashTablePointer, size, _PageShiftForSize(options, size)) == 0)
+	{
+		free(hashTablePointer);
+		return NULL;
+	}
+
+	return hashTablePointer;
+}
+
+static struct HashTable *_InitTable(struct HashTable *table, size_t size)
+{
+	/* The list points at the keys of the elements */
+	table->iteratorKVList = lst_CreateListBorrowingKeys();
+	if (table->iteratorKVList == NULL)
+	{
+		_SetSize(table, (tindex_t) size);
+		_ReleasePages(table);
+		free(table);
+		return NULL;
+	}
+
+	_SetSize(table, (tindex_t) size);
+
+	return table;
+}
+
+static struct HashTable *_CreateStorageLike(struct HashTable *table, size_t size)
+{
+	/* Grown and re-seeded slots are placed the same way as the first ones,
+	 * and keep a list only if the table does */
+	struct HashTableOptions options = table->options;
+	options.initialCapacity = size;
+	struct HashTable *storage = htbl_CreateWithOptions(&options);
+	if (storage == NULL)
+		return NULL;
+
+	storage->keyPool = table->keyPool; /* Borrowed, storages are never freed with htbl_Free */
+	if (table->iteratorKVList == NULL)
+	{
+		lst_Free(storage->iteratorKVList);
+		storage->iteratorKVList = NULL;
+	}
+	return storage;
+}
+
+static void _SetSize(struct HashTable *table, tindex_t size)
+{
+	/* The load factor is applied once here, not on every insert */
+	table->size = size;
+	table->hashMask = size - 1;
+	table->growAt = (tindex_t) ((double) size * table->options.maxLoadFactor);
+}
+
+static size_t _RoundUpToPowerOfTwo(size_t size)
+{
+	size_t powerOfTwo = 1;
+	while (powerOfTwo < size && (powerOfTwo << 1) != 0)
+		powerOfTwo <<= 1;
+	return powerOfTwo;
+}
+
+#pragma mark Slot Memory
+static struct HashTableElement **_AllocateSlots(struct HashTableOptions *options, size_t size)
+{
+	if (!_AreSlotsMapped(options))
+		return calloc(size, sizeof(struct HashTableElement *));
+	if (size > (SIZE_MAX - HTBL_HUGE_PAGE_SIZE) / sizeof(struct HashTableElement *))
+		return NULL;
+	return _MapSlots(options, size);
+}
+
+static void _FreeSlots(struct HashTableOptions *options, struct HashTableElement **slots, size_t size)
+{
+	/* The options and the size are the ones the slots were allocated with */
+	if (!_AreSlotsMapped(options))
+	{
+		free(slots);
+		return;
+	}
+#ifdef __linux__
+	if (slots != NULL)
+		munmap(slots, _MappedSlotBytes(size));
+#endif
+}
+
+static bool _AreSlotsMapped(struct HashTableOptions *options)
+{
+#ifdef __linux__
+	return (options->pages != HTBL_PAGES_DEFAULT || options->numaPolicy != HTBL_NUMA_DEFAULT);
+#else
+	return 0;
+#endif
+}
+
+static size_t _MappedSlotBytes(size_t size)
+{
+	size_t bytes = size * sizeof(struct HashTableElement *);
+	return (bytes + HTBL_HUGE_PAGE_SIZE - 1) & ~(HTBL_HUGE_PAGE_SIZE - 1);
+}
+
+static struct HashTableElement **_MapSlots(struct HashTableOptions *options, size_t size)
+{
+#ifdef __linux__
+	/* Anonymous pages come zeroed, like calloc, and are only backed
+	 * when first touched - after the NUMA policy is set */
+	size_t bytes = _MappedSlotBytes(size);
+	void *slots = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (options->pages == HTBL_PAGES_EXPLICIT_HUGE)
+		slots = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (slots == MAP_FAILED)
+	{
+		slots = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (slots == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		if (options->pages != HTBL_PAGES_DEFAULT)
+			madvise(slots, bytes, MADV_HUGEPAGE); /* Just a hint, small pages still work */
+#endif
+	}
+
+	if (_BindSlotsToNodes(options, slots, bytes) == 0)
+	{
+		munmap(slots, bytes);
+		return NULL;
+	}
+	return slots;
+#else
+	return NULL;
+#endif
+}
+
+static bool _BindSlotsToNodes(struct HashTableOptions *options, void *slots, size_t bytes)
+{
+	if (options->numaPolicy == HTBL_NUMA_DEFAULT)
+		return 1;
+#ifdef __linux__
+	/* The raw system call, to not depend on libnuma. The kernel reads
+	 * one bit less of the mask than maxnode says. */
+	int mode = (options->numaPolicy == HTBL_NUMA_BIND) ? HTBL_MPOL_BIND : HTBL_MPOL_INTERLEAVE;
+	unsigned long nodes = options->numaNodes;
+	return (syscall(SYS_mbind, slots, bytes, mode, &nodes, sizeof(nodes) * 8 + 1, 0) == 0);
+#else
+	return 0;
+#endif
+}
+
+#pragma mark Slot Pages
+static unsigned _PageShiftForSize(struct HashTableOptions *options, size_t size)
+{
+	/* Mapped slots get a whole huge page each, smaller tables one page */
+	size_t slotsPerPage = HTBL_PAGE_SLOTS;
+	if (_AreSlotsMapped(options))
+		slotsPerPage = HTBL_HUGE_PAGE_SIZE / sizeof(struct HashTableElement *);
+	unsigned pageShift = 0;
+	while (((size_t) 1 << pageShift) < slotsPerPage && ((size_t) 1 << pageShift) < size)
+		pageShift++;
+	return pageShift;
+}
+
+static bool _AllocatePages(struct HashTable *storage, size_t size, unsigned pageShift)
+{
+	size_t pageCount = size >> pageShift;
+	size_t slotsPerPage = (size_t) 1 << pageShift;
+	struct HashTableElement ***slots = calloc(pageCount, sizeof(struct HashTableElement **));
+	struct HashTableSlotPage **pages = calloc(pageCount, sizeof(struct HashTableSlotPage *));
+	size_t allocated = 0;
+	while (slots != NULL && pages != NULL && allocated < pageCount)
+	{
+		pages[allocated] = _AllocatePage(&storage->options, slotsPerPage);
+		if (pages[allocated] == NULL)
+			break;
+		slots[allocated] = pages[allocated]->slots;
+		allocated++;
+	}
+	if (allocated != pageCount)
+	{
+		while (allocated-- > 0)
+			_FreePage(&storage->options, pages[allocated], slotsPerPage);
+		free(slots);
+		free(pages);
+		return 0;
+	}
+
+	storage->slots = slots;
+	storage->pages = pages;
+	storage->pageShift = pageShift;
+	return 1;
+}
+
+static struct HashTableSlotPage *_AllocatePage(struct HashTableOptions *options, size_t slotsPerPage)
+{
+	struct HashTableSlotPage *page = calloc(1, sizeof(struct HashTableSlotPage));
+	if (page == NULL)
+		return NULL;
+
+	page->slots = _AllocateSlots(options, slotsPerPage);
+	if (page->slots == NULL)
+	{
+		free(page);
+		return NULL;
+	}
+	page->references = 1;
+	return page;
+}
+
+static void _FreePage(struct HashTableOptions *options, struct HashTableSlotPage *page, size_t slotsPerPage)
+{
+	free(page->displacedCounts);
+	_FreeSlots(options, page->slots, slotsPerPage);
+	free(page);
+}
+
+static void _ReleasePage(struct HashTable *storage, struct HashTableSlotPage *page)
+{
+	if (__atomic_sub_fetch(&page->references, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+
+	size_t slotsPerPage = _SlotsPerPage(storage);
+	for (size_t i = 0; i < slotsPerPage; ++i)
+	{
+		if (page->slots[i] != NULL)
+			_ReleaseElement(storage->keyPool, page->slots[i]);
+	}
+	_FreePage(&storage->options, page, slotsPerPage);
+}
+
+static void _ReleasePages(struct HashTable *storage)
+{
+	if (storage->pages == NULL)
+		return;
+
+	size_t pageCount = _PageCount(storage);
+	for (size_t i = 0; i < pageCount; ++i)
+		_ReleasePage(storage, storage->pages[i]);
+	free(storage->pages);
+	free(storage->slots);
+	storage->pages = NULL;
+	storage->slots = NULL;
+}
+
+static bool _SharePagesWithTable(struct HashTable *storage, struct HashTable *clone)
+{
+	/* Only the page directories are copied */
+	size_t pageCount = _PageCount(storage);
+	clone->slots = malloc(pageCount * sizeof(struct HashTableElement **));
+	clone->pages = malloc(pageCount * sizeof(struct HashTableSlotPage *));
+	if (clone->slots == NULL || clone->pages == NULL)
+	{
+		free(clone->slots);
+		free(clone->pages);
+		clone->slots = NULL;
+		clone->pages = NULL;
+		return 0;
+	}
+
+	memcpy(clone->slots, storage->slots, pageCount * sizeof(struct HashTableElement **));
+	memcpy(clone->pages, storage->pages, pageCount * sizeof(struct HashTableSlotPage *));
+	for (size_t i = 0; i < pageCount; ++i)
+		__atomic_add_fetch(&storage->pages[i]->references, 1, __ATOMIC_RELAXED);
+	clone->pageShift = storage->pageShift;
+	return 1;
+}
+
+static struct HashTableSlotPage *_WritablePage(struct HashTable *storage, tindex_t index)
+{
+	size_t pageIndex = (size_t) index >> storage->pageShift;
+	struct HashTableSlotPage *page = storage->pages[pageIndex];
+	if (__atomic_load_n(&page->references, __ATOMIC_ACQUIRE) == 1)
+		return page;
+
+	size_t slotsPerPage = _SlotsPerPage(storage);
+	struct HashTableSlotPage *copy = _AllocatePage(&storage->options, slotsPerPage);
+	if (copy == NULL)
+		return NULL;
+	if (page->displacedCounts != NULL)
+	{
+		copy->displacedCounts = malloc(slotsPerPage * sizeof(uint32_t));
+		if (copy->displacedCounts == NULL)
+		{
+			_FreePage(&storage->options, copy, slotsPerPage);
+			return NULL;
+		}
+		memcpy(copy->displacedCounts, page->displacedCounts, slotsPerPage * sizeof(uint32_t));
+	}
+
+	memcpy(copy->slots, page->slots, slotsPerPage * sizeof(struct HashTableElement *));
+	for (size_t i = 0; i < slotsPerPage; ++i)
+	{
+		if (copy->slots[i] != NULL)
+			_RetainElement(copy->slots[i]);
+	}
+	_ReleasePage(storage, page);
+	storage->pages[pageIndex] = copy;
+	storage->slots[pageIndex] = copy->slots;
+	return copy;
+}
+
+static uint32_t *_WritableDisplacedCount(struct HashTable *storage, tindex_t home)
+{
+	struct HashTableSlotPage *page = _WritablePage(storage, home);
+	if (page == NULL)
+		return NULL;
+	if (page->displacedCounts == NULL)
+		page->displacedCounts = calloc(_SlotsPerPage(storage), sizeof(uint32_t));
+	if (page->displacedCounts == NULL)
+		return NULL;
+	return &page->displacedCounts[(size_t) home & (_SlotsPerPage(storage) - 1)];
+}
+
+static inline uint32_t _DisplacedCount(struct HashTable *storage, tindex_t home)
+{
+	uint32_t *displacedCounts = storage->pages[(size_t) home >> storage->pageShift]->displacedCounts;
+	if (displacedCounts == NULL)
+		return 0;
+	return displacedCounts[(size_t) home & (_SlotsPerPage(storage) - 1)];
+}
+
+static inline size_t _SlotsPerPage(struct HashTable *storage)
+{
+	return (size_t) 1 << storage->pageShift;
+}
+
+static inline size_t _PageCount(struct HashTable *storage)
+{
+	return (size_t) storage->size >> storage->pageShift;
+}
+
+static size_t _SlotBytes(struct HashTable *storage)
+{
+	size_t pageCount = _PageCount(storage);
+	size_t pageBytes = sizeof(struct HashTableSlotPage) + _SlotsPerPage(storage) * sizeof(struct HashTableElement *);
+	return pageCount * (pageBytes + sizeof(struct HashTableElement **) + sizeof(struct HashTableSlotPage *));
+}
+
+static size_t _DisplacedCountBytes(struct HashTable *storage)
+{
+	size_t bytes = 0;
+	size_t pageCount = _PageCount(storage);
+	for (size_t i = 0; i < pageCount; ++i)
+		bytes += storage->pages[i]->displacedCounts ? _SlotsPerPage(storage) * sizeof(uint32_t) : 0;
+	return bytes;
+}
+
+#pragma mark Destruction
+void htbl_Free(struct HashTable *table)
+{
+	if (table == NULL)
+		return;
+
+	_FreeTableContentsButLeaveStruct(table);
+	_FreeTableStructButLeakContents(table);
+}
+
+static void _FreeTableContentsButLeaveStruct(struct HashTable *table)
+{
+	wlog_Close(table->log); /* Commits what is left */
+	_EndLogSnapshot(table);
+	wtrc_Close(table->recorder);
+	if (table->draining != NULL)
+		_RemoveDrainingElements(table, NULL, NULL);
+
+	_ReleaseTableStorage(table); /* The pages and the cuckoo table release their elements themselves */
+	cuck_Free(table->cuckoo);
+	ftbl_Close(table->file);
+	twhl_Free(table->wheel);
+	rdx_Free(table->prefixIndex);
+	blm_Free(table->filter);
+	kpool_Release(table->keyPool);
+	htbl_SetTraceHooks(table, NULL);
+}
+
+static void _FreeTableStructButLeakContents(struct HashTable *table)
+{
+	free(table);
+}
+
+static void _ReleaseTableStorage(struct HashTable *storage)
+{
+	/* Elements still held by other pages (a clone's, or the new storage's) stay */
+	lst_Free(storage->iteratorKVList);
+	storage->iteratorKVList = NULL;
+	_ReleasePages(storage);
+}
+
+static void _AdoptStorageOfTable(struct HashTable *table, struct HashTable *donorTable)
+{
+	/* The very same elements, the donor's pages hold their own references */
+	assert(table->count == donorTable->count);
+	_ReleaseTableStorage(table);
+
+	table->slots = donorTable->slots;
+	table->pages = donorTable->pages;
+	table->pageShift = donorTable->pageShift;
+	table->iteratorKVList = donorTable->iteratorKVList;
+	table->displacedCount = donorTable->displacedCount;
+	_SetSize(table, donorTable->size);
+	table->version++;
+	table->clockHand = 0;
+	table->longProbes = 0;
+
+	_FreeTableStructButLeakContents(donorTable);
+}
+
+#pragma mark Adding
+void htbl_SetValueForKey(struct HashTable *table, void *value, char *key)
+{
+	if (table == NULL)
+		return;
+	if (key == NULL)
+		return;
+	if (strlen(key) == 0)
+		return;
+	if (value == NULL)
+		return;
+	if (table->recorder != NULL)
+		wtrc_Record(table->recorder, WTRC_SET, key);
+	if (table->file != NULL) /* Copies the key into the file, keeps no ttl */
+	{
+		_SetValueInFile(table, key, value);
+		return;
+	}
+
+	size_t len = strlen(key);
+	char backedUpKey[len + 1];
+	memcpy(backedUpKey, key, len + 1);
+
+	uint64_t traceStart = _BeginTracedOperation(table, HTBL_OP_SET);
+	char *pinnedKey = _PinKey(table, backedUpKey);
+	if (pinnedKey != NULL)
+	{
+		_OptimizeTable(table);
+		_SetValueForKey(table, value, pinnedKey, 0);
+	}
+	_UnpinKey(table, pinnedKey);
+	_CompactLog(table);
+	_EndTracedOperation(table, traceStart);
+}
+
+void htbl_SetValueForBorrowedKey(struct HashTable *table, void *value, char *key)
+{
+	if (table == NULL)
+		return;
+	if (key == NULL)
+		return;
+	if (strlen(key) == 0)
+		return;
+	if (value == NULL)
+		return;
+	if (table->keyPool != NULL || table->file != NULL) /* Pooled keys are shared copies anyway, so are file keys */
+	{
+		htbl_SetValueForKey(table, value, key);
+		return;
+	}
+
+	/* No backup: the caller keeps the key alive, the table never frees it */
+	if (table->recorder != NULL)
+		wtrc_Record(table->recorder, WTRC_SET, key);
+	uint64_t traceStart = _BeginTracedOperation(table, HTBL_OP_SET);
+	_OptimizeTable(table);
+	_SetValueForKey(table, value, key, 1);
+	_CompactLog(table);
+	_EndTracedOperation(table, traceStart);
+}
+
+static struct HashTableElement *_AddKeyValuePair(struct HashTable *table, char *key, void *value, bool borrowKey)
+{
+	struct HashTableElement *element = _MakeElement(table->keyPool, key, value, borrowKey);
+	if (element == NULL)
+		return NULL;
+
+	tindex_t index = _PlaceElement(table, element);
+	if (index == -1 && table->cuckoo != NULL)
+	{
+		/* Both buckets, every displacement chain and the stash are full */
+		_ResizeTable(table, (size_t) table->size * 2);
+		index = _PlaceElement(table, element);
+	}
+	if (index == -1)
+	{
+		_FreeElement(table->keyPool, element);
+		return NULL;
+	}
+	if (table->filter != NULL)
+	{
+		blm_Add(table->filter, _CuckooHash(element->key));
+		if (blm_Count(table->filter) > blm_Capacity(table->filter))
+			_RebuildFilter(table); /* Out of memory - more false positives for now */
+	}
+	if (table->prefixIndex != NULL && rdx_Insert(table->prefixIndex, element->key, element) == 0)
+	{
+		_RemoveKeyValuePairAtIndex(table, index);
+		return NULL;
+	}
+
+	return element;
+}
+
+static tindex_t _PlaceElement(struct HashTable *table, struct HashTableElement *element)
+{
+	if (table->cuckoo != NULL)
+		return _PlaceElementInCuckoo(table, element);
+
+	/* Takes over the caller's reference to the element */
+	char *key = element->key;
+	tindex_t index = _HomeIndexForKey(table, key);
+	uint32_t *displacedCount = NULL;
+	// Do the nice way
+	bool collided = (_IsElementAtIndexEmpty(table, index) == 0);
+	if (collided)
+	{
+		// Otherwise do collision way
+		tindex_t homeIndex = index;
+		index = _FindEmptyIndexAfterIndex(table, index);
+		if (index == -1)
+			return -1;
+		if (_ProbeLength(table, homeIndex, index) > HTBL_FLOOD_PROBE_LENGTH)
+			table->longProbes++;
+		displacedCount = _WritableDisplacedCount(table, homeIndex);
+		if (displacedCount == NULL)
+			return -1;
+	} else
+	{
+		STAT(_CountProbe(table, index, index));
+	}
+
+	/* A private home page stays private, so the count stays where it is */
+	struct HashTableSlotPage *page = _WritablePage(table, index);
+	if (page == NULL)
+		return -1;
+	/* Every caller places a key the table doesn't hold yet */
+	if (table->iteratorKVList != NULL && lst_AppendNewKey(table->iteratorKVList, index, key) == 0)
+		return -1;
+
+	page->slots[(size_t) index & (_SlotsPerPage(table) - 1)] = element;
+	table->count++;
+	if (collided)
+	{
+		(*displacedCount)++;
+		table->displacedCount++;
+	}
+	table->usedBytes += _BytesForKey(key);
+
+	return index;
+}
+
+static bool _PlaceSharedElement(struct HashTable *storage, struct HashTableElement *element)
+{
+	/* Into a second storage, the pages of both hold a reference */
+	_RetainElement(element);
+	if (_PlaceElement(storage, element) != -1)
+		return 1;
+
+	_ReleaseElement(storage->keyPool, element);
+	return 0;
+}
+
+#pragma mark Removing
+void htbl_RemoveKey(struct HashTable *table, char *key)
+{
+	if (table == NULL)
+		return;
+	if (key == NULL)
+		return;
+	if (strlen(key) == 0)
+		return;
+	if (table->recorder != NULL)
+		wtrc_Record(table->recorder, WTRC_REMOVE, key);
+	if (table->file != NULL)
+	{
+		if (ftbl_RemoveKey(table->file, key) && table->filter != NULL)
+			blm_Remove(table->filter, _CuckooHash(key));
+		return;
+	}
+
+	/*	Passing in a ptr to a key In a table will
+		couse a loosing one after a removal of element, so we backup
+		the key.
+	 */
+	size_t len = strlen(key);
+	char backedUpKey[len + 1];
+	memcpy(backedUpKey, key, len + 1);
+
+	uint64_t traceStart = _BeginTracedOperation(table, HTBL_OP_REMOVE);
+	if (table->draining != NULL)
+		_RehashStep(table);
+	_RemoveKeyValuePair(table, backedUpKey);
+	_CompactLog(table);
+	_EndTracedOperation(table, traceStart);
+}
+
+void htbl_Clear(struct HashTable *table, htbl_DestroyFunction destroy, void *context)
+{
+	if (table == NULL)
+		return;
+	if (table->recorder != NULL)
+		wtrc_Record(table->recorder, WTRC_CLEAR, NULL);
+	if (table->file != NULL)
+	{
+		if (destroy != NULL)
+			_ScanWholeFile(table, destroy, context, NULL);
+		ftbl_RemoveAll(table->file);
+		blm_RemoveAll(table->filter);
+		return;
+	}
+
+	_RemoveAllElements(table, destroy, context);
+	if (table->log != NULL)
+	{
+		_LogChange(table, WLOG_REMOVE_ALL, NULL, NULL);
+		_CompactLog(table);
+	}
+}
+
+int htbl_Sync(struct HashTable *table)
+{
+	if (table == NULL)
+		return 0;
+	if (table->log != NULL)
+		return wlog_Commit(table->log);
+	return ftbl_Sync(table->file);
+}
+
+static void _RemoveAllElements(struct HashTable *table, htbl_DestroyFunction destroy, void *context)
+{
+	/* The pages are swapped for empty ones, shared ones aren't copied.
+	 * Allocated up front: out of memory, nothing is removed. */
+	struct HashTable emptyPages = {.options = table->options};
+	if (table->cuckoo == NULL && _AllocatePages(&emptyPages, (size_t) table->size, table->pageShift) == 0)
+		return;
+
+	/* One pass over the slots; the side lists are emptied as a whole
+	 * instead of being searched for every key */
+	tindex_t left = table->count;
+	for (tindex_t i = 0; i < table->size && left != 0 && destroy != NULL; ++i)
+	{
+		struct HashTableElement *element = _ElementAtIndex(table, i);
+		if (element == NULL)
+			continue;
+
+		destroy(element->key, element->value, context);
+		left--;
+	}
+	if (table->cuckoo != NULL)
+	{
+		/* Swaps the chunks for empty ones, shared ones aren't copied */
+		cuck_RemoveAll(table->cuckoo);
+		table->count = (tindex_t) cuck_Count(table->cuckoo);
+	} else
+	{
+		_ReleasePages(table);
+		table->slots = emptyPages.slots;
+		table->pages = emptyPages.pages;
+		table->count = 0;
+	}
+	if (table->draining != NULL)
+		_RemoveDrainingElements(table, destroy, context);
+
+	lst_RemoveAll(table->iteratorKVList);
+	table->displacedCount = 0;
+	rdx_RemoveAll(table->prefixIndex);
+	blm_RemoveAll(table->filter);
+	twhl_Free(table->wheel); /* Scheduled entries were freed with their elements */
+	table->wheel = NULL;
+	table->usedBytes = table->count ? table->usedBytes : 0;
+	table->clockHand = 0;
+}
+
+static void _RemoveKeyValuePair(struct HashTable *table, char *key)
+{
+	tindex_t index = _FindExistingIndexForKey(table, key);
+	if (index != -1)
+	{
+		_RemoveKeyValuePairAtIndex(table, index);
+		return;
+	}
+
+	index = _FindDrainingIndexForKey(table, key);
+	if (index != -1)
+		_RemoveDrainingElementAtIndex(table, index);
+}
+
+static void _RemoveKeyValuePairAtIndex(struct HashTable *table, tindex_t index)
+{
+	struct HashTableElement *element = _ElementAtIndex(table, index);
+	if (table->cuckoo == NULL)
+	{
+		if (_DetachElementAtIndex(table, index) == 0)
+			return; /* Out of memory copying a page shared with a clone */
+	} else
+	{
+		if (cuck_RemoveAtIndex(table->cuckoo, index) == 0)
+			return; /* Out of memory copying a chunk shared with a clone */
+		table->usedBytes -= _BytesForKey(element->key);
+		table->count--;
+	}
+
+	_DiscardElement(table, element);
+}
+
+static bool _DetachElementAtIndex(struct HashTable *storage, tindex_t index)
+{
+	/* Out of the slots and the lists, but still alive: the reference of
+	 * the page goes to the caller */
+	struct HashTableSlotPage *page = _WritablePage(storage, index);
+	if (page == NULL)
+		return 0;
+	struct HashTableElement *element = page->slots[(size_t) index & (_SlotsPerPage(storage) - 1)];
+	tindex_t home = _HomeIndexForKey(storage, element->key);
+	uint32_t *displacedCount = NULL;
+	if (home != index)
+	{
+		displacedCount = _WritableDisplacedCount(storage, home);
+		if (displacedCount == NULL)
+			return 0;
+	}
+
+	lst_RemoveElementWithKey(storage->iteratorKVList, element->key);
+	page->slots[(size_t) index & (_SlotsPerPage(storage) - 1)] = NULL;
+	if (displacedCount != NULL)
+	{
+		(*displacedCount)--;
+		storage->displacedCount--;
+	}
+	storage->usedBytes -= _BytesForKey(element->key);
+	storage->count--;
+	return 1;
+}
+
+static void _DiscardElement(struct HashTable *table, struct HashTableElement *element)
+{
+	_CancelElementTimer(table, element);
+	rdx_Remove(table->prefixIndex, element->key);
+	if (table->filter != NULL)
+		blm_Remove(table->filter, _CuckooHash(element->key));
+	if (table->log != NULL) /* Expired and evicted elements as well */
+		_LogChange(table, WLOG_REMOVE, element->key, NULL);
+	_ReleaseElement(table->keyPool, element);
+}
+
+#pragma mark Setters
+static struct HashTableElement *_SetValueForKey(struct HashTable *table, void *value, char *key, bool borrowKey)
+{
+	struct HashTableElement *element = _StoreValueForKey(table, value, key, borrowKey);
+	if (element != NULL && table->log != NULL)
+		_LogChange(table, WLOG_SET, element->key, value);
+	return element;
+}
+
+static struct HashTableElement *_StoreValueForKey(struct HashTable *table, void *value, char *key, bool borrowKey)
+{
+	tindex_t index = _FindLiveIndexForKey(table, key);
+	if (index != -1)
+	{
+		struct HashTableElement *element = _WritableElementAtIndex(table, index);
+		if (element == NULL)
+			return NULL;
+		_SetValueInElement(element, value);
+		element->referenced = 1;
+		return element;
+	}
+
+	index = _FindLiveDrainingIndexForKey(table, key);
+	if (index != -1)
+	{
+		struct HashTableElement *drainingElement = _UnshareElementInStorage(table, table->draining, index);
+		if (drainingElement == NULL)
+			return NULL;
+		_SetValueInElement(drainingElement, value);
+		drainingElement->referenced = 1;
+		return drainingElement;
+	}
+
+	if (_IsCacheTable(table))
+		_EvictForKey(table, key);
+
+	return _AddKeyValuePair(table, key, value, borrowKey);
+}
+
+#pragma mark Getters
+void *htbl_ValueForKey(struct HashTable *table, char *key)
+{
+	if (table == NULL)
+		return NULL;
+	if (key == NULL)
+		return NULL;
+	if (strlen(key) == 0)
+		return NULL;
+	if (table->recorder != NULL)
+		wtrc_Record(table->recorder, WTRC_GET, key);
+	if (table->filter != NULL && blm_MayContain(table->filter, _CuckooHash(key)) == 0)
+	{
+		STAT(table->counters.misses++);
+		STAT(table->counters.filteredMisses++);
+		return NULL;
+	}
+	if (table->file != NULL)
+		return _ValueInFile(table, key);
+
+	/* Pooled or not, the key is found by the table's own probe */
+	uint64_t traceStart = _BeginTracedOperation(table, HTBL_OP_GET);
+	if (table->draining != NULL)
+		_RehashStep(table);
+	void *value = _ValueForKey(table, key);
+	_EndTracedOperation(table, traceStart);
+	return value;
+}
+
+static void *_ValueForKey(struct HashTable *table, char *key)
+{
+	tindex_t index = _FindLiveIndexForKey(table, key);
+	struct HashTableElement *element = (index < 0) ? _FindLiveDrainingElementForKey(table, key) : _ElementAtIndex(table, index);
+	if (element == NULL)
+	{
+		STAT(table->counters.misses++);
+		return NULL;
+	}
+	STAT(table->counters.hits++);
+
+	if (_IsCacheTable(table)) /* Others may share the element with a clone */
+		element->referenced = 1;
+	return element->value;
+}
+
+static inline struct HashTableElement *_ElementAtIndex(struct HashTable *table, tindex_t index)
+{
+	if (table->cuckoo != NULL)
+		return cuck_ItemAtIndex(table->cuckoo, index);
+
+	return table->slots[(size_t) index >> table->pageShift][(size_t) index & (_SlotsPerPage(table) - 1)];
+}
+
+static struct HashTableElement *_WritableElementAtIndex(struct HashTable *table, tindex_t index)
+{
+	return _UnshareElementInStorage(table, table, index);
+}
+
+static struct HashTableElement *_UnshareElementInStorage(struct HashTable *table, struct HashTable *storage, tindex_t index)
+{
+	/* Copy-on-write: first the page or chunk of the slot, then the
+	 * element itself. The copy shares the key, which the side list
+	 * and the prefix index point at. */
+	struct HashTableElement **slot = _WritableSlotAtIndex(storage, index);
+	if (slot == NULL)
+		return NULL;
+	struct HashTableElement *element = *slot;
+	if (__atomic_load_n(&element->references, __ATOMIC_ACQUIRE) == 1)
+		return element;
+
+	struct HashTableElement *copy = _CopyElement(table->keyPool, element);
+	if (copy == NULL)
+		return NULL;
+	*slot = copy;
+	if (element->timer != NULL) /* Only ever shared with the draining storage */
+	{
+		copy->timer = element->timer;
+		copy->timer->element = copy;
+		element->timer = NULL;
+	}
+	if (table->prefixIndex != NULL) /* Same key, can't run out of memory */
+		rdx_Insert(table->prefixIndex, copy->key, copy);
+	_ReleaseElement(table->keyPool, element);
+	return copy;
+}
+
+static struct HashTableElement **_WritableSlotAtIndex(struct HashTable *storage, tindex_t index)
+{
+	if (storage->cuckoo != NULL)
+		return (struct HashTableElement **) cuck_WritableSlotAtIndex(storage->cuckoo, index);
+
+	struct HashTableSlotPage *page = _WritablePage(storage, index);
+	if (page == NULL)
+		return NULL;
+	return &page->slots[(size_t) index & (_SlotsPerPage(storage) - 1)];
+}
+
+#pragma mark Checkers
+static bool _IsElementAtIndexEmpty(struct HashTable *table, tindex_t index)
+{
+	struct HashTableElement *element = _ElementAtIndex(table, index);
+	return (element == NULL);
+}
+
+static bool _IsElementAtIndexForKey(struct HashTable *table, tindex_t index, char *key)
+{
+	struct HashTableElement *element = _ElementAtIndex(table, index);
+	if (element == NULL)
+		return 0;
+	return _IsElementForKey(element, key);
+}
+
+static bool _IsElementForKey(struct HashTableElement *element, char *key)
+{
+	/* Callers holding the pooled key skip the string compare */
+	char *elementKey = element->key;
+	if (elementKey == key)
+		return 1;
+	int compareResult = strncmp(elementKey, key, STRING_MAX_LEN);
+
+	return compareResult ? 0 : 1;
+}
+
+#pragma mark Searching
+static tindex_t _FindExistingIndexForKey(struct HashTable *table, char *key)
+{
+	if (table->cuckoo != NULL)
+		return cuck_FindIndex(table->cuckoo, _CuckooHash(key), _CuckooMatch, key);
+
+	// Search in hash index
+	tindex_t desiredIndex = _HomeIndexForKey(table, key);
+	bool containsDesiredElement = _IsElementAtIndexForKey(table, desiredIndex, key);
+	if (containsDesiredElement != 0)
+	{
+		STAT(_CountProbe(table, desiredIndex, desiredIndex));
+		return desiredIndex;
+	}
+
+	// Search after it, if any element with that home slot was displaced
+	if (_DisplacedCount(table, desiredIndex) == 0)
+		return -1;
+	STAT(table->counters.collisionsListWalks++);
+	tindex_t collisionIndex = _FindDisplacedIndexForKey(table, desiredIndex, key);
+	if (collisionIndex != -1)
+	{
+		STAT(_CountProbe(table, desiredIndex, collisionIndex));
+		return collisionIndex;
+	}
+
+	return -1;
+}
+
+static tindex_t _FindDisplacedIndexForKey(struct HashTable *table, tindex_t home, char *key)
+{
+	/* Displaced elements went to the first empty slot after their home
+	 * slot and removals since may have left holes: walks on until it met
+	 * the key or every element displaced from there */
+	uint32_t left = _DisplacedCount(table, home);
+	tindex_t index = home;
+	tindex_t foundIndex = -1;
+	while (left > 0)
+	{
+		index = (index + 1) & table->hashMask;
+		if (index == home)
+			break;
+		struct HashTableElement *element = _ElementAtIndex(table, index);
+		if (element == NULL)
+			continue;
+		if (_IsElementForKey(element, key))
+		{
+			foundIndex = index;
+			break;
+		}
+		if (_HomeIndexForKey(table, element->key) == home)
+			left--;
+	}
+
+	if (table->trace != NULL)
+		_TraceProbe(table, (size_t) _ProbeLength(table, home, index));
+	return foundIndex;
+}
+
+static tindex_t _FindLiveIndexForKey(struct HashTable *table, char *key)
+{
+	tindex_t index = _FindExistingIndexForKey(table, key);
+	if (index == -1)
+		return -1;
+
+	/* Expired elements are collected lazily by whoever finds them first */
+	if (_IsElementExpired(table, _ElementAtIndex(table, index)))
+	{
+		_RemoveKeyValuePairAtIndex(table, index);
+		return -1;
+	}
+
+	return index;
+}
+
+static tindex_t _FindEmptyIndexAfterIndex(struct HashTable *table, tindex_t startIndex)
+{
+	tindex_t currentIndex = startIndex;
+
+	while (_IsElementAtIndexEmpty(table, currentIndex) == 0)
+	{
+		currentIndex = (currentIndex + 1) & table->hashMask;
+		if (currentIndex == startIndex) /* If made a full circle */
+			return -1;
+	}
+
+	STAT(_CountProbe(table, startIndex, currentIndex));
+	if (table->trace != NULL)
+		_TraceProbe(table, (size_t) _ProbeLength(table, startIndex, currentIndex));
+	return currentIndex;
+}
+
+#pragma mark Optimization
+static void _OptimizeTable(struct HashTable *table)
+{
+	if (table->draining != NULL)
+		_RehashStep(table);
+	else if (table->cuckoo == NULL && _IsTableFlooded(table))
+		_Reseed(table);
+
+	if (_ElementCount(table) > table->growAt)
+		_ResizeTable(table, _GrownSize(table));
+}
+
+static size_t _GrownSize(struct HashTable *table)
+{
+	size_t size = (size_t) ((double) table->size * table->options.growthFactor);
+	if (size <= (size_t) table->size)
+		size = (size_t) table->size + 1;
+	return _RoundUpToPowerOfTwo(size);
+}
+
+static void _ResizeTable(struct HashTable *table, size_t newSize)
+{
+	size_t oldSize = (size_t) table->size;
+	struct HashTableTrace *trace = table->trace;
+	if (trace != NULL && trace->hooks.resizeStarted != NULL)
+		trace->hooks.resizeStarted(table, oldSize, newSize, trace->hooks.context);
+
+	uint64_t startTime = util_MonotonicNanoseconds();
+	if (table->cuckoo != NULL)
+	{
+		/* Grows in place, by doubling */
+		if (cuck_Grow(table->cuckoo) == 0)
+			return;
+		_SetSize(table, (tindex_t) cuck_SlotCount(table->cuckoo));
+		table->clockHand = 0;
+		newSize = (size_t) table->size;
+	} else if (_MoveElementsToNewStorage(table, newSize) == 0)
+	{
+		return;
+	}
+
+	uint64_t duration = util_MonotonicNanoseconds() - startTime;
+	STAT(table->counters.resizeCount++);
+	STAT(table->counters.resizeNanoseconds += duration);
+	if (trace != NULL)
+	{
+		struct HashTableTraceEvent event = {HTBL_TRACE_RESIZE, HTBL_OP_SET, startTime, duration, oldSize, newSize, 0};
+		_RecordTraceEvent(trace, &event);
+		if (trace->hooks.resizeFinished != NULL)
+			trace->hooks.resizeFinished(table, oldSize, newSize, duration, trace->hooks.context);
+	}
+}
+
+static bool _MoveElementsToNewStorage(struct HashTable *table, size_t newSize)
+{
+	struct HashTable *tmpTable = _CreateStorageLike(table, newSize);
+	if (tmpTable == NULL)
+		return 0;
+	tmpTable->seeded = table->seeded;
+	memcpy(tmpTable->hashSeed, table->hashSeed, sizeof(table->hashSeed));
+
+	/* Move the very same elements over, so nothing attached to them
+	 * (like the CLOCK bit) gets lost. In the order of the list, if the
+	 * table keeps one, for it to keep the insertion order. */
+	if (table->iteratorKVList != NULL)
+	{
+		struct KeyValueListIterator *listIterator = lst_IteratorForList(table->iteratorKVList);
+		while (lst_IsIteratorValid(listIterator) && _PlaceSharedElement(tmpTable, _ElementAtIndex(table, listIterator->value)))
+			listIterator->next(listIterator);
+		lst_FreeIterator(listIterator);
+	} else
+	{
+		for (tindex_t i = 0; i < table->size; ++i)
+		{
+			struct HashTableElement *element = _ElementAtIndex(table, i);
+			if (element != NULL && _PlaceSharedElement(tmpTable, element) == 0)
+				break;
+		}
+	}
+
+	if (tmpTable->count != table->count) // Out of memory, the iterator included
+	{
+		_ReleaseTableStorage(tmpTable);
+		_FreeTableStructButLeakContents(tmpTable);
+		return 0;
+	}
+
+	_AdoptStorageOfTable(table, tmpTable);
+	return 1;
+}
+
+#pragma mark Cache
+static bool _IsCacheTable(struct HashTable *table)
+{
+	return (table->maxCount != 0 || table->maxBytes != 0);
+}
+
+static bool _IsCacheFullForKey(struct HashTable *table, char *key)
+{
+	if (table->maxCount != 0 && _ElementCount(table) >= table->maxCount)
+		return 1;
+	if (table->maxBytes != 0 && _UsedBytes(table) + _BytesForKey(key) > table->maxBytes)
+		return 1;
+	return 0;
+}
+
+static void _EvictForKey(struct HashTable *table, char *key)
+{
+	while (table->count > 0 && _IsCacheFullForKey(table, key))
+	{
+		tindex_t index = _FindClockVictim(table);
+		struct HashTableElement *element = _ElementAtIndex(table, index);
+		if (table->evictFunction != NULL)
+			table->evictFunction(element->key, element->value, table->evictContext);
+
+		_RemoveKeyValuePairAtIndex(table, index);
+	}
+}
+
+static tindex_t _FindClockVictim(struct HashTable *table)
+{
+	/* Second chance: referenced elements lose their bit and survive
+	 * one more sweep. Terminates within two sweeps as the table is not empty. */
+	for (; ;)
+	{
+		tindex_t index = table->clockHand;
+		table->clockHand = (table->clockHand + 1) & table->hashMask;
+
+		struct HashTableElement *element = _ElementAtIndex(table, index);
+		if (element == NULL)
+			continue;
+
+		if (element->referenced)
+		{
+			element->referenced = 0;
+			continue;
+		}
+
+		return index;
+	}
+}
+
+#pragma mark Expiration
+void htbl_SetValueForKeyTTL(struct HashTable *table, void *value, char *key, uint64_t ttl)
+{
+	if (table == NULL)
+		return;
+	if (key == NULL)
+		return;
+	if (strlen(key) == 0)
+		return;
+	if (value == NULL)
+		return;
+	if (table->recorder != NULL) /* Replayed without a ttl */
+		wtrc_Record(table->recorder, WTRC_SET, key);
+	if (table->file != NULL) /* Copies the key into the file, keeps no ttl */
+	{
+		_SetValueInFile(table, key, value);
+		return;
+	}
+
+	size_t len = strlen(key);
+	char backedUpKey[len + 1];
+	memcpy(backedUpKey, key, len + 1);
+
+	uint64_t traceStart = _BeginTracedOperation(table, HTBL_OP_SET);
+	char *pinnedKey = _PinKey(table, backedUpKey);
+	if (pinnedKey != NULL)
+	{
+		_OptimizeTable(table);
+		struct HashTableElement *element = _SetValueForKey(table, value, pinnedKey, 0);
+		if (element != NULL)
+			_SetElementTTL(table, element, ttl);
+	}
+	_UnpinKey(table, pinnedKey);
+	_CompactLog(table);
+	_EndTracedOperation(table, traceStart);
+}
+
+void htbl_Tick(struct HashTable *table, uint64_t now)
+{
+	if (table == NULL)
+		return;
+
+	if (now > table->now)
+		table->now = now;
+	twhl_Advance(table->wheel, table->now, HTBL_TICK_BUDGET, _ExpireTimerEntry, table);
+	_CompactLog(table);
+}
+
+static void _SetElementTTL(struct HashTable *table, struct HashTableElement *element, uint64_t ttl)
+{
+	if (ttl == 0)
+	{
+		_CancelElementTimer(table, element);
+		return;
+	}
+
+	if (table->wheel == NULL)
+	{
+		table->wheel = twhl_Create(table->now);
+		if (table->wheel == NULL)
+			return;
+	}
+	if (element->timer == NULL)
+	{
+		element->timer = calloc(1, sizeof(struct HashTableTimer));
+		if (element->timer == NULL)
+			return;
+		element->timer->element = element;
+	}
+
+	twhl_Schedule(table->wheel, &element->timer->entry, table->now + ttl);
+}
+
+static void _CancelElementTimer(struct HashTable *table, struct HashTableElement *element)
+{
+	if (element->timer == NULL)
+		return;
+
+	twhl_Cancel(table->wheel, &element->timer->entry);
+	free(element->timer);
+	element->timer = NULL;
+}
+
+static bool _IsElementExpired(struct HashTable *table, struct HashTableElement *element)
+{
+	if (element->timer == NULL)
+		return 0;
+	uint64_t deadline = element->timer->entry.deadline;
+	return (deadline != 0 && deadline <= table->now);
+}
+
+static void _ExpireTimerEntry(struct TimerWheelEntry *entry, void *context)
+{
+	struct HashTable *table = context;
+	struct HashTableElement *element = ((struct HashTableTimer *) entry)->element;
+
+	_RemoveKeyValuePair(table, element->key);
+}
+
+#pragma mark Flooding Defence
+static tindex_t _HomeIndexForKey(struct HashTable *table, char *key)
+{
+	if (table->seeded == 0)
+		return _HashFunction(key, table->size);
+	return (tindex_t) (_SipHash(table->hashSeed, key) & (uint64_t) table->hashMask);
+}
+
+static bool _IsTableFlooded(struct HashTable *table)
+{
+	/* The character sum is trivial to collide on purpose: many keys end
+	 * up in one long cluster, displaced from their home slots. Seeded,
+	 * long probes near the load limit are just linear probing: only
+	 * most keys displaced (a third at most otherwise) still counts. */
+	if (table->seeded == 0 && table->longProbes >= HTBL_FLOOD_LONG_PROBES)
+		return 1;
+
+	size_t displaced = table->displacedCount;
+	return (displaced > HTBL_FLOOD_CHAIN_LENGTH && displaced > (size_t) table->count * 3 / 4);
+}
+
+static void _Reseed(struct HashTable *table)
+{
+	/* The elements stay in the old storage and move over to a fresh one
+	 * hashed with a new random seed as the next operations go */
+	struct HashTable *draining = _CreateStorageLike(table, (size_t) table->size);
+	if (draining == NULL)
+		return;
+
+	_SwapStorage(table, draining);
+	table->version++;
+	/* Never iterated, iterators finish the rehash first. Without it
+	 * taking an element out of the old storage doesn't search a list. */
+	lst_Free(draining->iteratorKVList);
+	draining->iteratorKVList = NULL;
+	table->draining = draining;
+	table->drainIndex = 0;
+	table->seeded = 1;
+	_RandomSeed(table->hashSeed);
+	table->longProbes = 0;
+	table->clockHand = 0;
+	STAT(table->counters.reseedCount++);
+
+	if (_IsCacheTable(table)) /* Eviction only sweeps one storage, and caches are bounded anyway */
+		_FinishRehash(table);
+}
+
+static void _SwapStorage(struct HashTable *table, struct HashTable *otherTable)
+{
+	struct HashTable temporary = *table;
+
+	table->slots = otherTable->slots;
+	table->pages = otherTable->pages;
+	table->pageShift = otherTable->pageShift;
+	table->iteratorKVList = otherTable->iteratorKVList;
+	table->displacedCount = otherTable->displacedCount;
+	_SetSize(table, otherTable->size);
+	table->count = otherTable->count;
+	table->usedBytes = otherTable->usedBytes;
+	table->seeded = otherTable->seeded;
+	memcpy(table->hashSeed, otherTable->hashSeed, sizeof(table->hashSeed));
+
+	otherTable->slots = temporary.slots;
+	otherTable->pages = temporary.pages;
+	otherTable->pageShift = temporary.pageShift;
+	otherTable->iteratorKVList = temporary.iteratorKVList;
+	otherTable->displacedCount = temporary.displacedCount;
+	_SetSize(otherTable, temporary.size);
+	otherTable->count = temporary.count;
+	otherTable->usedBytes = temporary.usedBytes;
+	otherTable->seeded = temporary.seeded;
+	memcpy(otherTable->hashSeed, temporary.hashSeed, sizeof(table->hashSeed));
+}
+
+static bool _RehashStep(struct HashTable *table)
+{
+	/* Moves up to HTBL_REHASH_STEP elements, looking at a bounded number
+	 * of slots. The old pages are only read (a clone may share them):
+	 * slots before drainIndex count as empty, whatever they still hold. */
+	struct HashTable *draining = table->draining;
+	tindex_t scanLimit = table->drainIndex + HTBL_REHASH_STEP * 4;
+	if (scanLimit > draining->size)
+		scanLimit = draining->size;
+	int moved = 0;
+	while (draining->count != 0 && table->drainIndex < scanLimit && moved < HTBL_REHASH_STEP)
+	{
+		struct HashTableElement *element = _ElementAtIndex(draining, table->drainIndex);
+		if (element != NULL)
+		{
+			if (_PlaceSharedElement(table, element) == 0)
+				return 0; /* Out of memory, it stays where it is for now */
+			draining->usedBytes -= _BytesForKey(element->key);
+			draining->count--;
+			moved++;
+		}
+		table->drainIndex++;
+	}
+
+	if (draining->count == 0)
+	{
+		_ReleaseTableStorage(draining);
+		_FreeTableStructButLeakContents(draining);
+		table->draining = NULL;
+	}
+	return 1;
+}
+
+static bool _FinishRehash(struct HashTable *table)
+{
+	while (table->draining != NULL)
+	{
+		if (_RehashStep(table) == 0)
+			return 0;
+	}
+	return 1;
+}
+
+static tindex_t _FindDrainingIndexForKey(struct HashTable *table, char *key)
+{
+	if (table->draining == NULL)
+		return -1;
+	tindex_t index = _FindExistingIndexForKey(table->draining, key);
+	if (index < table->drainIndex) /* Moved over already */
+		return -1;
+	return index;
+}
+
+static tindex_t _FindLiveDrainingIndexForKey(struct HashTable *table, char *key)
+{
+	/* Elements not moved over yet are used right where they are */
+	tindex_t index = _FindDrainingIndexForKey(table, key);
+	if (index == -1)
+		return -1;
+
+	if (_IsElementExpired(table, _ElementAtIndex(table->draining, index)))
+	{
+		_RemoveDrainingElementAtIndex(table, index);
+		return -1;
+	}
+	return index;
+}
+
+static struct HashTableElement *_FindLiveDrainingElementForKey(struct HashTable *table, char *key)
+{
+	tindex_t index = _FindLiveDrainingIndexForKey(table, key);
+	if (index == -1)
+		return NULL;
+	return _ElementAtIndex(table->draining, index);
+}
+
+static void _RemoveDrainingElementAtIndex(struct HashTable *table, tindex_t index)
+{
+	struct HashTableElement *element = _ElementAtIndex(table->draining, index);
+	if (_DetachElementAtIndex(table->draining, index) == 0)
+		return; /* Out of memory copying a page shared with a clone */
+	_DiscardElement(table, element);
+}
+
+static void _RemoveDrainingElements(struct HashTable *table, htbl_DestroyFunction destroy, void *context)
+{
+	/* The elements go with the pages, the ones moved over already are
+	 * held by the table's pages as well */
+	struct HashTable *draining = table->draining;
+	for (tindex_t i = table->drainIndex; i < draining->size && destroy != NULL; ++i)
+	{
+		struct HashTableElement *element = _ElementAtIndex(draining, i);
+		if (element != NULL)
+			destroy(element->key, element->value, context);
+	}
+
+	_ReleaseTableStorage(draining);
+	_FreeTableStructButLeakContents(draining);
+	table->draining = NULL;
+}
+
+static inline tindex_t _ElementCount(struct HashTable *table)
+{
+	return table->count + (table->draining ? table->draining->count : 0);
+}
+
+static inline size_t _UsedBytes(struct HashTable *table)
+{
+	return table->usedBytes + (table->draining ? table->draining->usedBytes : 0);
+}
+
+static void _RandomSeed(uint64_t seed[2])
+{
+#ifdef __APPLE__
+	arc4random_buf(seed, 2 * sizeof(uint64_t));
+#else
+	if (getrandom(seed, 2 * sizeof(uint64_t), GRND_NONBLOCK) == 2 * sizeof(uint64_t))
+		return;
+
+	/* Not secret, but still different for every run and every table */
+	seed[0] = util_MonotonicNanoseconds() ^ (uint64_t) (uintptr_t) seed;
+	seed[1] = (seed[0] ^ (uint64_t) clock()) * 0x9E3779B97F4A7C15ull;
+#endif
+}
+
+static inline uint64_t _RotateLeft(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static inline void _SipRound(uint64_t v[4])
+{
+	v[0] += v[1]; v[1] = _RotateLeft(v[1], 13); v[1] ^= v[0]; v[0] = _RotateLeft(v[0], 32);
+	v[2] += v[3]; v[3] = _RotateLeft(v[3], 16); v[3] ^= v[2];
+	v[0] += v[3]; v[3] = _RotateLeft(v[3], 21); v[3] ^= v[0];
+	v[2] += v[1]; v[1] = _RotateLeft(v[1], 17); v[1] ^= v[2]; v[2] = _RotateLeft(v[2], 32);
+}
+
+static uint64_t _SipHash(uint64_t seed[2], char *key)
+{
+	/* SipHash-2-4, little-endian words */
+	const unsigned char *bytes = (const unsigned char *) key;
+	size_t length = strlen(key);
+	uint64_t v[4] = {
+		0x736f6d6570736575ull ^ seed[0], 0x646f72616e646f6dull ^ seed[1],
+		0x6c7967656e657261ull ^ seed[0], 0x7465646279746573ull ^ seed[1]
+	};
+
+	size_t wordsEnd = length & ~(size_t) 7;
+	uint64_t word = 0;
+	for (size_t i = 0; i < wordsEnd; i += 8)
+	{
+		word = 0;
+		for (int byte = 0; byte < 8; ++byte)
+			word |= (uint64_t) bytes[i + byte] << (8 * byte);
+		v[3] ^= word;
+		_SipRound(v);
+		_SipRound(v);
+		v[0] ^= word;
+	}
+
+	word = (uint64_t) length << 56;
+	for (size_t i = wordsEnd; i < length; ++i)
+		word |= (uint64_t) bytes[i] << (8 * (i - wordsEnd));
+	v[3] ^= word;
+	_SipRound(v);
+	_SipRound(v);
+	v[0] ^= word;
+
+	v[2] ^= 0xff;
+	for (int round = 0; round < 4; ++round)
+		_SipRound(v);
+	return v[0] ^ v[1] ^ v[2] ^ v[3];
+}
+
+#pragma mark Statistics
+void htbl_GetStats(struct HashTable *table, struct HashTableStats *stats)
+{
+	if (stats == NULL)
+		return;
+	memset(stats, 0, sizeof(struct HashTableStats));
+	if (table == NULL)
+		return;
+	if (table->file != NULL)
+	{
+		_GetFileTableStats(table, stats);
+		return;
+	}
+
+	struct HashTable *draining = table->draining;
+	stats->count = (size_t) _ElementCount(table);
+	stats->capacity = (size_t) table->size;
+	stats->loadFactor = table->size ? (double) stats->count / table->size : 0;
+	stats->collisionsCount = table->cuckoo ? cuck_StashCount(table->cuckoo) : table->displacedCount;
+	stats->seeded = table->seeded;
+	if (draining != NULL)
+		stats->collisionsCount += draining->displacedCount;
+
+	struct HashTableCounters *counters = &table->counters;
+	memcpy(stats->probeHistogram, counters->probeHistogram, sizeof(stats->probeHistogram));
+	stats->longestProbe = counters->longestProbe;
+	stats->collisionsListWalks = counters->collisionsListWalks;
+	stats->resizeCount = counters->resizeCount;
+	stats->resizeNanoseconds = counters->resizeNanoseconds;
+	stats->reseedCount = counters->reseedCount;
+	stats->hits = counters->hits;
+	stats->misses = counters->misses;
+	stats->filteredMisses = counters->filteredMisses;
+
+	stats->slotBytes = table->cuckoo ? cuck_BytesUsed(table->cuckoo) : _SlotBytes(table);
+	stats->elementBytes = stats->count * sizeof(struct HashTableElement);
+	stats->keyBytes = _UsedBytes(table) - stats->elementBytes;
+	stats->sideListBytes = lst_BytesUsed(table->iteratorKVList) + rdx_BytesUsed(table->prefixIndex) + blm_BytesUsed(table->filter);
+	stats->sideListBytes += table->cuckoo ? 0 : _DisplacedCountBytes(table);
+	if (draining != NULL)
+	{
+		stats->slotBytes += _SlotBytes(draining);
+		stats->sideListBytes += _DisplacedCountBytes(draining);
+	}
+	stats->totalBytes = sizeof(struct HashTable) + stats->slotBytes + stats->elementBytes + stats->keyBytes + stats->sideListBytes;
+}
+
+#if HTBL_STATS
+static void _CountProbe(struct HashTable *table, tindex_t fromIndex, tindex_t toIndex)
+{
+	size_t length = (size_t) _ProbeLength(table, fromIndex, toIndex);
+
+	int bucket = 0;
+	for (size_t rest = length; rest != 0 && bucket < HTBL_PROBE_HISTOGRAM_SIZE - 1; rest >>= 1)
+		++bucket;
+
+	table->counters.probeHistogram[bucket]++;
+	if (length > table->counters.longestProbe)
+		table->counters.longestProbe = length;
+}
+#endif
+
+#pragma mark Tracing
+void htbl_SetTraceHooks(struct HashTable *table, struct HashTableTraceHooks *hooks)
+{
+	if (table == NULL)
+		return;
+
+	if (table->trace != NULL)
+	{
+		free(table->trace->events);
+		free(table->trace);
+		table->trace = NULL;
+	}
+	if (hooks == NULL)
+		return;
+
+	struct HashTableTrace *trace = calloc(1, sizeof(struct HashTableTrace));
+	if (trace == NULL)
+		return;
+	trace->hooks = *hooks;
+
+	if (hooks->ringCapacity != 0)
+	{
+		trace->events = calloc(hooks->ringCapacity, sizeof(struct HashTableTraceEvent));
+		if (trace->events == NULL)
+		{
+			free(trace);
+			return;
+		}
+	}
+
+	table->trace = trace;
+}
+
+size_t htbl_CopyTraceEvents(struct HashTable *table, struct HashTableTraceEvent *events, size_t capacity)
+{
+	if (table == NULL || table->trace == NULL || events == NULL)
+		return 0;
+	if (table->trace->eventsCount == 0)
+		return 0;
+
+	/* Oldest first */
+	struct HashTableTrace *trace = table->trace;
+	size_t count = trace->eventsCount < capacity ? trace->eventsCount : capacity;
+	size_t first = _OldestTraceEventIndex(trace);
+	for (size_t i = 0; i < count; ++i)
+		events[i] = trace->events[(first + i) % trace->hooks.ringCapacity];
+
+	return count;
+}
+
+void htbl_DumpTraceEvents(struct HashTable *table, FILE *file)
+{
+	if (table == NULL || table->trace == NULL || file == NULL)
+		return;
+	if (table->trace->eventsCount == 0) /* Or no ring at all */
+		return;
+
+	static const char *kindNames[] = {"resize", "long-probe", "slow-op"};
+	static const char *operationNames[] = {"set", "get", "remove"};
+
+	/* Oldest first, straight from the ring */
+	struct HashTableTrace *trace = table->trace;
+	size_t first = _OldestTraceEventIndex(trace);
+	for (size_t i = 0; i < trace->eventsCount; ++i)
+	{
+		struct HashTableTraceEvent *event = &trace->events[(first + i) % trace->hooks.ringCapacity];
+		fprintf(file, "%llu %s", (unsigned long long) event->timestamp, kindNames[event->kind]);
+		if (event->kind == HTBL_TRACE_RESIZE)
+			fprintf(file, " %zu -> %zu in %llu ns\n", event->oldSize, event->newSize, (unsigned long long) event->nanoseconds);
+		else if (event->kind == HTBL_TRACE_LONG_PROBE)
+			fprintf(file, " %s probed %zu\n", operationNames[event->operation], event->probeLength);
+		else
+			fprintf(file, " %s took %llu ns\n", operationNames[event->operation], (unsigned long long) event->nanoseconds);
+	}
+}
+
+static uint64_t _BeginTracedOperation(struct HashTable *table, enum HashTableOperation operation)
+{
+	struct HashTableTrace *trace = table->trace;
+	if (trace == NULL)
+		return 0;
+
+	trace->operation = operation;
+	if (trace->hooks.sampleEvery == 0)
+		return 0;
+	if (++trace->sampleCounter < trace->hooks.sampleEvery)
+		return 0;
+
+	trace->sampleCounter = 0;
+	return util_MonotonicNanoseconds();
+}
+
+static void _EndTracedOperation(struct HashTable *table, uint64_t startTime)
+{
+	if (startTime == 0)
+		return;
+
+	struct HashTableTrace *trace = table->trace;
+	uint64_t duration = util_MonotonicNanoseconds() - startTime;
+	if (trace->hooks.operationSampled != NULL)
+		trace->hooks.operationSampled(table, trace->operation, duration, trace->hooks.context);
+
+	if (trace->hooks.slowOperationNanoseconds != 0 && duration >= trace->hooks.slowOperationNanoseconds)
+	{
+		struct HashTableTraceEvent event = {HTBL_TRACE_SLOW_OPERATION, trace->operation, startTime, duration, 0, 0, 0};
+		_RecordTraceEvent(trace, &event);
+	}
+}
+
+static void _TraceProbe(struct HashTable *table, size_t probeLength)
+{
+	struct HashTableTrace *trace = table->trace;
+	if (trace->hooks.probeThreshold == 0 || probeLength < trace->hooks.probeThreshold)
+		return;
+
+	if (trace->hooks.longProbe != NULL)
+		trace->hooks.longProbe(table, trace->operation, probeLength, trace->hooks.context);
+
+	struct HashTableTraceEvent event = {HTBL_TRACE_LONG_PROBE, trace->operation, util_MonotonicNanoseconds(), 0, 0, 0, probeLength};
+	_RecordTraceEvent(trace, &event);
+}
+
+static inline size_t _OldestTraceEventIndex(struct HashTableTrace *trace)
+{
+	return (trace->eventsHead + trace->hooks.ringCapacity - trace->eventsCount) % trace->hooks.ringCapacity;
+}
+
+static void _RecordTraceEvent(struct HashTableTrace *trace, struct HashTableTraceEvent *event)
+{
+	size_t capacity = trace->hooks.ringCapacity;
+	if (capacity == 0)
+		return;
+
+	trace->events[trace->eventsHead] = *event;
+	trace->eventsHead = (trace->eventsHead + 1) % capacity;
+	if (trace->eventsCount < capacity)
+		trace->eventsCount++;
+}
+
+#pragma mark Cuckoo
+static tindex_t _PlaceElementInCuckoo(struct HashTable *table, struct HashTableElement *element)
+{
+	tindex_t index = cuck_Insert(table->cuckoo, _CuckooHash(element->key), element);
+	if (index == -1)
+		return -1;
+
+	table->count++;
+	table->usedBytes += _BytesForKey(element->key);
+	return index;
+}
+
+static int _CuckooMatch(void *item, void *key)
+{
+	return _IsElementForKey(item, key);
+}
+
+static void _RetainCuckooElement(void *item, void *context)
+{
+	(void) context;
+	_RetainElement(item);
+}
+
+static void _ReleaseCuckooElement(void *item, void *context)
+{
+	_ReleaseElement(context, item);
+}
+
+static uint64_t _CuckooHash(char *key)
+{
+	/* FNV-1a, both bucket choices come out of its two halves */
+	return util_HashString(key);
+}
+
+#pragma mark Cloning
+struct HashTable *htbl_Clone(struct HashTable *table)
+{
+	if (table == NULL)
+		return NULL;
+	if (_IsCacheTable(table))
+		return NULL;
+	if (twhl_Count(table->wheel) != 0)
+		return NULL;
+	if (table->file != NULL) /* A second mapping of the same file wouldn't be a copy */
+		return NULL;
+
+	if (table->cuckoo != NULL)
+		return _CloneCuckooTable(table);
+	if (_FinishRehash(table) == 0)
+		return NULL;
+	return _CopyTable(table);
+}
+
+static struct HashTable *_CloneCuckooTable(struct HashTable *table)
+{
+	struct HashTable *clone = calloc(1, sizeof(struct HashTable));
+	if (clone == NULL)
+		return NULL;
+
+	clone->cuckoo = cuck_Clone(table->cuckoo);
+	if (clone->cuckoo == NULL)
+	{
+		free(clone);
+		return NULL;
+	}
+	clone->options = table->options;
+	_SetSize(clone, table->size);
+	clone->count = table->count;
+	clone->usedBytes = table->usedBytes;
+	clone->keyPool = kpool_Retain(table->keyPool);
+
+	return clone;
+}
+
+static struct HashTable *_CopyTable(struct HashTable *table)
+{
+	/* The pages are shared until either side writes to one. The list
+	 * belongs to a single table and isn't copied, the clone iterates
+	 * in slot order instead. */
+	struct HashTable *copy = calloc(1, sizeof(struct HashTable));
+	if (copy == NULL)
+		return NULL;
+
+	copy->options = table->options;
+	_SetSize(copy, table->size);
+	if (_SharePagesWithTable(table, copy) == 0)
+	{
+		free(copy);
+		return NULL;
+	}
+	copy->count = table->count;
+	copy->usedBytes = table->usedBytes;
+	copy->displacedCount = table->displacedCount;
+	copy->keyPool = kpool_Retain(table->keyPool);
+	copy->seeded = table->seeded;
+	memcpy(copy->hashSeed, table->hashSeed, sizeof(table->hashSeed));
+
+	return copy;
+}
+
+#pragma mark Prefix Index
+int htbl_EnablePrefixIndex(struct HashTable *table)
+{
+	if (table == NULL)
+		return 0;
+	if (table->prefixIndex != NULL)
+		return 1;
+	if (table->file != NULL)
+		return 0;
+	if (_FinishRehash(table) == 0)
+		return 0;
+
+	struct RadixTree *tree = rdx_Create();
+	if (tree == NULL)
+		return 0;
+	for (tindex_t i = 0; i < table->size; ++i)
 	{
-		free(hashTablePointer);
-		return NULL;
+		struct HashTableElement *element = _ElementAtIndex(table, i);
+		if (element == NULL)
+			continue;
+
+		if (rdx_Insert(tree, element->key, element) == 0)
+		{
+			rdx_Free(tree);
+			return 0;
+		}
 	}
 
-	return hashTablePointer;
+	table->prefixIndex = tree;
+	return 1;
 }
 
-static struct HashTable *_InitTable(struct HashTable *table, size_t size)
+void htbl_ScanPrefix(struct HashTable *table, char *prefix, htbl_ScanFunction scan, void *context)
 {
-	// How to beautify this section?
-	table->iteratorKVList = lst_CreateList();
-	if (table->iteratorKVList == NULL)
+	if (table == NULL)
+		return;
+	if (prefix == NULL)
+		return;
+	if (scan == NULL)
+		return;
+
+	if (table->file != NULL)
 	{
-		free(table->array);
-		free(table);
-		return NULL;
+		_ScanWholeFile(table, scan, context, prefix);
+		return;
 	}
-
-	table->collisionsList = lst_CreateList();
-	if (table->collisionsList == NULL)
+	if (table->prefixIndex == NULL)
 	{
-		free(table->iteratorKVList);
-		free(table->array);
-		free(table);
-		return NULL;
+		_ScanPrefixInSlots(table, table, 0, prefix, scan, context);
+		if (table->draining != NULL)
+			_ScanPrefixInSlots(table, table->draining, table->drainIndex, prefix, scan, context);
+		return;
 	}
 
-	table->size = size;
-	table->hashLimit = size;
-
-	return table;
+	struct HashTableScan prefixScan = {table, scan, context, NULL};
+	rdx_ScanPrefix(table->prefixIndex, prefix, _ScanIndexedElement, &prefixScan);
 }
 
-#pragma mark Destruction
-void htbl_Free(struct HashTable *table)
+static void _ScanIndexedElement(char *key, void *item, void *context)
 {
-	if (table == NULL)
+	struct HashTableScan *prefixScan = context;
+	struct HashTableElement *element = item;
+	if (_IsElementExpired(prefixScan->table, element))
 		return;
-
-	_FreeTableContentsButLeaveStruct(table);
-	_FreeTableStructButLeakContents(table);
+	prefixScan->scan(key, element->value, prefixScan->context);
 }
 
-static void _FreeTableContentsButLeaveStruct(struct HashTable *table)
+static void _ScanPrefixInSlots(struct HashTable *table, struct HashTable *storage, tindex_t from, char *prefix, htbl_ScanFunction scan, void *context)
 {
-	bool succeed = _RemoveAllElementsUsingIterator(table);
-	if (succeed == 0)
-		_RemoveAllElementsByHand(table);
+	/* No index: every key is checked, in slot order */
+	size_t prefixLength = strlen(prefix);
+	for (tindex_t i = from; i < storage->size; ++i)
+	{
+		struct HashTableElement *element = _ElementAtIndex(storage, i);
+		if (element == NULL)
+			continue;
+		if (strncmp(element->key, prefix, prefixLength) != 0)
+			continue;
+		if (_IsElementExpired(table, element))
+			continue;
 
-	lst_Free(table->iteratorKVList);
-	lst_Free(table->collisionsList);
-	free(table->array);
+		scan(element->key, element->value, context);
+	}
 }
 
-bool _RemoveAllElementsUsingIterator(struct HashTable *table)
+#pragma mark Cursor Scan
+size_t htbl_Scan(struct HashTable *table, size_t cursor, size_t count, htbl_ScanFunction scan, void *context)
 {
-	struct HashTableIterator *iterator = htbl_IteratorForTable(table);
-	if (iterator == NULL)
+	if (table == NULL)
+		return 0;
+	if (scan == NULL)
 		return 0;
-	while (htbl_IsValidIterator(iterator))
+	if (count == 0)
+		count = 1;
+
+	if (table->file != NULL)
 	{
-		htbl_RemoveKey(table, iterator->key);
-		iterator->next(iterator);
+		struct HashTableScan fileScan = {table, scan, context, NULL};
+		return ftbl_Scan(table->file, cursor, count, _ScanFileEntry, &fileScan);
 	}
-	htbl_FreeIterator(iterator);
-	assert(table->count == 0);
-	return 1;
+	if (table->cuckoo != NULL)
+	{
+		struct HashTableScan cuckooScan = {table, scan, context, NULL};
+		return cuck_Scan(table->cuckoo, cursor, count, _ScanCuckooElement, &cuckooScan);
+	}
+	if (_FinishRehash(table) == 0) /* Both storages hash differently */
+		return cursor;
+	return _ScanSlots(table, cursor, count, scan, context);
 }
 
-void _RemoveAllElementsByHand(struct HashTable *table)
+static size_t _ScanSlots(struct HashTable *table, size_t cursor, size_t count, htbl_ScanFunction scan, void *context)
 {
-	for (int i = 0; i < table->size; ++i)
+	/* Every element belongs to its home slot, wherever it was placed.
+	 * Home slots are visited in the order of their reversed bits: growing
+	 * splits a visited slot into slots whose reversed bits sort before
+	 * the cursor as well, so nothing visited needs a second look. */
+	size_t mask = (size_t) table->hashMask;
+	cursor &= mask;
+	do
 	{
-		if (table->array[i] == NULL)
-			continue;
+		struct HashTableElement *element = _ElementAtIndex(table, (tindex_t) cursor);
+		if (element != NULL && _HomeIndexForKey(table, element->key) == (tindex_t) cursor && !_IsElementExpired(table, element))
+			scan(element->key, element->value, context);
+		_ScanDisplacedElements(table, (tindex_t) cursor, scan, context);
+		cursor = _NextScanCursor(cursor, mask);
+	} while (cursor != 0 && --count > 0);
+
+	return cursor;
+}
 
-		_RemoveKeyValuePairAtIndex(table, i);
+static void _ScanDisplacedElements(struct HashTable *table, tindex_t home, htbl_ScanFunction scan, void *context)
+{
+	/* They went to the first empty slot after their home slot, and
+	 * removals since may have left holes: walks on until it met them all */
+	uint32_t left = _DisplacedCount(table, home);
+	for (tindex_t index = (home + 1) & table->hashMask; left > 0 && index != home; index = (index + 1) & table->hashMask)
+	{
+		struct HashTableElement *element = _ElementAtIndex(table, index);
+		if (element == NULL || _HomeIndexForKey(table, element->key) != home)
+			continue;
+		left--;
+		if (!_IsElementExpired(table, element))
+			scan(element->key, element->value, context);
 	}
 }
 
-static void _FreeTableStructButLeakContents(struct HashTable *table)
+static void _ScanCuckooElement(void *item, void *context)
 {
-	free(table);
+	struct HashTableScan *cuckooScan = context;
+	struct HashTableElement *element = item;
+	if (_IsElementExpired(cuckooScan->table, element))
+		return;
+	cuckooScan->scan(element->key, element->value, cuckooScan->context);
 }
 
-#pragma mark Adding
-void htbl_SetValueForKey(struct HashTable *table, void *value, char *key)
+static size_t _NextScanCursor(size_t cursor, size_t mask)
+{
+	/* Adds one to the reversed slot index */
+	uint64_t reversed = util_ReverseBits((uint64_t) cursor | ~(uint64_t) mask);
+	return (size_t) util_ReverseBits(reversed + 1);
+}
+
+#pragma mark Filter
+int htbl_EnableFilter(struct HashTable *table)
 {
 	if (table == NULL)
-		return;
-	if (key == NULL)
-		return;
-	if (strlen(key) == 0)
-		return;
-	if (value == NULL)
-		return;
+		return 0;
+	if (table->filter != NULL)
+		return 1;
+	if (table->file != NULL && ftbl_IsShared(table->file)) /* Other processes' keys would be missed */
+		return 0;
 
-	size_t len = strlen(key);
-	char backedUpKey[len + 1];
-	memcpy(backedUpKey, key, len + 1);
+	return _RebuildFilter(table);
+}
 
-	_OptimizeTable(table);
-	_SetValueForKey(table, value, backedUpKey);
+static bool _RebuildFilter(struct HashTable *table)
+{
+	/* Room for twice the keys there are, so it is rebuilt about as
+	 * often as the table doubles */
+	size_t capacity = htbl_Count(table) * 2; /* File tables included */
+	struct BloomFilter *filter = blm_Create(capacity > HTBL_MIN_CAPACITY ? capacity : HTBL_MIN_CAPACITY);
+	if (filter == NULL)
+		return 0;
+
+	if (table->file != NULL)
+		_ScanWholeFile(table, _AddFileKeyToFilter, filter, NULL);
+	else
+		_FillFilter(filter, table, 0);
+	if (table->draining != NULL)
+		_FillFilter(filter, table->draining, table->drainIndex);
+	blm_Free(table->filter);
+	table->filter = filter;
+	return 1;
 }
 
-static void _AddKeyValuePair(struct HashTable *table, char *key, void *value)
+static void _FillFilter(struct BloomFilter *filter, struct HashTable *storage, tindex_t from)
 {
-	tindex_t index = _HashFunction(key, table->hashLimit);
-	// Do the nice way
-	bool empty = _IsElementAtIndexEmpty(table, index);
-	if (empty)
-	{
-		_SetKeyValuePairAtIndex(table, key, value, index);
-	} else
-			// Otherwise do collision way
+	for (tindex_t i = from; i < storage->size; ++i)
 	{
-		index = _FindEmptyIndexAfterIndex(table, index);
-		if (index == -1)
-			return;
-
-		_SetCollisionKeyValuePairAtIndex(table, key, value, index);
+		struct HashTableElement *element = _ElementAtIndex(storage, i);
+		if (element != NULL)
+			blm_Add(filter, _CuckooHash(element->key));
 	}
+}
+
+static void _AddFileKeyToFilter(char *key, void *value, void *context)
+{
+	blm_Add(context, _CuckooHash(key));
+}
 
-	tindex_t successfullyAddedIndex = _FindExistingIndexForKey(table, key);
-	if (successfullyAddedIndex == -1)
+#pragma mark File-Backed Tables
+static void _SetValueInFile(struct HashTable *table, char *key, void *value)
+{
+	/* The filter counts every key once, so it has to know if this one is new */
+	uint64_t oldValue = 0;
+	bool isNew = (table->filter != NULL && (blm_MayContain(table->filter, _CuckooHash(key)) == 0 || ftbl_ValueForKey(table->file, key, &oldValue) == 0));
+	if (ftbl_SetValueForKey(table->file, (uintptr_t) value, key) == 0 || isNew == 0)
 		return;
 
-	lst_SetValueForKey(table->iteratorKVList, index, key);
-	if (lst_ValueForKey(table->iteratorKVList, key) != index)
+	blm_Add(table->filter, _CuckooHash(key));
+	if (blm_Count(table->filter) > blm_Capacity(table->filter))
+		_RebuildFilter(table); /* Out of memory - more false positives for now */
+}
+
+static void *_ValueInFile(struct HashTable *table, char *key)
+{
+	uint64_t value = 0;
+	if (ftbl_ValueForKey(table->file, key, &value) == 0)
 	{
-		_RemoveKeyValuePairAtIndex(table, index);
+		STAT(table->counters.misses++);
+		return NULL;
 	}
-
+	STAT(table->counters.hits++);
+	return (void *) (uintptr_t) value;
 }
 
-#pragma mark Removing
-void htbl_RemoveKey(struct HashTable *table, char *key)
+static void _ScanFileEntry(char *key, uint64_t value, void *context)
 {
-	if (table == NULL)
-		return;
-	if (key == NULL)
+	struct HashTableScan *fileScan = context;
+	if (fileScan->prefix != NULL && strncmp(key, fileScan->prefix, strlen(fileScan->prefix)) != 0)
 		return;
-	if (strlen(key) == 0)
-		return;
-
-	/*	Passing in a ptr to a key In a table will
-		couse a loosing one after a removal of element, so we backup
-		the key.
-	 */
-	size_t len = strlen(key);
-	char backedUpKey[len + 1];
-	memcpy(backedUpKey, key, len + 1);
+	fileScan->scan(key, (void *) (uintptr_t) value, fileScan->context);
+}
 
-	_RemoveKeyValuePair(table, backedUpKey);
+static void _ScanWholeFile(struct HashTable *table, htbl_ScanFunction scan, void *context, char *prefix)
+{
+	struct HashTableScan fileScan = {table, scan, context, prefix};
+	size_t cursor = 0;
+	do
+		cursor = ftbl_Scan(table->file, cursor, ftbl_SlotCount(table->file), _ScanFileEntry, &fileScan);
+	while (cursor != 0);
 }
 
-static void _RemoveKeyValuePair(struct HashTable *table, char *key)
+static void _GetFileTableStats(struct HashTable *table, struct HashTableStats *stats)
 {
-	tindex_t index = _FindExistingIndexForKey(table, key);
-	if (index == -1)
-		return;
-	_RemoveKeyValuePairAtIndex(table, index);
+	stats->count = ftbl_Count(table->file);
+	stats->capacity = ftbl_SlotCount(table->file);
+	stats->loadFactor = (double) stats->count / stats->capacity;
+	stats->hits = table->counters.hits;
+	stats->misses = table->counters.misses;
+	stats->filteredMisses = table->counters.filteredMisses;
+	stats->sideListBytes = blm_BytesUsed(table->filter);
+	stats->totalBytes = ftbl_FileSize(table->file); /* Mapped, not necessarily in memory */
 }
 
-static void _RemoveKeyValuePairAtIndex(struct HashTable *table, tindex_t index)
+#pragma mark Write-Ahead Log
+int htbl_EnableLog(struct HashTable *table, const char *path, struct WriteLogOptions *options)
 {
-	struct HashTableElement *element = _ElementAtIndex(table, index);
-	char *key = element->key;
-	lst_RemoveElementWithKey(table->iteratorKVList, key);
-	lst_RemoveElementWithKey(table->collisionsList, key);
+	if (table == NULL)
+		return 0;
+	if (table->log != NULL || table->file != NULL)
+		return 0;
+	if (_ElementCount(table) != 0) /* Those would never be logged */
+		return 0;
 
-	struct HashTableElement **array = table->array;
-	_FreeElement(array[index]);
-	array[index] = NULL;
+	struct WriteLog *log = wlog_Open(path, options);
+	if (log == NULL)
+		return 0;
+
+	/* Straight into the slots, sized for the snapshot up front. The
+	 * filter and the prefix index are built once, after the last key. */
+	bool indexed = (table->prefixIndex != NULL);
+	bool filtered = (table->filter != NULL);
+	rdx_Free(table->prefixIndex);
+	blm_Free(table->filter);
+	table->prefixIndex = NULL;
+	table->filter = NULL;
+	_ReserveForReplay(table, wlog_SnapshotCount(log));
+	bool bulk = (table->cuckoo == NULL && _IsCacheTable(table) == 0); /* Those may need to grow or evict */
+	bool replayed = wlog_Replay(log, bulk ? _LoadSnapshotRecord : NULL, _ReplayLogRecord, table);
+	if (replayed == 0)
+		_RemoveAllElements(table, NULL, NULL);
+	if (indexed)
+		htbl_EnablePrefixIndex(table); /* Out of memory - a scan of the slots for now */
+	if (filtered)
+		htbl_EnableFilter(table);
+	if (replayed == 0)
+	{
+		wlog_Close(log);
+		return 0;
+	}
 
-	table->count--;
+	table->log = log;
+	return 1;
 }
 
-#pragma mark Setters
-static void _SetValueForKey(struct HashTable *table, void *value, char *key)
+static void _ReplayLogRecord(enum WriteLogOperation operation, char *key, uint64_t value, void *context)
 {
-	tindex_t index = _FindExistingIndexForKey(table, key);
-	if (index != -1)
+	struct HashTable *table = context;
+	if (operation == WLOG_REMOVE_ALL)
+	{
+		_RemoveAllElements(table, NULL, NULL);
+		return;
+	}
+	if (operation == WLOG_REMOVE)
 	{
-		_SetKeyValuePairAtIndex(table, key, value, index);
+		_RemoveKeyValuePair(table, key);
 		return;
 	}
 
-	_AddKeyValuePair(table, key, value);
+	char *pinnedKey = _PinKey(table, key);
+	if (pinnedKey != NULL && value != 0)
+	{
+		_OptimizeTable(table);
+		_SetValueForKey(table, (void *) (uintptr_t) value, pinnedKey, 0);
+	}
+	_UnpinKey(table, pinnedKey);
 }
 
-static void _SetKeyValuePairAtIndex(struct HashTable *table, char *key, void *value, tindex_t index)
+static void _LoadSnapshotRecord(enum WriteLogOperation operation, char *key, uint64_t value, void *context)
 {
-	struct HashTableElement *element = _ElementAtIndex(table, index);
-	if (element != NULL)
+	/* Snapshot keys are all sets, and there is nothing to evict or log:
+	 * placed as they are, after one look for a key written twice */
+	struct HashTable *table = context;
+	if (_FindExistingIndexForKey(table, key) != -1 || _FindDrainingIndexForKey(table, key) != -1 || value == 0)
 	{
-		_SetValueInElement(element, value);
+		_ReplayLogRecord(operation, key, value, context);
 		return;
 	}
 
-	element = _MakeElement(key, value);
-	if (element == NULL)
-		return;
-
-	struct HashTableElement **array = table->array;
-	array[index] = element;
-	table->count++;
-
+	_OptimizeTable(table); /* Flooded keys still get re-seeded */
+	char *pinnedKey = _PinKey(table, key);
+	struct HashTableElement *element = pinnedKey ? _MakeElement(table->keyPool, pinnedKey, (void *) (uintptr_t) value, 0) : NULL;
+	_UnpinKey(table, pinnedKey);
+	if (element != NULL && _PlaceElement(table, element) == -1)
+		_FreeElement(table->keyPool, element);
 }
 
-static void _SetCollisionKeyValuePairAtIndex(struct HashTable *table, char *key, void *value, tindex_t index)
+static void _ReserveForReplay(struct HashTable *table, size_t count)
 {
-	_SetKeyValuePairAtIndex(table, key, value, index);
-
-	struct HashTableElement *successfullyAddedElement = _ElementAtIndex(table, index);
-	if (successfullyAddedElement == NULL)
+	/* Cuckoo tables only ever double, caches never grow past maxCount */
+	if (table->cuckoo != NULL || _IsCacheTable(table))
 		return;
-
-	lst_SetValueForKey(table->collisionsList, index, key);
-	if (lst_ValueForKey(table->collisionsList, key) == -1)
-	{
-		_RemoveKeyValuePairAtIndex(table, index);
-	}
+	if (count <= (size_t) table->growAt)
+		return;
+	_ResizeTable(table, _RoundUpToPowerOfTwo((size_t) ((double) count / table->options.maxLoadFactor) + 1));
 }
 
-#pragma mark Getters
-void *htbl_ValueForKey(struct HashTable *table, char *key)
+static void _LogChange(struct HashTable *table, enum WriteLogOperation operation, char *key, void *value)
 {
-	if (table == NULL)
-		return NULL;
-	if (key == NULL)
-		return NULL;
-	if (strlen(key) == 0)
-		return NULL;
+	/* A failed write shows up as htbl_Sync returning 0 */
+	wlog_Append(table->log, operation, key, (uintptr_t) value);
+}
 
-	tindex_t index = _FindExistingIndexForKey(table, key);
-	if (index < 0)
-		return NULL;
+static void _CompactLog(struct HashTable *table)
+{
+	if (table->log == NULL)
+		return;
 
-	struct HashTableElement *element = _ElementAtIndex(table, index);
-	return element->value;
+	if (table->snapshotSource != NULL)
+		_ContinueLogSnapshot(table);
+	else if (wlog_IsCompactionDue(table->log))
+		_BeginLogSnapshot(table);
 }
 
-static inline struct HashTableElement *_ElementAtIndex(struct HashTable *table, tindex_t index)
+static void _BeginLogSnapshot(struct HashTable *table)
 {
-	struct HashTableElement **array = table->array;
-	return array[index];
+	/* Cuckoo inserts move other keys, which a scan can miss; a clone
+	 * shares the slots until either side writes to them */
+	struct HashTable *source = table;
+	if (table->cuckoo != NULL)
+		source = htbl_Clone(table);
+	if (source == NULL)
+		return;
+	if (wlog_BeginSnapshot(table->log) == 0)
+	{
+		if (source != table)
+			htbl_Free(source);
+		return;
+	}
+
+	table->snapshotSource = source;
+	table->snapshotCursor = 0;
+	memcpy(table->snapshotSeed, table->hashSeed, sizeof(table->hashSeed));
 }
 
-#pragma mark Checkers
-static bool _IsElementAtIndexEmpty(struct HashTable *table, tindex_t index)
+static void _ContinueLogSnapshot(struct HashTable *table)
 {
-	struct HashTableElement *element = _ElementAtIndex(table, index);
-	return (element == NULL);
+	if (table->snapshotSource == table && memcmp(table->snapshotSeed, table->hashSeed, sizeof(table->hashSeed)) != 0)
+	{
+		/* Keys already written are written again, the log has all changes since the start */
+		table->snapshotCursor = 0;
+		memcpy(table->snapshotSeed, table->hashSeed, sizeof(table->hashSeed));
+	}
+	if (table->snapshotSource->draining != NULL) /* Scanning would finish the rehash in this one write */
+		return;
+
+	/* A slice of home slots and the elements displaced from them, the same work for every write */
+	table->snapshotCursor = htbl_Scan(table->snapshotSource, table->snapshotCursor, HTBL_SNAPSHOT_SLICE, _SnapshotElement, table->log);
+	if (table->snapshotCursor != 0)
+		return;
+
+	wlog_FinishSnapshot(table->log); /* Otherwise the log stays long and the next write tries again */
+	_EndLogSnapshot(table);
 }
 
-static bool _IsElementAtIndexForKey(struct HashTable *table, tindex_t index, char *key)
+static void _SnapshotElement(char *key, void *value, void *context)
 {
-	struct HashTableElement *element = _ElementAtIndex(table, index);
-	if (element == NULL)
-		return 0;
-	return _IsElementForKey(element, key);
+	wlog_AddToSnapshot(context, key, (uintptr_t) value);
 }
 
-static bool _IsElementForKey(struct HashTableElement *element, char *key)
+static void _EndLogSnapshot(struct HashTable *table)
 {
-	char *elementKey = element->key;
-	int compareResult = strncmp(elementKey, key, STRING_MAX_LEN);
-
-	return compareResult ? 0 : 1;
+	if (table->snapshotSource != table)
+		htbl_Free(table->snapshotSource);
+	table->snapshotSource = NULL;
 }
 
-#pragma mark Searching
-static tindex_t _FindExistingIndexForKey(struct HashTable *table, char *key)
+#pragma mark Recording
+int htbl_StartRecording(struct HashTable *table, const char *path)
 {
-	// Search in hash index
-	tindex_t desiredIndex = _HashFunction(key, table->hashLimit);
-	bool containsDesiredElement = _IsElementAtIndexForKey(table, desiredIndex, key);
-	if (containsDesiredElement != 0)
-		return desiredIndex;
-
-	// Search in collisions
-	struct KeyValueList *collisionList = table->collisionsList;
-	tindex_t collisionIndex = lst_ValueForKey(collisionList, key); // Will return -1 if not found
-	if (collisionIndex != -1)
-		return collisionIndex;
+	if (table == NULL)
+		return 0;
+	if (table->recorder != NULL)
+		return 0;
 
-	return -1;
+	table->recorder = wtrc_Create(path);
+	return table->recorder != NULL;
 }
 
-static tindex_t _FindEmptyIndexAfterIndex(struct HashTable *table, tindex_t startIndex)
+int htbl_StopRecording(struct HashTable *table)
 {
-	tindex_t currentIndex = startIndex;
-
-	while (_IsElementAtIndexEmpty(table, currentIndex) == 0)
-	{
-		_loopIncrement(&currentIndex, 1, table->size);
-		if (currentIndex == startIndex) /* If made a full circle */
-			return -1;
-	}
+	if (table == NULL)
+		return 0;
+	if (table->recorder == NULL)
+		return 0;
 
-	return currentIndex;
+	int written = wtrc_Close(table->recorder);
+	table->recorder = NULL;
+	return written;
 }
 
-#pragma mark Optimization
-static void _OptimizeTable(struct HashTable *table)
+#pragma mark Key Pool
+static char *_PinKey(struct HashTable *table, char *key)
 {
-	if ((float) table->count / table->size > 0.75)
-		_ResizeTable(table, (size_t) table->size * 2);
+	/* Keeps the pooled key alive through the whole operation, even
+	 * if the element holding it expires or gets evicted meanwhile */
+	if (table->keyPool == NULL)
+		return key;
+	return kpool_Intern(table->keyPool, key);
 }
 
-static void _ResizeTable(struct HashTable *table, size_t newSize)
+static void _UnpinKey(struct HashTable *table, char *pinnedKey)
 {
-	struct HashTable *tmpTable = htbl_Create(newSize);
-	if (tmpTable == NULL)
-		return;
-
-	struct HashTableIterator *iterator = htbl_IteratorForTable(table);
-	if (iterator == NULL)
-	{
-		htbl_Free(tmpTable);
+	if (table->keyPool == NULL)
 		return;
-	}
-
-	while (htbl_IsValidIterator(iterator))
-	{
-		htbl_SetValueForKey(tmpTable, iterator->value, iterator->key);
-		iterator->next(iterator);
-	}
-	htbl_FreeIterator(iterator);
-
-	_FreeTableContentsButLeaveStruct(table);
-	memcpy(table, tmpTable, sizeof(struct HashTable));
-	_FreeTableStructButLeakContents(tmpTable);
+	kpool_ReleaseKey(table->keyPool, pinnedKey);
 }
 
 #pragma mark Stuff
@@ -475,6 +2831,8 @@ size_t htbl_TableSize(struct HashTable *table)
 {
 	if (table == NULL)
 		return 0;
+	if (table->file != NULL)
+		return ftbl_SlotCount(table->file);
 	return (size_t) table->size;
 }
 
@@ -482,49 +2840,50 @@ size_t htbl_Count(struct HashTable *table)
 {
 	if (table == NULL)
 		return 0;
-	return (size_t) table->count;
+	if (table->file != NULL)
+		return ftbl_Count(table->file);
+	return (size_t) _ElementCount(table);
 }
 
 tindex_t _HashFunction(char *key, tindex_t limit)
 {
+	/* Reduced once at the end, by a mask for every linear table */
 	size_t keyLength = strnlen(key, STRING_MAX_LEN);
 	tindex_t hash = 0;
 	for (size_t i = 0; i < keyLength; ++i)
-		_loopIncrement(&hash, key[i], limit);
+		hash += abs((int) key[i]);
 
-	assert(hash >= 0);
-	assert(hash < limit);
-	return hash;
+	if ((limit & (limit - 1)) == 0)
+		return hash & (limit - 1);
+	return hash % limit;
 }
 
-static inline void _loopIncrement(tindex_t *variable, tindex_t increment, tindex_t maxValueExclusive)
+static inline tindex_t _ProbeLength(struct HashTable *table, tindex_t fromIndex, tindex_t toIndex)
 {
-	tindex_t value = *variable;
-	tindex_t inc = abs((int) increment);
-
-	if (value + inc >= maxValueExclusive)
-	{
-		*variable = (value + inc) % maxValueExclusive;
-	} else
-	{
-		*variable = value + inc;
-	}
+	return (toIndex - fromIndex) & table->hashMask;
 }
 
 #pragma mark Iterator
 struct HashTableIteratorInternal
 {
 	struct KeyValueListIterator *listIterator;
+
+	// Cuckoo tables and clones walk the slots instead
+	tindex_t index;
+	unsigned long version;
 };
 
 static struct HashTableIterator *_AllocateIterator();
 static struct HashTableIterator *_InitIterator(struct HashTableIterator *iterator, struct HashTable *table);
 static void _InvalidateIterator(struct HashTableIterator *iterator);
 static void _IteratorNextFunction(struct HashTableIterator *iterator);
+static void _MoveIteratorToOccupiedIndex(struct HashTableIterator *iterator, tindex_t index);
 
 struct HashTableIterator *htbl_IteratorForTable(struct HashTable *table)
 {
-	if (table == NULL)
+	if (table == NULL || table->file != NULL)
+		return NULL;
+	if (_FinishRehash(table) == 0) /* Iterators only know one storage */
 		return NULL;
 	if (table->count == 0)
 		return NULL;
@@ -559,6 +2918,16 @@ static struct HashTableIterator *_AllocateIterator()
 
 static struct HashTableIterator *_InitIterator(struct HashTableIterator *iterator, struct HashTable *table)
 {
+	iterator->table = table;
+	iterator->next = _IteratorNextFunction;
+	iterator->cheshire->listIterator = NULL;
+	if (table->iteratorKVList == NULL)
+	{
+		iterator->cheshire->version = table->cuckoo ? cuck_Version(table->cuckoo) : table->version;
+		_MoveIteratorToOccupiedIndex(iterator, 0);
+		return iterator;
+	}
+
 	struct KeyValueListIterator *listIterator = lst_IteratorForList(table->iteratorKVList);
 	if (lst_IsIteratorValid(listIterator) == 0)
 	{
@@ -570,7 +2939,7 @@ static struct HashTableIterator *_InitIterator(struct HashTableIterator *iterato
 	iterator->table = table;
 	iterator->cheshire->listIterator = listIterator;
 	iterator->key = listIterator->key;
-	iterator->value = table->array[listIterator->value]->value;
+	iterator->value = _ElementAtIndex(table, listIterator->value)->value;
 	iterator->next = _IteratorNextFunction;
 
 	return iterator;
@@ -581,6 +2950,12 @@ static void _IteratorNextFunction(struct HashTableIterator *iterator)
 	if (htbl_IsValidIterator(iterator) == 0)
 		return;
 
+	if (iterator->cheshire->listIterator == NULL)
+	{
+		_MoveIteratorToOccupiedIndex(iterator, iterator->cheshire->index + 1);
+		return;
+	}
+
 	struct KeyValueListIterator *listIterator = iterator->cheshire->listIterator;
 	listIterator->next(listIterator);
 	if (listIterator->key == NULL || strlen(listIterator->key) == 0)
@@ -590,7 +2965,25 @@ static void _IteratorNextFunction(struct HashTableIterator *iterator)
 	}
 
 	iterator->key = listIterator->key;
-	iterator->value = iterator->table->array[listIterator->value]->value;
+	iterator->value = _ElementAtIndex(iterator->table, listIterator->value)->value;
+}
+
+static void _MoveIteratorToOccupiedIndex(struct HashTableIterator *iterator, tindex_t index)
+{
+	struct HashTable *table = iterator->table;
+	for (; index < table->size; ++index)
+	{
+		struct HashTableElement *element = _ElementAtIndex(table, index);
+		if (element == NULL)
+			continue;
+
+		iterator->cheshire->index = index;
+		iterator->key = element->key;
+		iterator->value = element->value;
+		return;
+	}
+
+	_InvalidateIterator(iterator);
 }
 
 static void _InvalidateIterator(struct HashTableIterator *iterator)
@@ -606,6 +2999,13 @@ int htbl_IsValidIterator(struct HashTableIterator *iterator)
 	if (iterator->key == NULL)
 		return 0;
 
+	/* Removals keep the slots of the rest, displacements and resizes don't */
+	struct HashTable *table = iterator->table;
+	if (table->cuckoo != NULL)
+		return iterator->cheshire->version == cuck_Version(table->cuckoo);
+	if (iterator->cheshire->listIterator == NULL)
+		return iterator->cheshire->version == table->version;
+
 	struct KeyValueList *listInsideIterator = iterator->cheshire->listIterator->list;
 	struct KeyValueList *listInsideTable = iterator->table->iteratorKVList;
 	if (listInsideIterator != listInsideTable)
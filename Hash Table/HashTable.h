@@ -1,7 +1,11 @@
 #ifndef HashTable_h
 #define HashTable_h
 
+#include <stdint.h>
+#include <stdio.h>
 #include "KeyValueList.h"
+#include "KeyPool.h"
+#include "WriteLog.h"
 
 struct HashTable;
 struct HashTableIteratorInternal;
@@ -16,15 +20,240 @@ struct HashTableIterator
 	struct HashTable *table;
 	struct HashTableIteratorInternal *cheshire;
 };
+typedef void (*htbl_EvictFunction)(char *key, void *value, void *context);
+typedef void (*htbl_DestroyFunction)(char *key, void *value, void *context);
+typedef void (*htbl_ScanFunction)(char *key, void *value, void *context);
+
+enum HashTablePages
+{
+	HTBL_PAGES_DEFAULT = 0, /* Slots come from calloc */
+	HTBL_PAGES_TRANSPARENT_HUGE, /* mmap with MADV_HUGEPAGE */
+	HTBL_PAGES_EXPLICIT_HUGE /* mmap with MAP_HUGETLB, transparent ones if none are reserved */
+};
+
+enum HashTableNumaPolicy
+{
+	HTBL_NUMA_DEFAULT = 0, /* Wherever the thread touching the slots runs */
+	HTBL_NUMA_BIND, /* Only on the nodes of numaNodes */
+	HTBL_NUMA_INTERLEAVE /* Page by page across the nodes of numaNodes */
+};
+
+struct HashTableOptions
+{
+	size_t initialCapacity; /* 0 - minCapacity */
+	size_t minCapacity; /* 0 - 8 */
+	double maxLoadFactor; /* Grows when an insert would go past it, 0 - 0.75 */
+	double growthFactor; /* At least 2, rounded up to a power of two with the size. 0 - 2 */
+
+	/* Linux only, ignored elsewhere. The slot array is mapped on its own,
+	 * rounded up to a whole 2 MB huge page, and so is every grown one. */
+	enum HashTablePages pages;
+	enum HashTableNumaPolicy numaPolicy;
+	unsigned long numaNodes; /* Bit i - node i */
+};
+
+/* Keys are hashed with a cheap character sum, which is easy to collide on
+ * purpose. Once inserts run into long probes or most keys are displaced
+ * from their home slots, the table switches to SipHash with a random seed
+ * and moves the elements over a few per operation. */
 struct HashTable *htbl_Create(size_t capacity);
+/* Capacities are rounded up to powers of two, so a slot is picked with
+ * a mask instead of a division; growing multiplies the capacity by the
+ * growth factor and rounds it up again, so 3 grows like 4. NULL if the
+ * load factor is not within (0, 1), the growth factor is below 2 or a
+ * NUMA policy has no nodes, or if the slots can't be mapped or bound.
+ * options may be NULL. */
+struct HashTable *htbl_CreateWithOptions(struct HashTableOptions *options);
+/* A table that holds at most maxEntries elements or maxBytes of elements
+ * and keys (0 - no limit, but not both). Adding a new key to a full cache
+ * evicts not recently used elements, calling evict for each of them. */
+struct HashTable *htbl_CreateCache(size_t maxEntries, size_t maxBytes, htbl_EvictFunction evict, void *context);
+/* Cuckoo mode: every key lives in one of its two 4-way buckets or in a small
+ * stash, so a lookup checks at most two cache lines of slots. Inserts move
+ * other keys around, which invalidates iterators. */
+struct HashTable *htbl_CreateCuckoo(size_t capacity);
+/* Keys are interned in the pool, which the table keeps a reference to.
+ * Tables sharing a pool store every key once. Lookups probe the table like
+ * any other and compare a key by pointer before its characters, so passing
+ * the pooled key (see kpool_Lookup) saves the string compare. */
+struct HashTable *htbl_CreateWithKeyPool(size_t capacity, struct KeyPool *pool);
+/* Keeps everything in the file at path, mapped into memory, so the table
+ * can outgrow RAM and survives the process; an existing table file is
+ * opened as it is. Values are stored as raw 64-bit numbers, not followed,
+ * and keys are copied into the file. No expiry, clones, iterators, index
+ * or filter: those calls do nothing or fail. NULL - can't open or map. */
+struct HashTable *htbl_CreateFileBacked(const char *path, size_t capacity);
+/* A file-backed table in the POSIX shared memory object name (see
+ * shm_open), so processes on the host read and update a single copy;
+ * every call takes a process-shared lock. Create fails if name exists,
+ * the others attach with htbl_AttachShared. Values should be numbers or
+ * offsets, pointers mean nothing in another process. A table handle
+ * belongs to one thread. The memory lives until htbl_UnlinkShared and the
+ * last htbl_Free. macOS can't resize shared memory, so there the table
+ * keeps the capacity it was created with and sets fail beyond it.
+ * NULL - can't create, open or map the object. */
+struct HashTable *htbl_CreateShared(const char *name, size_t capacity);
+struct HashTable *htbl_AttachShared(const char *name);
+int htbl_UnlinkShared(const char *name); /* 0 - no such object */
+/* A point-in-time copy. The slots are shared with the clone in chunks
+ * (pages of 4 KB, or of a huge page if mapped) until either side writes
+ * to one, which makes cloning O(chunks); so are the elements and their
+ * keys. Values are shared, borrowed keys stay borrowed. The iteration
+ * list isn't cloned: clones iterate in slot order.
+ * Cache tables and tables with expiring elements can't be cloned (NULL).
+ * A clone without a key pool may be used from another thread. */
+struct HashTable *htbl_Clone(struct HashTable *table);
 
 void htbl_SetValueForKey(struct HashTable *table, void *value, char *key);
+/* Zero-copy: the table keeps the key pointer itself, which must stay
+ * unchanged and alive until the key is removed or the table is freed.
+ * Tables with a key pool intern it as usual. */
+void htbl_SetValueForBorrowedKey(struct HashTable *table, void *value, char *key);
 void *htbl_ValueForKey(struct HashTable *table, char *key);
 void htbl_RemoveKey(struct HashTable *table, char *key);
+/* Removes everything in one sweep over the slots, calling destroy (if not
+ * NULL) for every value. The slots are swapped for empty ones. */
+void htbl_Clear(struct HashTable *table, htbl_DestroyFunction destroy, void *context);
+/* Writes a file-backed table to disk (msync) or commits the log, 0 - a
+ * write failed since the last sync, or there is nothing to write to */
+int htbl_Sync(struct HashTable *table);
+
+/* Keeps the keys in an adaptive radix tree as well, which makes
+ * htbl_ScanPrefix cost the length of the prefix plus the keys found
+ * and return them in byte order. Clones don't inherit the index.
+ * Returns 0 when out of memory. */
+int htbl_EnablePrefixIndex(struct HashTable *table);
+/* Calls scan for every key starting with prefix ("" - every key),
+ * in byte order with the index, otherwise in slot order after checking
+ * every key. The table must not be changed from inside scan. */
+void htbl_ScanPrefix(struct HashTable *table, char *prefix, htbl_ScanFunction scan, void *context);
+/* Keeps a counting Bloom filter of the keys, checked before anything
+ * else by htbl_ValueForKey: most misses then cost one hash and one cache
+ * line. 4 to 8 bytes per key, hits pay for the extra hash. Clones don't
+ * inherit the filter. A file table reads every key once to build it, and
+ * then misses don't touch the file at all; setting a key pays for one
+ * more lookup to tell if it's new. Not for shared tables, where other
+ * processes add keys too. Returns 0 when out of memory or shared. */
+int htbl_EnableFilter(struct HashTable *table);
+#define HTBL_HAS_FILTER 1 /* Lets code built against older trees check */
+/* Resumable scan in small slices: start with cursor 0 and pass the
+ * returned cursor to the next call, until it returns 0 again. A call
+ * looks at about count home slots and calls scan for the keys hashing
+ * there, wherever they ended up. Every key present from the first call
+ * to the last is visited at least once, even if the table grows in
+ * between; some may be visited twice. A re-seed after flooding (see
+ * htbl_Create) reorders every key, and so do inserts for keys of cuckoo
+ * tables, those may be missed. The table must not be changed from
+ * inside scan. */
+size_t htbl_Scan(struct HashTable *table, size_t cursor, size_t count, htbl_ScanFunction scan, void *context);
+
+/* Appends every change to the log at path, a buffered write each, fsynced
+ * in groups (see WriteLog.h); the keys already in it are loaded first.
+ * Values are logged as raw 64-bit numbers, not followed. Changes are
+ * durable once their group is committed or htbl_Sync returns. A long log
+ * is compacted into a snapshot a few keys per write. Expired and evicted
+ * keys are logged as removed, ttls aren't logged. The table has to be
+ * empty and not file-backed; clones don't inherit the log. Returns 0 if
+ * the log can't be opened or read. */
+int htbl_EnableLog(struct HashTable *table, const char *path, struct WriteLogOptions *options);
+#define HTBL_HAS_LOG 1
+
+/* Records every set, lookup, removal and clear to a trace file at path
+ * (see WorkloadTrace.h): a hash and the length of the key, not the key,
+ * and the time since the previous operation. Benchmark/Replay.c replays
+ * a trace against other configurations. 0 - already recording or can't
+ * create the file. Stopping returns 0 if a write failed meanwhile. */
+int htbl_StartRecording(struct HashTable *table, const char *path);
+int htbl_StopRecording(struct HashTable *table);
+
+/* Expiring elements. Time is whatever units the caller passes to htbl_Tick,
+ * ttl is counted from the last tick. Expired elements are removed lazily on
+ * lookup or incrementally by htbl_Tick, which does a bounded amount of work
+ * per call. Until then they are still counted and iterated over.
+ * ttl 0 - never expire. htbl_SetValueForKey keeps the existing ttl. */
+void htbl_SetValueForKeyTTL(struct HashTable *table, void *value, char *key, uint64_t ttl);
+void htbl_Tick(struct HashTable *table, uint64_t now);
 
 size_t htbl_TableSize(struct HashTable *table);
 size_t htbl_Count(struct HashTable *table);
 
+#define HTBL_PROBE_HISTOGRAM_SIZE 16
+
+struct HashTableStats
+{
+	size_t count;
+	size_t capacity;
+	double loadFactor;
+	size_t collisionsCount; /* Elements outside of their home slot, or in the stash of a cuckoo table */
+	int seeded; /* Hashed with SipHash and a random seed instead of the character sum */
+
+	/* Counters, collected only when built with -DHTBL_STATS=1 */
+	size_t probeHistogram[HTBL_PROBE_HISTOGRAM_SIZE]; /* [0] - found at home, [i] - probes of 2^(i-1)...2^i-1 slots */
+	size_t longestProbe;
+	size_t collisionsListWalks; /* Searches that walked on past the home slot */
+	size_t resizeCount;
+	uint64_t resizeNanoseconds;
+	size_t reseedCount; /* Switches to a new random hash seed, see htbl_Create */
+	size_t hits;
+	size_t misses;
+	size_t filteredMisses; /* Misses the filter answered alone, see htbl_EnableFilter */
+
+	/* Memory, in bytes */
+	size_t slotBytes;
+	size_t elementBytes;
+	size_t keyBytes;
+	size_t sideListBytes; /* Iteration list with the displaced counts per home slot, the prefix index and the filter */
+	size_t totalBytes;
+};
+
+void htbl_GetStats(struct HashTable *table, struct HashTableStats *stats);
+
+enum HashTableOperation
+{
+	HTBL_OP_SET = 0, HTBL_OP_GET, HTBL_OP_REMOVE
+};
+
+enum HashTableTraceEventKind
+{
+	HTBL_TRACE_RESIZE = 0, HTBL_TRACE_LONG_PROBE, HTBL_TRACE_SLOW_OPERATION
+};
+
+struct HashTableTraceEvent
+{
+	enum HashTableTraceEventKind kind;
+	enum HashTableOperation operation; /* Long probes and slow operations */
+	uint64_t timestamp; /* When it started, monotonic nanoseconds */
+	uint64_t nanoseconds; /* Resizes and slow operations */
+	size_t oldSize; /* Resizes */
+	size_t newSize;
+	size_t probeLength; /* Long probes */
+};
+
+/* Latency tracing. Every callback is optional, unused ones cost nothing.
+ * Probe length is the number of slots scanned looking for an empty one,
+ * or past the home slot looking for a displaced key. */
+struct HashTableTraceHooks
+{
+	void (*resizeStarted)(struct HashTable *table, size_t oldSize, size_t newSize, void *context);
+	void (*resizeFinished)(struct HashTable *table, size_t oldSize, size_t newSize, uint64_t nanoseconds, void *context);
+
+	void (*longProbe)(struct HashTable *table, enum HashTableOperation operation, size_t probeLength, void *context);
+	size_t probeThreshold; /* 0 - don't report probes */
+
+	void (*operationSampled)(struct HashTable *table, enum HashTableOperation operation, uint64_t nanoseconds, void *context);
+	unsigned sampleEvery; /* Time one of that many operations, 0 - none */
+	uint64_t slowOperationNanoseconds; /* Sampled operations this slow are kept in the ring, 0 - none */
+
+	size_t ringCapacity; /* How many of the last resizes, long probes and slow operations to keep */
+	void *context;
+};
+
+/* Hooks are copied, NULL removes them */
+void htbl_SetTraceHooks(struct HashTable *table, struct HashTableTraceHooks *hooks);
+/* In the order they finished, returns the number of events copied */
+size_t htbl_CopyTraceEvents(struct HashTable *table, struct HashTableTraceEvent *events, size_t capacity);
+void htbl_DumpTraceEvents(struct HashTable *table, FILE *file);
+
 struct HashTableIterator *htbl_IteratorForTable(struct HashTable *table);
 int htbl_IsValidIterator(struct HashTableIterator *iterator);
 void htbl_FreeIterator(struct HashTableIterator *iterator);
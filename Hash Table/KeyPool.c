@@ -0,0 +1,239 @@
+#import <stdlib.h>
+#import <string.h>
+#import <assert.h>
+#import "KeyPool.h"
+#include "Utilities.h"
+
+#pragma mark Private Header
+#define KPOOL_MIN_SLOTS 64
+#define KPOOL_MAX_LOAD 0.7
+
+/* The key is stored right after its header, so an interned key
+ * pointer leads back to its entry without any searching */
+struct KeyPoolEntry
+{
+	size_t references;
+	uint32_t hash;
+	char key[];
+};
+
+struct KeyPool
+{
+	struct KeyPoolEntry **slots; /* Linear probing, no tombstones */
+	size_t slotMask; /* Slot count is a power of two */
+	size_t count;
+	size_t keyBytes;
+
+	unsigned long references;
+};
+
+static struct KeyPoolEntry *_EntryForKey(char *internedKey);
+static size_t _FindSlot(struct KeyPool *pool, char *key, uint32_t hash);
+static size_t _FindSlotOfEntry(struct KeyPool *pool, struct KeyPoolEntry *entry);
+static void _RemoveSlot(struct KeyPool *pool, size_t slot);
+static int _Grow(struct KeyPool *pool);
+
+#pragma mark Creation
+struct KeyPool *kpool_Create()
+{
+	struct KeyPool *pool = calloc(1, sizeof(struct KeyPool));
+	if (pool == NULL)
+		return NULL;
+
+	pool->slots = calloc(KPOOL_MIN_SLOTS, sizeof(struct KeyPoolEntry *));
+	if (pool->slots == NULL)
+	{
+		free(pool);
+		return NULL;
+	}
+	pool->slotMask = KPOOL_MIN_SLOTS - 1;
+	pool->references = 1;
+
+	return pool;
+}
+
+struct KeyPool *kpool_Retain(struct KeyPool *pool)
+{
+	if (pool == NULL)
+		return NULL;
+
+	pool->references++;
+	return pool;
+}
+
+void kpool_Release(struct KeyPool *pool)
+{
+	if (pool == NULL)
+		return;
+	if (--pool->references != 0)
+		return;
+
+	for (size_t i = 0; i <= pool->slotMask; ++i)
+		free(pool->slots[i]);
+	free(pool->slots);
+	free(pool);
+}
+
+#pragma mark Keys
+char *kpool_Intern(struct KeyPool *pool, char *key)
+{
+	if (pool == NULL)
+		return NULL;
+	if (key == NULL)
+		return NULL;
+
+	uint32_t hash = util_HashString32(key);
+	size_t slot = _FindSlot(pool, key, hash);
+	if (pool->slots[slot] != NULL)
+	{
+		pool->slots[slot]->references++;
+		return pool->slots[slot]->key;
+	}
+
+	if ((double) (pool->count + 1) / (pool->slotMask + 1) > KPOOL_MAX_LOAD)
+	{
+		if (_Grow(pool) == 0)
+			return NULL;
+		slot = _FindSlot(pool, key, hash);
+	}
+
+	size_t keyLen = strlen(key);
+	struct KeyPoolEntry *entry = malloc(sizeof(struct KeyPoolEntry) + keyLen + 1);
+	if (entry == NULL)
+		return NULL;
+	entry->references = 1;
+	entry->hash = hash;
+	memcpy(entry->key, key, keyLen + 1);
+
+	pool->slots[slot] = entry;
+	pool->count++;
+	pool->keyBytes += sizeof(struct KeyPoolEntry) + keyLen + 1;
+
+	return entry->key;
+}
+
+char *kpool_RetainKey(struct KeyPool *pool, char *internedKey)
+{
+	if (pool == NULL)
+		return NULL;
+	if (internedKey == NULL)
+		return NULL;
+
+	_EntryForKey(internedKey)->references++;
+	return internedKey;
+}
+
+void kpool_ReleaseKey(struct KeyPool *pool, char *internedKey)
+{
+	if (pool == NULL)
+		return;
+	if (internedKey == NULL)
+		return;
+
+	struct KeyPoolEntry *entry = _EntryForKey(internedKey);
+	assert(entry->references != 0);
+	if (--entry->references != 0)
+		return;
+
+	_RemoveSlot(pool, _FindSlotOfEntry(pool, entry));
+	pool->count--;
+	pool->keyBytes -= sizeof(struct KeyPoolEntry) + strlen(entry->key) + 1;
+	free(entry);
+}
+
+char *kpool_Lookup(struct KeyPool *pool, char *key)
+{
+	if (pool == NULL)
+		return NULL;
+	if (key == NULL)
+		return NULL;
+
+	struct KeyPoolEntry *entry = pool->slots[_FindSlot(pool, key, util_HashString32(key))];
+	return entry ? entry->key : NULL;
+}
+
+static struct KeyPoolEntry *_EntryForKey(char *internedKey)
+{
+	return (struct KeyPoolEntry *) (internedKey - offsetof(struct KeyPoolEntry, key));
+}
+
+#pragma mark Slots
+static size_t _FindSlot(struct KeyPool *pool, char *key, uint32_t hash)
+{
+	/* Either the slot of the key or the empty one where it would go */
+	size_t slot = hash & pool->slotMask;
+	while (pool->slots[slot] != NULL)
+	{
+		struct KeyPoolEntry *entry = pool->slots[slot];
+		if (entry->hash == hash && strcmp(entry->key, key) == 0)
+			break;
+		slot = (slot + 1) & pool->slotMask;
+	}
+	return slot;
+}
+
+static size_t _FindSlotOfEntry(struct KeyPool *pool, struct KeyPoolEntry *entry)
+{
+	size_t slot = entry->hash & pool->slotMask;
+	while (pool->slots[slot] != entry)
+		slot = (slot + 1) & pool->slotMask;
+	return slot;
+}
+
+static void _RemoveSlot(struct KeyPool *pool, size_t slot)
+{
+	/* Shift the rest of the run back, so searches never stop at the hole early */
+	size_t hole = slot;
+	size_t mask = pool->slotMask;
+	for (size_t next = (slot + 1) & mask; pool->slots[next] != NULL; next = (next + 1) & mask)
+	{
+		size_t home = pool->slots[next]->hash & mask;
+		if (((next - home) & mask) < ((next - hole) & mask))
+			continue;
+
+		pool->slots[hole] = pool->slots[next];
+		hole = next;
+	}
+	pool->slots[hole] = NULL;
+}
+
+static int _Grow(struct KeyPool *pool)
+{
+	size_t slotCount = (pool->slotMask + 1) * 2;
+	struct KeyPoolEntry **slots = calloc(slotCount, sizeof(struct KeyPoolEntry *));
+	if (slots == NULL)
+		return 0;
+
+	for (size_t i = 0; i <= pool->slotMask; ++i)
+	{
+		struct KeyPoolEntry *entry = pool->slots[i];
+		if (entry == NULL)
+			continue;
+
+		size_t slot = entry->hash & (slotCount - 1);
+		while (slots[slot] != NULL)
+			slot = (slot + 1) & (slotCount - 1);
+		slots[slot] = entry;
+	}
+
+	free(pool->slots);
+	pool->slots = slots;
+	pool->slotMask = slotCount - 1;
+	return 1;
+}
+
+#pragma mark Stuff
+size_t kpool_Count(struct KeyPool *pool)
+{
+	if (pool == NULL)
+		return 0;
+	return pool->count;
+}
+
+size_t kpool_BytesUsed(struct KeyPool *pool)
+{
+	if (pool == NULL)
+		return 0;
+	return sizeof(struct KeyPool) + (pool->slotMask + 1) * sizeof(struct KeyPoolEntry *) + pool->keyBytes;
+}
+
@@ -0,0 +1,28 @@
+#ifndef KeyPool_h
+#define KeyPool_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Interned strings shared by several tables: every distinct key is stored
+ * once and reference counted, so two interned keys are equal only if they
+ * are the same pointer. The pool itself is reference counted as well, every
+ * table using it keeps one reference. Not thread safe, like the tables. */
+struct KeyPool;
+
+struct KeyPool *kpool_Create();
+struct KeyPool *kpool_Retain(struct KeyPool *pool);
+void kpool_Release(struct KeyPool *pool); /* Frees the pool with the last reference */
+
+/* Returns the pooled copy of the key with one more reference, NULL - out of memory */
+char *kpool_Intern(struct KeyPool *pool, char *key);
+/* The key must come from kpool_Intern or kpool_Lookup of the same pool */
+char *kpool_RetainKey(struct KeyPool *pool, char *internedKey);
+void kpool_ReleaseKey(struct KeyPool *pool, char *internedKey);
+/* The pooled copy without taking a reference, NULL - not in the pool */
+char *kpool_Lookup(struct KeyPool *pool, char *key);
+
+size_t kpool_Count(struct KeyPool *pool);
+size_t kpool_BytesUsed(struct KeyPool *pool);
+
+#endif
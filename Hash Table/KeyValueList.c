@@ -1,29 +1,55 @@
 #import <string.h>
 #import <stdlib.h>
+#import <stdint.h>
 #import "KeyValueList.h"
+#include "Utilities.h"
 
 #pragma mark Private Header
-struct KeyValueListElement
+/* The list is unrolled: every node keeps up to KVLIST_NODE_CAPACITY pairs
+ * in insertion order together with a 32-bit hash of every key. Searching
+ * compares hashes first and only calls strcmp on a hash match, so a node
+ * is usually checked without touching the keys at all. */
+#define KVLIST_NODE_CAPACITY 8
+#define KVLIST_MERGE_BELOW (KVLIST_NODE_CAPACITY / 4) /* A node emptier than that merges into a neighbour */
+
+struct KeyValueListNode
 {
-	char *key;
-	long value;
+	uint32_t hashes[KVLIST_NODE_CAPACITY];
+	char *keys[KVLIST_NODE_CAPACITY];
+	long values[KVLIST_NODE_CAPACITY];
+	int count;
 
-	struct KeyValueListElement *next;
+	struct KeyValueListNode *next;
 };
 
 struct KeyValueListIteratorInternal
 {
-	struct KeyValueListElement *currentElement;
-	struct KeyValueListElement *nextElement;
+	struct KeyValueListNode *currentNode;
+	struct KeyValueListNode *nextNode;
+	char *nextKey; /* Index inside the node may shift on removal and the pair may move to a neighbour, the key pointer doesn't */
 };
 
 struct KeyValueList
 {
-	struct KeyValueListElement *firstElement;
+	struct KeyValueListNode *firstNode;
+	struct KeyValueListNode *lastNode;
+	struct KeyValueListNode *freeNodes; /* Pool of empty nodes to be reused */
+
+	size_t count;
+	size_t nodesCount; /* Including pooled ones */
+	size_t keyBytes;
+	int borrowsKeys;
 };
 
 static struct KeyValueList *_allocateList();
-static struct KeyValueListElement *_CreateElement(char *key, long value);
+static struct KeyValueListNode *_TakeNode(struct KeyValueList *list);
+static void _PutNodeBack(struct KeyValueList *list, struct KeyValueListNode *node);
+static void _FreeNodeChain(struct KeyValueListNode *node, int freeKeys);
+static char *_CopyKey(struct KeyValueList *list, char *key);
+static int _AppendPair(struct KeyValueList *list, char *key, uint32_t hash, long value);
+static int _FindPair(struct KeyValueList *list, char *key, uint32_t hash, struct KeyValueListNode **outNode, struct KeyValueListNode **outPreviousNode);
+static void _RemovePairAtIndex(struct KeyValueList *list, struct KeyValueListNode *node, struct KeyValueListNode *previousNode, int index);
+static void _MergeNextNode(struct KeyValueList *list, struct KeyValueListNode *node);
 
 #pragma mark Implementation
 
@@ -33,6 +59,16 @@ struct KeyValueList *lst_CreateList()
 	return list;
 }
 
+struct KeyValueList *lst_CreateListBorrowingKeys()
+{
+	struct KeyValueList *list = _allocateList();
+	if (list == NULL)
+		return NULL;
+
+	list->borrowsKeys = 1;
+	return list;
+}
+
 static struct KeyValueList *_allocateList()
 {
 	size_t size = sizeof(struct KeyValueList);
@@ -47,57 +83,83 @@ void lst_SetValueForKey(struct KeyValueList *list, long value, char *key)
 	if (key == NULL)
 		return;
 
-	if (list->firstElement == NULL)
+	uint32_t hash = util_HashString32(key);
+
+	struct KeyValueListNode *node = NULL;
+	int index = _FindPair(list, key, hash, &node, NULL);
+	if (index != -1)
 	{
-		struct KeyValueListElement *newElement = _CreateElement(key, value);
-		if (newElement == NULL)
-			return;
-		list->firstElement = newElement;
+		node->values[index] = value;
+		if (list->borrowsKeys) /* The old pointer may be about to go away */
+			node->keys[index] = key;
 		return;
 	}
 
-	struct KeyValueListElement *element = list->firstElement;
-	for (; ;)
+	_AppendPair(list, key, hash, value);
+}
+
+int lst_AppendNewKey(struct KeyValueList *list, long value, char *key)
+{
+	if (list == NULL)
+		return 0;
+	if (key == NULL)
+		return 0;
+
+	/* The last node is always at hand, only a search makes setting O(n) */
+	return _AppendPair(list, key, util_HashString32(key), value);
+}
+
+static int _AppendPair(struct KeyValueList *list, char *key, uint32_t hash, long value)
+{
+	char *keyCopy = _CopyKey(list, key);
+	if (keyCopy == NULL)
+		return 0;
+
+	struct KeyValueListNode *node = list->lastNode;
+	if (node == NULL || node->count == KVLIST_NODE_CAPACITY)
 	{
-		int cmp = strcmp(element->key, key);
-		if (cmp == 0)
+		node = _TakeNode(list);
+		if (node == NULL)
 		{
-			element->value = value;
-			return;
+			if (list->borrowsKeys == 0)
+			{
+				list->keyBytes -= strlen(keyCopy) + 1;
+				free(keyCopy);
+			}
+			return 0;
 		}
 
-		if (element->next == NULL)
-			break;
-
-		element = element->next;
+		if (list->lastNode == NULL)
+			list->firstNode = node;
+		else
+			list->lastNode->next = node;
+		list->lastNode = node;
 	}
 
-	struct KeyValueListElement *newElement = _CreateElement(key, value);
-	if (newElement == NULL)
-		return;
-	element->next = newElement;
+	int index = node->count;
+	node->hashes[index] = hash;
+	node->keys[index] = keyCopy;
+	node->values[index] = value;
+	node->count++;
+
+	list->count++;
+
+	return 1;
 }
 
-struct KeyValueListElement *_CreateElement(char *key, long value)
+static char *_CopyKey(struct KeyValueList *list, char *key)
 {
-	size_t size = sizeof(struct KeyValueListElement);
-	struct KeyValueListElement *element = malloc(size);
-	if (element == NULL)
-		return NULL;
+	if (list->borrowsKeys)
+		return key;
 
 	size_t keyLen = strlen(key);
-	element->key = malloc(sizeof(char) * (keyLen + 1));
-	if (element->key == NULL)
-	{
-		free(element);
+	char *keyCopy = malloc(sizeof(char) * (keyLen + 1));
+	if (keyCopy == NULL)
 		return NULL;
-	}
-
-	memcpy(element->key, key, keyLen + 1);
-	element->value = value;
-	element->next = NULL;
+	memcpy(keyCopy, key, keyLen + 1);
 
-	return element;
+	list->keyBytes += keyLen + 1;
+	return keyCopy;
 }
 
 void lst_RemoveElementWithKey(struct KeyValueList *list, char *key)
@@ -106,35 +168,98 @@ void lst_RemoveElementWithKey(struct KeyValueList *list, char *key)
 		return;
 	if (key == NULL)
 		return;
-	if (list->firstElement == NULL)
+	if (list->firstNode == NULL)
 		return;
 
-	struct KeyValueListElement *element = list->firstElement;
+	uint32_t hash = util_HashString32(key);
 
-	int cmp = strcmp(key, element->key);
-	if (cmp == 0)
-	{
-		struct KeyValueListElement *elementToDelete = list->firstElement;
-		list->firstElement = list->firstElement->next;
-		free(elementToDelete->key);
-		free(elementToDelete);
+	struct KeyValueListNode *node = NULL;
+	struct KeyValueListNode *previousNode = NULL;
+	int index = _FindPair(list, key, hash, &node, &previousNode);
+	if (index == -1)
 		return;
-	}
 
-	while (element->next != NULL)
+	_RemovePairAtIndex(list, node, previousNode, index);
+}
+
+void lst_RemoveAll(struct KeyValueList *list)
+{
+	if (list == NULL)
+		return;
+	if (list->firstNode == NULL)
+		return;
+
+	for (struct KeyValueListNode *node = list->firstNode; node != NULL; node = node->next)
 	{
-		char *kKey = element->next->key;
-		cmp = strcmp(key, kKey);
-		if (cmp == 0)
+		if (list->borrowsKeys == 0)
 		{
-			struct KeyValueListElement *elementToDelete = element->next;
-			element->next = element->next->next;
-			free(elementToDelete->key);
-			free(elementToDelete);
-			return;
+			for (int i = 0; i < node->count; ++i)
+				free(node->keys[i]);
 		}
-		element = element->next;
+		node->count = 0;
 	}
+
+	list->lastNode->next = list->freeNodes;
+	list->freeNodes = list->firstNode;
+	list->firstNode = NULL;
+	list->lastNode = NULL;
+	list->count = 0;
+	list->keyBytes = 0;
+}
+
+static void _RemovePairAtIndex(struct KeyValueList *list, struct KeyValueListNode *node, struct KeyValueListNode *previousNode, int index)
+{
+	list->count--;
+	if (list->borrowsKeys == 0)
+	{
+		list->keyBytes -= strlen(node->keys[index]) + 1;
+		free(node->keys[index]);
+	}
+
+	/* Keep the node dense and ordered, so appending stays trivial */
+	int tail = node->count - index - 1;
+	memmove(&node->hashes[index], &node->hashes[index + 1], tail * sizeof(uint32_t));
+	memmove(&node->keys[index], &node->keys[index + 1], tail * sizeof(char *));
+	memmove(&node->values[index], &node->values[index + 1], tail * sizeof(long));
+	node->count--;
+
+	if (node->count == 0)
+	{
+		if (previousNode == NULL)
+			list->firstNode = node->next;
+		else
+			previousNode->next = node->next;
+		if (list->lastNode == node)
+			list->lastNode = previousNode;
+
+		_PutNodeBack(list, node);
+		return;
+	}
+
+	/* Removals all over the list would leave it as long as ever, with a
+	 * few pairs per node: a nearly empty node joins a neighbour it fits in */
+	if (node->count >= KVLIST_MERGE_BELOW)
+		return;
+	if (previousNode != NULL && previousNode->count + node->count <= KVLIST_NODE_CAPACITY)
+		_MergeNextNode(list, previousNode);
+	else if (node->next != NULL && node->count + node->next->count <= KVLIST_NODE_CAPACITY)
+		_MergeNextNode(list, node);
+}
+
+static void _MergeNextNode(struct KeyValueList *list, struct KeyValueListNode *node)
+{
+	/* Appends the pairs of the next node, which keeps them in order */
+	struct KeyValueListNode *nextNode = node->next;
+	int count = nextNode->count;
+	memcpy(&node->hashes[node->count], nextNode->hashes, count * sizeof(uint32_t));
+	memcpy(&node->keys[node->count], nextNode->keys, count * sizeof(char *));
+	memcpy(&node->values[node->count], nextNode->values, count * sizeof(long));
+	node->count += count;
+
+	node->next = nextNode->next;
+	if (list->lastNode == nextNode)
+		list->lastNode = node;
+	_PutNodeBack(list, nextNode);
 }
 
 long lst_ValueForKey(struct KeyValueList *list, char *key)
@@ -143,36 +268,108 @@ long lst_ValueForKey(struct KeyValueList *list, char *key)
 		return -1;
 	if (key == NULL)
 		return -1;
-	struct KeyValueListElement *element = list->firstElement;
-	while (element != NULL)
+
+	uint32_t hash = util_HashString32(key);
+
+	struct KeyValueListNode *node = NULL;
+	int index = _FindPair(list, key, hash, &node, NULL);
+	if (index == -1)
+		return -1;
+
+	return node->values[index];
+}
+
+static int _FindPair(struct KeyValueList *list, char *key, uint32_t hash, struct KeyValueListNode **outNode, struct KeyValueListNode **outPreviousNode)
+{
+	struct KeyValueListNode *previousNode = NULL;
+	struct KeyValueListNode *node = list->firstNode;
+	while (node != NULL)
 	{
-		char *kKey = element->key;
-		int cmp = strcmp(kKey, key);
-		if (cmp == 0)
+		for (int i = 0; i < node->count; ++i)
 		{
-			return element->value;
+			if (node->hashes[i] != hash)
+				continue;
+
+			int cmp = strcmp(node->keys[i], key);
+			if (cmp != 0)
+				continue;
+
+			*outNode = node;
+			if (outPreviousNode != NULL)
+				*outPreviousNode = previousNode;
+			return i;
 		}
-		element = element->next;
+		previousNode = node;
+		node = node->next;
 	}
 	return -1;
 }
 
+size_t lst_Count(struct KeyValueList *list)
+{
+	if (list == NULL)
+		return 0;
+	return list->count;
+}
+
+size_t lst_BytesUsed(struct KeyValueList *list)
+{
+	if (list == NULL)
+		return 0;
+	return sizeof(struct KeyValueList) + list->nodesCount * sizeof(struct KeyValueListNode) + list->keyBytes;
+}
+
 void lst_Free(struct KeyValueList *list)
 {
 	if (list == NULL)
 		return;
 
-	struct KeyValueListElement *element = list->firstElement;
+	_FreeNodeChain(list->firstNode, list->borrowsKeys == 0);
+	_FreeNodeChain(list->freeNodes, 0);
+
+	free(list);
+}
 
-	while (element)
+#pragma mark Node Pool
+static struct KeyValueListNode *_TakeNode(struct KeyValueList *list)
+{
+	struct KeyValueListNode *node = list->freeNodes;
+	if (node != NULL)
+	{
+		list->freeNodes = node->next;
+	} else
 	{
-		struct KeyValueListElement *nElem = element->next;
-		free(element->key);
-		free(element);
-		element = nElem;
+		node = malloc(sizeof(struct KeyValueListNode));
+		if (node == NULL)
+			return NULL;
+		list->nodesCount++;
 	}
 
-	free(list);
+	node->count = 0;
+	node->next = NULL;
+	return node;
+}
+
+static void _PutNodeBack(struct KeyValueList *list, struct KeyValueListNode *node)
+{
+	node->count = 0;
+	node->next = list->freeNodes;
+	list->freeNodes = node;
+}
+
+static void _FreeNodeChain(struct KeyValueListNode *node, int freeKeys)
+{
+	while (node)
+	{
+		struct KeyValueListNode *nextNode = node->next;
+		if (freeKeys)
+		{
+			for (int i = 0; i < node->count; ++i)
+				free(node->keys[i]);
+		}
+		free(node);
+		node = nextNode;
+	}
 }
 
 #pragma mark Iterator
@@ -180,13 +377,13 @@ struct KeyValueListIterator *_AllocateIterator();
 void _InitIterator(struct KeyValueListIterator *iterator, struct KeyValueList *list);
 void _IteratorNextFunction(struct KeyValueListIterator *iterator);
 void _InvalidateIterator(struct KeyValueListIterator *iterator);
-void _SetIteratorToElement(struct KeyValueListIterator *iterator, struct KeyValueListElement *element);
+void _SetIteratorToPair(struct KeyValueListIterator *iterator, struct KeyValueListNode *node, int index);
 
 struct KeyValueListIterator *lst_IteratorForList(struct KeyValueList *list)
 {
 	if (list == NULL)
 		return NULL;
-	if (list->firstElement == NULL)
+	if (list->firstNode == NULL)
 		return NULL;
 
 	struct KeyValueListIterator *iterator = _AllocateIterator();
@@ -217,17 +414,32 @@ struct KeyValueListIterator *_AllocateIterator()
 
 void _InitIterator(struct KeyValueListIterator *iterator, struct KeyValueList *list)
 {
-	_SetIteratorToElement(iterator, list->firstElement);
+	_SetIteratorToPair(iterator, list->firstNode, 0);
 	iterator->next = _IteratorNextFunction;
 	iterator->list = list;
 }
 
-void _SetIteratorToElement(struct KeyValueListIterator *iterator, struct KeyValueListElement *element)
+void _SetIteratorToPair(struct KeyValueListIterator *iterator, struct KeyValueListNode *node, int index)
 {
-	iterator->key = element->key;
-	iterator->value = element->value;
-	iterator->cheshire->currentElement = element;
-	iterator->cheshire->nextElement = element->next;
+	iterator->key = node->keys[index];
+	iterator->value = node->values[index];
+	iterator->cheshire->currentNode = node;
+
+	/* Remember where to go next now: the current pair may be removed
+	 * (and its node recycled) before next() is called */
+	if (index + 1 < node->count)
+	{
+		iterator->cheshire->nextNode = node;
+		iterator->cheshire->nextKey = node->keys[index + 1];
+	} else if (node->next != NULL)
+	{
+		iterator->cheshire->nextNode = node->next;
+		iterator->cheshire->nextKey = node->next->keys[0];
+	} else
+	{
+		iterator->cheshire->nextNode = NULL;
+		iterator->cheshire->nextKey = NULL;
+	}
 }
 
 void _IteratorNextFunction(struct KeyValueListIterator *iterator)
@@ -235,21 +447,44 @@ void _IteratorNextFunction(struct KeyValueListIterator *iterator)
 	if (lst_IsIteratorValid(iterator) == 0)
 		return;
 
-	struct KeyValueListElement *nextElement = iterator->cheshire->nextElement;
-	if (nextElement == NULL)
+	struct KeyValueListNode *nextNode = iterator->cheshire->nextNode;
+	if (nextNode == NULL)
 	{
 		_InvalidateIterator(iterator);
 		return;
 	}
 
-	_SetIteratorToElement(iterator, nextElement);
+	char *nextKey = iterator->cheshire->nextKey;
+	for (int i = 0; i < nextNode->count; ++i)
+	{
+		if (nextNode->keys[i] == nextKey)
+		{
+			_SetIteratorToPair(iterator, nextNode, i);
+			return;
+		}
+	}
+
+	/* Its node was merged into a neighbour since, look it up the long way */
+	for (struct KeyValueListNode *node = iterator->list->firstNode; node != NULL; node = node->next)
+	{
+		for (int i = 0; i < node->count; ++i)
+		{
+			if (node->keys[i] == nextKey)
+			{
+				_SetIteratorToPair(iterator, node, i);
+				return;
+			}
+		}
+	}
+
+	_InvalidateIterator(iterator);
 }
 
 void _InvalidateIterator(struct KeyValueListIterator *iterator)
 {
 	iterator->key = NULL;
 	iterator->value = 0;
-	iterator->cheshire->currentElement = NULL;
+	iterator->cheshire->currentNode = NULL;
 }
 
 int8_t lst_IsIteratorValid(struct KeyValueListIterator *iterator)
@@ -257,7 +492,7 @@ int8_t lst_IsIteratorValid(struct KeyValueListIterator *iterator)
 	if (iterator == NULL)
 		return 0;
 
-	if (iterator->cheshire->currentElement == NULL)
+	if (iterator->cheshire->currentNode == NULL)
 		return 0;
 	else
 		return 1;
@@ -270,4 +505,4 @@ void lst_FreeIterator(struct KeyValueListIterator *iterator)
 
 	free(iterator->cheshire);
 	free(iterator);
-}
\ No newline at end of file
+}
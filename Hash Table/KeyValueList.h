@@ -1,5 +1,9 @@
 #ifndef KeyValueList_h
 #define KeyValueList_h
+
+#include <stddef.h>
+#include <stdint.h>
+
 struct KeyValueList;
 struct KeyValueListIteratorInternal;
 
@@ -15,10 +19,20 @@ struct KeyValueListIterator
 };
 
 struct KeyValueList *lst_CreateList();
+/* Keeps the caller's key pointers instead of copies, every key
+ * must stay alive for as long as it is in the list. Setting a key that
+ * is there already keeps the new pointer. */
+struct KeyValueList *lst_CreateListBorrowingKeys();
 
 void lst_SetValueForKey(struct KeyValueList *list, long value, char *key);
+/* For keys known not to be in the list: appended without looking for them
+ * first, in constant time. 0 - out of memory, the list is left as it was */
+int lst_AppendNewKey(struct KeyValueList *list, long value, char *key);
 void lst_RemoveElementWithKey(struct KeyValueList *list, char *key);
+void lst_RemoveAll(struct KeyValueList *list); /* Keeps the nodes pooled for reuse */
 long lst_ValueForKey(struct KeyValueList *list, char *key);
+size_t lst_Count(struct KeyValueList *list);
+size_t lst_BytesUsed(struct KeyValueList *list); /* Nodes, pooled nodes and owned keys */
 int8_t lst_IsIteratorValid(struct KeyValueListIterator *iterator);
 void lst_Free(struct KeyValueList *list);
 
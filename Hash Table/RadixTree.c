@@ -0,0 +1,869 @@
+#import <stdlib.h>
+#import <string.h>
+#import <assert.h>
+#import "RadixTree.h"
+
+#pragma mark Private Header
+/* Longer runs of shared bytes are still skipped, but checked against a leaf */
+#define RDX_MAX_PREFIX 10
+
+enum RadixNodeType
+{
+	RDX_NODE4,
+	RDX_NODE16,
+	RDX_NODE48,
+	RDX_NODE256
+};
+
+struct RadixNode
+{
+	uint8_t type;
+	uint16_t childrenCount;
+	uint32_t prefixLength; /* Bytes every key below shares at this point */
+	unsigned char prefix[RDX_MAX_PREFIX]; /* The first ones of them */
+};
+
+/* Children are either nodes or leaves with the lowest pointer bit set */
+struct RadixNode4
+{
+	struct RadixNode header;
+	unsigned char keys[4]; /* Sorted */
+	void *children[4];
+};
+
+struct RadixNode16
+{
+	struct RadixNode header;
+	unsigned char keys[16]; /* Sorted */
+	void *children[16];
+};
+
+struct RadixNode48
+{
+	struct RadixNode header;
+	unsigned char childIndex[256]; /* 0 - no child, otherwise its slot + 1 */
+	void *children[48];
+};
+
+struct RadixNode256
+{
+	struct RadixNode header;
+	void *children[256];
+};
+
+struct RadixLeaf
+{
+	char *key;
+	size_t keyLength; /* With the terminating zero, so no key is a prefix of another */
+	void *value;
+};
+
+struct RadixTree
+{
+	void *root;
+	size_t count;
+	size_t bytes;
+};
+
+// Nodes
+static struct RadixNode *_AllocateNode(struct RadixTree *tree, uint8_t type);
+static void _FreeNode(struct RadixTree *tree, struct RadixNode *node);
+static size_t _NodeSize(uint8_t type);
+static void _CopyHeader(struct RadixNode *to, struct RadixNode *from);
+static void _FreeSubtree(struct RadixTree *tree, void *child);
+// Leaves
+static struct RadixLeaf *_MakeLeaf(struct RadixTree *tree, char *key, size_t keyLength, void *value);
+static void _FreeLeaf(struct RadixTree *tree, struct RadixLeaf *leaf);
+static int _IsLeaf(void *child);
+static void *_TagLeaf(struct RadixLeaf *leaf);
+static struct RadixLeaf *_UntagLeaf(void *child);
+static int _LeafMatches(struct RadixLeaf *leaf, char *key, size_t keyLength);
+static struct RadixLeaf *_MinimumLeaf(void *child);
+// Searching
+static void **_FindChild(struct RadixNode *node, unsigned char byte);
+static size_t _PrefixMismatch(struct RadixNode *node, char *key, size_t keyLength, size_t depth);
+// Changing
+static int _Insert(struct RadixTree *tree, void **reference, char *key, size_t keyLength, size_t depth, void *value);
+static int _SplitPrefix(struct RadixTree *tree, void **reference, size_t mismatch, char *key, size_t keyLength, size_t depth, void *value);
+static int _AddChild(struct RadixTree *tree, void **reference, unsigned char byte, void *child);
+static void _InsertSorted(unsigned char *keys, void **children, uint16_t *count, unsigned char byte, void *child);
+static struct RadixLeaf *_Remove(struct RadixTree *tree, void **reference, char *key, size_t keyLength, size_t depth);
+static void _RemoveChild(struct RadixTree *tree, void **reference, unsigned char byte, void **child);
+static void _CollapseNode4(struct RadixTree *tree, void **reference);
+// Scanning
+static void _ScanSubtree(void *child, rdx_ScanFunction scan, void *context);
+
+static inline size_t _Min(size_t a, size_t b)
+{
+	return a < b ? a : b;
+}
+
+#pragma mark Creation
+struct RadixTree *rdx_Create()
+{
+	struct RadixTree *tree = calloc(1, sizeof(struct RadixTree));
+	if (tree == NULL)
+		return NULL;
+
+	tree->bytes = sizeof(struct RadixTree);
+	return tree;
+}
+
+void rdx_Free(struct RadixTree *tree)
+{
+	if (tree == NULL)
+		return;
+
+	_FreeSubtree(tree, tree->root);
+	free(tree);
+}
+
+static void _FreeSubtree(struct RadixTree *tree, void *child)
+{
+	if (child == NULL)
+		return;
+	if (_IsLeaf(child))
+	{
+		_FreeLeaf(tree, _UntagLeaf(child));
+		return;
+	}
+
+	struct RadixNode *node = child;
+	switch (node->type)
+	{
+		case RDX_NODE4:
+			for (int i = 0; i < node->childrenCount; ++i)
+				_FreeSubtree(tree, ((struct RadixNode4 *) node)->children[i]);
+			break;
+		case RDX_NODE16:
+			for (int i = 0; i < node->childrenCount; ++i)
+				_FreeSubtree(tree, ((struct RadixNode16 *) node)->children[i]);
+			break;
+		case RDX_NODE48:
+			for (int i = 0; i < 48; ++i)
+				_FreeSubtree(tree, ((struct RadixNode48 *) node)->children[i]);
+			break;
+		case RDX_NODE256:
+			for (int i = 0; i < 256; ++i)
+				_FreeSubtree(tree, ((struct RadixNode256 *) node)->children[i]);
+			break;
+	}
+	_FreeNode(tree, node);
+}
+
+#pragma mark Nodes
+static struct RadixNode *_AllocateNode(struct RadixTree *tree, uint8_t type)
+{
+	struct RadixNode *node = calloc(1, _NodeSize(type));
+	if (node == NULL)
+		return NULL;
+
+	node->type = type;
+	tree->bytes += _NodeSize(type);
+	return node;
+}
+
+static void _FreeNode(struct RadixTree *tree, struct RadixNode *node)
+{
+	tree->bytes -= _NodeSize(node->type);
+	free(node);
+}
+
+static size_t _NodeSize(uint8_t type)
+{
+	switch (type)
+	{
+		case RDX_NODE4:
+			return sizeof(struct RadixNode4);
+		case RDX_NODE16:
+			return sizeof(struct RadixNode16);
+		case RDX_NODE48:
+			return sizeof(struct RadixNode48);
+		default:
+			return sizeof(struct RadixNode256);
+	}
+}
+
+static void _CopyHeader(struct RadixNode *to, struct RadixNode *from)
+{
+	to->childrenCount = from->childrenCount;
+	to->prefixLength = from->prefixLength;
+	memcpy(to->prefix, from->prefix, _Min(from->prefixLength, RDX_MAX_PREFIX));
+}
+
+#pragma mark Leaves
+static struct RadixLeaf *_MakeLeaf(struct RadixTree *tree, char *key, size_t keyLength, void *value)
+{
+	struct RadixLeaf *leaf = malloc(sizeof(struct RadixLeaf));
+	if (leaf == NULL)
+		return NULL;
+
+	leaf->key = key;
+	leaf->keyLength = keyLength;
+	leaf->value = value;
+	tree->bytes += sizeof(struct RadixLeaf);
+	return leaf;
+}
+
+static void _FreeLeaf(struct RadixTree *tree, struct RadixLeaf *leaf)
+{
+	tree->bytes -= sizeof(struct RadixLeaf);
+	free(leaf);
+}
+
+static inline int _IsLeaf(void *child)
+{
+	return (int) ((uintptr_t) child & 1);
+}
+
+static inline void *_TagLeaf(struct RadixLeaf *leaf)
+{
+	return (void *) ((uintptr_t) leaf | 1);
+}
+
+static inline struct RadixLeaf *_UntagLeaf(void *child)
+{
+	return (struct RadixLeaf *) ((uintptr_t) child & ~(uintptr_t) 1);
+}
+
+static int _LeafMatches(struct RadixLeaf *leaf, char *key, size_t keyLength)
+{
+	return leaf->keyLength == keyLength && memcmp(leaf->key, key, keyLength) == 0;
+}
+
+static struct RadixLeaf *_MinimumLeaf(void *child)
+{
+	while (child != NULL && _IsLeaf(child) == 0)
+	{
+		struct RadixNode *node = child;
+		int i = 0;
+		switch (node->type)
+		{
+			case RDX_NODE4:
+				child = ((struct RadixNode4 *) node)->children[0];
+				break;
+			case RDX_NODE16:
+				child = ((struct RadixNode16 *) node)->children[0];
+				break;
+			case RDX_NODE48:
+				while (((struct RadixNode48 *) node)->childIndex[i] == 0)
+					i++;
+				child = ((struct RadixNode48 *) node)->children[((struct RadixNode48 *) node)->childIndex[i] - 1];
+				break;
+			case RDX_NODE256:
+				while (((struct RadixNode256 *) node)->children[i] == NULL)
+					i++;
+				child = ((struct RadixNode256 *) node)->children[i];
+				break;
+		}
+	}
+	return child ? _UntagLeaf(child) : NULL;
+}
+
+#pragma mark Searching
+void *rdx_Search(struct RadixTree *tree, char *key)
+{
+	if (tree == NULL)
+		return NULL;
+	if (key == NULL)
+		return NULL;
+
+	size_t keyLength = strlen(key) + 1;
+	size_t depth = 0;
+	void *child = tree->root;
+	while (child != NULL)
+	{
+		if (_IsLeaf(child))
+		{
+			struct RadixLeaf *leaf = _UntagLeaf(child);
+			return _LeafMatches(leaf, key, keyLength) ? leaf->value : NULL;
+		}
+
+		struct RadixNode *node = child;
+		if (node->prefixLength != 0)
+		{
+			if (_PrefixMismatch(node, key, keyLength, depth) != node->prefixLength)
+				return NULL;
+			depth += node->prefixLength;
+		}
+		if (depth >= keyLength)
+			return NULL;
+
+		void **reference = _FindChild(node, (unsigned char) key[depth]);
+		child = reference ? *reference : NULL;
+		depth++;
+	}
+	return NULL;
+}
+
+static void **_FindChild(struct RadixNode *node, unsigned char byte)
+{
+	switch (node->type)
+	{
+		case RDX_NODE4:
+		{
+			struct RadixNode4 *node4 = (struct RadixNode4 *) node;
+			for (int i = 0; i < node->childrenCount; ++i)
+			{
+				if (node4->keys[i] == byte)
+					return &node4->children[i];
+			}
+			break;
+		}
+		case RDX_NODE16:
+		{
+			struct RadixNode16 *node16 = (struct RadixNode16 *) node;
+			for (int i = 0; i < node->childrenCount; ++i)
+			{
+				if (node16->keys[i] == byte)
+					return &node16->children[i];
+			}
+			break;
+		}
+		case RDX_NODE48:
+		{
+			struct RadixNode48 *node48 = (struct RadixNode48 *) node;
+			if (node48->childIndex[byte] != 0)
+				return &node48->children[node48->childIndex[byte] - 1];
+			break;
+		}
+		case RDX_NODE256:
+		{
+			struct RadixNode256 *node256 = (struct RadixNode256 *) node;
+			if (node256->children[byte] != NULL)
+				return &node256->children[byte];
+			break;
+		}
+	}
+	return NULL;
+}
+
+static size_t _PrefixMismatch(struct RadixNode *node, char *key, size_t keyLength, size_t depth)
+{
+	/* How many bytes of the node prefix the key matches from depth on */
+	size_t limit = _Min(_Min(node->prefixLength, RDX_MAX_PREFIX), keyLength - depth);
+	size_t i = 0;
+	for (; i < limit; ++i)
+	{
+		if (node->prefix[i] != (unsigned char) key[depth + i])
+			return i;
+	}
+
+	if (node->prefixLength > RDX_MAX_PREFIX)
+	{
+		/* The rest isn't stored, but any key below has it */
+		struct RadixLeaf *leaf = _MinimumLeaf(node);
+		limit = _Min(node->prefixLength, keyLength - depth);
+		for (; i < limit; ++i)
+		{
+			if (leaf->key[depth + i] != key[depth + i])
+				return i;
+		}
+	}
+	return i;
+}
+
+#pragma mark Inserting
+int rdx_Insert(struct RadixTree *tree, char *key, void *value)
+{
+	if (tree == NULL)
+		return 0;
+	if (key == NULL)
+		return 0;
+
+	int result = _Insert(tree, &tree->root, key, strlen(key) + 1, 0, value);
+	if (result == 1)
+		tree->count++;
+	return result != 0;
+}
+
+/* 0 - out of memory and nothing changed, 1 - added, 2 - replaced */
+static int _Insert(struct RadixTree *tree, void **reference, char *key, size_t keyLength, size_t depth, void *value)
+{
+	void *child = *reference;
+	if (child == NULL)
+	{
+		struct RadixLeaf *leaf = _MakeLeaf(tree, key, keyLength, value);
+		if (leaf == NULL)
+			return 0;
+		*reference = _TagLeaf(leaf);
+		return 1;
+	}
+
+	if (_IsLeaf(child))
+	{
+		struct RadixLeaf *leaf = _UntagLeaf(child);
+		if (_LeafMatches(leaf, key, keyLength))
+		{
+			leaf->key = key;
+			leaf->value = value;
+			return 2;
+		}
+
+		/* Both keys go under a new node holding what they share */
+		struct RadixLeaf *newLeaf = _MakeLeaf(tree, key, keyLength, value);
+		if (newLeaf == NULL)
+			return 0;
+		struct RadixNode4 *node = (struct RadixNode4 *) _AllocateNode(tree, RDX_NODE4);
+		if (node == NULL)
+		{
+			_FreeLeaf(tree, newLeaf);
+			return 0;
+		}
+
+		size_t shared = 0;
+		while (leaf->key[depth + shared] == key[depth + shared])
+			shared++;
+		node->header.prefixLength = (uint32_t) shared;
+		memcpy(node->header.prefix, key + depth, _Min(shared, RDX_MAX_PREFIX));
+		_InsertSorted(node->keys, node->children, &node->header.childrenCount, (unsigned char) leaf->key[depth + shared], child);
+		_InsertSorted(node->keys, node->children, &node->header.childrenCount, (unsigned char) key[depth + shared], _TagLeaf(newLeaf));
+		*reference = node;
+		return 1;
+	}
+
+	struct RadixNode *node = child;
+	if (node->prefixLength != 0)
+	{
+		size_t mismatch = _PrefixMismatch(node, key, keyLength, depth);
+		if (mismatch < node->prefixLength)
+			return _SplitPrefix(tree, reference, mismatch, key, keyLength, depth, value);
+		depth += node->prefixLength;
+	}
+
+	void **childReference = _FindChild(node, (unsigned char) key[depth]);
+	if (childReference != NULL)
+		return _Insert(tree, childReference, key, keyLength, depth + 1, value);
+
+	struct RadixLeaf *leaf = _MakeLeaf(tree, key, keyLength, value);
+	if (leaf == NULL)
+		return 0;
+	if (_AddChild(tree, reference, (unsigned char) key[depth], _TagLeaf(leaf)) == 0)
+	{
+		_FreeLeaf(tree, leaf);
+		return 0;
+	}
+	return 1;
+}
+
+static int _SplitPrefix(struct RadixTree *tree, void **reference, size_t mismatch, char *key, size_t keyLength, size_t depth, void *value)
+{
+	/* The key leaves the node prefix halfway: a new node takes the shared
+	 * part, the old one keeps what is left after the byte that differs */
+	struct RadixNode *node = *reference;
+	struct RadixLeaf *leaf = _MakeLeaf(tree, key, keyLength, value);
+	if (leaf == NULL)
+		return 0;
+	struct RadixNode4 *parent = (struct RadixNode4 *) _AllocateNode(tree, RDX_NODE4);
+	if (parent == NULL)
+	{
+		_FreeLeaf(tree, leaf);
+		return 0;
+	}
+	parent->header.prefixLength = (uint32_t) mismatch;
+	memcpy(parent->header.prefix, node->prefix, _Min(mismatch, RDX_MAX_PREFIX));
+
+	unsigned char nodeByte;
+	if (node->prefixLength <= RDX_MAX_PREFIX)
+	{
+		nodeByte = node->prefix[mismatch];
+		node->prefixLength -= mismatch + 1;
+		memmove(node->prefix, node->prefix + mismatch + 1, _Min(node->prefixLength, RDX_MAX_PREFIX));
+	} else
+	{
+		struct RadixLeaf *minimum = _MinimumLeaf(node);
+		nodeByte = (unsigned char) minimum->key[depth + mismatch];
+		node->prefixLength -= mismatch + 1;
+		memcpy(node->prefix, minimum->key + depth + mismatch + 1, _Min(node->prefixLength, RDX_MAX_PREFIX));
+	}
+
+	_InsertSorted(parent->keys, parent->children, &parent->header.childrenCount, nodeByte, node);
+	_InsertSorted(parent->keys, parent->children, &parent->header.childrenCount, (unsigned char) key[depth + mismatch], _TagLeaf(leaf));
+	*reference = parent;
+	return 1;
+}
+
+static int _AddChild(struct RadixTree *tree, void **reference, unsigned char byte, void *child)
+{
+	struct RadixNode *node = *reference;
+	switch (node->type)
+	{
+		case RDX_NODE4:
+		{
+			struct RadixNode4 *node4 = (struct RadixNode4 *) node;
+			if (node->childrenCount < 4)
+			{
+				_InsertSorted(node4->keys, node4->children, &node->childrenCount, byte, child);
+				return 1;
+			}
+
+			struct RadixNode16 *bigger = (struct RadixNode16 *) _AllocateNode(tree, RDX_NODE16);
+			if (bigger == NULL)
+				return 0;
+			_CopyHeader(&bigger->header, node);
+			memcpy(bigger->keys, node4->keys, sizeof(node4->keys));
+			memcpy(bigger->children, node4->children, sizeof(node4->children));
+			_FreeNode(tree, node);
+			*reference = bigger;
+			return _AddChild(tree, reference, byte, child);
+		}
+		case RDX_NODE16:
+		{
+			struct RadixNode16 *node16 = (struct RadixNode16 *) node;
+			if (node->childrenCount < 16)
+			{
+				_InsertSorted(node16->keys, node16->children, &node->childrenCount, byte, child);
+				return 1;
+			}
+
+			struct RadixNode48 *bigger = (struct RadixNode48 *) _AllocateNode(tree, RDX_NODE48);
+			if (bigger == NULL)
+				return 0;
+			_CopyHeader(&bigger->header, node);
+			for (int i = 0; i < 16; ++i)
+			{
+				bigger->childIndex[node16->keys[i]] = (unsigned char) (i + 1);
+				bigger->children[i] = node16->children[i];
+			}
+			_FreeNode(tree, node);
+			*reference = bigger;
+			return _AddChild(tree, reference, byte, child);
+		}
+		case RDX_NODE48:
+		{
+			struct RadixNode48 *node48 = (struct RadixNode48 *) node;
+			if (node->childrenCount < 48)
+			{
+				int slot = 0;
+				while (node48->children[slot] != NULL)
+					slot++;
+				node48->children[slot] = child;
+				node48->childIndex[byte] = (unsigned char) (slot + 1);
+				node->childrenCount++;
+				return 1;
+			}
+
+			struct RadixNode256 *bigger = (struct RadixNode256 *) _AllocateNode(tree, RDX_NODE256);
+			if (bigger == NULL)
+				return 0;
+			_CopyHeader(&bigger->header, node);
+			for (int i = 0; i < 256; ++i)
+			{
+				if (node48->childIndex[i] != 0)
+					bigger->children[i] = node48->children[node48->childIndex[i] - 1];
+			}
+			_FreeNode(tree, node);
+			*reference = bigger;
+			return _AddChild(tree, reference, byte, child);
+		}
+		case RDX_NODE256:
+		{
+			((struct RadixNode256 *) node)->children[byte] = child;
+			node->childrenCount++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void _InsertSorted(unsigned char *keys, void **children, uint16_t *count, unsigned char byte, void *child)
+{
+	int i = 0;
+	while (i < *count && keys[i] < byte)
+		i++;
+
+	memmove(keys + i + 1, keys + i, (size_t) (*count - i));
+	memmove(children + i + 1, children + i, (size_t) (*count - i) * sizeof(void *));
+	keys[i] = byte;
+	children[i] = child;
+	(*count)++;
+}
+
+#pragma mark Removing
+void *rdx_Remove(struct RadixTree *tree, char *key)
+{
+	if (tree == NULL)
+		return NULL;
+	if (key == NULL)
+		return NULL;
+
+	struct RadixLeaf *leaf = _Remove(tree, &tree->root, key, strlen(key) + 1, 0);
+	if (leaf == NULL)
+		return NULL;
+
+	void *value = leaf->value;
+	_FreeLeaf(tree, leaf);
+	tree->count--;
+	return value;
+}
+
+void rdx_RemoveAll(struct RadixTree *tree)
+{
+	if (tree == NULL)
+		return;
+
+	_FreeSubtree(tree, tree->root);
+	tree->root = NULL;
+	tree->count = 0;
+}
+
+static struct RadixLeaf *_Remove(struct RadixTree *tree, void **reference, char *key, size_t keyLength, size_t depth)
+{
+	void *child = *reference;
+	if (child == NULL)
+		return NULL;
+
+	if (_IsLeaf(child)) /* Only the root gets here */
+	{
+		struct RadixLeaf *leaf = _UntagLeaf(child);
+		if (_LeafMatches(leaf, key, keyLength) == 0)
+			return NULL;
+		*reference = NULL;
+		return leaf;
+	}
+
+	struct RadixNode *node = child;
+	if (node->prefixLength != 0)
+	{
+		if (_PrefixMismatch(node, key, keyLength, depth) != node->prefixLength)
+			return NULL;
+		depth += node->prefixLength;
+	}
+	if (depth >= keyLength)
+		return NULL;
+
+	void **childReference = _FindChild(node, (unsigned char) key[depth]);
+	if (childReference == NULL)
+		return NULL;
+	if (_IsLeaf(*childReference) == 0)
+		return _Remove(tree, childReference, key, keyLength, depth + 1);
+
+	struct RadixLeaf *leaf = _UntagLeaf(*childReference);
+	if (_LeafMatches(leaf, key, keyLength) == 0)
+		return NULL;
+	_RemoveChild(tree, reference, (unsigned char) key[depth], childReference);
+	return leaf;
+}
+
+static void _RemoveChild(struct RadixTree *tree, void **reference, unsigned char byte, void **child)
+{
+	/* Nodes shrink a bit later than they grow, so a key added and removed
+	 * at the boundary doesn't reallocate every time. Failing to allocate
+	 * the smaller node just keeps the bigger one. */
+	struct RadixNode *node = *reference;
+	switch (node->type)
+	{
+		case RDX_NODE4:
+		{
+			struct RadixNode4 *node4 = (struct RadixNode4 *) node;
+			int position = (int) (child - node4->children);
+			memmove(node4->keys + position, node4->keys + position + 1, (size_t) (node->childrenCount - position - 1));
+			memmove(node4->children + position, node4->children + position + 1, (size_t) (node->childrenCount - position - 1) * sizeof(void *));
+			node->childrenCount--;
+			if (node->childrenCount == 1)
+				_CollapseNode4(tree, reference);
+			return;
+		}
+		case RDX_NODE16:
+		{
+			struct RadixNode16 *node16 = (struct RadixNode16 *) node;
+			int position = (int) (child - node16->children);
+			memmove(node16->keys + position, node16->keys + position + 1, (size_t) (node->childrenCount - position - 1));
+			memmove(node16->children + position, node16->children + position + 1, (size_t) (node->childrenCount - position - 1) * sizeof(void *));
+			node->childrenCount--;
+			if (node->childrenCount != 3)
+				return;
+
+			struct RadixNode4 *smaller = (struct RadixNode4 *) _AllocateNode(tree, RDX_NODE4);
+			if (smaller == NULL)
+				return;
+			_CopyHeader(&smaller->header, node);
+			memcpy(smaller->keys, node16->keys, 3);
+			memcpy(smaller->children, node16->children, 3 * sizeof(void *));
+			_FreeNode(tree, node);
+			*reference = smaller;
+			return;
+		}
+		case RDX_NODE48:
+		{
+			struct RadixNode48 *node48 = (struct RadixNode48 *) node;
+			node48->children[node48->childIndex[byte] - 1] = NULL;
+			node48->childIndex[byte] = 0;
+			node->childrenCount--;
+			if (node->childrenCount != 12)
+				return;
+
+			struct RadixNode16 *smaller = (struct RadixNode16 *) _AllocateNode(tree, RDX_NODE16);
+			if (smaller == NULL)
+				return;
+			_CopyHeader(&smaller->header, node);
+			int count = 0;
+			for (int i = 0; i < 256; ++i)
+			{
+				if (node48->childIndex[i] == 0)
+					continue;
+				smaller->keys[count] = (unsigned char) i;
+				smaller->children[count] = node48->children[node48->childIndex[i] - 1];
+				count++;
+			}
+			_FreeNode(tree, node);
+			*reference = smaller;
+			return;
+		}
+		case RDX_NODE256:
+		{
+			struct RadixNode256 *node256 = (struct RadixNode256 *) node;
+			node256->children[byte] = NULL;
+			node->childrenCount--;
+			if (node->childrenCount != 37)
+				return;
+
+			struct RadixNode48 *smaller = (struct RadixNode48 *) _AllocateNode(tree, RDX_NODE48);
+			if (smaller == NULL)
+				return;
+			_CopyHeader(&smaller->header, node);
+			int count = 0;
+			for (int i = 0; i < 256; ++i)
+			{
+				if (node256->children[i] == NULL)
+					continue;
+				smaller->children[count] = node256->children[i];
+				smaller->childIndex[i] = (unsigned char) (count + 1);
+				count++;
+			}
+			_FreeNode(tree, node);
+			*reference = smaller;
+			return;
+		}
+	}
+}
+
+static void _CollapseNode4(struct RadixTree *tree, void **reference)
+{
+	/* A node with one child is merged into it: the child prefix becomes
+	 * this prefix, the byte leading to the child and the child prefix */
+	struct RadixNode4 *node = *reference;
+	void *onlyChild = node->children[0];
+	if (_IsLeaf(onlyChild) == 0)
+	{
+		struct RadixNode *child = onlyChild;
+		unsigned char merged[RDX_MAX_PREFIX];
+		size_t length = _Min(node->header.prefixLength, RDX_MAX_PREFIX);
+		memcpy(merged, node->header.prefix, length);
+		if (length < RDX_MAX_PREFIX)
+			merged[length++] = node->keys[0];
+		if (length < RDX_MAX_PREFIX)
+		{
+			size_t childLength = _Min(_Min(child->prefixLength, RDX_MAX_PREFIX), RDX_MAX_PREFIX - length);
+			memcpy(merged + length, child->prefix, childLength);
+			length += childLength;
+		}
+		memcpy(child->prefix, merged, length);
+		child->prefixLength += node->header.prefixLength + 1;
+	}
+
+	*reference = onlyChild;
+	_FreeNode(tree, &node->header);
+}
+
+#pragma mark Scanning
+void rdx_ScanPrefix(struct RadixTree *tree, char *prefix, rdx_ScanFunction scan, void *context)
+{
+	if (tree == NULL)
+		return;
+	if (prefix == NULL)
+		return;
+	if (scan == NULL)
+		return;
+
+	size_t prefixLength = strlen(prefix);
+	size_t depth = 0;
+	void *child = tree->root;
+	while (child != NULL)
+	{
+		if (_IsLeaf(child))
+		{
+			struct RadixLeaf *leaf = _UntagLeaf(child);
+			if (leaf->keyLength > prefixLength && memcmp(leaf->key, prefix, prefixLength) == 0)
+				scan(leaf->key, leaf->value, context);
+			return;
+		}
+		if (depth == prefixLength)
+		{
+			_ScanSubtree(child, scan, context);
+			return;
+		}
+
+		struct RadixNode *node = child;
+		if (node->prefixLength != 0)
+		{
+			size_t mismatch = _PrefixMismatch(node, prefix, prefixLength, depth);
+			if (depth + mismatch == prefixLength) /* The prefix ends inside the node prefix */
+			{
+				_ScanSubtree(child, scan, context);
+				return;
+			}
+			if (mismatch < node->prefixLength)
+				return;
+			depth += node->prefixLength;
+		}
+
+		void **reference = _FindChild(node, (unsigned char) prefix[depth]);
+		child = reference ? *reference : NULL;
+		depth++;
+	}
+}
+
+static void _ScanSubtree(void *child, rdx_ScanFunction scan, void *context)
+{
+	if (_IsLeaf(child))
+	{
+		struct RadixLeaf *leaf = _UntagLeaf(child);
+		scan(leaf->key, leaf->value, context);
+		return;
+	}
+
+	struct RadixNode *node = child;
+	switch (node->type)
+	{
+		case RDX_NODE4:
+			for (int i = 0; i < node->childrenCount; ++i)
+				_ScanSubtree(((struct RadixNode4 *) node)->children[i], scan, context);
+			break;
+		case RDX_NODE16:
+			for (int i = 0; i < node->childrenCount; ++i)
+				_ScanSubtree(((struct RadixNode16 *) node)->children[i], scan, context);
+			break;
+		case RDX_NODE48:
+			for (int i = 0; i < 256; ++i)
+			{
+				unsigned char slot = ((struct RadixNode48 *) node)->childIndex[i];
+				if (slot != 0)
+					_ScanSubtree(((struct RadixNode48 *) node)->children[slot - 1], scan, context);
+			}
+			break;
+		case RDX_NODE256:
+			for (int i = 0; i < 256; ++i)
+			{
+				void *grandchild = ((struct RadixNode256 *) node)->children[i];
+				if (grandchild != NULL)
+					_ScanSubtree(grandchild, scan, context);
+			}
+			break;
+	}
+}
+
+#pragma mark Stuff
+size_t rdx_Count(struct RadixTree *tree)
+{
+	if (tree == NULL)
+		return 0;
+	return tree->count;
+}
+
+size_t rdx_BytesUsed(struct RadixTree *tree)
+{
+	if (tree == NULL)
+		return 0;
+	return tree->bytes;
+}
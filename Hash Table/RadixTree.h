@@ -0,0 +1,30 @@
+#ifndef RadixTree_h
+#define RadixTree_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Adaptive radix tree over C strings: inner nodes grow from 4 to 16, 48
+ * and 256 children as needed and skip shared runs of key bytes, so a
+ * lookup or a prefix scan costs the key length, not the key count.
+ * Keys are borrowed, every key must stay alive while it is in the tree. */
+struct RadixTree;
+
+typedef void (*rdx_ScanFunction)(char *key, void *value, void *context);
+
+struct RadixTree *rdx_Create();
+
+/* Replaces the key pointer and the value if the key is there. 0 - out of memory */
+int rdx_Insert(struct RadixTree *tree, char *key, void *value);
+void *rdx_Remove(struct RadixTree *tree, char *key); /* The value, NULL - no such key */
+void *rdx_Search(struct RadixTree *tree, char *key);
+void rdx_RemoveAll(struct RadixTree *tree);
+/* Every key starting with prefix, in byte order. The tree must not be
+ * changed from inside scan. */
+void rdx_ScanPrefix(struct RadixTree *tree, char *prefix, rdx_ScanFunction scan, void *context);
+
+size_t rdx_Count(struct RadixTree *tree);
+size_t rdx_BytesUsed(struct RadixTree *tree);
+void rdx_Free(struct RadixTree *tree);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef ServerProtocol_h
+#define ServerProtocol_h
+
+#include <stdint.h>
+
+/* Wire format of the key-value server in main.c. Clients may send any
+ * number of requests without waiting; replies come back in the same
+ * order, one per key. Integers are in host byte order, the server only
+ * listens on a Unix socket or loopback. Keys can't contain zero bytes. */
+enum ServerOperation
+{
+	SRV_GET = 1, /* key - reply with the value */
+	SRV_SET, /* key, then value - empty reply */
+	SRV_DEL, /* key - empty reply, SRV_NOT_FOUND if it wasn't there */
+	SRV_MGET /* keyLength keys, each a uint16_t length and the key, in valueLength bytes - a reply per key */
+};
+
+enum ServerStatus
+{
+	SRV_OK = 0,
+	SRV_NOT_FOUND,
+	SRV_ERROR /* Malformed request or out of memory */
+};
+
+#define SRV_MAX_KEY_LENGTH 1023
+#define SRV_MAX_VALUE_LENGTH (1024 * 1024)
+
+struct ServerRequest
+{
+	uint8_t operation;
+	uint8_t reserved;
+	uint16_t keyLength; /* SRV_MGET: the number of keys */
+	uint32_t valueLength; /* SRV_MGET: the length of all keys */
+};
+
+struct ServerReply
+{
+	uint8_t status;
+	uint8_t reserved[3];
+	uint32_t valueLength;
+};
+
+#endif
@@ -0,0 +1,245 @@
+#import <stdlib.h>
+#import <assert.h>
+#import "TimerWheel.h"
+
+#pragma mark Private Header
+/* Hierarchical wheel: level L has TWHL_SLOTS slots, TWHL_SLOTS^L ticks wide each.
+ * Entries move one level down when the wheel reaches their slot (cascade),
+ * so every entry is touched at most TWHL_LEVELS times before it expires.
+ * A bitmap per level marks the slots that may hold entries, the wheel jumps
+ * straight to the next tick with something to expire or cascade. */
+#define TWHL_LEVELS 4
+#define TWHL_SLOT_BITS 6
+#define TWHL_SLOTS (1 << TWHL_SLOT_BITS) /* One bit each in occupied */
+#define TWHL_SLOT_MASK (TWHL_SLOTS - 1)
+#define TWHL_RANGE ((uint64_t) 1 << (TWHL_LEVELS * TWHL_SLOT_BITS))
+
+struct TimerWheel
+{
+	uint64_t current; /* Next tick to be processed, all before it are done */
+	size_t count;
+	uint64_t occupied[TWHL_LEVELS]; /* Set when linking, cleared once a slot is found empty */
+
+	struct TimerWheelEntry slots[TWHL_LEVELS][TWHL_SLOTS]; /* Sentinels of circular lists */
+};
+
+static struct TimerWheelEntry *_SlotForDeadline(struct TimerWheel *wheel, uint64_t deadline);
+static void _LinkInSlot(struct TimerWheel *wheel, struct TimerWheelEntry *head, struct TimerWheelEntry *entry);
+static void _Link(struct TimerWheelEntry *head, struct TimerWheelEntry *entry);
+static void _Unlink(struct TimerWheelEntry *entry);
+static size_t _Cascade(struct TimerWheel *wheel, int level);
+static uint64_t _NextBusyTick(struct TimerWheel *wheel);
+static int _SlotsToNextOccupied(uint64_t occupied, uint64_t position);
+
+#pragma mark Implementation
+struct TimerWheel *twhl_Create(uint64_t now)
+{
+	struct TimerWheel *wheel = malloc(sizeof(struct TimerWheel));
+	if (wheel == NULL)
+		return NULL;
+
+	wheel->current = now;
+	wheel->count = 0;
+	for (int level = 0; level < TWHL_LEVELS; ++level)
+		wheel->occupied[level] = 0;
+	for (int level = 0; level < TWHL_LEVELS; ++level)
+	{
+		for (int slot = 0; slot < TWHL_SLOTS; ++slot)
+		{
+			struct TimerWheelEntry *head = &wheel->slots[level][slot];
+			head->next = head;
+			head->previous = head;
+		}
+	}
+
+	return wheel;
+}
+
+void twhl_Schedule(struct TimerWheel *wheel, struct TimerWheelEntry *entry, uint64_t deadline)
+{
+	if (wheel == NULL || entry == NULL)
+		return;
+
+	if (twhl_IsScheduled(entry))
+		twhl_Cancel(wheel, entry);
+
+	entry->deadline = deadline;
+	_LinkInSlot(wheel, _SlotForDeadline(wheel, deadline), entry);
+	wheel->count++;
+}
+
+void twhl_Cancel(struct TimerWheel *wheel, struct TimerWheelEntry *entry)
+{
+	if (wheel == NULL || entry == NULL)
+		return;
+	if (twhl_IsScheduled(entry) == 0)
+		return;
+
+	_Unlink(entry);
+	wheel->count--;
+}
+
+int8_t twhl_IsScheduled(struct TimerWheelEntry *entry)
+{
+	return entry->next != NULL;
+}
+
+size_t twhl_Advance(struct TimerWheel *wheel, uint64_t now, size_t budget, twhl_ExpireFunction expire, void *context)
+{
+	if (wheel == NULL)
+		return 0;
+
+	size_t expired = 0;
+	while (wheel->current <= now && budget > 0)
+	{
+		if (wheel->count == 0)
+		{
+			wheel->current = now + 1; /* Nothing to wait for, just jump */
+			break;
+		}
+
+		int slot = (int) (wheel->current & TWHL_SLOT_MASK);
+		struct TimerWheelEntry *head = &wheel->slots[0][slot];
+		while (head->next != head && budget > 0)
+		{
+			struct TimerWheelEntry *entry = head->next;
+			_Unlink(entry);
+			wheel->count--;
+			expire(entry, context);
+			++expired;
+			--budget;
+		}
+		if (head->next != head)
+			break; /* Out of budget in the middle of a slot, resume here */
+		wheel->occupied[0] &= ~((uint64_t) 1 << slot);
+
+		/* Empty ticks cost nothing: the ones in between hold nothing and cascade nothing */
+		uint64_t next = _NextBusyTick(wheel);
+		wheel->current = (next <= now) ? next : now + 1;
+		for (int level = TWHL_LEVELS - 1; level > 0; --level)
+		{
+			uint64_t levelMask = ((uint64_t) 1 << (level * TWHL_SLOT_BITS)) - 1;
+			if ((wheel->current & levelMask) == 0)
+			{
+				size_t moved = _Cascade(wheel, level);
+				budget -= (moved < budget) ? moved : budget;
+			}
+		}
+	}
+
+	return expired;
+}
+
+size_t twhl_Count(struct TimerWheel *wheel)
+{
+	if (wheel == NULL)
+		return 0;
+	return wheel->count;
+}
+
+void twhl_Free(struct TimerWheel *wheel)
+{
+	free(wheel);
+}
+
+#pragma mark Slots
+static struct TimerWheelEntry *_SlotForDeadline(struct TimerWheel *wheel, uint64_t deadline)
+{
+	/* Overdue entries go to the slot processed next */
+	if (deadline < wheel->current)
+		deadline = wheel->current;
+
+	uint64_t delta = deadline - wheel->current;
+	if (delta >= TWHL_RANGE)
+	{
+		/* Too far away, park in the last reachable slot and look again on cascade */
+		delta = TWHL_RANGE - 1;
+		deadline = wheel->current + delta;
+	}
+
+	int level = 0;
+	while (level < TWHL_LEVELS - 1 && delta >= ((uint64_t) 1 << ((level + 1) * TWHL_SLOT_BITS)))
+		++level;
+
+	int slot = (int) ((deadline >> (level * TWHL_SLOT_BITS)) & TWHL_SLOT_MASK);
+	return &wheel->slots[level][slot];
+}
+
+static size_t _Cascade(struct TimerWheel *wheel, int level)
+{
+	/* Returns the number of entries moved */
+	int slot = (int) ((wheel->current >> (level * TWHL_SLOT_BITS)) & TWHL_SLOT_MASK);
+	struct TimerWheelEntry *head = &wheel->slots[level][slot];
+	wheel->occupied[level] &= ~((uint64_t) 1 << slot);
+	if (head->next == head)
+		return 0;
+
+	/* Detach the whole slot first, entries may land in it again */
+	struct TimerWheelEntry *entry = head->next;
+	head->previous->next = NULL;
+	head->next = head;
+	head->previous = head;
+
+	size_t moved = 0;
+	while (entry != NULL)
+	{
+		struct TimerWheelEntry *nextEntry = entry->next;
+		_LinkInSlot(wheel, _SlotForDeadline(wheel, entry->deadline), entry);
+		entry = nextEntry;
+		++moved;
+	}
+	return moved;
+}
+
+static uint64_t _NextBusyTick(struct TimerWheel *wheel)
+{
+	/* The first tick after current whose level 0 slot may hold entries, or
+	 * that cascades a slot of a higher level that may. UINT64_MAX - none */
+	uint64_t next = UINT64_MAX;
+	for (int level = 0; level < TWHL_LEVELS; ++level)
+	{
+		int shift = level * TWHL_SLOT_BITS;
+		int distance = _SlotsToNextOccupied(wheel->occupied[level], wheel->current >> shift);
+		if (distance == 0)
+			continue;
+		/* Level 0 slots are due at their tick, higher ones cascade at the start of theirs */
+		uint64_t tick = (level == 0) ? wheel->current + (uint64_t) distance : ((wheel->current >> shift) + (uint64_t) distance) << shift;
+		if (tick < next)
+			next = tick;
+	}
+	return next;
+}
+
+static int _SlotsToNextOccupied(uint64_t occupied, uint64_t position)
+{
+	/* 1 to TWHL_SLOTS slots on from position, going round; 0 - all empty */
+	int start = (int) ((position + 1) & TWHL_SLOT_MASK);
+	uint64_t rotated = start ? (occupied >> start) | (occupied << (TWHL_SLOTS - start)) : occupied;
+	if (rotated == 0)
+		return 0;
+	return __builtin_ctzll(rotated) + 1;
+}
+
+static void _LinkInSlot(struct TimerWheel *wheel, struct TimerWheelEntry *head, struct TimerWheelEntry *entry)
+{
+	size_t index = (size_t) (head - &wheel->slots[0][0]);
+	wheel->occupied[index / TWHL_SLOTS] |= (uint64_t) 1 << (index % TWHL_SLOTS);
+	_Link(head, entry);
+}
+
+static void _Link(struct TimerWheelEntry *head, struct TimerWheelEntry *entry)
+{
+	entry->previous = head->previous;
+	entry->next = head;
+	head->previous->next = entry;
+	head->previous = entry;
+}
+
+static void _Unlink(struct TimerWheelEntry *entry)
+{
+	assert(entry->next != NULL);
+	entry->previous->next = entry->next;
+	entry->next->previous = entry->previous;
+	entry->next = NULL;
+	entry->previous = NULL;
+}
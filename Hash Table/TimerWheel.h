@@ -0,0 +1,36 @@
+#ifndef TimerWheel_h
+#define TimerWheel_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+struct TimerWheel;
+
+/* Embedded into whatever is being timed, the wheel never allocates entries */
+struct TimerWheelEntry
+{
+	uint64_t deadline;
+
+	struct TimerWheelEntry *next;
+	struct TimerWheelEntry *previous;
+};
+
+typedef void (*twhl_ExpireFunction)(struct TimerWheelEntry *entry, void *context);
+
+struct TimerWheel *twhl_Create(uint64_t now);
+
+void twhl_Schedule(struct TimerWheel *wheel, struct TimerWheelEntry *entry, uint64_t deadline);
+void twhl_Cancel(struct TimerWheel *wheel, struct TimerWheelEntry *entry);
+int8_t twhl_IsScheduled(struct TimerWheelEntry *entry);
+
+/* Expires everything due at or before now, but does at most budget units of
+ * work (one per expired or cascaded entry, a cascading slot is moved whole);
+ * empty slots are skipped for free. Returns the number of expired entries;
+ * the rest is picked up by the next call. Entries are unscheduled before
+ * expire is called, so it may free them. */
+size_t twhl_Advance(struct TimerWheel *wheel, uint64_t now, size_t budget, twhl_ExpireFunction expire, void *context);
+
+size_t twhl_Count(struct TimerWheel *wheel);
+void twhl_Free(struct TimerWheel *wheel); /* Scheduled entries are left as they are */
+
+#endif
@@ -0,0 +1,116 @@
+#ifndef Utilities_h
+#define Utilities_h
+
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#endif
+
+/* Helpers shared by the table and its parts, internal to the library.
+ * The hashes are part of the formats of FileTable, WriteLog and
+ * WorkloadTrace files: changing them needs new versions of those. */
+
+#pragma mark Hashing
+static inline uint64_t util_HashString(const char *key) /* 64-bit FNV-1a */
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (const unsigned char *c = (const unsigned char *) key; *c != '\0'; ++c)
+	{
+		hash ^= *c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static inline uint64_t util_HashBytes(const char *key, size_t length) /* The same over length bytes */
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= (unsigned char) key[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static inline uint32_t util_HashString32(const char *key) /* 32-bit FNV-1a */
+{
+	uint32_t hash = 2166136261u;
+	for (const unsigned char *c = (const unsigned char *) key; *c != '\0'; ++c)
+	{
+		hash ^= *c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline uint32_t util_HashBytes32(const char *bytes, size_t length)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= (unsigned char) bytes[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static inline uint64_t util_MixHash(uint64_t hash)
+{
+	/* MurmurHash3 finalizer, so weak hashes spread over every bit */
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdull;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ull;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+#pragma mark Scanning
+static inline uint64_t util_ReverseBits(uint64_t value)
+{
+	/* Scan cursors count up in reversed bit order */
+	value = ((value >> 1) & 0x5555555555555555ull) | ((value & 0x5555555555555555ull) << 1);
+	value = ((value >> 2) & 0x3333333333333333ull) | ((value & 0x3333333333333333ull) << 2);
+	value = ((value >> 4) & 0x0F0F0F0F0F0F0F0Full) | ((value & 0x0F0F0F0F0F0F0F0Full) << 4);
+	value = ((value >> 8) & 0x00FF00FF00FF00FFull) | ((value & 0x00FF00FF00FF00FFull) << 8);
+	value = ((value >> 16) & 0x0000FFFF0000FFFFull) | ((value & 0x0000FFFF0000FFFFull) << 16);
+	return (value >> 32) | (value << 32);
+}
+
+#pragma mark Time And Files
+static inline uint64_t util_MonotonicNanoseconds(void)
+{
+#ifdef __APPLE__
+	static mach_timebase_info_data_t timebase;
+	if (timebase.denom == 0)
+		mach_timebase_info(&timebase);
+	return mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
+
+static inline int util_WriteAll(int fd, const void *bytes, size_t size) /* 0 - a write failed */
+{
+	const char *next = bytes;
+	while (size != 0)
+	{
+		ssize_t written = write(fd, next, size);
+		if (written < 0 && errno == EINTR)
+			continue; /* A signal before anything was written */
+		if (written <= 0)
+			return 0;
+		next += written;
+		size -= (size_t) written;
+	}
+	return 1;
+}
+
+#endif
@@ -0,0 +1,151 @@
+#import <stdlib.h>
+#include <stddef.h>
+#import <string.h>
+#import <errno.h>
+#import <stdio.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <time.h>
+#import <sys/stat.h>
+#import "WorkloadTrace.h"
+#include "Utilities.h"
+
+#pragma mark Private Header
+#define WTRC_MAGIC "HTBLTRCE"
+#define WTRC_VERSION 1
+#define WTRC_BUFFER_RECORDS 4096 /* 64 KB per write */
+
+struct WorkloadTraceHeader
+{
+	char magic[8];
+	uint64_t version;
+};
+
+struct WorkloadRecorder
+{
+	int fd;
+	int failed; /* A write failed, later records are dropped */
+	uint64_t lastTime;
+	size_t count;
+	size_t bufferUsed;
+	struct WorkloadTraceRecord buffer[WTRC_BUFFER_RECORDS];
+};
+
+// Writing
+static void _Flush(struct WorkloadRecorder *recorder);
+
+#pragma mark Creation
+struct WorkloadRecorder *wtrc_Create(const char *path)
+{
+	if (path == NULL)
+		return NULL;
+
+	struct WorkloadRecorder *recorder = malloc(sizeof(struct WorkloadRecorder));
+	if (recorder == NULL)
+		return NULL;
+	memset(recorder, 0, offsetof(struct WorkloadRecorder, buffer));
+
+	recorder->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	struct WorkloadTraceHeader header = {WTRC_MAGIC, WTRC_VERSION};
+	if (recorder->fd == -1 || util_WriteAll(recorder->fd, &header, sizeof(header)) == 0)
+	{
+		if (recorder->fd != -1)
+			close(recorder->fd);
+		free(recorder);
+		return NULL;
+	}
+
+	recorder->lastTime = util_MonotonicNanoseconds();
+	return recorder;
+}
+
+int wtrc_Close(struct WorkloadRecorder *recorder)
+{
+	if (recorder == NULL)
+		return 0;
+
+	_Flush(recorder);
+	int written = !recorder->failed;
+	if (close(recorder->fd) != 0)
+		written = 0;
+	free(recorder);
+	return written;
+}
+
+#pragma mark Recording
+void wtrc_Record(struct WorkloadRecorder *recorder, enum WorkloadOperation operation, char *key)
+{
+	if (recorder == NULL)
+		return;
+
+	uint64_t now = util_MonotonicNanoseconds();
+	uint64_t delay = now - recorder->lastTime;
+	recorder->lastTime = now;
+
+	struct WorkloadTraceRecord *record = &recorder->buffer[recorder->bufferUsed++];
+	size_t keyLength = key ? strlen(key) : 0;
+	record->keyHash = key ? wtrc_HashKey(key, keyLength) : 0;
+	record->delay = delay < UINT32_MAX ? (uint32_t) delay : UINT32_MAX;
+	record->keyLength = keyLength < UINT16_MAX ? (uint16_t) keyLength : UINT16_MAX;
+	record->operation = (uint8_t) operation;
+	record->reserved = 0;
+	recorder->count++;
+
+	if (recorder->bufferUsed == WTRC_BUFFER_RECORDS)
+		_Flush(recorder);
+}
+
+uint64_t wtrc_HashKey(char *key, size_t keyLength)
+{
+	/* FNV-1a and the MurmurHash3 finalizer, unseeded so traces of
+	 * different processes agree. Part of the format, like WTRC_VERSION. */
+	return util_MixHash(util_HashBytes(key, keyLength));
+}
+
+#pragma mark Writing
+static void _Flush(struct WorkloadRecorder *recorder)
+{
+	if (recorder->bufferUsed == 0)
+		return;
+	if (!recorder->failed && util_WriteAll(recorder->fd, recorder->buffer, recorder->bufferUsed * sizeof(struct WorkloadTraceRecord)) == 0)
+		recorder->failed = 1;
+	recorder->bufferUsed = 0;
+}
+
+#pragma mark Loading
+struct WorkloadTraceRecord *wtrc_Load(const char *path, size_t *count)
+{
+	if (path == NULL || count == NULL)
+		return NULL;
+
+	FILE *file = fopen(path, "rb");
+	if (file == NULL)
+		return NULL;
+
+	struct WorkloadTraceHeader header;
+	struct stat status;
+	struct WorkloadTraceRecord *records = NULL;
+	if (fread(&header, sizeof(header), 1, file) == 1 && memcmp(header.magic, WTRC_MAGIC, sizeof(header.magic)) == 0
+		&& header.version == WTRC_VERSION && fstat(fileno(file), &status) == 0)
+	{
+		size_t recordCount = ((size_t) status.st_size - sizeof(header)) / sizeof(struct WorkloadTraceRecord);
+		records = malloc((recordCount ? recordCount : 1) * sizeof(struct WorkloadTraceRecord));
+		if (records != NULL && fread(records, sizeof(struct WorkloadTraceRecord), recordCount, file) == recordCount)
+			*count = recordCount;
+		else
+		{
+			free(records);
+			records = NULL;
+		}
+	}
+	fclose(file);
+	return records;
+}
+
+#pragma mark Stuff
+size_t wtrc_RecordCount(struct WorkloadRecorder *recorder)
+{
+	if (recorder == NULL)
+		return 0;
+	return recorder->count;
+}
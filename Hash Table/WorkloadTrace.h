@@ -0,0 +1,43 @@
+#ifndef WorkloadTrace_h
+#define WorkloadTrace_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Compact binary trace of table operations, for replaying a real access
+ * pattern against other table configurations. A record keeps the kind of
+ * operation, a fixed 64-bit hash and the length of the key (never the key
+ * itself) and the nanoseconds since the previous record. Records are 16
+ * bytes, buffered and written in large blocks. */
+struct WorkloadRecorder;
+
+enum WorkloadOperation
+{
+	WTRC_SET = 0,
+	WTRC_GET,
+	WTRC_REMOVE,
+	WTRC_CLEAR /* No key */
+};
+
+struct WorkloadTraceRecord
+{
+	uint64_t keyHash; /* Equal keys, equal hashes - in every trace */
+	uint32_t delay; /* Since the previous record, saturates at about 4 s */
+	uint16_t keyLength; /* Saturates at UINT16_MAX */
+	uint8_t operation;
+	uint8_t reserved;
+};
+
+/* Creates or truncates the trace at path. NULL - can't open it */
+struct WorkloadRecorder *wtrc_Create(const char *path);
+/* Writes what is buffered and closes the file, 0 - a write failed */
+int wtrc_Close(struct WorkloadRecorder *recorder);
+void wtrc_Record(struct WorkloadRecorder *recorder, enum WorkloadOperation operation, char *key);
+size_t wtrc_RecordCount(struct WorkloadRecorder *recorder);
+
+/* Reads a whole trace into an array the caller frees. A torn last record
+ * is left out. NULL - can't read it or it isn't a trace */
+struct WorkloadTraceRecord *wtrc_Load(const char *path, size_t *count);
+uint64_t wtrc_HashKey(char *key, size_t keyLength);
+
+#endif
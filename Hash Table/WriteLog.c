@@ -0,0 +1,565 @@
+#import <stdlib.h>
+#import <string.h>
+#import <stdio.h>
+#import <errno.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <time.h>
+#import <sys/mman.h>
+#import <sys/stat.h>
+#import "WriteLog.h"
+#include "Utilities.h"
+
+#pragma mark Private Header
+#define WLOG_LOG_MAGIC "HTBLWLOG"
+#define WLOG_SNAPSHOT_MAGIC "HTBLSNAP"
+#define WLOG_VERSION 1
+#define WLOG_DEFAULT_COMMIT_INTERVAL 2000000ull
+#define WLOG_DEFAULT_COMMIT_BYTES (64 * 1024)
+#define WLOG_DEFAULT_COMPACT_BYTES (64 * 1024 * 1024)
+#define WLOG_KEY_LENGTH_MASK 0x3FFFFFFFu /* The operation takes the top two bits */
+#define WLOG_OPERATION_SHIFT 30
+
+struct WriteLogHeader
+{
+	char magic[8];
+	uint64_t version;
+	uint64_t count; /* Snapshots only: the keys in it */
+};
+
+struct WriteLogRecord
+{
+	uint32_t checksum; /* FNV-1a of the rest of the record */
+	uint32_t keyLength; /* Without the zero */
+	uint64_t value;
+	/* keyLength + 1 bytes of key follow, records aren't aligned */
+};
+
+struct WriteLog
+{
+	char *path;
+	char *nextPath; /* The log while a snapshot is written */
+	char *snapshotPath;
+	char *partialSnapshotPath; /* Renamed to snapshotPath once complete */
+	struct WriteLogOptions options;
+
+	int fd; /* Appended to, the file at path or nextPath */
+	size_t fileBytes; /* Written to fd */
+	char *buffer;
+	size_t bufferCapacity;
+	size_t bufferUsed;
+	uint64_t lastCommit;
+	int failed; /* Since the last commit */
+	size_t commitCount;
+
+	FILE *snapshot; /* Being written, NULL - none */
+	size_t snapshotCount;
+};
+
+// Files
+static int _Recover(struct WriteLog *log);
+static void _ReturnToLog(struct WriteLog *log);
+static int _OpenLogFile(const char *path, size_t *validBytes);
+static int _WriteHeader(int fd, const char *magic, uint64_t count);
+static int _AppendLogFile(struct WriteLog *log, const char *fromPath);
+static char *_MapFile(const char *path, const char *magic, size_t *size);
+static int _SyncFile(int fd);
+static void _SyncDirectory(const char *path);
+static char *_PathWithSuffix(const char *path, const char *suffix);
+static void _Discard(struct WriteLog *log);
+// Records
+static size_t _EncodeRecord(char *bytes, enum WriteLogOperation operation, char *key, size_t keyLength, uint64_t value);
+static size_t _ReplayRecords(char *bytes, size_t size, wlog_ReplayFunction replay, void *context);
+static uint32_t _Checksum(const char *bytes, size_t size);
+static int _ReserveBuffer(struct WriteLog *log, size_t size);
+
+#pragma mark Creation
+struct WriteLog *wlog_Open(const char *path, struct WriteLogOptions *options)
+{
+	if (path == NULL)
+		return NULL;
+
+	struct WriteLog *log = calloc(1, sizeof(struct WriteLog));
+	if (log == NULL)
+		return NULL;
+	log->fd = -1;
+
+	if (options != NULL)
+		log->options = *options;
+	if (log->options.commitInterval == 0)
+		log->options.commitInterval = WLOG_DEFAULT_COMMIT_INTERVAL;
+	if (log->options.commitBytes == 0)
+		log->options.commitBytes = WLOG_DEFAULT_COMMIT_BYTES;
+	if (log->options.compactBytes == 0)
+		log->options.compactBytes = WLOG_DEFAULT_COMPACT_BYTES;
+
+	log->path = _PathWithSuffix(path, "");
+	log->nextPath = _PathWithSuffix(path, ".next");
+	log->snapshotPath = _PathWithSuffix(path, ".snapshot");
+	log->partialSnapshotPath = _PathWithSuffix(path, ".snapshot.partial");
+	if (log->path == NULL || log->nextPath == NULL || log->snapshotPath == NULL || log->partialSnapshotPath == NULL
+		|| _ReserveBuffer(log, log->options.commitBytes) == 0 || _Recover(log) == 0)
+	{
+		_Discard(log);
+		return NULL;
+	}
+
+	log->lastCommit = util_MonotonicNanoseconds();
+	return log;
+}
+
+void wlog_Close(struct WriteLog *log)
+{
+	if (log == NULL)
+		return;
+
+	wlog_AbandonSnapshot(log);
+	wlog_Commit(log);
+	_Discard(log);
+}
+
+#pragma mark Replaying
+int wlog_Replay(struct WriteLog *log, wlog_ReplayFunction replaySnapshot, wlog_ReplayFunction replay, void *context)
+{
+	if (log == NULL || replay == NULL)
+		return 0;
+
+	/* Records the snapshot has seen already are replayed on top of it
+	 * after a crash while swapping the files: they leave the keys the
+	 * way the later records of the log expect them */
+	const char *paths[2] = {log->snapshotPath, log->path};
+	const char *magics[2] = {WLOG_SNAPSHOT_MAGIC, WLOG_LOG_MAGIC};
+	wlog_ReplayFunction replays[2] = {replaySnapshot ? replaySnapshot : replay, replay};
+	for (int i = 0; i < 2; ++i)
+	{
+		size_t size = 0;
+		char *bytes = _MapFile(paths[i], magics[i], &size);
+		if (bytes == NULL && size != 0)
+			return 0;
+		if (bytes == NULL)
+			continue;
+
+		_ReplayRecords(bytes + sizeof(struct WriteLogHeader), size - sizeof(struct WriteLogHeader), replays[i], context);
+		munmap(bytes, size);
+	}
+	return 1;
+}
+
+size_t wlog_SnapshotCount(struct WriteLog *log)
+{
+	if (log == NULL)
+		return 0;
+
+	int fd = open(log->snapshotPath, O_RDONLY);
+	if (fd == -1)
+		return 0;
+	struct WriteLogHeader header;
+	ssize_t bytesRead = pread(fd, &header, sizeof(header), 0);
+	close(fd);
+	if (bytesRead != sizeof(header) || memcmp(header.magic, WLOG_SNAPSHOT_MAGIC, sizeof(header.magic)) != 0)
+		return 0;
+	return (size_t) header.count;
+}
+
+#pragma mark Logging
+int wlog_Append(struct WriteLog *log, enum WriteLogOperation operation, char *key, uint64_t value)
+{
+	if (log == NULL)
+		return 0;
+
+	size_t keyLength = key ? strlen(key) : 0;
+	if (keyLength > WLOG_KEY_LENGTH_MASK)
+		return 0;
+	size_t size = sizeof(struct WriteLogRecord) + keyLength + 1;
+	if (log->bufferUsed + size > log->options.commitBytes && log->bufferUsed != 0)
+		wlog_Commit(log);
+	if (_ReserveBuffer(log, size) == 0)
+		return 0;
+
+	log->bufferUsed += _EncodeRecord(log->buffer + log->bufferUsed, operation, key, keyLength, value);
+	if (log->bufferUsed >= log->options.commitBytes || util_MonotonicNanoseconds() - log->lastCommit >= log->options.commitInterval)
+		return wlog_Commit(log);
+	return !log->failed;
+}
+
+int wlog_Commit(struct WriteLog *log)
+{
+	if (log == NULL)
+		return 0;
+
+	if (log->bufferUsed != 0)
+	{
+		if (util_WriteAll(log->fd, log->buffer, log->bufferUsed))
+		{
+			log->fileBytes += log->bufferUsed;
+		} else
+		{
+			/* Cut off what did get written, so the next records follow whole ones */
+			log->failed = 1;
+			if (ftruncate(log->fd, (off_t) log->fileBytes) == 0)
+				lseek(log->fd, (off_t) log->fileBytes, SEEK_SET);
+		}
+		log->bufferUsed = 0;
+	}
+	if (_SyncFile(log->fd) == 0)
+		log->failed = 1;
+
+	log->lastCommit = util_MonotonicNanoseconds();
+	log->commitCount++;
+	int committed = !log->failed;
+	log->failed = 0;
+	return committed;
+}
+
+#pragma mark Compaction
+int wlog_IsCompactionDue(struct WriteLog *log)
+{
+	if (log == NULL)
+		return 0;
+	return log->snapshot == NULL && log->fileBytes + log->bufferUsed >= log->options.compactBytes;
+}
+
+int wlog_BeginSnapshot(struct WriteLog *log)
+{
+	if (log == NULL || log->snapshot != NULL)
+		return 0;
+	if (access(log->nextPath, F_OK) == 0) /* Still appended to after a failed swap */
+		return 0;
+	if (wlog_Commit(log) == 0)
+		return 0;
+
+	int nextFd = open(log->nextPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (nextFd == -1)
+		return 0;
+	FILE *snapshot = fopen(log->partialSnapshotPath, "wb");
+	struct WriteLogHeader header = {{0}, WLOG_VERSION, 0};
+	memcpy(header.magic, WLOG_SNAPSHOT_MAGIC, sizeof(header.magic));
+	if (snapshot == NULL || fwrite(&header, sizeof(header), 1, snapshot) != 1 || _WriteHeader(nextFd, WLOG_LOG_MAGIC, 0) == 0)
+	{
+		if (snapshot != NULL)
+			fclose(snapshot);
+		unlink(log->partialSnapshotPath);
+		close(nextFd);
+		unlink(log->nextPath);
+		return 0;
+	}
+
+	close(log->fd);
+	log->fd = nextFd;
+	log->fileBytes = sizeof(struct WriteLogHeader);
+	log->snapshot = snapshot;
+	log->snapshotCount = 0;
+	return 1;
+}
+
+int wlog_AddToSnapshot(struct WriteLog *log, char *key, uint64_t value)
+{
+	if (log == NULL || log->snapshot == NULL || key == NULL)
+		return 0;
+
+	size_t keyLength = strlen(key);
+	if (keyLength > WLOG_KEY_LENGTH_MASK)
+		return 0;
+	char record[sizeof(struct WriteLogRecord) + keyLength + 1];
+	size_t size = _EncodeRecord(record, WLOG_SET, key, keyLength, value);
+	if (fwrite(record, size, 1, log->snapshot) != 1)
+		return 0;
+	log->snapshotCount++;
+	return 1;
+}
+
+int wlog_FinishSnapshot(struct WriteLog *log)
+{
+	if (log == NULL || log->snapshot == NULL)
+		return 0;
+
+	struct WriteLogHeader header = {{0}, WLOG_VERSION, log->snapshotCount};
+	memcpy(header.magic, WLOG_SNAPSHOT_MAGIC, sizeof(header.magic));
+	int written = (ferror(log->snapshot) == 0 && fseek(log->snapshot, 0, SEEK_SET) == 0 && fwrite(&header, sizeof(header), 1, log->snapshot) == 1
+		&& fflush(log->snapshot) == 0 && _SyncFile(fileno(log->snapshot)));
+	if (!written)
+	{
+		wlog_AbandonSnapshot(log);
+		return 0;
+	}
+	fclose(log->snapshot);
+	log->snapshot = NULL;
+
+	/* Each rename leaves files that replay to the same keys */
+	if (rename(log->partialSnapshotPath, log->snapshotPath) != 0 || wlog_Commit(log) == 0 || rename(log->nextPath, log->path) != 0)
+	{
+		unlink(log->partialSnapshotPath);
+		_ReturnToLog(log);
+		return 0;
+	}
+	_SyncDirectory(log->path);
+	return 1;
+}
+
+void wlog_AbandonSnapshot(struct WriteLog *log)
+{
+	if (log == NULL || log->snapshot == NULL)
+		return;
+
+	fclose(log->snapshot);
+	log->snapshot = NULL;
+	unlink(log->partialSnapshotPath);
+	_ReturnToLog(log);
+}
+
+static void _ReturnToLog(struct WriteLog *log)
+{
+	/* What went to the next log belongs to the old one again */
+	wlog_Commit(log);
+	size_t validBytes = 0;
+	int fd = _OpenLogFile(log->path, &validBytes);
+	if (fd == -1)
+		return; /* Stays with the next log, merged back by the next open */
+	close(log->fd);
+	log->fd = fd;
+	log->fileBytes = validBytes;
+	_AppendLogFile(log, log->nextPath);
+}
+
+int wlog_IsSnapshotting(struct WriteLog *log)
+{
+	if (log == NULL)
+		return 0;
+	return log->snapshot != NULL;
+}
+
+#pragma mark Files
+static int _Recover(struct WriteLog *log)
+{
+	/* Never renamed in, so never complete */
+	unlink(log->partialSnapshotPath);
+
+	log->fd = _OpenLogFile(log->path, &log->fileBytes);
+	if (log->fd == -1)
+		return 0;
+	if (access(log->nextPath, F_OK) == 0)
+		return _AppendLogFile(log, log->nextPath);
+	return 1;
+}
+
+static int _OpenLogFile(const char *path, size_t *validBytes)
+{
+	/* Positioned after the last whole record, anything behind it cut off */
+	int fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (fd == -1)
+		return -1;
+
+	size_t size = 0;
+	char *bytes = _MapFile(path, WLOG_LOG_MAGIC, &size);
+	if (bytes == NULL && size != 0)
+	{
+		close(fd);
+		return -1;
+	}
+	if (bytes == NULL)
+	{
+		*validBytes = sizeof(struct WriteLogHeader);
+		if (_WriteHeader(fd, WLOG_LOG_MAGIC, 0) == 0)
+		{
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	*validBytes = sizeof(struct WriteLogHeader) + _ReplayRecords(bytes + sizeof(struct WriteLogHeader), size - sizeof(struct WriteLogHeader), NULL, NULL);
+	munmap(bytes, size);
+	if ((*validBytes != size && ftruncate(fd, (off_t) *validBytes) != 0) || lseek(fd, (off_t) *validBytes, SEEK_SET) == -1)
+	{
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int _WriteHeader(int fd, const char *magic, uint64_t count)
+{
+	struct WriteLogHeader header = {{0}, WLOG_VERSION, count};
+	memcpy(header.magic, magic, sizeof(header.magic));
+	return ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0 && util_WriteAll(fd, &header, sizeof(header)) && _SyncFile(fd);
+}
+
+static int _AppendLogFile(struct WriteLog *log, const char *fromPath)
+{
+	size_t size = 0;
+	char *bytes = _MapFile(fromPath, WLOG_LOG_MAGIC, &size);
+	if (bytes != NULL)
+	{
+		size_t validBytes = _ReplayRecords(bytes + sizeof(struct WriteLogHeader), size - sizeof(struct WriteLogHeader), NULL, NULL);
+		int appended = util_WriteAll(log->fd, bytes + sizeof(struct WriteLogHeader), validBytes) && _SyncFile(log->fd);
+		munmap(bytes, size);
+		if (!appended)
+			return 0;
+		log->fileBytes += validBytes;
+	}
+	unlink(fromPath);
+	_SyncDirectory(fromPath);
+	return 1;
+}
+
+static char *_MapFile(const char *path, const char *magic, size_t *size)
+{
+	/* NULL and size 0 - missing or empty, NULL and a size - not a log */
+	*size = 0;
+	int fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return NULL;
+
+	/* Shorter than a header - a crash while creating it */
+	struct stat status;
+	char *bytes = NULL;
+	if (fstat(fd, &status) == 0 && status.st_size >= (off_t) sizeof(struct WriteLogHeader))
+	{
+		*size = (size_t) status.st_size;
+		bytes = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (bytes == MAP_FAILED)
+			bytes = NULL;
+	}
+	close(fd);
+
+	struct WriteLogHeader *header = (struct WriteLogHeader *) bytes;
+	if (bytes != NULL && (memcmp(header->magic, magic, sizeof(header->magic)) != 0 || header->version != WLOG_VERSION))
+	{
+		munmap(bytes, *size);
+		bytes = NULL;
+	}
+	return bytes;
+}
+
+static int _SyncFile(int fd)
+{
+#if defined(__APPLE__)
+	/* fsync only reaches the drive's cache there */
+	return fcntl(fd, F_FULLFSYNC) != -1 || fsync(fd) == 0;
+#elif defined(__linux__)
+	return fdatasync(fd) == 0;
+#else
+	return fsync(fd) == 0;
+#endif
+}
+
+static void _SyncDirectory(const char *path)
+{
+	/* Makes renames and unlinks in it durable */
+	char *directory = _PathWithSuffix(path, "");
+	if (directory == NULL)
+		return;
+	char *slash = strrchr(directory, '/');
+	if (slash == NULL)
+		strcpy(directory, ".");
+	else if (slash == directory)
+		slash[1] = '\0';
+	else
+		*slash = '\0';
+
+	int fd = open(directory, O_RDONLY);
+	if (fd != -1)
+	{
+		fsync(fd);
+		close(fd);
+	}
+	free(directory);
+}
+
+static char *_PathWithSuffix(const char *path, const char *suffix)
+{
+	size_t length = strlen(path);
+	size_t suffixLength = strlen(suffix);
+	char *result = malloc(length + suffixLength + 1);
+	if (result == NULL)
+		return NULL;
+	memcpy(result, path, length);
+	memcpy(result + length, suffix, suffixLength + 1);
+	return result;
+}
+
+static void _Discard(struct WriteLog *log)
+{
+	if (log->fd != -1)
+		close(log->fd);
+	free(log->path);
+	free(log->nextPath);
+	free(log->snapshotPath);
+	free(log->partialSnapshotPath);
+	free(log->buffer);
+	free(log);
+}
+
+#pragma mark Records
+static size_t _EncodeRecord(char *bytes, enum WriteLogOperation operation, char *key, size_t keyLength, uint64_t value)
+{
+	struct WriteLogRecord record;
+	record.keyLength = (uint32_t) keyLength | ((uint32_t) operation << WLOG_OPERATION_SHIFT);
+	record.value = value;
+	memcpy(bytes, &record, sizeof(record));
+	if (keyLength != 0)
+		memcpy(bytes + sizeof(record), key, keyLength);
+	bytes[sizeof(record) + keyLength] = '\0';
+
+	size_t size = sizeof(record) + keyLength + 1;
+	record.checksum = _Checksum(bytes + sizeof(record.checksum), size - sizeof(record.checksum));
+	memcpy(bytes, &record.checksum, sizeof(record.checksum));
+	return size;
+}
+
+static size_t _ReplayRecords(char *bytes, size_t size, wlog_ReplayFunction replay, void *context)
+{
+	/* Stops at the first record that isn't whole, returns the bytes before it */
+	size_t offset = 0;
+	while (size - offset >= sizeof(struct WriteLogRecord) + 1)
+	{
+		struct WriteLogRecord record;
+		memcpy(&record, bytes + offset, sizeof(record));
+		size_t keyLength = record.keyLength & WLOG_KEY_LENGTH_MASK;
+		enum WriteLogOperation operation = record.keyLength >> WLOG_OPERATION_SHIFT;
+		size_t recordSize = sizeof(record) + keyLength + 1;
+		if (recordSize > size - offset || operation > WLOG_REMOVE_ALL)
+			break;
+		char *key = bytes + offset + sizeof(record);
+		if (key[keyLength] != '\0' || _Checksum(bytes + offset + sizeof(record.checksum), recordSize - sizeof(record.checksum)) != record.checksum)
+			break;
+
+		if (replay != NULL)
+			replay(operation, key, record.value, context);
+		offset += recordSize;
+	}
+	return offset;
+}
+
+static uint32_t _Checksum(const char *bytes, size_t size)
+{
+	return util_HashBytes32(bytes, size); /* Part of the record format */
+}
+
+static int _ReserveBuffer(struct WriteLog *log, size_t size)
+{
+	/* Records longer than commitBytes get a buffer of their own size */
+	if (log->bufferUsed + size <= log->bufferCapacity)
+		return 1;
+	char *buffer = realloc(log->buffer, log->bufferUsed + size);
+	if (buffer == NULL)
+		return 0;
+	log->buffer = buffer;
+	log->bufferCapacity = log->bufferUsed + size;
+	return 1;
+}
+
+#pragma mark Stuff
+size_t wlog_LogBytes(struct WriteLog *log)
+{
+	if (log == NULL)
+		return 0;
+	return log->fileBytes + log->bufferUsed;
+}
+
+size_t wlog_CommitCount(struct WriteLog *log)
+{
+	if (log == NULL)
+		return 0;
+	return log->commitCount;
+}
@@ -0,0 +1,62 @@
+#ifndef WriteLog_h
+#define WriteLog_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Append-only log of key changes in a file, plus a snapshot of every key
+ * next to it (path.snapshot). Records are buffered and written with one
+ * fsync per group: once commitBytes are buffered or commitInterval has
+ * passed since the last commit, checked on every append. Each record has
+ * a checksum, so a tail torn by a crash is cut off when the log is opened
+ * again. Compaction writes a new snapshot a few keys at a time while the
+ * log goes on in path.next, then swaps both in with renames; a crash at
+ * any point leaves files that replay to the same keys. */
+struct WriteLog;
+
+enum WriteLogOperation
+{
+	WLOG_SET = 0,
+	WLOG_REMOVE,
+	WLOG_REMOVE_ALL /* No key */
+};
+
+struct WriteLogOptions
+{
+	uint64_t commitInterval; /* Nanoseconds, 0 - 2 ms */
+	size_t commitBytes; /* 0 - 64 KB */
+	size_t compactBytes; /* A snapshot is due once the log is longer, 0 - 64 MB */
+};
+
+typedef void (*wlog_ReplayFunction)(enum WriteLogOperation operation, char *key, uint64_t value, void *context);
+
+/* Opens or creates the log at path, finishing what a crash interrupted.
+ * options may be NULL. NULL - the files can't be opened or aren't logs */
+struct WriteLog *wlog_Open(const char *path, struct WriteLogOptions *options);
+/* Commits what is buffered and closes the files. An unfinished snapshot
+ * is thrown away, the log still has everything */
+void wlog_Close(struct WriteLog *log);
+
+/* Calls replaySnapshot for every key of the snapshot (all sets, a key
+ * may come twice if the snapshot had to start over) and then replay for
+ * every record logged since, in order. replaySnapshot NULL - replay gets
+ * the snapshot too. Keys are zero terminated. 0 - couldn't read the files */
+int wlog_Replay(struct WriteLog *log, wlog_ReplayFunction replaySnapshot, wlog_ReplayFunction replay, void *context);
+size_t wlog_SnapshotCount(struct WriteLog *log); /* Keys in the snapshot, to size a table before replaying */
+
+int wlog_Append(struct WriteLog *log, enum WriteLogOperation operation, char *key, uint64_t value); /* 0 - a write failed */
+int wlog_Commit(struct WriteLog *log); /* Writes and fsyncs the buffer, 0 - any write since the last commit failed */
+
+int wlog_IsCompactionDue(struct WriteLog *log);
+/* The keys added between begin and finish have to be every key present
+ * when it began; later changes go to the log as usual. */
+int wlog_BeginSnapshot(struct WriteLog *log);
+int wlog_AddToSnapshot(struct WriteLog *log, char *key, uint64_t value);
+int wlog_FinishSnapshot(struct WriteLog *log);
+void wlog_AbandonSnapshot(struct WriteLog *log);
+int wlog_IsSnapshotting(struct WriteLog *log);
+
+size_t wlog_LogBytes(struct WriteLog *log);
+size_t wlog_CommitCount(struct WriteLog *log);
+
+#endif
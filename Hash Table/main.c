@@ -5,9 +5,693 @@
 //  Created by ASPCartman on 03/25/13.
 //  Copyright (c) 2013 __MyCompanyName__. All rights reserved.
 //
+//  Key-value server on top of the table, ServerProtocol.h has the wire
+//  format. A worker thread per core runs its own event loop (epoll, or
+//  kqueue where there is none) and takes connections from the shared
+//  listening socket. Keys are spread by hash over a table shard per core,
+//  each behind its own mutex, so workers seldom wait for each other.
+//  Replies to a batch of pipelined requests queue up and go out with one
+//  writev; values are reference counted, so a GET copies nothing.
+//
+//  Usage: server [--unix PATH | --tcp PORT] [--threads N] [--linear]
+//
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#endif
+#include "HashTable.h"
+#include "ServerProtocol.h"
+
+#pragma mark Private Header
+#define SERVER_DEFAULT_PORT 7379
+#define SERVER_SHARD_CAPACITY 1024
+#define SERVER_MAX_EVENTS 64
+#define SERVER_READ_SIZE (64 * 1024) /* Read per event */
+#define SERVER_MAX_BACKLOG (1024 * 1024) /* Reply bytes queued before a connection stops taking requests */
+#define SERVER_IOV_COUNT 512
+
+enum
+{
+	kEventRead = 1, kEventWrite = 2
+};
+
+struct Value /* Shared by the table and the replies still being written */
+{
+	uint32_t references;
+	uint32_t length;
+	char bytes[];
+};
 
+struct Shard
+{
+	pthread_mutex_t lock;
+	struct HashTable *table;
+} __attribute__((aligned(64))); /* Locks of different shards on different cache lines */
+
+struct Reply
+{
+	struct ServerReply header;
+	struct Value *value; /* NULL - the header only */
+};
+
+struct Connection
+{
+	int fd;
+	char *input;
+	size_t inputUsed;
+	size_t inputCapacity;
+
+	struct Reply *replies;
+	size_t repliesCount;
+	size_t repliesCapacity;
+	size_t repliesSent;
+	size_t partialBytes; /* Of replies[repliesSent], written already */
+	size_t backlogBytes; /* Queued and not written yet */
+	int watching; /* kEventRead and kEventWrite it waits for */
+};
+
+struct Server
+{
+	int listenFd;
+	int isTCP;
+	struct Shard *shards;
+	int shardCount;
+};
+
+struct Worker
+{
+	struct Server *server;
+	int loopFd;
+	pthread_t thread;
+};
+
+struct LoopEvent
+{
+	void *data; /* The connection, NULL - the listening socket */
+	int events;
+};
+
+// Server
+static int _Listen(struct Server *server, const char *unixPath, int port);
+static void *_RunWorker(void *argument);
+static void _AcceptConnections(struct Worker *worker);
+static int _ServeConnection(struct Worker *worker, struct Connection *connection, int events);
+static void _CloseConnection(struct Connection *connection);
+// Requests
+static int _HandleRequests(struct Server *server, struct Connection *connection);
+static size_t _RequestBodyLength(struct ServerRequest *request);
+static int _HandleRequest(struct Server *server, struct Connection *connection, struct ServerRequest *request, char *body);
+static int _Get(struct Server *server, struct Connection *connection, char *key, size_t keyLength);
+static int _Set(struct Server *server, struct Connection *connection, char *key, size_t keyLength, char *bytes, size_t length);
+static int _Delete(struct Server *server, struct Connection *connection, char *key, size_t keyLength);
+static int _CopyKey(char *copy, char *key, size_t keyLength);
+static struct Shard *_ShardForKey(struct Server *server, char *key);
+static void _ReleaseValue(struct Value *value);
+// Replies
+static int _PushReply(struct Connection *connection, enum ServerStatus status, struct Value *value);
+static int _FlushReplies(struct Connection *connection);
+static int _WatchConnection(struct Worker *worker, struct Connection *connection);
+static void _AddToIov(struct iovec *iov, int *iovCount, void *bytes, size_t length, size_t *skip);
+static void _AdvanceReplies(struct Connection *connection, size_t written);
+// Event loop
+static int _CreateLoop(void);
+static int _Watch(int loopFd, int fd, void *data, int events, int adding);
+static int _WaitForEvents(int loopFd, struct LoopEvent *events, int capacity);
+static int _SetNonBlocking(int fd);
+static void _PrintUsage(const char *name);
+
+#pragma mark Main
 int main(int argc, const char *argv[])
 {
-	// What is the purport of life?
+	const char *unixPath = NULL;
+	int port = SERVER_DEFAULT_PORT;
+	long threadCount = sysconf(_SC_NPROCESSORS_ONLN);
+	int linear = 0;
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strcmp(argv[i], "--linear") == 0)
+		{
+			linear = 1;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			_PrintUsage(argv[0]);
+			return 1;
+		}
+		if (strcmp(argv[i], "--unix") == 0)
+			unixPath = argv[++i];
+		else if (strcmp(argv[i], "--tcp") == 0)
+			port = atoi(argv[++i]);
+		else if (strcmp(argv[i], "--threads") == 0)
+			threadCount = atol(argv[++i]);
+		else
+		{
+			_PrintUsage(argv[0]);
+			return 1;
+		}
+	}
+	if (threadCount < 1)
+		threadCount = 1;
+
+	signal(SIGPIPE, SIG_IGN); /* Clients that go away show up as write errors */
+
+	struct Server server = {0};
+	server.shardCount = (int) threadCount;
+	server.shards = calloc((size_t) threadCount, sizeof(struct Shard));
+	if (server.shards == NULL)
+		return 1;
+	for (int i = 0; i < server.shardCount; ++i)
+	{
+		pthread_mutex_init(&server.shards[i].lock, NULL);
+		server.shards[i].table = linear ? htbl_Create(SERVER_SHARD_CAPACITY) : htbl_CreateCuckoo(SERVER_SHARD_CAPACITY);
+		if (server.shards[i].table == NULL)
+			return 1;
+	}
+	if (_Listen(&server, unixPath, port) == 0)
+	{
+		perror("Can't listen");
+		return 1;
+	}
+	if (unixPath != NULL)
+		fprintf(stderr, "Listening on %s, %ld threads\n", unixPath, threadCount);
+	else
+		fprintf(stderr, "Listening on 127.0.0.1:%d, %ld threads\n", port, threadCount);
+
+	struct Worker *workers = calloc((size_t) threadCount, sizeof(struct Worker));
+	if (workers == NULL)
+		return 1;
+	for (long i = 0; i < threadCount; ++i)
+	{
+		workers[i].server = &server;
+		workers[i].loopFd = _CreateLoop();
+		if (workers[i].loopFd == -1 || _Watch(workers[i].loopFd, server.listenFd, NULL, kEventRead, 1) == 0)
+		{
+			perror("Can't create an event loop");
+			return 1;
+		}
+		if (i != 0 && pthread_create(&workers[i].thread, NULL, _RunWorker, &workers[i]) != 0)
+		{
+			perror("Can't start a worker");
+			return 1;
+		}
+	}
+	_RunWorker(&workers[0]); /* Never returns */
 	return 0;
 }
+
+static void _PrintUsage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [options]\n"
+			"  --unix PATH    listen on a Unix domain socket\n"
+			"  --tcp PORT     listen on 127.0.0.1 (default %d)\n"
+			"  --threads N    workers and table shards (default: one per core)\n"
+			"  --linear       linear probing shards instead of cuckoo ones\n", name, SERVER_DEFAULT_PORT);
+}
+
+#pragma mark Server
+static int _Listen(struct Server *server, const char *unixPath, int port)
+{
+	if (unixPath != NULL)
+	{
+		struct sockaddr_un address = {0};
+		if (strlen(unixPath) >= sizeof(address.sun_path))
+			return 0;
+		address.sun_family = AF_UNIX;
+		strcpy(address.sun_path, unixPath);
+		unlink(unixPath);
+
+		server->listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (server->listenFd == -1 || bind(server->listenFd, (struct sockaddr *) &address, sizeof(address)) != 0)
+			return 0;
+	} else
+	{
+		struct sockaddr_in address = {0};
+		address.sin_family = AF_INET;
+		address.sin_port = htons((uint16_t) port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		server->listenFd = socket(AF_INET, SOCK_STREAM, 0);
+		int reuse = 1;
+		if (server->listenFd == -1 || setsockopt(server->listenFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0
+			|| bind(server->listenFd, (struct sockaddr *) &address, sizeof(address)) != 0)
+			return 0;
+		server->isTCP = 1;
+	}
+	return listen(server->listenFd, SOMAXCONN) == 0 && _SetNonBlocking(server->listenFd);
+}
+
+static void *_RunWorker(void *argument)
+{
+	struct Worker *worker = argument;
+	struct LoopEvent events[SERVER_MAX_EVENTS];
+	struct Connection *closed[SERVER_MAX_EVENTS];
+	for (;;)
+	{
+		int count = _WaitForEvents(worker->loopFd, events, SERVER_MAX_EVENTS);
+		int closedCount = 0;
+		for (int i = 0; i < count; ++i)
+		{
+			struct Connection *connection = events[i].data;
+			if (connection == NULL)
+			{
+				_AcceptConnections(worker);
+				continue;
+			}
+			/* kqueue reports reading and writing separately, a connection
+			 * may have been closed by an earlier event of the batch */
+			if (connection->fd == -1)
+				continue;
+			if (_ServeConnection(worker, connection, events[i].events) == 0)
+			{
+				close(connection->fd);
+				connection->fd = -1;
+				closed[closedCount++] = connection;
+			}
+		}
+		for (int i = 0; i < closedCount; ++i)
+			_CloseConnection(closed[i]);
+	}
+	return NULL;
+}
+
+static void _AcceptConnections(struct Worker *worker)
+{
+	for (;;)
+	{
+		int fd = accept(worker->server->listenFd, NULL, NULL);
+		if (fd == -1)
+			return; /* EAGAIN - another worker took it, or none left */
+
+		int noDelay = 1;
+		if (worker->server->isTCP)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+		struct Connection *connection = calloc(1, sizeof(struct Connection));
+		if (connection != NULL)
+		{
+			connection->fd = fd;
+			connection->watching = kEventRead;
+		}
+		if (connection == NULL || _SetNonBlocking(fd) == 0 || _Watch(worker->loopFd, fd, connection, kEventRead, 1) == 0)
+		{
+			free(connection);
+			close(fd);
+		}
+	}
+}
+
+static int _ServeConnection(struct Worker *worker, struct Connection *connection, int events)
+{
+	/* 0 - close it. Requests are read and answered while earlier replies
+	 * are still being written, up to SERVER_MAX_BACKLOG, so a client that
+	 * writes a long pipeline before it reads doesn't stall both sides. */
+	if ((events & kEventRead) && connection->backlogBytes < SERVER_MAX_BACKLOG)
+	{
+		if (connection->inputCapacity - connection->inputUsed < SERVER_READ_SIZE)
+		{
+			size_t capacity = connection->inputUsed + SERVER_READ_SIZE;
+			char *input = realloc(connection->input, capacity);
+			if (input == NULL)
+				return 0;
+			connection->input = input;
+			connection->inputCapacity = capacity;
+		}
+
+		ssize_t bytesRead = read(connection->fd, connection->input + connection->inputUsed, SERVER_READ_SIZE);
+		if (bytesRead == 0)
+			return 0;
+		if (bytesRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			return 0;
+		if (bytesRead > 0)
+			connection->inputUsed += (size_t) bytesRead;
+	}
+
+	/* Requests left at a full backlog go on once some of it was written */
+	for (;;)
+	{
+		int full = (connection->backlogBytes >= SERVER_MAX_BACKLOG);
+		size_t inputUsed = connection->inputUsed;
+		if (_HandleRequests(worker->server, connection) == 0 || _FlushReplies(connection) == 0)
+			return 0;
+		if (connection->backlogBytes >= SERVER_MAX_BACKLOG || (!full && connection->inputUsed == inputUsed))
+			break;
+	}
+	return _WatchConnection(worker, connection);
+}
+
+static void _CloseConnection(struct Connection *connection)
+{
+	for (size_t i = connection->repliesSent; i < connection->repliesCount; ++i)
+		_ReleaseValue(connection->replies[i].value);
+	free(connection->replies);
+	free(connection->input);
+	free(connection);
+}
+
+#pragma mark Requests
+static int _HandleRequests(struct Server *server, struct Connection *connection)
+{
+	/* Every whole request in the input, the rest waits for more bytes */
+	size_t offset = 0;
+	while (connection->inputUsed - offset >= sizeof(struct ServerRequest) && connection->backlogBytes < SERVER_MAX_BACKLOG)
+	{
+		struct ServerRequest request;
+		memcpy(&request, connection->input + offset, sizeof(request));
+		size_t bodyLength = _RequestBodyLength(&request);
+		if (bodyLength == (size_t) -1)
+			return 0; /* Can't tell where the next request starts */
+		if (connection->inputUsed - offset - sizeof(request) < bodyLength)
+			break;
+
+		if (_HandleRequest(server, connection, &request, connection->input + offset + sizeof(request)) == 0)
+			return 0;
+		offset += sizeof(request) + bodyLength;
+	}
+
+	memmove(connection->input, connection->input + offset, connection->inputUsed - offset);
+	connection->inputUsed -= offset;
+	return 1;
+}
+
+static size_t _RequestBodyLength(struct ServerRequest *request)
+{
+	/* (size_t) -1 - malformed */
+	switch (request->operation)
+	{
+		case SRV_GET:
+		case SRV_DEL:
+			return request->keyLength <= SRV_MAX_KEY_LENGTH ? request->keyLength : (size_t) -1;
+		case SRV_SET:
+			if (request->keyLength > SRV_MAX_KEY_LENGTH || request->valueLength > SRV_MAX_VALUE_LENGTH)
+				return (size_t) -1;
+			return (size_t) request->keyLength + request->valueLength;
+		case SRV_MGET:
+			if (request->valueLength > (size_t) request->keyLength * (sizeof(uint16_t) + SRV_MAX_KEY_LENGTH))
+				return (size_t) -1;
+			return request->valueLength;
+		default:
+			return (size_t) -1;
+	}
+}
+
+static int _HandleRequest(struct Server *server, struct Connection *connection, struct ServerRequest *request, char *body)
+{
+	switch (request->operation)
+	{
+		case SRV_GET:
+			return _Get(server, connection, body, request->keyLength);
+		case SRV_SET:
+			return _Set(server, connection, body, request->keyLength, body + request->keyLength, request->valueLength);
+		case SRV_DEL:
+			return _Delete(server, connection, body, request->keyLength);
+	}
+
+	/* SRV_MGET: a reply per key, even past a malformed one */
+	char *end = body + request->valueLength;
+	for (uint16_t i = 0; i < request->keyLength; ++i)
+	{
+		uint16_t keyLength = 0;
+		if (end - body >= (ptrdiff_t) sizeof(keyLength))
+			memcpy(&keyLength, body, sizeof(keyLength));
+		if (end - body < (ptrdiff_t) sizeof(keyLength) || end - body - (ptrdiff_t) sizeof(keyLength) < keyLength)
+		{
+			if (_PushReply(connection, SRV_ERROR, NULL) == 0)
+				return 0;
+			continue;
+		}
+		body += sizeof(keyLength);
+		if (_Get(server, connection, body, keyLength) == 0)
+			return 0;
+		body += keyLength;
+	}
+	return 1;
+}
+
+static int _Get(struct Server *server, struct Connection *connection, char *key, size_t keyLength)
+{
+	char copy[SRV_MAX_KEY_LENGTH + 1];
+	if (_CopyKey(copy, key, keyLength) == 0)
+		return _PushReply(connection, SRV_ERROR, NULL);
+
+	struct Shard *shard = _ShardForKey(server, copy);
+	pthread_mutex_lock(&shard->lock);
+	struct Value *value = htbl_ValueForKey(shard->table, copy);
+	if (value != NULL)
+		__atomic_add_fetch(&value->references, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&shard->lock);
+
+	if (value == NULL)
+		return _PushReply(connection, SRV_NOT_FOUND, NULL);
+	return _PushReply(connection, SRV_OK, value);
+}
+
+static int _Set(struct Server *server, struct Connection *connection, char *key, size_t keyLength, char *bytes, size_t length)
+{
+	char copy[SRV_MAX_KEY_LENGTH + 1];
+	struct Value *value = malloc(sizeof(struct Value) + length);
+	if (value == NULL || _CopyKey(copy, key, keyLength) == 0)
+	{
+		free(value);
+		return _PushReply(connection, SRV_ERROR, NULL);
+	}
+	value->references = 1;
+	value->length = (uint32_t) length;
+	memcpy(value->bytes, bytes, length);
+
+	struct Shard *shard = _ShardForKey(server, copy);
+	pthread_mutex_lock(&shard->lock);
+	struct Value *oldValue = htbl_ValueForKey(shard->table, copy);
+	htbl_SetValueForKey(shard->table, value, copy);
+	int stored = (htbl_ValueForKey(shard->table, copy) == value); /* Out of memory otherwise */
+	pthread_mutex_unlock(&shard->lock);
+
+	_ReleaseValue(stored ? oldValue : value);
+	return _PushReply(connection, stored ? SRV_OK : SRV_ERROR, NULL);
+}
+
+static int _Delete(struct Server *server, struct Connection *connection, char *key, size_t keyLength)
+{
+	char copy[SRV_MAX_KEY_LENGTH + 1];
+	if (_CopyKey(copy, key, keyLength) == 0)
+		return _PushReply(connection, SRV_ERROR, NULL);
+
+	struct Shard *shard = _ShardForKey(server, copy);
+	pthread_mutex_lock(&shard->lock);
+	struct Value *value = htbl_ValueForKey(shard->table, copy);
+	if (value != NULL)
+		htbl_RemoveKey(shard->table, copy);
+	pthread_mutex_unlock(&shard->lock);
+
+	_ReleaseValue(value);
+	return _PushReply(connection, value ? SRV_OK : SRV_NOT_FOUND, NULL);
+}
+
+static int _CopyKey(char *copy, char *key, size_t keyLength)
+{
+	/* Table keys are strings: not empty, no zeros inside */
+	if (keyLength == 0 || keyLength > SRV_MAX_KEY_LENGTH || memchr(key, '\0', keyLength) != NULL)
+		return 0;
+	memcpy(copy, key, keyLength);
+	copy[keyLength] = '\0';
+	return 1;
+}
+
+static struct Shard *_ShardForKey(struct Server *server, char *key)
+{
+	/* FNV-1a, independent of the hashes inside the shards */
+	uint32_t hash = 2166136261u;
+	for (char *c = key; *c != '\0'; ++c)
+	{
+		hash ^= (unsigned char) *c;
+		hash *= 16777619u;
+	}
+	return &server->shards[hash % (uint32_t) server->shardCount];
+}
+
+static void _ReleaseValue(struct Value *value)
+{
+	if (value != NULL && __atomic_sub_fetch(&value->references, 1, __ATOMIC_ACQ_REL) == 0)
+		free(value);
+}
+
+#pragma mark Replies
+static int _PushReply(struct Connection *connection, enum ServerStatus status, struct Value *value)
+{
+	/* Takes over the reference to value */
+	if (connection->repliesCount == connection->repliesCapacity)
+	{
+		size_t capacity = connection->repliesCapacity ? connection->repliesCapacity * 2 : 64;
+		struct Reply *replies = realloc(connection->replies, capacity * sizeof(struct Reply));
+		if (replies == NULL)
+		{
+			_ReleaseValue(value);
+			return 0;
+		}
+		connection->replies = replies;
+		connection->repliesCapacity = capacity;
+	}
+
+	struct Reply *reply = &connection->replies[connection->repliesCount++];
+	memset(&reply->header, 0, sizeof(reply->header));
+	reply->header.status = (uint8_t) status;
+	reply->header.valueLength = value ? value->length : 0;
+	reply->value = value;
+	connection->backlogBytes += sizeof(reply->header) + reply->header.valueLength;
+	return 1;
+}
+
+static int _FlushReplies(struct Connection *connection)
+{
+	while (connection->repliesSent < connection->repliesCount)
+	{
+		struct iovec iov[SERVER_IOV_COUNT];
+		int iovCount = 0;
+		size_t skip = connection->partialBytes;
+		for (size_t i = connection->repliesSent; i < connection->repliesCount && iovCount + 2 <= SERVER_IOV_COUNT; ++i)
+		{
+			struct Reply *reply = &connection->replies[i];
+			_AddToIov(iov, &iovCount, &reply->header, sizeof(reply->header), &skip);
+			if (reply->value != NULL)
+				_AddToIov(iov, &iovCount, reply->value->bytes, reply->value->length, &skip);
+		}
+
+		ssize_t written = writev(connection->fd, iov, iovCount);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+			return 0;
+		if (written < 0)
+			break;
+		_AdvanceReplies(connection, (size_t) written);
+	}
+
+	if (connection->repliesSent == connection->repliesCount)
+		connection->repliesCount = connection->repliesSent = 0;
+	return 1;
+}
+
+static int _WatchConnection(struct Worker *worker, struct Connection *connection)
+{
+	/* Stops reading only while the client leaves a full backlog unread */
+	int events = (connection->backlogBytes < SERVER_MAX_BACKLOG ? kEventRead : 0)
+		| (connection->repliesSent < connection->repliesCount ? kEventWrite : 0);
+	if (events == connection->watching)
+		return 1;
+	if (_Watch(worker->loopFd, connection->fd, connection, events, 0) == 0)
+		return 0;
+	connection->watching = events;
+	return 1;
+}
+
+static void _AddToIov(struct iovec *iov, int *iovCount, void *bytes, size_t length, size_t *skip)
+{
+	/* Leaves out the first skip bytes, which were written before */
+	if (*skip >= length)
+	{
+		*skip -= length;
+		return;
+	}
+	iov[*iovCount].iov_base = (char *) bytes + *skip;
+	iov[*iovCount].iov_len = length - *skip;
+	(*iovCount)++;
+	*skip = 0;
+}
+
+static void _AdvanceReplies(struct Connection *connection, size_t written)
+{
+	size_t remaining = written + connection->partialBytes;
+	while (connection->repliesSent < connection->repliesCount)
+	{
+		struct Reply *reply = &connection->replies[connection->repliesSent];
+		size_t length = sizeof(reply->header) + (reply->value ? reply->value->length : 0);
+		if (remaining < length)
+			break;
+		remaining -= length;
+		_ReleaseValue(reply->value);
+		connection->repliesSent++;
+	}
+	connection->backlogBytes -= written;
+	connection->partialBytes = remaining;
+}
+
+#pragma mark Event Loop
+#ifdef __linux__
+static int _CreateLoop(void)
+{
+	return epoll_create1(0);
+}
+
+static int _Watch(int loopFd, int fd, void *data, int events, int adding)
+{
+	/* Level triggered; only one of the workers wakes up for a new connection */
+	struct epoll_event event = {0};
+	event.events = ((events & kEventRead) ? EPOLLIN : 0) | ((events & kEventWrite) ? EPOLLOUT : 0);
+	if (data == NULL)
+		event.events |= EPOLLEXCLUSIVE;
+	event.data.ptr = data;
+	return epoll_ctl(loopFd, adding ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+static int _WaitForEvents(int loopFd, struct LoopEvent *events, int capacity)
+{
+	struct epoll_event epollEvents[capacity];
+	int count = epoll_wait(loopFd, epollEvents, capacity, -1);
+	for (int i = 0; i < count; ++i)
+	{
+		events[i].data = epollEvents[i].data.ptr;
+		/* Errors and hangups are found by the next read or write */
+		events[i].events = ((epollEvents[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? kEventRead : 0)
+			| ((epollEvents[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) ? kEventWrite : 0);
+	}
+	return count > 0 ? count : 0;
+}
+#else
+static int _CreateLoop(void)
+{
+	return kqueue();
+}
+
+static int _Watch(int loopFd, int fd, void *data, int events, int adding)
+{
+	struct kevent changes[2];
+	EV_SET(&changes[0], fd, EVFILT_READ, (events & kEventRead) ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE, 0, 0, data);
+	EV_SET(&changes[1], fd, EVFILT_WRITE, (events & kEventWrite) ? EV_ADD | EV_ENABLE : EV_ADD | EV_DISABLE, 0, 0, data);
+	return kevent(loopFd, changes, 2, NULL, 0, NULL) == 0;
+}
+
+static int _WaitForEvents(int loopFd, struct LoopEvent *events, int capacity)
+{
+	struct kevent kevents[capacity];
+	int count = kevent(loopFd, NULL, 0, kevents, capacity, NULL);
+	for (int i = 0; i < count; ++i)
+	{
+		events[i].data = kevents[i].udata;
+		events[i].events = (kevents[i].filter == EVFILT_READ) ? kEventRead : kEventWrite;
+	}
+	return count > 0 ? count : 0;
+}
+#endif
+
+static int _SetNonBlocking(int fd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
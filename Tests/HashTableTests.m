@@ -7,8 +7,10 @@
 //
 
 #include <dlfcn.h>
+#include <sys/wait.h>
 #import "HashTableTests.h"
 #import "HashTable.h"
+#import "WorkloadTrace.h"
 #import "NSString+RandomString.h"
 
 #define KEY_LEN 4
@@ -315,6 +317,591 @@ extern long _HashFunction(char *key, long limit);
 	htbl_FreeIterator(iterator);
 }
 
+#pragma mark Cache
+static void countEviction(char *key, void *value, void *context)
+{
+	(*(NSUInteger *) context)++;
+}
+
+- (void) testCacheEvictsWhenFull
+{
+	NSUInteger evictions = 0;
+	struct HashTable *cache = htbl_CreateCache(TABLE_LEN, 0, countEviction, &evictions);
+	size_t tableSize = htbl_TableSize(cache);
+
+	char hotKey[] = "Hot Key";
+	htbl_SetValueForKey(cache, (void *) 1, hotKey);
+	for (NSUInteger i = 0; i < 100; ++i)
+	{
+		NSString *keyString = [NSString stringWithFormat:@"Key %lu", (unsigned long) i];
+		char *key = (char *) [keyString cStringUsingEncoding:NSASCIIStringEncoding];
+		htbl_SetValueForKey(cache, (void *) 2, key);
+		htbl_ValueForKey(cache, hotKey);
+
+		STAssertTrue(htbl_Count(cache) <= TABLE_LEN, @"Cache must not grow past its limit");
+	}
+
+	STAssertEquals(evictions, (NSUInteger) (101 - TABLE_LEN), @"Every overflowing insert must evict exactly once");
+	STAssertEquals(htbl_TableSize(cache), tableSize, @"Cache must not resize");
+	STAssertEquals(htbl_ValueForKey(cache, hotKey), (void *) 1, @"Recently used key must survive");
+	htbl_Free(cache);
+}
+
+#pragma mark Expiration
+- (void) testExpiration
+{
+	char shortKey[] = "Short Lived";
+	char longKey[] = "Long Lived";
+	char eternalKey[] = "Eternal";
+	char distantKey[] = "Distant";
+
+	htbl_Tick(self.table, 100);
+	htbl_SetValueForKeyTTL(self.table, (void *) 1, shortKey, 10);
+	htbl_SetValueForKeyTTL(self.table, (void *) 2, longKey, 1000);
+	htbl_SetValueForKeyTTL(self.table, (void *) 3, eternalKey, 0);
+	[self addObjectsToTable:100];
+
+	htbl_Tick(self.table, 109);
+	STAssertEquals(htbl_ValueForKey(self.table, shortKey), (void *) 1, @"Must not expire before its time");
+
+	htbl_Tick(self.table, 110);
+	STAssertEquals(htbl_ValueForKey(self.table, shortKey), NULL, @"Must expire on time");
+	STAssertEquals(htbl_ValueForKey(self.table, longKey), (void *) 2, @"Must not expire before its time");
+
+	htbl_Tick(self.table, 1000000);
+	STAssertEquals(htbl_ValueForKey(self.table, longKey), NULL, @"Must expire on time");
+	STAssertEquals(htbl_ValueForKey(self.table, eternalKey), (void *) 3, @"ttl 0 must never expire");
+
+	htbl_SetValueForKeyTTL(self.table, (void *) 4, distantKey, 5000000);
+	htbl_Tick(self.table, 9000000);
+	STAssertEquals(htbl_Count(self.table), (size_t) 101, @"Expired elements must be removed, one htbl_Tick skips the empty ticks");
+	STAssertEquals(htbl_ValueForKey(self.table, distantKey), NULL, @"Must expire on time");
+}
+
+#pragma mark Statistics
+- (void) testStats
+{
+	[self addObjectsToTable:100];
+
+	struct HashTableStats stats;
+	htbl_GetStats(self.table, &stats);
+
+	STAssertEquals(stats.count, htbl_Count(self.table), @"Stats must report the element count");
+	STAssertEquals(stats.capacity, htbl_TableSize(self.table), @"Stats must report the table size");
+	STAssertTrue(stats.loadFactor > 0 && stats.loadFactor <= 1, @"Load factor must be sane");
+	STAssertTrue(stats.collisionsCount < stats.count, @"Some elements must be at home");
+	STAssertTrue(stats.keyBytes >= stats.count * (KEY_LEN + 1), @"Every key must be accounted for");
+	STAssertTrue(stats.totalBytes > stats.slotBytes + stats.elementBytes + stats.keyBytes, @"Side lists must be accounted for");
+}
+
+static void countResize(struct HashTable *table, size_t oldSize, size_t newSize, uint64_t nanoseconds, void *context)
+{
+	(*(int *) context)++;
+}
+
+- (void) testTraceHooks
+{
+	int resizes = 0;
+	struct HashTableTraceHooks hooks = {0};
+	hooks.resizeFinished = countResize;
+	hooks.ringCapacity = 4;
+	hooks.context = &resizes;
+	htbl_SetTraceHooks(self.table, &hooks);
+
+	size_t sizeBefore = htbl_TableSize(self.table);
+	[self addObjectsToTable:100];
+	STAssertTrue(htbl_TableSize(self.table) > sizeBefore, @"Table must have grown");
+	STAssertTrue(resizes > 0, @"Every resize must be reported");
+
+	struct HashTableTraceEvent events[4];
+	size_t count = htbl_CopyTraceEvents(self.table, events, 4);
+	STAssertTrue(count > 0, @"Resizes must be kept in the ring");
+	STAssertEquals(events[count - 1].newSize, htbl_TableSize(self.table), @"The last resize must be the latest one");
+
+	htbl_SetTraceHooks(self.table, NULL);
+}
+
+- (void) testCuckooTable
+{
+	struct HashTable *table = htbl_CreateCuckoo(8);
+	char key[16];
+	for (long i = 0; i < 1000; ++i)
+	{
+		sprintf(key, "key%ld", i);
+		htbl_SetValueForKey(table, (void *) (i + 1), key);
+	}
+	STAssertEquals(htbl_Count(table), (size_t) 1000, @"Cuckoo table must grow instead of dropping keys");
+
+	for (long i = 0; i < 1000; ++i)
+	{
+		sprintf(key, "key%ld", i);
+		STAssertEquals(htbl_ValueForKey(table, key), (void *) (i + 1), @"Displaced keys must still be found");
+	}
+
+	htbl_RemoveKey(table, "key0");
+	STAssertTrue(htbl_ValueForKey(table, "key0") == NULL, @"Removed key must be gone");
+
+	int iterated = 0;
+	struct HashTableIterator *iterator = htbl_IteratorForTable(table);
+	while (htbl_IsValidIterator(iterator))
+	{
+		iterated++;
+		iterator->next(iterator);
+	}
+	htbl_FreeIterator(iterator);
+	STAssertEquals(iterated, 999, @"Iterator must visit buckets and stash");
+
+	htbl_Free(table);
+}
+
+- (void) testSharedKeyPool
+{
+	struct KeyPool *pool = kpool_Create();
+	struct HashTable *first = htbl_CreateWithKeyPool(16, pool);
+	struct HashTable *second = htbl_CreateWithKeyPool(16, pool);
+	kpool_Release(pool);
+
+	htbl_SetValueForKey(first, (void *) 1, "shared");
+	htbl_SetValueForKey(second, (void *) 2, "shared");
+	htbl_SetValueForKey(second, (void *) 3, "own");
+	STAssertEquals(kpool_Count(pool), (size_t) 2, @"Every key must be stored once");
+
+	struct HashTableIterator *iterator = htbl_IteratorForTable(first);
+	STAssertTrue(iterator->key == kpool_Lookup(pool, "shared"), @"Element keys must be the pooled ones");
+	htbl_FreeIterator(iterator);
+	STAssertEquals(htbl_ValueForKey(second, "shared"), (void *) 2, @"Tables must keep their own values");
+
+	htbl_Free(second);
+	STAssertEquals(kpool_Count(pool), (size_t) 1, @"Keys must go away with their last table");
+	STAssertEquals(htbl_ValueForKey(first, "shared"), (void *) 1, @"Pool must outlive one of its tables");
+	htbl_Free(first);
+}
+
+- (void) testBorrowedKey
+{
+	char key[] = "Borrowed";
+	htbl_SetValueForBorrowedKey(self.table, (void *) 1, key);
+
+	struct HashTableIterator *iterator = htbl_IteratorForTable(self.table);
+	STAssertTrue(iterator->key == key, @"Borrowed key must not be copied");
+	htbl_FreeIterator(iterator);
+
+	STAssertEquals(htbl_ValueForKey(self.table, "Borrowed"), (void *) 1, @"Borrowed key must be found by value");
+	htbl_RemoveKey(self.table, key);
+	STAssertTrue(strcmp(key, "Borrowed") == 0, @"Table must not touch a borrowed key");
+}
+
+static void countDestroyed(char *key, void *value, void *context)
+{
+	(*(int *) context)++;
+}
+
+- (void) testClear
+{
+	[self addObjectsToTable:100];
+	size_t sizeBefore = htbl_TableSize(self.table);
+
+	int destroyed = 0;
+	htbl_Clear(self.table, countDestroyed, &destroyed);
+	STAssertEquals(destroyed, 100, @"Every value must be handed to destroy");
+	STAssertEquals(htbl_Count(self.table), (size_t) 0, @"Table must be empty");
+	STAssertEquals(htbl_TableSize(self.table), sizeBefore, @"Slots must be kept for reuse");
+
+	[self addObjectsToTable:100];
+}
+
+- (void) testClone
+{
+	/* Both share their elements with the clone until one side writes */
+	struct HashTable *tables[] = {htbl_CreateCuckoo(16), htbl_Create(16)};
+	for (int i = 0; i < 2; ++i)
+	{
+		struct HashTable *table = tables[i];
+		htbl_SetValueForKey(table, (void *) 1, "first");
+		htbl_SetValueForKey(table, (void *) 2, "second");
+
+		struct HashTable *clone = htbl_Clone(table);
+		htbl_SetValueForKey(table, (void *) 3, "first");
+		htbl_RemoveKey(table, "second");
+		htbl_SetValueForKey(clone, (void *) 4, "second");
+
+		STAssertEquals(htbl_ValueForKey(clone, "first"), (void *) 1, @"Clone must not see later writes");
+		STAssertEquals(htbl_ValueForKey(clone, "second"), (void *) 4, @"Clone must not see later removals");
+		STAssertEquals(htbl_ValueForKey(table, "first"), (void *) 3, @"Original must see its own writes");
+
+		htbl_Free(table);
+		STAssertEquals(htbl_Count(clone), (size_t) 2, @"Clone must outlive the original");
+		htbl_Free(clone);
+	}
+}
+
+- (void) testCloneIteratesEveryKey // No iteration list of its own, it walks the slots
+{
+	struct HashTable *table = htbl_Create(16);
+	char key[16];
+	for (int i = 0; i < 2000; ++i)
+	{
+		sprintf(key, "key%d", i);
+		htbl_SetValueForKey(table, (void *) 1, key);
+	}
+
+	struct HashTable *clone = htbl_Clone(table);
+	htbl_Free(table);
+	size_t visited = 0;
+	struct HashTableIterator *iterator = htbl_IteratorForTable(clone);
+	while (htbl_IsValidIterator(iterator))
+	{
+		visited++;
+		iterator->next(iterator);
+	}
+	htbl_FreeIterator(iterator);
+
+	STAssertEquals(visited, (size_t) 2000, @"Clone must iterate over every key once");
+	htbl_Free(clone);
+}
+
+static void appendScannedKey(char *key, void *value, void *context)
+{
+	[(NSMutableArray *) context addObject:[NSString stringWithUTF8String:key]];
+}
+
+- (void) testScanPrefix
+{
+	htbl_SetValueForKey(self.table, (void *) 1, "user:2");
+	htbl_SetValueForKey(self.table, (void *) 1, "user:10");
+	htbl_SetValueForKey(self.table, (void *) 1, "group:1");
+	STAssertEquals(htbl_EnablePrefixIndex(self.table), 1, @"Index must be built from existing keys");
+	htbl_SetValueForKey(self.table, (void *) 1, "user:1");
+	htbl_RemoveKey(self.table, "user:2");
+
+	NSMutableArray *keys = [NSMutableArray array];
+	htbl_ScanPrefix(self.table, "user:", appendScannedKey, keys);
+	NSArray *expected = @[@"user:1", @"user:10"];
+	STAssertEqualObjects(keys, expected, @"Keys with the prefix must come in byte order");
+}
+
+- (void) testFloodingDefence
+{
+	/* Every pair of characters sums up to 'A' + 'z': one home slot for all */
+	char key[13] = {0};
+	for (int i = 0; i < 2000; ++i)
+	{
+		for (int pair = 0, index = i; pair < 6; ++pair, index /= 26)
+		{
+			key[2 * pair] = (char) ('A' + index % 26);
+			key[2 * pair + 1] = (char) ('z' - index % 26);
+		}
+		htbl_SetValueForKey(self.table, (void *) (long) (i + 1), key);
+		STAssertEquals(htbl_ValueForKey(self.table, key), (void *) (long) (i + 1), @"Keys must stay reachable while rehashing");
+	}
+
+	struct HashTableStats stats;
+	htbl_GetStats(self.table, &stats);
+	STAssertEquals(stats.seeded, 1, @"Colliding keys must switch the table to a seeded hash");
+	STAssertEquals(htbl_Count(self.table), (size_t) 2000, @"Rehashing must keep every element");
+}
+
+- (void) testExpiringKeysOverwrittenWhileRehashing
+{
+	char key[13] = {0};
+	htbl_Tick(self.table, 100);
+	for (int i = 0; i < 4000; ++i)
+	{
+		/* Even steps add a key, odd ones overwrite an older one, maybe moved over already */
+		for (int pair = 0, index = (i % 2) ? i / 4 : i / 2; pair < 6; ++pair, index /= 26)
+		{
+			key[2 * pair] = (char) ('A' + index % 26);
+			key[2 * pair + 1] = (char) ('z' - index % 26);
+		}
+		if (i % 2)
+			htbl_SetValueForKey(self.table, (void *) 2, key); /* Keeps the ttl */
+		else
+			htbl_SetValueForKeyTTL(self.table, (void *) 1, key, 50);
+	}
+
+	htbl_Tick(self.table, 1000);
+	htbl_Tick(self.table, 1000);
+	STAssertEquals(htbl_Count(self.table), (size_t) 0, @"Overwritten keys must still expire");
+}
+
+- (void) testCreateWithOptions
+{
+	STAssertEquals(htbl_TableSize(self.table), (size_t) 16, @"Capacity must be rounded up to a power of two");
+
+	struct HashTableOptions options = {.initialCapacity = 100, .maxLoadFactor = 0.5, .growthFactor = 4};
+	struct HashTable *table = htbl_CreateWithOptions(&options);
+	STAssertEquals(htbl_TableSize(table), (size_t) 128, @"Initial capacity must be rounded up to a power of two");
+	for (int i = 0; i < 66; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %d", i);
+		htbl_SetValueForKey(table, (void *) 1, key);
+	}
+	STAssertEquals(htbl_TableSize(table), (size_t) 512, @"Table must grow past the load factor by the growth factor");
+	htbl_Free(table);
+
+	options.maxLoadFactor = 1;
+	STAssertTrue(htbl_CreateWithOptions(&options) == NULL, @"Load factor must be below 1");
+	options.maxLoadFactor = 0.5;
+	options.growthFactor = 1.5;
+	STAssertTrue(htbl_CreateWithOptions(&options) == NULL, @"Growth factor must be at least 2");
+}
+
+- (void) testMappedSlots
+{
+	struct HashTableOptions options = {0};
+	options.numaPolicy = HTBL_NUMA_INTERLEAVE;
+	STAssertTrue(htbl_CreateWithOptions(&options) == NULL, @"A NUMA policy needs nodes");
+
+	options.numaPolicy = HTBL_NUMA_DEFAULT;
+	options.pages = HTBL_PAGES_TRANSPARENT_HUGE;
+	struct HashTable *table = htbl_CreateWithOptions(&options);
+	STAssertTrue(table != NULL, @"Huge pages are only a hint");
+	for (long i = 0; i < 1000; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		htbl_SetValueForKey(table, (void *) i, key);
+	}
+	for (long i = 0; i < 1000; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		STAssertEquals(htbl_ValueForKey(table, key), (void *) i, @"Grown slots must be mapped the same way");
+	}
+	htbl_Free(table);
+}
+
+static void addScannedValue(char *key, void *value, void *context)
+{
+	[(NSMutableSet *) context addObject:@((long) value)];
+}
+
+- (void) testScanWithCursor
+{
+	struct HashTable *table = htbl_Create(8);
+	for (long i = 1; i <= 200; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		htbl_SetValueForKey(table, (void *) i, key);
+	}
+
+	NSMutableSet *scanned = [NSMutableSet set];
+	size_t cursor = 0;
+	long added = 1000;
+	do
+	{
+		cursor = htbl_Scan(table, cursor, 4, addScannedValue, scanned);
+		for (int i = 0; i < 10; ++i, ++added) /* Grows while being scanned */
+		{
+			char key[16];
+			sprintf(key, "Key %ld", added);
+			htbl_SetValueForKey(table, (void *) added, key);
+		}
+	} while (cursor != 0);
+
+	for (long i = 1; i <= 200; ++i)
+		STAssertTrue([scanned containsObject:@(i)], @"Every key there from start to end must be scanned");
+	htbl_Free(table);
+}
+
+- (void) testFilter
+{
+	htbl_SetValueForKey(self.table, (void *) 1, "before");
+	STAssertTrue(htbl_EnableFilter(self.table), @"Enabling the filter must succeed");
+	for (long i = 1; i <= 500; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		htbl_SetValueForKey(self.table, (void *) i, key);
+	}
+	htbl_RemoveKey(self.table, "Key 7");
+
+	STAssertEquals(htbl_ValueForKey(self.table, "before"), (void *) 1, @"Keys added before enabling the filter must be found");
+	for (long i = 1; i <= 500; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		STAssertEquals(htbl_ValueForKey(self.table, key), (void *) (i == 7 ? 0 : i), @"The filter must never hide a key");
+	}
+	STAssertTrue(htbl_ValueForKey(self.table, "missing") == NULL, @"Missing keys must stay missing");
+}
+
+- (void) testFileBacked
+{
+	NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString randomStringWithLength:16]];
+	struct HashTable *table = htbl_CreateFileBacked([path fileSystemRepresentation], 8);
+	STAssertTrue(table != NULL, @"Creating a file-backed table must succeed");
+	for (long i = 1; i <= 1000; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		htbl_SetValueForKey(table, (void *) i, key);
+	}
+	htbl_RemoveKey(table, "Key 7");
+	STAssertTrue(htbl_Sync(table), @"Syncing must succeed");
+	htbl_Free(table);
+
+	table = htbl_CreateFileBacked([path fileSystemRepresentation], 0);
+	STAssertEquals(htbl_Count(table), (size_t) 999, @"Reopened table must keep its keys");
+	for (long i = 1; i <= 1000; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		STAssertEquals(htbl_ValueForKey(table, key), (void *) (i == 7 ? 0 : i), @"Values must survive reopening");
+	}
+	htbl_Free(table);
+	[[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+}
+
+- (void) testFileBackedFilter
+{
+	NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString randomStringWithLength:16]];
+	struct HashTable *table = htbl_CreateFileBacked([path fileSystemRepresentation], 8);
+	htbl_SetValueForKey(table, (void *) 1, "before");
+	STAssertTrue(htbl_EnableFilter(table), @"Enabling the filter of a file table must succeed");
+	for (long i = 1; i <= 500; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		htbl_SetValueForKey(table, (void *) i, key);
+		htbl_SetValueForKey(table, (void *) i, key);
+	}
+	htbl_RemoveKey(table, "Key 7");
+
+	STAssertEquals(htbl_ValueForKey(table, "before"), (void *) 1, @"Keys already in the file must be found");
+	for (long i = 1; i <= 500; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		STAssertEquals(htbl_ValueForKey(table, key), (void *) (i == 7 ? 0 : i), @"The filter must never hide a key");
+	}
+	htbl_Free(table);
+	[[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+}
+
+- (void) testWriteAheadLog
+{
+	NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString randomStringWithLength:16]];
+	struct WriteLogOptions options = {0, 1024, 16 * 1024}; /* Compacts a few times */
+	STAssertTrue(htbl_EnableLog(self.table, [path fileSystemRepresentation], &options), @"Enabling the log must succeed");
+	for (long i = 1; i <= 2000; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i % 500);
+		htbl_SetValueForKey(self.table, (void *) i, key);
+	}
+	htbl_RemoveKey(self.table, "Key 7");
+	htbl_Free(self.table);
+
+	self.table = htbl_Create(TABLE_LEN);
+	STAssertTrue(htbl_EnableLog(self.table, [path fileSystemRepresentation], &options), @"Replaying the log must succeed");
+	STAssertEquals(htbl_Count(self.table), (size_t) 499, @"Replayed table must have every key but the removed one");
+	for (long i = 1501; i <= 2000; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i % 500);
+		STAssertEquals(htbl_ValueForKey(self.table, key), (void *) (i % 500 == 7 ? 0 : i), @"Replayed values must be the last ones set");
+	}
+	for (NSString *suffix in @[@"", @".snapshot", @".next"])
+		[[NSFileManager defaultManager] removeItemAtPath:[path stringByAppendingString:suffix] error:nil];
+}
+
+- (void) testSharedTable
+{
+	/* Sized up front: macOS can't grow a shared memory object */
+	const char *name = [[@"/" stringByAppendingString:[NSString randomStringWithLength:16]] UTF8String];
+	struct HashTable *table = htbl_CreateShared(name, 1000);
+	STAssertTrue(table != NULL, @"Creating a shared table must succeed");
+	STAssertTrue(htbl_CreateShared(name, 1000) == NULL, @"Creating it twice must fail");
+
+	pid_t child = fork();
+	if (child == 0)
+	{
+		struct HashTable *attached = htbl_AttachShared(name);
+		for (long i = 1; attached != NULL && i <= 1000; i += 2)
+		{
+			char key[16];
+			sprintf(key, "Key %ld", i);
+			htbl_SetValueForKey(attached, (void *) i, key);
+		}
+		_exit(attached == NULL);
+	}
+	for (long i = 2; i <= 1000; i += 2)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		htbl_SetValueForKey(table, (void *) i, key);
+	}
+	int status = 0;
+	waitpid(child, &status, 0);
+	STAssertTrue(WIFEXITED(status) && WEXITSTATUS(status) == 0, @"Another process must be able to attach");
+
+	STAssertEquals(htbl_Count(table), (size_t) 1000, @"Both processes' keys must be in the table");
+	for (long i = 1; i <= 1000; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		STAssertEquals(htbl_ValueForKey(table, key), (void *) i, @"Values set by either process must be visible");
+	}
+	htbl_Free(table);
+	STAssertTrue(htbl_UnlinkShared(name), @"Unlinking must succeed");
+}
+
+static void removeScannedKey(char *key, void *value, void *context)
+{
+	htbl_RemoveKey(context, key); /* Would wait on the scan's own lock */
+}
+
+- (void) testSharedTableScanMayChangeIt
+{
+	const char *name = [[@"/" stringByAppendingString:[NSString randomStringWithLength:16]] UTF8String];
+	struct HashTable *table = htbl_CreateShared(name, 1000);
+	for (long i = 1; i <= 500; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i);
+		htbl_SetValueForKey(table, (void *) i, key);
+	}
+
+	size_t cursor = 0;
+	do
+		cursor = htbl_Scan(table, cursor, 16, removeScannedKey, table);
+	while (cursor != 0);
+	STAssertEquals(htbl_Count(table), (size_t) 0, @"Keys removed from inside the scan must be gone");
+	htbl_Free(table);
+	htbl_UnlinkShared(name);
+}
+
+- (void) testWorkloadRecording
+{
+	NSString *path = [NSTemporaryDirectory() stringByAppendingPathComponent:[NSString randomStringWithLength:16]];
+	STAssertTrue(htbl_StartRecording(self.table, [path fileSystemRepresentation]), @"Starting to record must succeed");
+	STAssertFalse(htbl_StartRecording(self.table, [path fileSystemRepresentation]), @"Recording twice must fail");
+	for (long i = 1; i <= 1000; ++i)
+	{
+		char key[16];
+		sprintf(key, "Key %ld", i % 100);
+		htbl_SetValueForKey(self.table, (void *) i, key);
+		htbl_ValueForKey(self.table, key);
+	}
+	htbl_RemoveKey(self.table, "Key 7");
+	htbl_Clear(self.table, NULL, NULL);
+	STAssertTrue(htbl_StopRecording(self.table), @"Every record must be written");
+
+	size_t count = 0;
+	struct WorkloadTraceRecord *records = wtrc_Load([path fileSystemRepresentation], &count);
+	STAssertTrue(records != NULL, @"The trace must load");
+	STAssertEquals(count, (size_t) 2002, @"Every operation must be recorded");
+	STAssertEquals(records[0].keyHash, wtrc_HashKey("Key 1", 5), @"Records must keep the hash of the key");
+	STAssertEquals((int) records[1].operation, (int) WTRC_GET, @"Records must keep the operation");
+	STAssertEquals((int) records[2000].operation, (int) WTRC_REMOVE, @"Records must keep the operation");
+	STAssertEquals((int) records[2001].operation, (int) WTRC_CLEAR, @"Records must keep the operation");
+	free(records);
+	[[NSFileManager defaultManager] removeItemAtPath:path error:nil];
+}
+
 #pragma mark Helper Functions
 - (void) compareToDict:(NSDictionary *)dict
 {
@@ -132,6 +132,15 @@
 	STAssertEquals(res, (long) 2, @"Value should've been changed");
 }
 
+- (void) testAppendNewKey
+{
+	STAssertEquals(lst_AppendNewKey(self.list, 1, "First"), 1, @"Append must succeed");
+	STAssertEquals(lst_AppendNewKey(self.list, 2, "Second"), 1, @"Append must succeed");
+	STAssertEquals(lst_ValueForKey(self.list, "Second"), (long) 2, @"Appended key must be found");
+	STAssertEquals(lst_Count(self.list), (size_t) 2, @"Both keys must be counted");
+	STAssertEquals(lst_AppendNewKey(NULL, 1, "Key"), 0, @"No list, nothing appended");
+}
+
 #pragma mark Wrong Arguments
 - (void) testWrongArguments
 {
@@ -211,6 +220,44 @@
 	lst_FreeIterator(iterator);
 }
 
+- (void) testIteratorKeepsOrderAfterRemovals // Pairs are packed into nodes, removals must not reorder them
+{
+	NSMutableArray *array = [self addObjectsToList:100];
+
+	for (NSUInteger i = 0; i < array.count; i += 3)
+	{
+		char *key = (char *) [array[i] cStringUsingEncoding:NSASCIIStringEncoding];
+		lst_RemoveElementWithKey(self.list, key);
+		array[i] = @"";
+	}
+	[self compareToArray:array];
+
+	struct KeyValueListIterator *iterator = lst_IteratorForList(self.list);
+	long previousValue = -1;
+	while (lst_IsIteratorValid(iterator))
+	{
+		STAssertTrue(iterator->value > previousValue, @"Iterator must keep insertion order");
+		previousValue = iterator->value;
+		iterator->next(iterator);
+	}
+	lst_FreeIterator(iterator);
+}
+
+- (void) testBorrowedKeys
+{
+	struct KeyValueList *list = lst_CreateListBorrowingKeys();
+	char key[] = "Borrowed";
+	lst_SetValueForKey(list, 1, key);
+
+	struct KeyValueListIterator *iterator = lst_IteratorForList(list);
+	STAssertTrue(iterator->key == key, @"Borrowed key must not be copied");
+	lst_FreeIterator(iterator);
+
+	lst_RemoveElementWithKey(list, key);
+	STAssertEquals(lst_ValueForKey(list, key), (long) -1, @"Removal must work the same way");
+	lst_Free(list);
+}
+
 #pragma mark Methods
 - (void) addAndRemoveObjects:(NSUInteger)count
 {